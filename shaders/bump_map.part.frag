@@ -87,7 +87,10 @@ vec3 get_bump_map_normal() {
 #ifdef USE_TILE_BLEND_NMAP
 	return normalize(ByExampleProceduralNoise(tc) * 2.0 - 1.0);
 #else
-	return normalize(texture(bump_map, tc).xyz * 2.0 - 1.0);
+	vec3 nv = texture(bump_map, tc).xyz;
+	vec3 n  = nv * 2.0 - 1.0;
+	if (nv.b == 0.0) {n.z = sqrt(max(0.0, 1.0 - dot(n.xy, n.xy)));} // two channel (BC5) normal map, reconstruct Z
+	return normalize(n);
 #endif
 }
 #endif // !BUMP_MAP_CUSTOM
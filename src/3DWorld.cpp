@@ -17,6 +17,7 @@
 #include "draw_utils.h"
 #include "tree_leaf.h"
 #include <set>
+#include <thread>
 
 #ifdef _WIN32 // wglew.h seems to be Windows only
 #include <GL/wglew.h> // for wglSwapIntervalEXT
@@ -64,17 +65,17 @@ char *lighting_file[NUM_LIGHTING_TYPES] = {0};
 bool combined_gu(0), underwater(0), kbd_text_mode(0), univ_stencil_shadows(1), use_waypoint_app_spots(0), enable_tiled_mesh_ao(0), tiled_terrain_only(0);
 bool show_lightning(0), disable_shader_effects(0), use_waypoints(0), group_back_face_cull(0), start_maximized(0), claim_planet(0), skip_light_vis_test(0);
 bool no_smoke_over_mesh(0), enable_model3d_tex_comp(0), global_lighting_update(0), lighting_update_offline(0), mesh_difuse_tex_comp(1), smoke_dlights(0), keep_keycards_on_death(0);
-bool texture_alpha_in_red_comp(0), use_model2d_tex_mipmaps(1), mt_cobj_tree_build(0), two_sided_lighting(0), inf_terrain_scenery(1), invert_model_nmap_bscale(0);
+bool texture_alpha_in_red_comp(0), use_model2d_tex_mipmaps(1), mt_cobj_tree_build(0), cobj_tree_sah(0), cobj_tree_perf_test(0), two_sided_lighting(0), inf_terrain_scenery(1), invert_model_nmap_bscale(0);
 bool gen_tree_roots(1), fast_water_reflect(0), vsync_enabled(0), use_voxel_cobjs(0), disable_sound(0), enable_depth_clamp(0), volume_lighting(0), no_subdiv_model(0);
 bool detail_normal_map(0), init_core_context(0), use_core_context(0), enable_multisample(1), dynamic_smap_bias(0), model3d_wn_normal(0), snow_shadows(0), user_action_key(0);
 bool enable_dlight_shadows(1), tree_indir_lighting(0), ctrl_key_pressed(0), only_pine_palm_trees(0), enable_gamma_correct(0), use_z_prepass(0), reflect_dodgeballs(0);
 bool store_cobj_accum_lighting_as_blocked(0), all_model3d_ref_update(0), begin_motion(0), enable_mouse_look(MOUSE_LOOK_DEF), enable_init_shields(1), tt_triplanar_tex(0);
-bool enable_model3d_bump_maps(1), use_obj_file_bump_grayscale(1), invert_bump_maps(0), use_interior_cube_map_refl(0), enable_cube_map_bump_maps(1), no_store_model_textures_in_memory(0);
-bool enable_model3d_custom_mipmaps(1), flatten_tt_mesh_under_models(0), show_map_view_mandelbrot(0), smileys_chase_player(0), disable_fire_delay(0), disable_recoil(0);
+bool enable_model3d_bump_maps(1), use_obj_file_bump_grayscale(1), parallel_obj_load(1), obj_load_benchmark(0), invert_bump_maps(0), use_interior_cube_map_refl(0), enable_cube_map_bump_maps(1), no_store_model_textures_in_memory(0);
+bool enable_model3d_custom_mipmaps(1), model3d_compress_geom(0), flatten_tt_mesh_under_models(0), show_map_view_mandelbrot(0), smileys_chase_player(0), disable_fire_delay(0), disable_recoil(0);
 bool enable_dpart_shadows(0), enable_tt_model_reflect(1), enable_tt_model_indir(0), auto_calc_tt_model_zvals(0), use_model_lod_blocks(0), enable_translocator(0), enable_grass_fire(0);
 bool disable_model_textures(0), start_in_inf_terrain(0), allow_shader_invariants(1), config_unlimited_weapons(0), disable_tt_water_reflect(0), allow_model3d_quads(1);
-bool enable_timing_profiler(0), fast_transparent_spheres(0), force_ref_cmap_update(0), use_instanced_pine_trees(0), enable_postproc_recolor(0), draw_building_interiors(0);
-bool toggle_room_light(0), merge_model_objects(0), display_frame_time(0);
+bool enable_timing_profiler(0), enable_prof_zones(0), fast_transparent_spheres(0), force_ref_cmap_update(0), use_instanced_pine_trees(0), enable_postproc_recolor(0), draw_building_interiors(0);
+bool toggle_room_light(0), merge_model_objects(0), display_frame_time(0), headless_bake(0), lighting_scaling_test(0), lighting_dda_walk(0), lighting_ray_packets(1), incremental_lighting(0), lighting_file_half_float(0);
 int xoff(0), yoff(0), xoff2(0), yoff2(0), rand_gen_index(0), mesh_rgen_index(0), camera_change(1), camera_in_air(0), auto_time_adv(0);
 int animate(1), animate2(1), draw_model(0), init_x(STARTING_INIT_X), fire_key(0), do_run(0), init_num_balls(-1), change_wmode_frame(0);
 int game_mode(0), map_mode(0), load_hmv(0), load_coll_objs(1), read_landscape(0), screen_reset(0), mesh_seed(0), rgen_seed(1);
@@ -92,7 +93,7 @@ int enable_fsource(0), run_forward(0), advanced(0), dynamic_mesh_scroll(0);
 int read_snow_file(0), write_snow_file(0), mesh_detail_tex(NOISE_TEX);
 int read_light_files[NUM_LIGHTING_TYPES] = {0}, write_light_files[NUM_LIGHTING_TYPES] = {0};
 unsigned num_snowflakes(0), create_voxel_landscape(0), hmap_filter_width(0), num_dynam_parts(100), snow_coverage_resolution(2), num_birds_per_tile(2), num_fish_per_tile(15);
-unsigned erosion_iters(0), erosion_iters_tt(0), video_framerate(60), num_video_threads(0), skybox_tid(0);
+unsigned erosion_iters(0), erosion_iters_tt(0), video_framerate(60), num_video_threads(0), skybox_tid(0), model_cache_max_mb(4096), texture_cache_max_mb(4096), model_lod_levels(0), cpu_tex_compress_mode(0), bc7_quality(2);
 float NEAR_CLIP(DEF_NEAR_CLIP), FAR_CLIP(DEF_FAR_CLIP), system_max_orbit(1.0), sky_occlude_scale(0.0), tree_slope_thresh(5.0), mouse_sensitivity(1.0), tt_grass_scale_factor(1.0);
 float water_plane_z(0.0), base_gravity(1.0), crater_depth(1.0), crater_radius(1.0), disabled_mesh_z(FAR_CLIP), vegetation(1.0), atmosphere(1.0), biome_x_offset(0.0);
 float mesh_file_scale(1.0), mesh_file_tz(0.0), speed_mult(1.0), mesh_z_cutoff(-FAR_CLIP), relh_adj_tex(0.0), dodgeball_metalness(1.0), ray_step_size_mult(1.0);
@@ -101,12 +102,12 @@ float snow_depth(0.0), snow_random(0.0), cobj_z_bias(DEF_Z_BIAS), init_temperatu
 float CAMERA_RADIUS(DEF_CAMERA_RADIUS), C_STEP_HEIGHT(0.6), waypoint_sz_thresh(1.0), model3d_alpha_thresh(0.9), model3d_texture_anisotropy(1.0), dist_to_fire_sq(0.0);
 float ocean_wave_height(DEF_OCEAN_WAVE_HEIGHT), tree_density_thresh(0.55), model_auto_tc_scale(0.0), model_triplanar_tc_scale(0.0), shadow_map_pcf_offset(0.0);
 float custom_glaciate_exp(0.0), tree_type_rand_zone(0.0), jump_height(1.0), force_czmin(0.0), force_czmax(0.0), smap_thresh_scale(1.0), dlight_intensity_scale(1.0);
-float model_mat_lod_thresh(5.0), clouds_per_tile(0.5), def_atmosphere(1.0), def_vegetation(1.0), ocean_depth_opacity_mult(1.0), erode_amount(1.0), ambient_scale(1.0);
+float model_mat_lod_thresh(5.0), model_lod_screen_error(1.0), clouds_per_tile(0.5), def_atmosphere(1.0), def_vegetation(1.0), ocean_depth_opacity_mult(1.0), erode_amount(1.0), ambient_scale(1.0);
 float model_hemi_lighting_scale(0.5);
 float light_int_scale[NUM_LIGHTING_TYPES] = {1.0, 1.0, 1.0, 1.0, 1.0}, first_ray_weight[NUM_LIGHTING_TYPES] = {1.0, 1.0, 1.0, 1.0, 1.0};
 double camera_zh(0.0);
 point mesh_origin(all_zeros), camera_pos(all_zeros), cube_map_center(all_zeros);
-string user_text, cobjs_out_fn, sphere_materials_fn, hmap_out_fn, skybox_cube_map_name, coll_damage_name;
+string user_text, prof_trace_fn, model_cache_dir, texture_cache_dir, scene_cache_dir, cobjs_out_fn, sphere_materials_fn, hmap_out_fn, skybox_cube_map_name, coll_damage_name;
 colorRGB ambient_lighting_scale(1,1,1), mesh_color_scale(1,1,1);
 colorRGBA bkg_color, flower_color(ALPHA0);
 set<unsigned char> keys, keyset;
@@ -122,14 +123,14 @@ char player_name[MAX_CHARS] = "Player";
 bool vert_opt_flags[3] = {0}; // {enable, full_opt, verbose}
 
 
-extern bool clear_landscape_vbo, use_dense_voxels, tree_4th_branches, model_calc_tan_vect, water_is_lava, use_grass_tess, def_tex_compress, ship_cube_map_reflection;
+extern bool clear_landscape_vbo, use_dense_voxels, sparse_lighting_volume, tree_4th_branches, model_calc_tan_vect, water_is_lava, use_grass_tess, def_tex_compress, ship_cube_map_reflection;
 extern int camera_flight, DISABLE_WATER, DISABLE_SCENERY, camera_invincible, onscreen_display, mesh_freq_filter, show_waypoints, last_inventory_frame;
 extern int tree_coll_level, GLACIATE, UNLIMITED_WEAPONS, destroy_thresh, MAX_RUN_DIST, mesh_gen_mode, mesh_gen_shape, map_drag_x, map_drag_y;
-extern unsigned NPTS, NRAYS, LOCAL_RAYS, GLOBAL_RAYS, DYNAMIC_RAYS, NUM_THREADS, MAX_RAY_BOUNCES, grass_density, max_unique_trees, shadow_map_sz;
+extern unsigned NPTS, NRAYS, LOCAL_RAYS, GLOBAL_RAYS, DYNAMIC_RAYS, NUM_THREADS, MAX_RAY_BOUNCES, LIGHTING_PASSES, grass_density, max_unique_trees, shadow_map_sz;
 extern unsigned scene_smap_vbo_invalid, spheres_mode, max_cube_map_tex_sz, DL_GRID_BS;
 extern float fticks, team_damage, self_damage, player_damage, smiley_damage, smiley_speed, tree_deadness, tree_dead_prob, lm_dz_adj, nleaves_scale, flower_density, universe_ambient_scale;
 extern float mesh_scale, tree_scale, mesh_height_scale, smiley_acc, hmv_scale, last_temp, grass_length, grass_width, branch_radius_scale, tree_height_scale, planet_update_rate;
-extern float MESH_START_MAG, MESH_START_FREQ, MESH_MAG_MULT, MESH_FREQ_MULT, def_tex_aniso;
+extern float MESH_START_MAG, MESH_START_FREQ, MESH_MAG_MULT, MESH_FREQ_MULT, def_tex_aniso, model_vertex_weld_eps;
 extern double map_x, map_y;
 extern point hmv_pos, camera_last_pos;
 extern colorRGBA sunlight_color;
@@ -152,6 +153,8 @@ void init_lights();
 
 bool export_modmap(string const &filename);
 void reset_planet_defaults();
+void print_texture_cache_stats();
+void run_texture_compress_test();
 void invalidate_cached_stars();
 void clear_default_vao();
 
@@ -1619,10 +1622,18 @@ int load_config(string const &config_file) {
 	kwmb.add("texture_alpha_in_red_comp", texture_alpha_in_red_comp);
 	kwmb.add("use_model2d_tex_mipmaps", use_model2d_tex_mipmaps);
 	kwmb.add("use_dense_voxels", use_dense_voxels);
+	kwmb.add("sparse_lighting_volume", sparse_lighting_volume);
 	kwmb.add("use_voxel_cobjs", use_voxel_cobjs);
 	kwmb.add("mt_cobj_tree_build", mt_cobj_tree_build);
+	kwmb.add("cobj_tree_sah", cobj_tree_sah);
+	kwmb.add("cobj_tree_perf_test", cobj_tree_perf_test);
 	kwmb.add("global_lighting_update", global_lighting_update);
 	kwmb.add("lighting_update_offline", lighting_update_offline);
+	kwmb.add("lighting_scaling_test", lighting_scaling_test);
+	kwmb.add("lighting_dda_walk", lighting_dda_walk);
+	kwmb.add("lighting_ray_packets", lighting_ray_packets);
+	kwmb.add("incremental_lighting", incremental_lighting);
+	kwmb.add("lighting_file_half_float", lighting_file_half_float);
 	kwmb.add("two_sided_lighting", two_sided_lighting);
 	kwmb.add("disable_sound", disable_sound);
 	kwmb.add("start_maximized", start_maximized);
@@ -1652,6 +1663,8 @@ int load_config(string const &config_file) {
 	kwmb.add("tt_triplanar_tex", tt_triplanar_tex);
 	kwmb.add("enable_model3d_bump_maps", enable_model3d_bump_maps);
 	kwmb.add("use_obj_file_bump_grayscale", use_obj_file_bump_grayscale);
+	kwmb.add("parallel_obj_load", parallel_obj_load);
+	kwmb.add("obj_load_benchmark", obj_load_benchmark);
 	kwmb.add("invert_bump_maps", invert_bump_maps);
 	kwmb.add("use_interior_cube_map_refl", use_interior_cube_map_refl);
 	kwmb.add("enable_cube_map_bump_maps", enable_cube_map_bump_maps);
@@ -1683,6 +1696,7 @@ int load_config(string const &config_file) {
 	kwmb.add("allow_model3d_quads", allow_model3d_quads);
 	kwmb.add("keep_keycards_on_death", keep_keycards_on_death);
 	kwmb.add("enable_timing_profiler", enable_timing_profiler);
+	kwmb.add("enable_prof_zones", enable_prof_zones); // hierarchical per-thread timing zones, printed along with the timing profiler stats
 	kwmb.add("fast_transparent_spheres", fast_transparent_spheres);
 	kwmb.add("draw_building_interiors", draw_building_interiors);
 
@@ -1725,6 +1739,7 @@ int load_config(string const &config_file) {
 	kwmu.add("max_unique_trees", max_unique_trees);
 	kwmu.add("shadow_map_sz", shadow_map_sz);
 	kwmu.add("max_ray_bounces", MAX_RAY_BOUNCES);
+	kwmu.add("lighting_bake_passes", LIGHTING_PASSES);
 	kwmu.add("num_test_snowflakes", num_snowflakes);
 	kwmu.add("hmap_filter_width", hmap_filter_width);
 	kwmu.add("erosion_iters", erosion_iters);
@@ -1737,6 +1752,12 @@ int load_config(string const &config_file) {
 	kwmu.add("dlight_grid_bitshift", DL_GRID_BS);
 	kwmu.add("video_framerate", video_framerate);
 	kwmu.add("num_video_threads", num_video_threads);
+	kwmu.add("model_cache_max_mb", model_cache_max_mb);
+	kwmu.add("texture_cache_max_mb", texture_cache_max_mb);
+	kwmu.add("model_lod_levels", model_lod_levels);
+	kwmb.add("model3d_compress_geom", model3d_compress_geom);
+	kwmu.add("cpu_tex_compress_mode", cpu_tex_compress_mode); // 0=driver compression, 1=BC1/BC3/BC4/BC5 on the CPU, 2=same with BC7 for RGB/RGBA
+	kwmu.add("bc7_quality", bc7_quality); // number of BC7 endpoint refinement iterations
 
 	kw_to_val_map_t<float> kwmf(error);
 	kwmf.add("gravity", base_gravity);
@@ -1784,6 +1805,7 @@ int load_config(string const &config_file) {
 	kwmf.add("far_clip_dist", FAR_CLIP);
 	kwmf.add("tree_height_scale", tree_height_scale);
 	kwmf.add("model_auto_tc_scale", model_auto_tc_scale);
+	kwmf.add("model_vertex_weld_eps", model_vertex_weld_eps);
 	kwmf.add("model_triplanar_tc_scale", model_triplanar_tc_scale);
 	kwmf.add("shadow_map_pcf_offset", shadow_map_pcf_offset);
 	kwmf.add("smap_thresh_scale", smap_thresh_scale);
@@ -1800,6 +1822,7 @@ int load_config(string const &config_file) {
 	kwmf.add("force_czmax", force_czmax);
 	kwmf.add("dlight_intensity_scale", dlight_intensity_scale);
 	kwmf.add("model_mat_lod_thresh", model_mat_lod_thresh);
+	kwmf.add("model_lod_screen_error", model_lod_screen_error);
 	kwmf.add("def_texture_aniso", def_tex_aniso);
 	kwmf.add("clouds_per_tile", clouds_per_tile);
 	kwmf.add("atmosphere", def_atmosphere);
@@ -1831,6 +1854,10 @@ int load_config(string const &config_file) {
 
 	kw_to_val_map_t<string> kwms(error);
 	kwms.add("cobjs_out_filename", cobjs_out_fn);
+	kwms.add("model_cache_dir", model_cache_dir);
+	kwms.add("texture_cache_dir", texture_cache_dir);
+	kwms.add("scene_cache_dir", scene_cache_dir);
+	kwms.add("prof_trace_filename", prof_trace_fn); // Chrome trace JSON written with the zone stats if enable_prof_zones=1
 	kwms.add("coll_damage_name",   coll_damage_name);
 	kwms.add("read_hmap_modmap_filename",  read_hmap_modmap_fn);
 	kwms.add("write_hmap_modmap_filename", write_hmap_modmap_fn);
@@ -2181,10 +2208,85 @@ void init_debug_callback() {
 }
 
 
+// window-less lighting bake: generate the scene, ray trace all lighting types that have a lighting file, write the files, and exit;
+// no OpenGL calls are made in this mode, so it can run on machines without a GPU or display
+void run_headless_lighting_bake() {
+
+	RESET_TIME;
+	cout << "Running headless lighting bake" << endl;
+	if (world_mode != WMODE_GROUND) {cerr << "Error: Headless lighting bake requires a ground mode scene" << endl; exit(1);}
+	unsigned const num_cores(std::thread::hardware_concurrency());
+	NUM_THREADS = max(NUM_THREADS, min(num_cores, 99U)); // use all cores; launch_threaded_job() supports up to 99 threads
+	bool any_ltypes(0);
+
+	for (unsigned ltype = 0; ltype < NUM_LIGHTING_TYPES; ++ltype) { // recompute and write every lighting type that has a file, rather than reading it
+		if (lighting_file[ltype] == nullptr || !(read_light_files[ltype] || write_light_files[ltype])) continue;
+		read_light_files [ltype] = 0;
+		write_light_files[ltype] = 1;
+		any_ltypes = 1;
+	}
+	if (!any_ltypes) {cerr << "Error: No lighting files were specified in the config file; nothing to bake" << endl; exit(1);}
+	load_textures(); // CPU side only; GL textures are created lazily on first use
+	reset_planet_defaults();
+	init_objects();
+	alloc_matrices();
+	init_terrain_mesh();
+	init_lights();
+	gen_scene(1, 1, 0, 0, 0);
+	get_landscape_texture_color(0, 0); // force creation of the cached_ls_colors vector in the master thread (before build_lightmap())
+	build_lightmap(1); // builds the cobj BVH and runs the lighting jobs on NUM_THREADS threads
+	print_lighting_bake_summary(NUM_THREADS, GET_DELTA_TIME);
+	kill_current_raytrace_threads();
+	free_scenery_cobjs();
+	delete_matrices();
+	exit(0);
+}
+
+
+// window-less texture precompile: load the built-in textures and generate the scene so that all model textures are loaded,
+// writing each texture that misses the texture cache; later runs with the same texture_cache_dir read the processed textures directly
+void run_texture_precompile() {
+
+	RESET_TIME;
+	cout << "Precompiling textures" << endl;
+	if (texture_cache_dir.empty()) {cerr << "Error: texture_cache_dir must be set in the config file to precompile textures" << endl; exit(1);}
+	load_textures(); // CPU side only; writes cache misses
+
+	if (world_mode == WMODE_GROUND) { // model textures are loaded along with the models
+		reset_planet_defaults();
+		init_objects();
+		alloc_matrices();
+		init_terrain_mesh();
+		init_lights();
+		gen_scene(1, 1, 0, 0, 0);
+		free_scenery_cobjs();
+		delete_matrices();
+	}
+	print_texture_cache_stats();
+	PRINT_TIME("Texture Precompile");
+	exit(0);
+}
+
+
 int main(int argc, char** argv) {
 
 	cout << "Starting 3DWorld" << endl;
-	if (argc == 2) {read_ueventlist(argv[1]);}
+	char const *config_file(defaults_file);
+	bool precompile_textures(0), texture_compress_test(0);
+
+	if (argc >= 2 && strcmp(argv[1], "-bake") == 0) { // usage: 3dworld -bake [config_file]
+		headless_bake = 1;
+		if (argc >= 3) {config_file = argv[2];}
+	}
+	else if (argc >= 2 && strcmp(argv[1], "-precompile_textures") == 0) { // usage: 3dworld -precompile_textures [config_file]
+		headless_bake = precompile_textures = 1; // no GL context
+		if (argc >= 3) {config_file = argv[2];}
+	}
+	else if (argc >= 2 && strcmp(argv[1], "-texture_compress_test") == 0) { // usage: 3dworld -texture_compress_test [config_file]
+		headless_bake = texture_compress_test = 1; // no GL context
+		if (argc >= 3) {config_file = argv[2];}
+	}
+	else if (argc == 2) {read_ueventlist(argv[1]);}
 	int rs(1);
 	if      (srand_param == 1) {rs = GET_TIME_MS();}
 	else if (srand_param != 0) {rs = srand_param;}
@@ -2192,8 +2294,11 @@ int main(int argc, char** argv) {
 	create_sin_table();
 	set_scene_constants();
 	load_texture_names(); // needs to be before config file load
-	load_top_level_config(defaults_file);
+	load_top_level_config(config_file);
 	gen_gauss_rand_arr(); // after reading seed from config file
+	if (precompile_textures) {run_texture_precompile();} // never returns
+	if (texture_compress_test) {run_texture_compress_test(); exit(0);}
+	if (headless_bake) {run_headless_lighting_bake();} // never returns
 	cout << "Loading."; cout.flush();
 	
  	// Initialize GLUT
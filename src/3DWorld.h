@@ -979,19 +979,32 @@ protected:
 	unsigned tid;
 	colorRGBA color;
 	vector<unsigned> mm_offsets;
+	std::string cache_fn; // set on a texture cache miss; the processed texture is written to this file in init()
+	vector<unsigned char> bcn_data; // block compressed data for all mipmap levels
+	char bcn_format; // BCN_* from texture_compress.h
+	bool from_cache, mm_precomputed; // mm_precomputed: mm_data holds the full mipmap chain, which is uploaded in do_gl_init()
+	bool from_height_map; // normal map generated by make_normal_map()
 	enum {DEFER_TYPE_NONE=0, DEFER_TYPE_DDS, NUM_DEFER_TYPE};
 
 	void maybe_swap_rb(unsigned char *ptr) const;
+	void downsample_for_mipmap(unsigned char const *idata, unsigned char *odata, unsigned w, unsigned h, bool custom_alpha) const;
+	void gen_mipmap_chain();
+	void upload_mipmap_chain();
+	void write_to_cache();
+	int choose_bcn_format() const;
+	void compress_bcn();
+	void upload_bcn_data();
 
 public:
 	texture_t() : type(0), format(0), use_mipmaps(0), defer_load_type(DEFER_TYPE_NONE), wrap(0), mirror(0), invert_y(0), do_compress(0), has_binary_alpha(0),
 		is_16_bit_gray(0), no_avg_color_alpha_fill(0), invert_alpha(0), normal_map(0), width(0), height(0), ncolors(0), bump_tid(-1), alpha_tid(-1),
-		anisotropy(1.0), mipmap_alpha_weight(1.0), data(0), orig_data(0), colored_data(0), mm_data(0), tid(0), color(DEF_TEX_COLOR) {}
+		anisotropy(1.0), mipmap_alpha_weight(1.0), data(0), orig_data(0), colored_data(0), mm_data(0), tid(0), color(DEF_TEX_COLOR), bcn_format(0), from_cache(0), mm_precomputed(0), from_height_map(0) {}
 
 	texture_t(char t, char f, int w, int h, int wrap_mir, int nc, char um, std::string const &n, bool inv=0, bool do_comp=1, float a=1.0, float maw=1.0, bool nm=0)
 		: type(t), format(f), use_mipmaps(um), defer_load_type(DEFER_TYPE_NONE), wrap(wrap_mir != 0), mirror(wrap_mir == 2), invert_y(inv), do_compress(do_comp),
 		has_binary_alpha(0), is_16_bit_gray(0), no_avg_color_alpha_fill(0), invert_alpha(0), normal_map(nm), width(w), height(h), ncolors(nc), bump_tid(-1),
-		alpha_tid(-1), anisotropy(a), mipmap_alpha_weight(maw), name(n), data(0), orig_data(0), colored_data(0), mm_data(0), tid(0), color(DEF_TEX_COLOR) {}
+		alpha_tid(-1), anisotropy(a), mipmap_alpha_weight(maw), name(n), data(0), orig_data(0), colored_data(0), mm_data(0), tid(0), color(DEF_TEX_COLOR),
+		bcn_format(0), from_cache(0), mm_precomputed(0), from_height_map(0) {}
 	bool is_inverted_y_type() const {return (defer_load_type == DEFER_TYPE_DDS);}
 	void set_existing_tid(unsigned tid_, colorRGBA const &color_) {tid = tid_; color = color_;}
 	void init();
@@ -1015,6 +1028,7 @@ public:
 	void free_data() {gl_delete(); free_client_mem();}
 	void gl_delete();
 	void load(int index, bool allow_diff_width_height=0, bool allow_two_byte_grayscale=0, bool ignore_word_alignment=0);
+	bool try_load_from_cache(bool make_nm=0);
 	void load_raw_bmp(int index, bool allow_diff_width_height, bool allow_two_byte_grayscale);
 	void load_targa(int index, bool allow_diff_width_height);
 	void load_jpeg(int index, bool allow_diff_width_height);
@@ -7,6 +7,10 @@
 #include "textures.h"
 #include "gl_ext_arb.h"
 #include "shaders.h"
+#include "file_reader.h"
+#include "texture_compress.h"
+#include <iomanip> // for setw()
+#include <mutex>
 
 
 float const TEXTURE_SMOOTH        = 0.01;
@@ -199,7 +203,9 @@ float def_tex_aniso(2.0);
 unsigned char *landscape0 = NULL;
 
 
-extern bool mesh_difuse_tex_comp, water_is_lava, invert_bump_maps;
+extern bool mesh_difuse_tex_comp, water_is_lava, invert_bump_maps, headless_bake;
+extern unsigned texture_cache_max_mb, cpu_tex_compress_mode, bc7_quality;
+extern string texture_cache_dir;
 extern unsigned smoke_tid, dl_tid, elem_tid, gb_tid, reflection_tid, depth_tid, empty_smap_tid, frame_buffer_RGB_tid, skybox_tid, skybox_cube_tid, univ_reflection_tid;
 extern int world_mode, read_landscape, default_ground_tex, xoff2, yoff2, DISABLE_WATER;
 extern int scrolling, dx_scroll, dy_scroll, display_mode, iticks, universe_only, window_width, window_height;
@@ -222,6 +228,7 @@ void gen_noise_texture();
 void regrow_landscape_texture_amt0();
 void update_lt_section(int x1, int y1, int x2, int y2);
 bool endswith(string const &value, string const &ending);
+string append_texture_dir(string const &filename);
 
 
 bool is_tex_disabled(int i) {
@@ -258,6 +265,218 @@ void set_landscape_texture_from_file() {
 }
 
 
+// ************ texture cache ************
+
+// File layout: header, mipmap level offsets, base level data, mipmap data (levels 1 through N, down to 1x1), block compressed data (all levels)
+unsigned const TEXTURE_CACHE_VERSION = 2; // increment when texture processing changes in a way that invalidates cached textures
+unsigned const TEXTURE_CACHE_MAGIC   = 0x43545833; // "3XTC"
+
+struct texture_cache_header_t {
+	unsigned magic, version;
+	int width, height, ncolors;
+	unsigned num_mm_levels, data_size, mm_size, bcn_size;
+	colorRGBA color;
+	char use_mipmaps, bcn_format;
+	bool has_binary_alpha, normal_map;
+
+	texture_cache_header_t() : magic(TEXTURE_CACHE_MAGIC), version(TEXTURE_CACHE_VERSION), width(0), height(0), ncolors(0),
+		num_mm_levels(0), data_size(0), mm_size(0), bcn_size(0), use_mipmaps(0), bcn_format(BCN_NONE), has_binary_alpha(0), normal_map(0) {}
+	uint64_t get_file_size() const {return (sizeof(texture_cache_header_t) + num_mm_levels*sizeof(unsigned) + uint64_t(data_size) + mm_size + bcn_size);}
+
+	bool is_valid(uint64_t file_size) const {
+		if (magic != TEXTURE_CACHE_MAGIC || version != TEXTURE_CACHE_VERSION) return 0;
+		if (width <= 0 || height <= 0 || ncolors < 1 || ncolors > 4) return 0;
+		if (bcn_format < BCN_NONE || bcn_format >= NUM_BCN_FORMATS || ((bcn_format == BCN_NONE) != (bcn_size == 0))) return 0;
+		return (uint64_t(data_size) == uint64_t(ncolors)*width*height && get_file_size() == file_size);
+	}
+};
+
+// caches fully processed texture data, including all mipmap levels, keyed by a hash of the source image file and the processing flags;
+// misses are written when the texture is initialized, and the least recently used files are removed when the cache exceeds texture_cache_max_mb
+class texture_cache_t {
+	struct stats_t {
+		unsigned hits, misses, writes, write_errors, evictions;
+		uint64_t bytes_read, bytes_written;
+		stats_t() : hits(0), misses(0), writes(0), write_errors(0), evictions(0), bytes_read(0), bytes_written(0) {}
+	};
+	std::mutex mutex; // protects stats and cache directory updates; hits and misses are recorded from the parallel load loop
+	stats_t stats;
+	uint64_t dir_size; // total size of all cache files; computed on the first write
+	bool dir_checked;
+
+	void evict() {
+		vector<cache_file_t> files;
+		if (!get_cache_dir_files(texture_cache_dir, ".texc", files)) return;
+		uint64_t const max_size(uint64_t(texture_cache_max_mb) << 20);
+		dir_size = 0;
+		for (auto f = files.begin(); f != files.end(); ++f) {dir_size += f->size;}
+		if (dir_size <= max_size) return;
+		sort(files.begin(), files.end());
+
+		for (auto f = files.begin(); f != files.end() && dir_size > max_size; ++f) {
+			if (remove(f->fn.c_str()) != 0) continue;
+			dir_size -= f->size;
+			++stats.evictions;
+		}
+	}
+public:
+	texture_cache_t() : dir_size(0), dir_checked(0) {}
+	bool enabled() const {return !texture_cache_dir.empty();}
+
+	string get_cache_filename(texture_t const &t, bool make_nm) const {
+		mapped_file_t mfile;
+		if (!mfile.open(append_texture_dir(t.name)) && !mfile.open(t.name)) return string(); // same search order as open_texture_file()
+		hash64_t hash;
+		hash.add_val(TEXTURE_CACHE_VERSION);
+		hash.add(mfile.get_data(), mfile.size());
+		// add load parameters and global state that affects the processed texture data
+		int const params[] = {t.format, t.width, t.height, t.ncolors, t.use_mipmaps, t.invert_y, t.invert_alpha, make_nm, (make_nm && invert_bump_maps),
+			int(cpu_tex_compress_mode), int(bc7_quality)};
+		hash.add(params, sizeof(params));
+		hash.add_val(t.mipmap_alpha_weight);
+		std::ostringstream oss;
+		oss << texture_cache_dir << "/" << std::hex << std::setw(16) << std::setfill('0') << hash.h << ".texc";
+		return oss.str();
+	}
+	void add_hit(string const &fn, uint64_t size) {
+		std::lock_guard<std::mutex> lock(mutex);
+		++stats.hits;
+		stats.bytes_read += size;
+		touch_cache_file(fn);
+	}
+	void add_miss() {
+		std::lock_guard<std::mutex> lock(mutex);
+		++stats.misses;
+	}
+	string get_tmp_filename(string const &fn) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!dir_checked) {make_cache_dir(texture_cache_dir); evict(); dir_checked = 1;} // evict() computes dir_size
+		return (fn + ".tmp");
+	}
+	void add_file(string const &fn, string const &tmp_fn, bool success, uint64_t size) {
+		if (success) {
+			remove(fn.c_str()); // rename() fails on Windows if the file exists
+			success = (rename(tmp_fn.c_str(), fn.c_str()) == 0);
+		}
+		if (!success) {remove(tmp_fn.c_str());}
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!success) {++stats.write_errors; return;}
+		++stats.writes;
+		stats.bytes_written += size;
+		dir_size += size;
+		if (dir_size > (uint64_t(texture_cache_max_mb) << 20)) {evict();}
+	}
+	void print_stats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		unsigned const num(stats.hits + stats.misses);
+		cout << "Texture cache: " << stats.hits << " hits, " << stats.misses << " misses (" << (num ? 100.0*stats.hits/num : 0.0) << "% hit rate), "
+			 << stats.writes << " writes, " << stats.write_errors << " write errors, " << stats.evictions << " evictions, "
+			 << (stats.bytes_read >> 20) << " MB read, " << (stats.bytes_written >> 20) << " MB written" << endl;
+	}
+};
+
+texture_cache_t texture_cache;
+
+void print_texture_cache_stats() {
+	if (texture_cache.enabled()) {texture_cache.print_stats();}
+}
+
+
+// make_nm: make_normal_map() will be called after loading; returns 1 if the texture was read from the cache, otherwise load() must be called
+bool texture_t::try_load_from_cache(bool make_nm) {
+
+	from_cache = 0;
+	cache_fn.clear();
+	if (!texture_cache.enabled() || type > 0 || alpha_tid >= 0) return 0; // generated, or alpha comes from another texture
+	if (format == 10 || (format == 7 && get_file_extension(name, 0, 1) == "dds")) return 0; // DDS textures are loaded on the fly
+	string const fn(texture_cache.get_cache_filename(*this, make_nm));
+	if (fn.empty()) return 0; // source file not found; let load() report the error
+	mapped_file_t mfile;
+	texture_cache_header_t header;
+	bool const opened(mfile.open(fn));
+	bool valid(opened && mfile.size() >= sizeof(header));
+	if (valid) {memcpy(&header, mfile.get_data(), sizeof(header)); valid = header.is_valid(mfile.size());}
+	char const *ptr(valid ? (mfile.get_data() + sizeof(header)) : nullptr);
+	vector<unsigned> offsets(valid ? header.num_mm_levels : 0);
+
+	if (!offsets.empty()) {
+		memcpy(&offsets.front(), ptr, offsets.size()*sizeof(unsigned));
+		for (auto i = offsets.begin(); i != offsets.end(); ++i) {valid &= (*i < header.mm_size);}
+	}
+	if (!valid) {
+		if (opened) {
+			std::cerr << "Error reading texture cache file " << fn << "; removing it" << endl;
+			mfile.close();
+			remove(fn.c_str());
+		}
+		texture_cache.add_miss();
+		cache_fn = fn; // written in init()
+		return 0;
+	}
+	ptr += offsets.size()*sizeof(unsigned);
+	width  = header.width;
+	height = header.height;
+	ncolors = header.ncolors;
+	use_mipmaps = header.use_mipmaps;
+	has_binary_alpha = header.has_binary_alpha;
+	normal_map |= header.normal_map;
+	is_16_bit_gray = 0;
+	alloc(); // frees any mipmap data
+	memcpy(data, ptr, header.data_size);
+	ptr += header.data_size;
+
+	if (!offsets.empty()) {
+		mm_offsets.swap(offsets);
+		mm_data = new unsigned char[header.mm_size];
+		memcpy(mm_data, ptr, header.mm_size);
+		mm_precomputed = 1;
+		ptr += header.mm_size;
+	}
+	bcn_data.assign((unsigned char const *)ptr, (unsigned char const *)ptr + header.bcn_size);
+	bcn_format = header.bcn_format;
+	color = header.color;
+	from_cache = 1;
+	texture_cache.add_hit(fn, mfile.size());
+	return 1;
+}
+
+void texture_t::write_to_cache() {
+
+	string const fn(cache_fn);
+	cache_fn.clear();
+	if (is_16_bit_gray || defer_load() || !is_allocated()) return; // not supported
+	if (use_mipmaps) {gen_mipmap_chain();}
+	texture_cache_header_t header;
+	header.width  = width;
+	header.height = height;
+	header.ncolors = ncolors;
+	header.num_mm_levels = mm_offsets.size();
+	header.data_size = num_bytes();
+	header.mm_size = (mm_offsets.empty() ? 0 : (mm_offsets.back() + ncolors)); // last level is 1x1
+	header.color = color;
+	header.use_mipmaps = use_mipmaps;
+	header.has_binary_alpha = has_binary_alpha;
+	header.normal_map = normal_map;
+	header.bcn_format = bcn_format;
+	header.bcn_size = bcn_data.size();
+	string const tmp_fn(texture_cache.get_tmp_filename(fn));
+	bool success(0);
+	{
+		std::ofstream out(tmp_fn, std::ios::out | std::ios::binary);
+
+		if (out.good()) {
+			out.write((char const *)&header, sizeof(header));
+			if (!mm_offsets.empty()) {out.write((char const *)&mm_offsets.front(), mm_offsets.size()*sizeof(unsigned));}
+			out.write((char const *)data, header.data_size);
+			if (header.mm_size > 0) {out.write((char const *)mm_data, header.mm_size);}
+			if (!bcn_data.empty()) {out.write((char const *)&bcn_data.front(), bcn_data.size());}
+			success = out.good();
+		}
+	}
+	texture_cache.add_file(fn, tmp_fn, success, header.get_file_size());
+}
+
+
 void load_textures() {
 
 	timer_t timer("Texture Load");
@@ -268,10 +487,12 @@ void load_textures() {
 #pragma omp parallel for schedule(dynamic)
 	for (int i = 0; i < (int)textures.size(); ++i) {
 		//cout << "."; cout.flush();
-		if (!is_tex_disabled(i)) {textures[i].load(i, 0, 0, 1);} // ignore word alignment here, since resizing isn't thread safe
+		if (is_tex_disabled(i)) continue;
+		if (i != BULLET_D_TEX && textures[i].try_load_from_cache()) continue; // BULLET_D_TEX has its alpha channel merged in below
+		textures[i].load(i, 0, 0, 1); // ignore word alignment here, since resizing isn't thread safe
 	}
 	for (int i = 0; i < (int)textures.size(); ++i) {
-		if (!is_tex_disabled(i)) {textures[i].fix_word_alignment();}
+		if (!is_tex_disabled(i)) {textures[i].fix_word_alignment();} // no-op for cached textures
 	}
 	cout << " done" << endl;
 	textures[BULLET_D_TEX].merge_in_alpha_channel(textures[BULLET_A_TEX]);
@@ -299,7 +520,9 @@ void load_textures() {
 	}
 	textures[TREE_HEMI_TEX].set_color_alpha_to_one();
 	textures_inited = 1;
+	print_texture_cache_stats();
 
+	if (headless_bake) return; // no GL context
 	glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &max_tius);
 	glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &max_ctius);
 	cout << "max TIUs: " << max_tius << ", max combined TIUs: " << max_ctius << endl;
@@ -307,6 +530,62 @@ void load_textures() {
 }
 
 
+// headless test of the CPU block compressor: compresses every loaded texture in each format that applies to it, then reports the PSNR
+// over the channels stored by that format and the throughput; all applicable formats are tested, independent of cpu_tex_compress_mode
+void run_texture_compress_test() {
+
+	load_textures(); // CPU side only
+	unsigned num[NUM_BCN_FORMATS] = {0};
+	int time_ms[NUM_BCN_FORMATS] = {0};
+	double mpix[NUM_BCN_FORMATS] = {0.0}, psnr_sum[NUM_BCN_FORMATS] = {0.0};
+	vector<unsigned char> comp, rgba;
+
+	for (auto t = textures.begin(); t != textures.end(); ++t) {
+		if (t->type > 0 || !t->is_allocated() || t->is_16_bit_gray) continue; // skip generated and unloaded textures
+		vector<int> formats;
+		if (t->ncolors == 1) {formats.push_back(BCN_BC4);}
+		if (t->ncolors == 2 || (t->ncolors == 3 && t->normal_map)) {formats.push_back(BCN_BC5);}
+		if (t->ncolors == 3) {formats.push_back(BCN_BC1);}
+		if (t->ncolors == 4) {formats.push_back(BCN_BC3);}
+		if (t->ncolors >= 3) {formats.push_back(BCN_BC7);}
+		unsigned const w(t->width), h(t->height), npixels(t->num_pixels());
+		unsigned char const *const src(t->get_data());
+		rgba.resize(4*npixels);
+		cout << t->name << " (" << w << "x" << h << "x" << t->ncolors << "):";
+
+		for (auto f = formats.begin(); f != formats.end(); ++f) {
+			comp.resize(get_bcn_image_size(*f, w, h));
+			int const start_time(GET_TIME_MS());
+			bcn_compress_image(src, w, h, t->ncolors, *f, bc7_quality, &comp.front());
+			time_ms[*f] += GET_TIME_MS() - start_time;
+			bcn_decompress_image(&comp.front(), w, h, *f, &rgba.front());
+			unsigned const nchan((*f == BCN_BC4) ? 1 : ((*f == BCN_BC5) ? 2 : min(t->ncolors, ((*f == BCN_BC1) ? 3 : 4))));
+			double err_sq(0.0);
+
+			for (unsigned i = 0; i < npixels; ++i) {
+				for (unsigned n = 0; n < nchan; ++n) {
+					int const d(int(src[t->ncolors*i + n]) - int(rgba[4*i + n]));
+					err_sq += d*d;
+				}
+			}
+			double const mse(err_sq/(double(npixels)*nchan)), psnr((mse > 0.0) ? 10.0*log10(255.0*255.0/mse) : 99.0);
+			cout << " " << get_bcn_format_name(*f) << " " << psnr << " dB";
+			++num[*f];
+			mpix[*f] += npixels/1.0E6;
+			psnr_sum[*f] += psnr;
+		} // for f
+		cout << endl;
+	} // for t
+	for (unsigned f = BCN_NONE+1; f < NUM_BCN_FORMATS; ++f) {
+		if (num[f] == 0) continue;
+		cout << get_bcn_format_name(f) << ": " << num[f] << " textures, average PSNR " << psnr_sum[f]/num[f] << " dB, "
+			 << 1000.0*mpix[f]/max(time_ms[f], 1) << " MPix/s" << ((f == BCN_BC7) ? " (quality " : "");
+		if (f == BCN_BC7) {cout << bc7_quality << ")";}
+		cout << endl;
+	}
+}
+
+
 unsigned get_loaded_textures_cpu_mem() {
 	unsigned mem(0);
 	for (auto i = textures.begin(); i != textures.end(); ++i) {mem += i->get_cpu_mem();}
@@ -339,7 +618,7 @@ int get_texture_by_name(string const &name, bool is_normal_map, bool invert_y, i
 	texture_t new_tex(0, 7, 0, 0, wrap_mir, 3, 1, name, invert_y, (def_tex_compress && !is_normal_map), ((aniso > 0.0) ? aniso : def_tex_aniso), 1.0, is_normal_map);
 
 	if (textures_inited) {
-		new_tex.load(tid);
+		if (!new_tex.try_load_from_cache()) {new_tex.load(tid);}
 		new_tex.init();
 	}
 	textures.push_back(new_tex);
@@ -489,6 +768,9 @@ void texture_t::free_mm_data() {
 	delete [] mm_data;
 	mm_data = NULL;
 	mm_offsets.clear();
+	mm_precomputed = 0;
+	bcn_data.clear(); // also derived from data
+	bcn_format = BCN_NONE;
 }
 
 void texture_t::free_client_mem() {
@@ -505,8 +787,10 @@ void texture_t::gl_delete() {
 }
 
 void texture_t::init() {
-	calc_color();
+	if (!from_cache) {calc_color();} // color is stored in the cache
 	build_mipmaps();
+	if (bcn_data.empty()) {compress_bcn();} // only if enabled
+	if (!cache_fn.empty()) {write_to_cache();}
 }
 
 GLenum texture_t::calc_internal_format() const {
@@ -537,9 +821,14 @@ void texture_t::do_gl_init(bool free_after_upload) {
 	else {
 		assert(is_allocated());
 		assert(width > 0 && height > 0);
-		glTexImage2D(GL_TEXTURE_2D, 0, calc_internal_format(), width, height, 0, calc_format(), get_data_format(), data);
-		if (use_mipmaps == 1 || use_mipmaps == 2) {gen_mipmaps();}
-		if (use_mipmaps == 3 || use_mipmaps == 4) {create_custom_mipmaps();}
+
+		if (!bcn_data.empty()) {upload_bcn_data();} // compressed on the CPU, including all mipmap levels
+		else {
+			glTexImage2D(GL_TEXTURE_2D, 0, calc_internal_format(), width, height, 0, calc_format(), get_data_format(), data);
+			if (use_mipmaps != 0 && mm_precomputed) {upload_mipmap_chain();} // from the texture cache
+			else if (use_mipmaps == 1 || use_mipmaps == 2) {gen_mipmaps();}
+			else if (use_mipmaps == 3 || use_mipmaps == 4) {create_custom_mipmaps();}
+		}
 	}
 	//assert(glIsTexture(tid)); // for some reason this check is slow
 	if (free_after_upload) {free_client_mem();}
@@ -594,6 +883,8 @@ void texture_t::copy_alpha_from_texture(texture_t const &at, bool alpha_in_red_c
 	assert(ncolors == 4); // check for alpha channel
 	assert(!is_bound());  // check that texture isn't already bound
 	assert(at.ncolors == 1 || at.ncolors == 3 || at.ncolors == 4);
+	cache_fn.clear(); // data now depends on another texture, so it can't be cached
+	if (mm_precomputed) {free_mm_data();} // no longer valid
 	
 	if (at.width != width || at.height != height) {
 		resize(at.width, at.height);
@@ -914,6 +1205,56 @@ void texture_t::make_normal_map() {
 	}
 	free_data();
 	data = new_data;
+	from_height_map = 1;
+}
+
+
+// w, h: size of idata; odata is (w/2)x(h/2), with a min size of 1
+void texture_t::downsample_for_mipmap(unsigned char const *idata, unsigned char *odata, unsigned w1, unsigned h1, bool custom_alpha) const {
+
+	unsigned const w2(max(w1>>1, 1U)), h2(max(h1>>1, 1U));
+	unsigned const xinc((w2 < w1) ? ncolors : 0), yinc((h2 < h1) ? ncolors*w1 : 0);
+	color_wrapper cw; cw.set_c4(color);
+
+	for (unsigned y = 0; y < h2; ++y) {
+		for (unsigned x = 0; x < w2; ++x) {
+			unsigned const ix1(ncolors*(y*w2+x)), ix2(ncolors*((y<<1)*w1+(x<<1)));
+
+			if (ncolors == 1) {
+				odata[ix1] = (unsigned char)(((unsigned)idata[ix2] + idata[ix2+xinc] + idata[ix2+yinc] + idata[ix2+yinc+xinc]) >> 2);
+			}
+			else if (ncolors == 3) {
+				UNROLL_3X(odata[ix1+i_] = (unsigned char)(((unsigned)idata[ix2+i_] + idata[ix2+xinc+i_] + idata[ix2+yinc+i_] + idata[ix2+yinc+xinc+i_]) >> 2);)
+			}
+			else if (ncolors == 4 && custom_alpha) { // custom alpha mipmaps
+				unsigned const a1(idata[ix2+3]), a2(idata[ix2+xinc+3]), a3(idata[ix2+yinc+3]), a4(idata[ix2+yinc+xinc+3]);
+				unsigned const a_sum(a1 + a2 + a3 + a4);
+
+				if (a_sum == 0) { // fully transparent
+					if (use_mipmaps == 4) {UNROLL_3X(odata[ix1+i_] = cw.c[i_];)} // use average texture color
+					else { // color is average of all 4 values
+						UNROLL_3X(odata[ix1+i_] = (unsigned char)(((unsigned)idata[ix2+i_] + idata[ix2+xinc+i_] + idata[ix2+yinc+i_] + idata[ix2+yinc+xinc+i_]) / 4);)
+					}
+					odata[ix1+3] = 0;
+				}
+				else { // pre-multiplied and normalized colors
+					if (use_mipmaps == 4) {
+						unsigned const a_cw(1020 - a_sum); // use average texture color for transparent pixels
+						UNROLL_3X(odata[ix1+i_] = (unsigned char)((a1*idata[ix2+i_] + a2*idata[ix2+xinc+i_] + a3*idata[ix2+yinc+i_] + a4*idata[ix2+yinc+xinc+i_] + a_cw*cw.c[i_]) / 1020);)
+					}
+					else {
+						UNROLL_3X(odata[ix1+i_] = (unsigned char)((a1*idata[ix2+i_] + a2*idata[ix2+xinc+i_] + a3*idata[ix2+yinc+i_] + a4*idata[ix2+yinc+xinc+i_]) / a_sum);)
+					}
+					odata[ix1+3] = min(255U, min(max(max(a1, a2), max(a3, a4)), unsigned(mipmap_alpha_weight*a_sum)));
+				}
+			}
+			else { // box filter of all components
+				for (int n = 0; n < ncolors; ++n) {
+					odata[ix1+n] = (unsigned char)(((unsigned)idata[ix2+n] + idata[ix2+xinc+n] + idata[ix2+yinc+n] + idata[ix2+yinc+xinc+n]) >> 2);
+				}
+			}
+		} // for x
+	} // for y
 }
 
 
@@ -925,49 +1266,12 @@ void texture_t::create_custom_mipmaps() {
 	vector<unsigned char> idata, odata;
 	idata.resize(tsize);
 	memcpy(&idata.front(), data, tsize);
-	color_wrapper cw; cw.set_c4(color);
 
 	for (unsigned w = width, h = height, level = 1; w > 1 || h > 1; w >>= 1, h >>= 1, ++level) {
 		unsigned const w1(max(w,    1U)), h1(max(h,    1U));
 		unsigned const w2(max(w>>1, 1U)), h2(max(h>>1, 1U));
-		unsigned const xinc((w2 < w1) ? ncolors : 0), yinc((h2 < h1) ? ncolors*w1 : 0);
 		odata.resize(ncolors*w2*h2);
-
-		for (unsigned y = 0; y < h2; ++y) {
-			for (unsigned x = 0; x < w2; ++x) {
-				unsigned const ix1(ncolors*(y*w2+x)), ix2(ncolors*((y<<1)*w1+(x<<1)));
-
-				if (ncolors == 1) {
-					odata[ix1] = (unsigned char)(((unsigned)idata[ix2] + idata[ix2+xinc] + idata[ix2+yinc] + idata[ix2+yinc+xinc]) >> 2);
-				}
-				else if (ncolors == 3) {
-					UNROLL_3X(odata[ix1+i_] = (unsigned char)(((unsigned)idata[ix2+i_] + idata[ix2+xinc+i_] + idata[ix2+yinc+i_] + idata[ix2+yinc+xinc+i_]) >> 2);)
-				}
-				else { // custom alpha mipmaps
-					assert(ncolors == 4);
-					unsigned const a1(idata[ix2+3]), a2(idata[ix2+xinc+3]), a3(idata[ix2+yinc+3]), a4(idata[ix2+yinc+xinc+3]);
-					unsigned const a_sum(a1 + a2 + a3 + a4);
-
-					if (a_sum == 0) { // fully transparent
-						if (use_mipmaps == 4) {UNROLL_3X(odata[ix1+i_] = cw.c[i_];)} // use average texture color
-						else { // color is average of all 4 values
-							UNROLL_3X(odata[ix1+i_] = (unsigned char)(((unsigned)idata[ix2+i_] + idata[ix2+xinc+i_] + idata[ix2+yinc+i_] + idata[ix2+yinc+xinc+i_]) / 4);)
-						}
-						odata[ix1+3] = 0;
-					}
-					else { // pre-multiplied and normalized colors
-						if (use_mipmaps == 4) {
-							unsigned const a_cw(1020 - a_sum); // use average texture color for transparent pixels
-							UNROLL_3X(odata[ix1+i_] = (unsigned char)((a1*idata[ix2+i_] + a2*idata[ix2+xinc+i_] + a3*idata[ix2+yinc+i_] + a4*idata[ix2+yinc+xinc+i_] + a_cw*cw.c[i_]) / 1020);)
-						}
-						else {
-							UNROLL_3X(odata[ix1+i_] = (unsigned char)((a1*idata[ix2+i_] + a2*idata[ix2+xinc+i_] + a3*idata[ix2+yinc+i_] + a4*idata[ix2+yinc+xinc+i_]) / a_sum);)
-						}
-						odata[ix1+3] = min(255U, min(max(max(a1, a2), max(a3, a4)), unsigned(mipmap_alpha_weight*a_sum)));
-					}
-				}
-			} // for x
-		} // for y
+		downsample_for_mipmap(&idata.front(), &odata.front(), w1, h1, 1); // custom_alpha=1
 		glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // needed for mipmap levels where width*ncolors is not aligned
 		glTexImage2D(GL_TEXTURE_2D, level, calc_internal_format(), w2, h2, 0, format, get_data_format(), &odata.front());
 		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
@@ -976,6 +1280,103 @@ void texture_t::create_custom_mipmaps() {
 }
 
 
+// generates all mipmap levels down to 1x1 on the CPU for the texture cache, using the same layout as build_mipmaps(); non-square textures are supported
+void texture_t::gen_mipmap_chain() {
+
+	assert(is_allocated() && !is_16_bit_gray);
+	if (mm_precomputed) return; // already generated
+	unsigned num_levels(0), data_size(0);
+
+	for (unsigned w = width, h = height; w > 1 || h > 1; ++num_levels) {
+		w = max(w>>1, 1U); h = max(h>>1, 1U);
+		data_size += ncolors*w*h;
+	}
+	if (mm_offsets.size() != num_levels) { // not built by build_mipmaps(), or a partial chain
+		free_mm_data();
+		mm_data = new unsigned char[data_size];
+		bool const custom_alpha(use_mipmaps == 3 || use_mipmaps == 4);
+		unsigned offset(0);
+
+		for (unsigned level = 0, w = width, h = height; level < num_levels; ++level) {
+			mm_offsets.push_back(offset);
+			downsample_for_mipmap(get_mipmap_data(level), (mm_data + offset), w, h, custom_alpha);
+			w = max(w>>1, 1U); h = max(h>>1, 1U);
+			offset += ncolors*w*h;
+		}
+	}
+	mm_precomputed = 1;
+}
+
+
+// uses the same conditions as calc_internal_format() for compression; Z of two channel normal maps is reconstructed in the shader
+int texture_t::choose_bcn_format() const {
+
+	if (cpu_tex_compress_mode == 0 || !COMPRESS_TEXTURES || !do_compress || type == 2 || is_16_bit_gray) return BCN_NONE;
+	if ((width & 3) || (height & 3)) return BCN_NONE; // must be a multiple of the block size
+	if (from_height_map && ncolors == 3) return BCN_BC5;
+	bool const use_bc7(cpu_tex_compress_mode == 2);
+
+	switch (ncolors) {
+	case 1: return BCN_BC4;
+	case 2: return BCN_BC5;
+	case 3: return (use_bc7 ? BCN_BC7 : BCN_BC1);
+	case 4: return (use_bc7 ? BCN_BC7 : BCN_BC3);
+	}
+	return BCN_NONE;
+}
+
+void texture_t::compress_bcn() {
+
+	bcn_data.clear();
+	int const format(is_allocated() ? choose_bcn_format() : BCN_NONE);
+	bcn_format = BCN_NONE;
+	if (format == BCN_NONE) return;
+	if (use_mipmaps) {gen_mipmap_chain();} // must be called before setting bcn_format, since this may call free_mm_data()
+	bcn_format = format;
+	unsigned const num_levels(1 + mm_offsets.size());
+	vector<unsigned> offsets;
+	unsigned tot_size(0);
+
+	for (unsigned level = 0, w = width, h = height; level < num_levels; ++level, w = max(w>>1, 1U), h = max(h>>1, 1U)) {
+		offsets.push_back(tot_size);
+		tot_size += get_bcn_image_size(bcn_format, w, h);
+	}
+	bcn_data.resize(tot_size);
+
+	for (unsigned level = 0, w = width, h = height; level < num_levels; ++level, w = max(w>>1, 1U), h = max(h>>1, 1U)) {
+		bcn_compress_image(get_mipmap_data(level), w, h, ncolors, bcn_format, bc7_quality, &bcn_data[offsets[level]]); // multithreaded
+	}
+}
+
+void texture_t::upload_bcn_data() {
+
+	assert(bcn_format != BCN_NONE && !bcn_data.empty());
+	GLenum const format(get_bcn_gl_format(bcn_format));
+	unsigned offset(0);
+
+	for (unsigned level = 0, w = width, h = height; offset < bcn_data.size(); ++level, w = max(w>>1, 1U), h = max(h>>1, 1U)) {
+		unsigned const size(get_bcn_image_size(bcn_format, w, h));
+		assert(offset + size <= bcn_data.size());
+		glCompressedTexImage2D(GL_TEXTURE_2D, level, format, w, h, 0, size, &bcn_data[offset]);
+		offset += size;
+	}
+}
+
+
+void texture_t::upload_mipmap_chain() {
+
+	assert(mm_precomputed && mm_data != NULL);
+	GLenum const format(calc_format()), internal_format(calc_internal_format());
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // needed for mipmap levels where width*ncolors is not aligned
+
+	for (unsigned level = 0, w = width, h = height; level < mm_offsets.size(); ++level) {
+		w = max(w>>1, 1U); h = max(h>>1, 1U);
+		glTexImage2D(GL_TEXTURE_2D, level+1, internal_format, w, h, 0, format, get_data_format(), (mm_data + mm_offsets[level]));
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+
 void texture_t::load_from_gl() { // also set tid?
 
 	alloc();
@@ -1939,6 +2340,7 @@ float texture_t::get_component(float u, float v, int comp) const {
 
 unsigned texture_t::get_gpu_mem() const {
 	if (!is_bound()) return 0;
+	if (!bcn_data.empty()) return bcn_data.size(); // exact, including mipmaps
 	unsigned mem(num_bytes());
 	if (use_mipmaps) {mem += mem/3;} // 33% overhead
 	if (do_compress) {mem /= 4;} // assumes DXT2-DXT5 4:1 compression
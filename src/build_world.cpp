@@ -14,7 +14,9 @@
 #include "player_state.h"
 #include "file_utils.h"
 #include "openal_wrap.h"
+#include "file_reader.h"
 #include <fstream>
+#include <iomanip> // for setw()
 
 
 bool const MORE_COLL_TSTEPS       = 1; // slow
@@ -58,7 +60,7 @@ extern double camera_zh;
 extern point cpos2, orig_camera, orig_cdir;
 extern unsigned create_voxel_landscape, scene_smap_vbo_invalid, num_dynam_parts, max_num_mat_spheres, init_item_counts[];
 extern obj_type object_types[];
-extern string cobjs_out_fn;
+extern string cobjs_out_fn, scene_cache_dir;
 extern coll_obj_group coll_objects;
 extern cobj_groups_t cobj_groups;
 extern cobj_draw_groups cdraw_groups;
@@ -1198,9 +1200,314 @@ bool read_block_comment(FILE *fp) {
 }
 
 
-int read_coll_obj_file(const char *coll_obj_file, geom_xform_t xf, coll_obj cobj, bool has_layer, colorRGBA lcolor) {
+// ************ scene cache ************
+
+unsigned const SCENE_CACHE_VERSION  = 1; // increment when cobj file parsing changes in a way that invalidates cached scenes
+unsigned const SCENE_CACHE_MAGIC    = 0x43534433; // "3DSC"
+unsigned const SCENE_CACHE_MIN_COBJS = 32; // don't write cache files for small includes
+
+struct scene_dep_t { // source file a compiled scene depends on
+	uint64_t size, hash;
+	int64_t mtime;
+	scene_dep_t() : size(0), hash(0), mtime(0) {}
+};
+
+struct cobj_file_deps_t { // state collected while parsing a cobj file and its includes
+	map<string, scene_dep_t> files;
+	bool cacheable;
+	cobj_file_deps_t() : cacheable(1) {}
+	void add(cobj_file_deps_t const &deps) {
+		files.insert(deps.files.begin(), deps.files.end());
+		cacheable &= deps.cacheable;
+	}
+};
+
+struct compiled_cobj_t { // POD copy of the coll_obj fields set by the cobj file parser; dynamic textures are indexed into the file's texture table
+	float d[3][2];
+	cobj_params cp;
+	point points[N_COLL_POLY_PTS];
+	vector3d norm, texture_offset;
+	float radius, radius2, thickness;
+	int counter;
+	short npoints;
+	char type, destroy, status;
+
+	compiled_cobj_t() {memset((void *)this, 0, sizeof(compiled_cobj_t));} // zero padding for deterministic cache files
+	compiled_cobj_t(coll_obj const &c) {
+		memset((void *)this, 0, sizeof(compiled_cobj_t));
+		memcpy(d, c.d, sizeof(d));
+		cp = c.cp;
+		cp.coll_func = NULL;
+		for (unsigned i = 0; i < N_COLL_POLY_PTS; ++i) {points[i] = c.points[i];}
+		norm = c.norm; texture_offset = c.texture_offset;
+		radius = c.radius; radius2 = c.radius2; thickness = c.thickness;
+		counter = c.counter; npoints = c.npoints;
+		type = c.type; destroy = c.destroy; status = c.status;
+	}
+	void copy_to(coll_obj &c) const {
+		memcpy(c.d, d, sizeof(d));
+		c.cp = cp;
+		for (unsigned i = 0; i < N_COLL_POLY_PTS; ++i) {c.points[i] = points[i];}
+		c.norm = norm; c.texture_offset = texture_offset;
+		c.radius = radius; c.radius2 = radius2; c.thickness = thickness;
+		c.counter = counter; c.npoints = npoints;
+		c.type = type; c.destroy = destroy; c.status = status;
+	}
+};
+
+bool hash_file_contents(string const &fn, uint64_t size, uint64_t &hash) {
+	hash64_t h;
+
+	if (size > 0) {
+		mapped_file_t mfile;
+		if (!mfile.open(fn)) return 0;
+		h.add(mfile.get_data(), mfile.size());
+	}
+	hash = h.h;
+	return 1;
+}
+bool get_scene_dep(string const &fn, scene_dep_t &dep) {
+	time_t mtime(0);
+	if (!get_file_size_and_mtime(fn, dep.size, mtime)) return 0;
+	dep.mtime = mtime;
+	return hash_file_contents(fn, dep.size, dep.hash);
+}
+bool scene_dep_is_valid(string const &fn, scene_dep_t const &dep) {
+	scene_dep_t cur;
+	time_t mtime(0);
+	if (!get_file_size_and_mtime(fn, cur.size, mtime)) return 0;
+	if (cur.size != dep.size) return 0;
+	if ((int64_t)mtime == dep.mtime) return 1; // unchanged
+	return (hash_file_contents(fn, cur.size, cur.hash) && cur.hash == dep.hash); // touched, but contents may be the same
+}
+
+// returns 1 if the cobj file commands starting with this letter only modify local parser state or add fixed cobjs
+bool is_cobj_only_cmd(int letter) {
+	switch (letter) {
+	case 0: case EOF: case '\n': case '\t': case '\f': case '\r': case '\v': case ' ': case '#': case 'q': case 'i':
+	case 'B': case 'S': case 'C': case 'k': case 'z': case 'P': case 'c': case 'D': case 'e':
+	case 'l': case 'j': case 'J': case 'X': case 'r': case 'y': case 'Y': case 'n': case 'a': case 'd': case 'v':
+	case 't': case 'T': case 'm': case 'M': case 's': case 'R':
+		return 1;
+	}
+	return 0;
+}
+bool is_cobj_only_keyword(string const &keyword) {
+	char const *const keywords[] = {"cube", "sphere", "cylinder", "capsule", "polygon", "torus", "movable", "end",
+		"density", "tj", "reflective", "cube_map_ref", "metalness", "damage", "destroy_prob"};
+	for (unsigned i = 0; i < sizeof(keywords)/sizeof(keywords[0]); ++i) {if (keyword == keywords[i]) return 1;}
+	return 0;
+}
+
+// caches the fixed cobjs generated by cobj files that contain only shapes, materials, transforms, and includes of other such files;
+// keyed by filename, transform, and incoming cobj state, and validated against the size/mtime/hash of each source file;
+// files with lights, models, platforms, etc. are always parsed, but their cacheable includes are still loaded from the cache
+class scene_cache_t {
+	struct stats_t {
+		unsigned hits, misses, writes, write_errors;
+		uint64_t cobjs_loaded;
+		stats_t() : hits(0), misses(0), writes(0), write_errors(0), cobjs_loaded(0) {}
+	};
+	stats_t stats;
+	bool dir_checked;
+
+	static void add_tid_to_hash(hash64_t &hash, int tid) {
+		if (tid >= NUM_PREDEF_TEXTURES) {assert((unsigned)tid < textures.size()); hash.add_str(textures[tid].name);} // index may change across runs
+		else {hash.add_val(tid);}
+	}
+	static unsigned get_tex_table_ix(int tid, vector<int> &tex_table) {
+		if (tid < NUM_PREDEF_TEXTURES) return tid;
+		auto it(find(tex_table.begin(), tex_table.end(), tid));
+		if (it == tex_table.end()) {tex_table.push_back(tid); it = tex_table.end()-1;}
+		return NUM_PREDEF_TEXTURES + (it - tex_table.begin());
+	}
+	template<typename T> static void write_val(ostream &out, T const &val) {out.write((char const *)&val, sizeof(T));}
+	static void write_str(ostream &out, string const &str) {write_val(out, (unsigned)str.size()); out.write(str.data(), str.size());}
+
+	class reader_t {
+		char const *pos, *end;
+	public:
+		reader_t(mapped_file_t const &mfile) : pos(mfile.get_data()), end(mfile.get_data() + mfile.size()) {}
+		bool read(void *data, size_t sz) {
+			if (size_t(end - pos) < sz) return 0;
+			memcpy(data, pos, sz);
+			pos += sz;
+			return 1;
+		}
+		template<typename T> bool read_val(T &val) {return read(&val, sizeof(T));}
+		bool read_str(string &str) {
+			unsigned len(0);
+			if (!read_val(len) || size_t(end - pos) < len) return 0;
+			str.assign(pos, len);
+			pos += len;
+			return 1;
+		}
+		bool at_end() const {return (pos == end);}
+	};
+public:
+	scene_cache_t() : dir_checked(0) {}
+	bool enabled() const {return !scene_cache_dir.empty();}
+
+	string get_cache_filename(string const &filename, geom_xform_t const &xf, coll_obj const &cobj) const {
+		// cobjs added to groups or platforms register with global state, so can't be cached
+		if (cobj.cgroup_id >= 0 || cobj.dgroup_id >= 0 || cobj.platform_id >= 0 || cobj.cp.coll_func != NULL) return string();
+		hash64_t hash;
+		hash.add_val(SCENE_CACHE_VERSION);
+		hash.add_str(filename);
+		hash.add_val(xf.tv);
+		hash.add_val(xf.scale);
+		for (unsigned i = 0; i < 3; ++i) {hash.add_val(xf.mirror[i]); UNROLL_3X(hash.add_val(xf.swap_dim[i][i_]);)}
+		// add incoming cobj state, which may be used by shapes, materials, and step deltas
+		obj_layer layer(cobj.cp);
+		layer.tid = layer.normal_map = -1;
+		hash.add(&layer, sizeof(obj_layer)); // no padding
+		add_tid_to_hash(hash, cobj.cp.tid);
+		add_tid_to_hash(hash, cobj.cp.normal_map);
+		hash.add_val(cobj.cp.cf_index);
+		unsigned char const cvals[6] = {cobj.cp.surfs, cobj.cp.flags, cobj.cp.destroy_prob, (unsigned char)cobj.type, (unsigned char)cobj.destroy, (unsigned char)cobj.status};
+		hash.add(cvals, sizeof(cvals));
+		hash.add(cobj.d, sizeof(cobj.d));
+		hash.add(cobj.points, sizeof(cobj.points));
+		hash.add_val(cobj.norm);
+		float const fvals[3] = {cobj.radius, cobj.radius2, cobj.thickness};
+		hash.add(fvals, sizeof(fvals));
+		hash.add_val(cobj.npoints);
+		std::ostringstream oss;
+		oss << scene_cache_dir << "/" << std::hex << std::setw(16) << std::setfill('0') << hash.h << ".cobjc";
+		return oss.str();
+	}
+	bool try_load(string const &cache_fn, cobj_file_deps_t &deps) {
+		mapped_file_t mfile;
+		if (!mfile.open(cache_fn)) {++stats.misses; return 0;} // not yet cached
+		reader_t reader(mfile);
+		unsigned magic(0), version(0), num_deps(0), num_tex(0), num_cobjs(0);
+		
+		if (!reader.read_val(magic) || !reader.read_val(version) || magic != SCENE_CACHE_MAGIC || version != SCENE_CACHE_VERSION ||
+			!reader.read_val(num_deps) || !reader.read_val(num_tex) || !reader.read_val(num_cobjs))
+		{
+			++stats.misses;
+			return 0;
+		}
+		cobj_file_deps_t cached_deps;
+
+		for (unsigned i = 0; i < num_deps; ++i) {
+			string fn;
+			scene_dep_t dep;
+			if (!reader.read_str(fn) || !reader.read_val(dep.size) || !reader.read_val(dep.hash) || !reader.read_val(dep.mtime)) {++stats.misses; return 0;}
+			if (!scene_dep_is_valid(fn, dep)) {++stats.misses; return 0;} // source file was modified
+			cached_deps.files[fn] = dep;
+		}
+		vector<string> tex_names(num_tex);
+		vector<unsigned char> tex_flags(num_tex);
+
+		for (unsigned i = 0; i < num_tex; ++i) {
+			if (!reader.read_str(tex_names[i]) || !reader.read_val(tex_flags[i])) {++stats.misses; return 0;}
+		}
+		vector<compiled_cobj_t> ccobjs(num_cobjs);
+		
+		if (!reader.read(ccobjs.data(), num_cobjs*sizeof(compiled_cobj_t)) || !reader.at_end()) { // single bulk read
+			cerr << "Error reading scene cache file " << cache_fn << endl;
+			++stats.misses;
+			return 0;
+		}
+		vector<int> tex_map(num_tex); // the file has been validated, so now we can modify global state
+		for (unsigned i = 0; i < num_tex; ++i) {tex_map[i] = get_texture_by_name(tex_names[i], (tex_flags[i] & 1), (tex_flags[i] & 2));}
+		maybe_reserve_fixed_cobjs(num_cobjs);
+		coll_obj cobj;
+		cobj.init();
+
+		for (auto i = ccobjs.begin(); i != ccobjs.end(); ++i) {
+			i->copy_to(cobj);
+			int *const tids[2] = {&cobj.cp.tid, &cobj.cp.normal_map};
+
+			for (unsigned n = 0; n < 2; ++n) {
+				if (*tids[n] < NUM_PREDEF_TEXTURES) continue;
+				unsigned const ix(*tids[n] - NUM_PREDEF_TEXTURES);
+				if (ix >= num_tex) {cerr << "Error: invalid texture in scene cache file " << cache_fn << endl; exit(1);}
+				*tids[n] = tex_map[ix];
+			}
+			if (cobj.cp.tid >= 0 && cobj.cp.normal_map >= 0) {textures[cobj.cp.tid].maybe_assign_normal_map_tid(cobj.cp.normal_map);} // as in add_to_vector()
+			cobj.id = (int)fixed_cobjs.size();
+			fixed_cobjs.push_back(cobj);
+		}
+		deps.add(cached_deps);
+		++stats.hits;
+		stats.cobjs_loaded += num_cobjs;
+		touch_cache_file(cache_fn);
+		return 1;
+	}
+	void write(string const &cache_fn, cobj_file_deps_t const &deps, unsigned cobjs_start) {
+		assert(cobjs_start <= fixed_cobjs.size());
+		unsigned const num_cobjs(fixed_cobjs.size() - cobjs_start);
+		if (num_cobjs < SCENE_CACHE_MIN_COBJS) return;
+		if (!dir_checked) {make_cache_dir(scene_cache_dir); dir_checked = 1;}
+		vector<compiled_cobj_t> ccobjs;
+		vector<int> tex_table;
+		ccobjs.reserve(num_cobjs);
+
+		for (auto i = fixed_cobjs.begin()+cobjs_start; i != fixed_cobjs.end(); ++i) {
+			ccobjs.push_back(compiled_cobj_t(*i));
+			compiled_cobj_t &cc(ccobjs.back());
+			if (cc.cp.tid        >= 0) {cc.cp.tid        = get_tex_table_ix(cc.cp.tid,        tex_table);}
+			if (cc.cp.normal_map >= 0) {cc.cp.normal_map = get_tex_table_ix(cc.cp.normal_map, tex_table);}
+		}
+		string const tmp_fn(cache_fn + ".tmp");
+		bool success(0);
+		{
+			ofstream out(tmp_fn, ios::out | ios::binary);
+
+			if (out.good()) {
+				write_val(out, SCENE_CACHE_MAGIC);
+				write_val(out, SCENE_CACHE_VERSION);
+				write_val(out, (unsigned)deps.files.size());
+				write_val(out, (unsigned)tex_table.size());
+				write_val(out, num_cobjs);
+
+				for (auto f = deps.files.begin(); f != deps.files.end(); ++f) {
+					write_str(out, f->first);
+					write_val(out, f->second.size);
+					write_val(out, f->second.hash);
+					write_val(out, f->second.mtime);
+				}
+				for (auto t = tex_table.begin(); t != tex_table.end(); ++t) {
+					texture_t const &tex(textures[*t]);
+					write_str(out, tex.name);
+					write_val(out, (unsigned char)((tex.normal_map ? 1 : 0) | (tex.invert_y ? 2 : 0)));
+				}
+				out.write((char const *)ccobjs.data(), ccobjs.size()*sizeof(compiled_cobj_t));
+				success = out.good();
+			}
+		}
+		if (success) {
+			remove(cache_fn.c_str()); // rename() fails on Windows if the file exists
+			success = (rename(tmp_fn.c_str(), cache_fn.c_str()) == 0);
+		}
+		if (!success) {remove(tmp_fn.c_str()); ++stats.write_errors;} else {++stats.writes;}
+	}
+	void print_stats() const {
+		unsigned const num(stats.hits + stats.misses);
+		if (num == 0) return;
+		cout << "Scene cache: " << stats.hits << " hits, " << stats.misses << " misses (" << (100.0*stats.hits/num) << "% hit rate), "
+			 << stats.writes << " writes, " << stats.write_errors << " write errors, " << stats.cobjs_loaded << " cobjs loaded" << endl;
+	}
+};
+
+scene_cache_t scene_cache;
+
+
+// parent_deps: if non-null, this file and its includes are added to it for scene cache validation
+int read_coll_obj_file(const char *coll_obj_file, geom_xform_t xf, coll_obj cobj, bool has_layer, colorRGBA lcolor, cobj_file_deps_t *parent_deps=nullptr) {
 
 	assert(coll_obj_file != NULL);
+	cobj_file_deps_t deps;
+	string const cache_fn(scene_cache.enabled() ? scene_cache.get_cache_filename(coll_obj_file, xf, cobj) : string());
+
+	if (!cache_fn.empty() && scene_cache.try_load(cache_fn, deps)) { // compiled scene is up to date
+		if (parent_deps) {parent_deps->add(deps);}
+		return 1;
+	}
+	if (scene_cache.enabled() && !get_scene_dep(coll_obj_file, deps.files[coll_obj_file])) {deps.cacheable = 0;}
+	unsigned const cobjs_start(fixed_cobjs.size());
 	FILE *fp;
 	if (!open_file(fp, coll_obj_file, "collision object")) return 0;
 	char str[MAX_CHARS] = {0};
@@ -1237,6 +1544,7 @@ int read_coll_obj_file(const char *coll_obj_file, geom_xform_t xf, coll_obj cobj
 				keyword.push_back(letter);
 				letter = next_letter;
 				while (!is_end_of_string(letter)) {keyword.push_back(letter); letter = getc(fp);}
+				if (!is_cobj_only_keyword(keyword)) {deps.cacheable = 0;}
 
 				if (0) {}
 				// long name aliases remapped to single character
@@ -1411,6 +1719,8 @@ int read_coll_obj_file(const char *coll_obj_file, geom_xform_t xf, coll_obj cobj
 				}
 			}
 		}
+		if (!is_cobj_only_cmd(letter)) {deps.cacheable = 0;}
+
 		switch (letter) {
 		case 0:
 		case EOF:
@@ -1431,7 +1741,7 @@ int read_coll_obj_file(const char *coll_obj_file, geom_xform_t xf, coll_obj cobj
 			{
 				string const fn(read_quoted_string(fp, line_num));
 				if (fn.empty()) {return read_error(fp, "include file", coll_obj_file);}
-				if (!read_coll_obj_file(fn.c_str(), xf, cobj, has_layer, lcolor)) {return read_error(fp, "include file", coll_obj_file);}
+				if (!read_coll_obj_file(fn.c_str(), xf, cobj, has_layer, lcolor, &deps)) {return read_error(fp, "include file", coll_obj_file);}
 			}
 			break;
 
@@ -2076,6 +2386,8 @@ int read_coll_obj_file(const char *coll_obj_file, geom_xform_t xf, coll_obj cobj
 		}
 	}
 	if (fp != NULL) {checked_fclose(fp);}
+	if (!cache_fn.empty() && deps.cacheable) {scene_cache.write(cache_fn, deps, cobjs_start);}
+	if (parent_deps) {parent_deps->add(deps);}
 	return 1;
 }
 
@@ -2089,6 +2401,7 @@ int read_coll_objects(const char *filename) {
 	if (EXPLODE_EVERYTHING) {cobj.destroy = EXPLODEABLE;}
 	if (use_voxel_cobjs) {cobj.cp.cobj_type = COBJ_TYPE_VOX_TERRAIN;}
 	if (!read_coll_obj_file(filename, xf, cobj, 0, WHITE)) return 0;
+	scene_cache.print_stats();
 	if (num_keycards > 0) {obj_groups[coll_id[KEYCARD]].enable();}
 	if (has_scenery2) {gen_scenery();} // need to call post_gen_setup() for leafy plants
 	cube_t const model_bcube(calc_and_return_all_models_bcube()); // calculate even if not using; will force internal transform bcubes to be calculated
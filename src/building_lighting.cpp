@@ -9,6 +9,8 @@
 #include <thread>
 
 bool const USE_BKG_THREAD = 1;
+unsigned const LIGHTS_PER_BATCH     = 16; // nearest incomplete lights traced together; the texture is updated after each batch
+unsigned const MAX_CACHED_BUILDINGS = 8;  // each entry is a 4 byte per cell lighting texture
 
 extern int MESH_Z_SIZE, display_mode, display_framerate, camera_surf_collide, animate2;
 extern unsigned LOCAL_RAYS, MAX_RAY_BOUNCES, NUM_THREADS;
@@ -157,12 +159,20 @@ void building_t::gather_interior_cubes(vect_colored_cube_t &cc) const {
 
 
 class building_indir_light_mgr_t {
+	struct cached_lighting_t { // finished lighting of a building; valid while the building and its set of lit lights are unchanged
+		unsigned bix;
+		cube_t bcube;
+		vector<unsigned> lit_lights; // sorted
+		vector<unsigned char> tex_data;
+		bool matches(cached_lighting_t const &c) const {return (bix == c.bix && bcube == c.bcube && lit_lights == c.lit_lights);}
+	};
 	bool is_running, is_done, kill_thread, lighting_updated, needs_to_join;
-	int cur_bix, cur_light;
+	int cur_bix;
 	unsigned cur_tid;
 	vector<unsigned char> tex_data;
-	vector<unsigned> light_ids;
+	vector<unsigned> light_ids, cur_lights; // cur_lights is the batch being traced
 	set<unsigned> lights_complete;
+	deque<cached_lighting_t> cache; // most recently used first
 	cube_bvh_t bvh;
 	lmap_manager_t lmgr;
 	std::thread rt_thread;
@@ -175,7 +185,7 @@ class building_indir_light_mgr_t {
 		lmgr.alloc(tot_sz, MESH_X_SIZE, MESH_Y_SIZE, MESH_SIZE[2], (unsigned char **)nullptr, init_lmcell);
 	}
 	void start_lighting_compute(building_t const &b) {
-		assert(cur_light >= 0);
+		assert(!cur_lights.empty());
 		init_lmgr(0); // clear_lighting=0
 		is_running = 1;
 		lighting_updated = 1;
@@ -198,28 +208,42 @@ class building_indir_light_mgr_t {
 		if (dot_product(dir, cnorm) < 0.0) {dir.negate();} // make sure it points away from the surface (is this needed?)
 		pos = cpos + tolerance*dir; // move slightly away from the surface
 	}
-	void cast_light_ray(building_t const &b) {
-		// Note: modifies lmgr, but otherwise thread safe
-		unsigned const num_rt_threads(NUM_THREADS - (USE_BKG_THREAD ? 1 : 0)); // reserve a thread for the main thread if running in the background
-		vector<room_object_t> const &objs(b.interior->room_geom->objs);
-		assert((unsigned)cur_light < objs.size());
-		room_object_t const &ro(objs[cur_light]);
-		colorRGBA const lcolor(ro.get_color());
-		cube_t const scene_bounds(get_scene_bounds_bcube()); // expected by lmap update code
-		point const ray_scale(scene_bounds.get_size()/b.bcube.get_size()), llc_shift(scene_bounds.get_llc() - b.bcube.get_llc()*ray_scale);
-		float const tolerance(1.0E-5*b.bcube.get_max_extent()), light_zval(ro.z1() - 0.01*ro.dz()); // set slightly below bottom of light
+	static float get_light_ray_weight(building_t const &b, room_object_t const &ro) {
 		float const surface_area(ro.dx()*ro.dy() + 2.0f*(ro.dx() + ro.dy())*ro.dz()); // bottom + 4 sides (top is occluded), 0.0003 for houses
 		float weight(100.0f*(surface_area/0.0003f)/LOCAL_RAYS); // normalize to the number of rays
 		if (b.has_pri_hall()) {weight *= 0.8;} // floorplan is open and well lit, indir lighting value seems too high
 		if (b.is_house) {weight *= 2.0;} // houses have dimmer lights and seem to work better with more indir
+		return weight;
+	}
+	void cast_light_ray(building_t const &b) {
+		// Note: modifies lmgr, but otherwise thread safe; traces all lights in cur_lights together so that small batches still use all threads
+		unsigned const num_rt_threads(max(1U, NUM_THREADS - (USE_BKG_THREAD ? 1 : 0))); // reserve a thread for the main thread if running in the background
+		vector<room_object_t> const &objs(b.interior->room_geom->objs);
+		cube_t const scene_bounds(get_scene_bounds_bcube()); // expected by lmap update code
+		point const ray_scale(scene_bounds.get_size()/b.bcube.get_size()), llc_shift(scene_bounds.get_llc() - b.bcube.get_llc()*ray_scale);
+		float const tolerance(1.0E-5*b.bcube.get_max_extent());
 		unsigned const NUM_PRI_SPLITS = 16;
-		int const num_rays(LOCAL_RAYS/NUM_PRI_SPLITS);
+		int const num_rays(LOCAL_RAYS/NUM_PRI_SPLITS), num_lights(cur_lights.size());
+		vector<float> weights(num_lights);
+		vector<lmap_thread_accum_t> accums(num_rt_threads); // one per thread, merged at the end, since lmgr is not thread safe
+
+		for (int l = 0; l < num_lights; ++l) {
+			assert(cur_lights[l] < objs.size());
+			weights[l] = get_light_ray_weight(b, objs[cur_lights[l]]);
+		}
+		for (auto a = accums.begin(); a != accums.end(); ++a) {a->init(lmgr.size());}
 
 #pragma omp parallel for schedule(dynamic) num_threads(num_rt_threads)
-		for (int n = 0; n < num_rays; ++n) {
+		for (int i = 0; i < num_lights*num_rays; ++i) {
 			if (kill_thread) continue;
+			int const n(i % num_rays), lix(i / num_rays);
+			unsigned const light_id(cur_lights[lix]);
+			room_object_t const &ro(objs[light_id]);
+			colorRGBA const lcolor(ro.get_color());
+			float const light_zval(ro.z1() - 0.01*ro.dz()), weight(weights[lix]); // set slightly below bottom of light
+			lmap_thread_accum_t &accum(accums[omp_get_thread_num_3dw()]);
 			rand_gen_t rgen;
-			rgen.set_state(n+1, cur_light);
+			rgen.set_state(n+1, light_id);
 			vector3d pri_dir(rgen.signed_rand_vector_spherical(1.0).get_norm());
 			pri_dir.z = -fabs(pri_dir.z); // make sure dir points down
 			point origin, init_cpos, cpos;
@@ -245,7 +269,7 @@ class building_indir_light_mgr_t {
 
 					if (cpos != pos) { // accumulate light along the ray from pos to cpos (which is always valid) with color cur_color
 						point const p1(pos*ray_scale + llc_shift), p2(cpos*ray_scale + llc_shift); // transform building space to global scene space
-						add_path_to_lmcs(&lmgr, nullptr, p1, p2, weight, cur_color, LIGHTING_LOCAL, 0); // local light, no bcube
+						add_path_to_lmcs(&lmgr, nullptr, p1, p2, weight, cur_color, LIGHTING_LOCAL, 0, &accum); // local light, no bcube
 					}
 					if (!hit) break; // done
 					cur_color = cur_color.modulate_with(ccolor);
@@ -253,7 +277,10 @@ class building_indir_light_mgr_t {
 					calc_reflect_ray(pos, cpos, dir, cnorm, rgen, tolerance);
 				} // for bounce
 			} // for splits
-		} // for n
+		} // for i
+		vector<lmap_thread_accum_t const *> accum_ptrs;
+		for (auto a = accums.begin(); a != accums.end(); ++a) {accum_ptrs.push_back(&(*a));}
+		lmgr.merge_thread_accums(accum_ptrs, LIGHTING_LOCAL);
 		is_running = 0;
 	}
 	void wait_for_finish(bool force_kill) {
@@ -269,14 +296,41 @@ class building_indir_light_mgr_t {
 	void maybe_join_thread() {
 		if (needs_to_join) {rt_thread.join(); needs_to_join = 0;}
 	}
+	cached_lighting_t get_cache_key(building_t const &b, unsigned bix) const {
+		cached_lighting_t key;
+		key.bix        = bix;
+		key.bcube      = b.bcube;
+		key.lit_lights = light_ids;
+		sort(key.lit_lights.begin(), key.lit_lights.end());
+		return key;
+	}
+	bool read_from_cache(building_t const &b, unsigned bix) {
+		cached_lighting_t const key(get_cache_key(b, bix));
+
+		for (auto i = cache.begin(); i != cache.end(); ++i) {
+			if (!i->matches(key)) continue;
+			tex_data = i->tex_data;
+			if (i != cache.begin()) {cached_lighting_t entry(*i); cache.erase(i); cache.push_front(entry);} // move to front
+			return 1;
+		}
+		return 0;
+	}
+	void add_to_cache(building_t const &b, unsigned bix) {
+		cached_lighting_t entry(get_cache_key(b, bix));
+		entry.tex_data = tex_data;
+		for (auto i = cache.begin(); i != cache.end(); ++i) {if (i->matches(entry)) {cache.erase(i); break;}} // remove old entry
+		cache.push_front(entry);
+		if (cache.size() > MAX_CACHED_BUILDINGS) {cache.pop_back();} // remove least recently used
+	}
 public:
-	building_indir_light_mgr_t() : is_running(0), is_done(0), kill_thread(0), lighting_updated(0), needs_to_join(0), cur_bix(-1), cur_light(-1), cur_tid(0) {}
+	building_indir_light_mgr_t() : is_running(0), is_done(0), kill_thread(0), lighting_updated(0), needs_to_join(0), cur_bix(-1), cur_tid(0) {}
 
 	void clear() {
 		is_done = lighting_updated = 0;
-		cur_bix = cur_light = -1;
+		cur_bix = -1;
 		tex_data.clear();
 		light_ids.clear();
+		cur_lights.clear();
 		lights_complete.clear();
 		end_rt_job();
 		lmgr.reset_all(); // clear lighting values back to 0
@@ -294,6 +348,15 @@ public:
 			cur_bix = bix;
 			assert(!is_running);
 			build_bvh(b);
+			b.order_lights_by_priority(target, light_ids);
+
+			if (read_from_cache(b, bix)) { // previously computed, use the cached texture
+				upload_indir_light_tex(cur_tid, tex_data, MESH_X_SIZE, MESH_Y_SIZE, MESH_SIZE[2]);
+				lights_complete.insert(light_ids.begin(), light_ids.end());
+				is_done = 1;
+				tid = cur_tid;
+				return;
+			}
 		}
 		if (cur_tid > 0 && is_done) return; // nothing else to do
 
@@ -309,15 +372,19 @@ public:
 			update_volume_light_texture();
 			lighting_updated = 0;
 		}
-		// nothing is running and there is more work to do, find the nearest light to the target and process it
-		if (cur_light >= 0) {lights_complete.insert(cur_light); cur_light = -1;} // mark the most recent light as complete
+		// nothing is running and there is more work to do, find the nearest lights to the target and process them
+		lights_complete.insert(cur_lights.begin(), cur_lights.end()); // mark the most recent batch of lights as complete
+		cur_lights.clear();
 		b.order_lights_by_priority(target, light_ids);
 
-		for (auto i = light_ids.begin(); i != light_ids.end(); ++i) {
-			if (lights_complete.find(*i) == lights_complete.end()) {cur_light = *i; break;} // find an incomplete light
+		for (auto i = light_ids.begin(); i != light_ids.end() && cur_lights.size() < LIGHTS_PER_BATCH; ++i) {
+			if (lights_complete.find(*i) == lights_complete.end()) {cur_lights.push_back(*i);} // find incomplete lights
+		}
+		if (!cur_lights.empty()) {start_lighting_compute(b);} // these lights are next
+		else { // no more lights to process
+			is_done = 1;
+			if (!tex_data.empty()) {add_to_cache(b, bix);}
 		}
-		if (cur_light >= 0) {start_lighting_compute(b);} // this light is next
-		else {is_done = 1;} // no more lights to process
 		//cout << "Process light " << lights_complete.size() << " of " << light_ids.size() << endl;
 		tid = cur_tid;
 	}
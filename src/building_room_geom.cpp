@@ -1166,7 +1166,7 @@ colorRGBA room_object_t::get_color() const {
 }
 
 void building_room_geom_t::create_static_vbos() {
-	//highres_timer_t timer("Gen Room Geom"); // 2.1ms
+	PROF_ZONE("Gen Room Geom"); // 2.1ms
 	float const tscale(2.0/obj_scale);
 	obj_model_insts.clear();
 
@@ -1214,7 +1214,7 @@ void building_room_geom_t::create_static_vbos() {
 	mats_static.create_vbos();
 }
 void building_room_geom_t::create_small_static_vbos() {
-	//highres_timer_t timer("Gen Room Geom Small"); // 1.3ms
+	PROF_ZONE("Gen Room Geom Small"); // 1.3ms
 	float const tscale(2.0/obj_scale);
 
 	for (auto i = objs.begin(); i != objs.end(); ++i) {
@@ -1233,7 +1233,7 @@ void building_room_geom_t::create_small_static_vbos() {
 	mats_small.create_vbos();
 }
 void building_room_geom_t::create_lights_vbos() {
-	//highres_timer_t timer("Gen Room Geom Light"); // 0.3ms
+	PROF_ZONE("Gen Room Geom Light"); // 0.3ms
 	float const tscale(2.0/obj_scale);
 
 	for (auto i = objs.begin(); i != objs.end(); ++i) {
@@ -6,6 +6,7 @@
 #include "openal_wrap.h"
 #include "explosion.h" // for add_blastr()
 #include "lightmap.h" // for light_source
+#include "profiler.h"
 #include <cfloat> // for FLT_MAX
 
 float const MIN_CAR_STOP_SEP = 0.25; // in units of car lengths
@@ -224,6 +225,24 @@ bool comp_car_road_then_pos::operator()(car_t const &c1, car_t const &c2) const
 	return (c1.bcube.d[c1.dim][c1.dir] < c2.bcube.d[c2.dim][c2.dir]); // compare front end of car (used for collisions)
 }
 
+// matches the city/parked/road part of comp_car_road_then_pos, which is all that can change when a car moves to a new road or intersection
+uint64_t get_car_sort_key(car_t const &c) {return ((uint64_t(c.cur_city) << 17) | (uint64_t(c.is_parked()) << 16) | c.cur_road);}
+
+// returns false if more than max_moves element moves are needed, in which case v is left partially sorted
+template<typename T, typename C> bool insertion_sort_repair(vector<T> &v, C const &comp, size_t max_moves) {
+	size_t num_moves(0);
+
+	for (size_t i = 1; i < v.size(); ++i) {
+		if (!comp(v[i], v[i-1])) continue; // already in order
+		T const val(v[i]);
+		size_t j(i);
+		for (; j > 0 && comp(val, v[j-1]); --j, ++num_moves) {v[j] = v[j-1];}
+		v[j] = val;
+		if (num_moves > max_moves) return 0;
+	}
+	return 1;
+}
+
 
 void ao_draw_state_t::draw_ao_qbd() {
 	if (ao_qbd.empty()) return;
@@ -438,6 +457,36 @@ void car_manager_t::remove_destroyed_cars() {
 	car_destroyed = 0;
 }
 
+void car_manager_t::sort_cars() { // cars rarely change order between frames, so repair the previous order rather than doing a full sort
+	comp_car_road_then_pos const comp(camera_pdu.pos - dstate.xlate);
+
+	if (car_keys.size() != cars.size()) { // first frame, or cars were added or removed
+		sort(cars.begin(), cars.end(), comp);
+	}
+	else {
+		// cars that changed city, road, or parked state are handled as events: they're removed, the remaining cars are repaired with an insertion sort,
+		// and then the sorted event cars are merged back in
+		unsigned num_kept(0);
+		moved_cars.clear();
+
+		for (unsigned i = 0; i < cars.size(); ++i) {
+			if (get_car_sort_key(cars[i]) != car_keys[i]) {moved_cars.push_back(cars[i]); continue;}
+			if (num_kept != i) {cars[num_kept] = cars[i];}
+			++num_kept;
+		}
+		cars.erase((cars.begin() + num_kept), cars.end());
+		if (!insertion_sort_repair(cars, comp, 4*cars.size())) {sort(cars.begin(), cars.end(), comp);} // too far out of order, maybe due to a large camera move
+
+		if (!moved_cars.empty()) {
+			sort(moved_cars.begin(), moved_cars.end(), comp);
+			vector_add_to(moved_cars, cars);
+			inplace_merge(cars.begin(), (cars.begin() + num_kept), cars.end(), comp);
+		}
+	}
+	car_keys.resize(cars.size());
+	for (unsigned i = 0; i < cars.size(); ++i) {car_keys[i] = get_car_sort_key(cars[i]);}
+}
+
 void car_manager_t::init_cars(unsigned num) {
 	if (num == 0) return;
 	timer_t timer("Init Cars");
@@ -739,7 +788,7 @@ void car_manager_t::next_frame(ped_manager_t const &ped_manager, float car_speed
 #pragma omp critical(modify_car_data)
 	{
 		if (car_destroyed) {remove_destroyed_cars();} // at least one car was destroyed in the previous frame - remove it/them
-		sort(cars.begin(), cars.end(), comp_car_road_then_pos(camera_pdu.pos - dstate.xlate)); // sort by city/road/position for intersection tests and tile shadow map binds
+		sort_cars(); // sort by city/road/position for intersection tests and tile shadow map binds
 	}
 	entering_city.clear();
 	car_blocks.clear();
@@ -747,7 +796,7 @@ void car_manager_t::next_frame(ped_manager_t const &ped_manager, float car_speed
 	bool saw_parked(0);
 	//unsigned num_on_conn_road(0);
 
-	for (auto i = cars.begin(); i != cars.end(); ++i) { // move cars
+	for (auto i = cars.begin(); i != cars.end(); ++i) { // build per-city blocks
 		unsigned const cix(i - cars.begin());
 		i->car_in_front = nullptr; // reset for this frame
 
@@ -756,18 +805,27 @@ void car_manager_t::next_frame(ped_manager_t const &ped_manager, float car_speed
 			saw_parked = 0; // reset for next city
 			car_blocks.emplace_back(cix, i->cur_city);
 		}
-		if (i->is_parked()) {
-			if (!saw_parked) {car_blocks.back().first_parked = cix; saw_parked = 1;}
-			continue; // no update for parked cars
-		}
-		i->move(speed);
-		if (i->entering_city) {entering_city.push_back(cix);} // record for use in collision detection
-		if (!i->stopped_at_light && i->is_almost_stopped() && i->in_isect()) {get_car_isec(*i).stoplight.mark_blocked(i->dim, i->dir);} // blocking intersection
-		register_car_at_city(*i);
+		if (i->is_parked() && !saw_parked) {car_blocks.back().first_parked = cix; saw_parked = 1;}
 	} // for i
 	if (!saw_parked && !car_blocks.empty()) {car_blocks.back().first_parked = cars.size();} // no parked cars in final city
 	car_blocks.emplace_back(cars.size(), 0); // add terminator
 
+	int const num_blocks(car_blocks.size() - 1); // excluding the terminator
+
+#pragma omp parallel for schedule(dynamic) if (cars.size() > 1000)
+	for (int cb = 0; cb < num_blocks; ++cb) { // move cars; each city's stoplights and car count are only modified by the thread that owns its block
+		PROF_ZONE("Move City Cars");
+		for (unsigned cix = car_blocks[cb].start; cix < car_blocks[cb].first_parked; ++cix) { // parked cars come last and aren't updated
+			car_t &car(cars[cix]);
+			car.move(speed);
+			if (!car.stopped_at_light && car.is_almost_stopped() && car.in_isect()) {get_car_isec(car).stoplight.mark_blocked(car.dim, car.dir);} // blocking intersection
+			register_car_at_city(car);
+		}
+	}
+	for (auto i = cars.begin(); i != cars.end(); ++i) {
+		if (i->entering_city && !i->is_parked()) {entering_city.push_back(i - cars.begin());} // record for use in collision detection
+	}
+
 	for (auto i = cars.begin(); i != cars.end(); ++i) { // collision detection
 		if (i->is_parked()) continue; // no collisions for parked cars
 		bool const on_conn_road(i->cur_city == CONN_CITY_IX);
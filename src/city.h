@@ -567,7 +567,9 @@ public:
 // forward declarations of some classes
 class city_road_gen_t;
 struct pedestrian_t;
+struct ped_snapshot_t;
 class ped_manager_t;
+class path_finder_t;
 
 struct ped_city_vect_t {
 	vector<vector<vector<sphere_t>>> peds; // per city per road
@@ -585,7 +587,8 @@ class car_manager_t {
 		bool is_in_building() const {return (cur_city == NO_CITY_IX);}
 	};
 	city_road_gen_t const &road_gen;
-	vector<car_t> cars;
+	vector<car_t> cars, moved_cars;
+	vector<uint64_t> car_keys; // coarse sort key of each car as of the last sort, for incremental reordering
 	vector<car_block_t> car_blocks, car_blocks_by_road;
 	vector<cube_with_ix_t> cars_by_road;
 	ped_city_vect_t peds_crossing_roads;
@@ -603,6 +606,7 @@ class car_manager_t {
 	void add_car();
 	void get_car_ix_range_for_cube(vector<car_block_t>::const_iterator cb, cube_t const &bc, unsigned &start, unsigned &end) const;
 	void remove_destroyed_cars();
+	void sort_cars();
 	void update_cars();
 	int find_next_car_after_turn(car_t &car);
 public:
@@ -637,12 +641,13 @@ struct pedestrian_t : public waiting_obj_t {
 	point pos;
 	float radius, speed, anim_time;
 	unsigned plot, next_plot, dest_plot, dest_bldg; // Note: can probably be made unsigned short later, though these are global plot and building indices
-	unsigned short city, model_id, ssn, colliding_ped;
+	unsigned colliding_ped; // index into peds, which may exceed 64K
+	unsigned short city, model_id, ssn;
 	unsigned char stuck_count;
 	bool collided, ped_coll, is_stopped, in_the_road, at_crosswalk, at_dest, has_dest_bldg, has_dest_car, destroyed, in_building;
 
 	pedestrian_t(float radius_) : target_pos(all_zeros), dir(zero_vector), vel(zero_vector), pos(all_zeros), radius(radius_), speed(0.0), anim_time(0.0), plot(0), next_plot(0), dest_plot(0),
-		dest_bldg(0), city(0), model_id(0), ssn(0), colliding_ped(0), stuck_count(0), collided(0), ped_coll(0), is_stopped(0), in_the_road(0), at_crosswalk(0), at_dest(0), has_dest_bldg(0),
+		dest_bldg(0), colliding_ped(0), city(0), model_id(0), ssn(0), stuck_count(0), collided(0), ped_coll(0), is_stopped(0), in_the_road(0), at_crosswalk(0), at_dest(0), has_dest_bldg(0),
 		has_dest_car(0), destroyed(0), in_building(0) {}
 	bool operator<(pedestrian_t const &ped) const {return ((city == ped.city) ? (plot < ped.plot) : (city < ped.city));} // currently only compares city + plot
 	string get_name() const;
@@ -655,24 +660,114 @@ struct pedestrian_t : public waiting_obj_t {
 	void stop();
 	void go();
 	bool check_for_safe_road_crossing(ped_manager_t const &ped_mgr, cube_t const &plot_bcube, cube_t const &next_plot_bcube, vect_cube_t *dbg_cubes=nullptr) const;
-	bool check_ped_ped_coll_range(vector<pedestrian_t> &peds, unsigned pid, unsigned ped_start, unsigned target_plot, float prox_radius, vector3d &force);
-	bool check_ped_ped_coll(ped_manager_t const &ped_mgr, vector<pedestrian_t> &peds, unsigned pid, float delta_dir);
-	bool check_ped_ped_coll_stopped(vector<pedestrian_t> &peds, unsigned pid);
-	bool check_inside_plot(ped_manager_t &ped_mgr, point const &prev_pos, cube_t const &plot_bcube, cube_t const &next_plot_bcube);
+	bool check_ped_ped_coll_one(ped_snapshot_t const &other, unsigned other_ix, vector3d &force);
+	bool check_ped_ped_coll(ped_manager_t const &ped_mgr, vector<ped_snapshot_t> const &snap, unsigned pid, float delta_dir);
+	bool check_inside_plot(ped_manager_t const &ped_mgr, point const &prev_pos, cube_t const &plot_bcube, cube_t const &next_plot_bcube);
 	bool check_road_coll(ped_manager_t const &ped_mgr, cube_t const &plot_bcube, cube_t const &next_plot_bcube) const;
 	bool is_valid_pos(vect_cube_t const &colliders, bool &ped_at_dest, ped_manager_t const *const ped_mgr) const;
 	bool try_place_in_plot(cube_t const &plot_cube, vect_cube_t const &colliders, unsigned plot_id, rand_gen_t &rgen);
 	point get_dest_pos(cube_t const &plot_bcube, cube_t const &next_plot_bcube, ped_manager_t const &ped_mgr) const;
 	bool choose_alt_next_plot(ped_manager_t const &ped_mgr);
 	void get_avoid_cubes(ped_manager_t const &ped_mgr, vect_cube_t const &colliders, point const &dest_pos, vect_cube_t &avoid) const;
-	void next_frame(ped_manager_t &ped_mgr, vector<pedestrian_t> &peds, unsigned pid, rand_gen_t &rgen, float delta_dir);
+	bool needs_update() const;
+	void next_frame(ped_manager_t const &ped_mgr, vector<ped_snapshot_t> const &snap, unsigned pid, path_finder_t &path_finder, rand_gen_t &rgen, float delta_dir);
 	void register_at_dest();
 	void destroy() {destroyed = 1;} // that's it, no other effects
 	bool is_close_to_player() const;
 	void debug_draw(ped_manager_t &ped_mgr) const;
 };
 
+struct ped_snapshot_t { // frozen copy of the ped state read by other peds, so that peds can be updated in parallel
+	point pos;
+	vector3d vel;
+	float radius;
+	unsigned plot;
+	ped_snapshot_t(pedestrian_t const &ped) : pos(ped.pos), vel(ped.vel), radius(ped.radius), plot(ped.plot) {}
+};
+
+class sphere_spatial_hash_t { // 2D uniform grid of sphere centers with cells hashed into a power-of-2 number of buckets; rebuilt from scratch by build()
+	struct entry_t {
+		float x, y, radius;
+		unsigned ix; // caller's index
+		int cx, cy; // grid cell, used to skip entries from other cells that hash to the same bucket
+		entry_t(point const &pos, float radius_, unsigned ix_) : x(pos.x), y(pos.y), radius(radius_), ix(ix_), cx(0), cy(0) {}
+	};
+	vector<entry_t> entries, sorted; // sorted is grouped by bucket
+	vector<unsigned> bucket_start, insert_pos; // entries of bucket b are sorted[bucket_start[b], bucket_start[b+1])
+	float inv_cell_sz;
+	unsigned mask;
+
+	int get_cell(float v) const {return (int)floor(v*inv_cell_sz);}
+	unsigned get_bucket(int cx, int cy) const {return (((unsigned)cx*73856093U) ^ ((unsigned)cy*19349663U)) & mask;}
+
+	// calls f(entry) for each entry with center within dist of pos in XY, in a deterministic order; returns true early if f returns true
+	template<typename F> bool visit_radius(point const &pos, float dist, F const &f) const {
+		if (sorted.empty()) return 0;
+		float const dist_sq(dist*dist);
+		float const span(2.0f*dist*inv_cell_sz + 1.0f);
+
+		if (span*span > bucket_start.size()) { // query covers more cells than there are buckets, faster to iterate over everything
+			for (auto const &e : sorted) {
+				if ((e.x - pos.x)*(e.x - pos.x) + (e.y - pos.y)*(e.y - pos.y) <= dist_sq && f(e)) return 1;
+			}
+			return 0;
+		}
+		int const x1(get_cell(pos.x - dist)), y1(get_cell(pos.y - dist)), x2(get_cell(pos.x + dist)), y2(get_cell(pos.y + dist));
+
+		for (int cy = y1; cy <= y2; ++cy) {
+			for (int cx = x1; cx <= x2; ++cx) {
+				unsigned const b(get_bucket(cx, cy));
+
+				for (unsigned i = bucket_start[b]; i < bucket_start[b+1]; ++i) {
+					entry_t const &e(sorted[i]);
+					if (e.cx != cx || e.cy != cy) continue; // a different cell that hashed to the same bucket
+					if ((e.x - pos.x)*(e.x - pos.x) + (e.y - pos.y)*(e.y - pos.y) <= dist_sq && f(e)) return 1;
+				}
+			} // for cx
+		} // for cy
+		return 0;
+	}
+public:
+	sphere_spatial_hash_t() : inv_cell_sz(0.0), mask(0) {}
+	bool empty() const {return sorted.empty();}
+	void add(point const &pos, float radius, unsigned ix) {entries.emplace_back(pos, radius, ix);}
+	void build(float cell_sz); // moves all added entries into the hash, replacing the previous contents
+	int find_nearest_in_dir(point const &pos, vector3d const &dir, float max_dist, float half_width, unsigned exclude_ix) const;
+
+	// calls f(ix) for each sphere with center within dist of pos in XY, in a deterministic order; returns true early if f returns true
+	template<typename F> bool query_radius(point const &pos, float dist, F const &f) const {
+		return visit_radius(pos, dist, [&f](entry_t const &e) {return f(e.ix);});
+	}
+};
+
 unsigned const MAX_PATH_DEPTH = 32;
+unsigned const MAX_NAV_GRAPH_OBSTACLES = 128; // plots with more static obstacles than this use only the recursive path search
+unsigned const MAX_NAV_PATH_CACHE = 1024; // max cached paths per plot; the cache is cleared when full
+
+struct ped_nav_graph_t { // visibility graph over the expanded corners of a plot's static obstacles; shared by all peds in the plot
+	vector<point> nodes; // walkable obstacle corners
+	vector<vector<unsigned>> adj; // nodes visible from each node
+	cube_t bcube; // plot bcube
+	float cell_sz; // quantization of start and goal positions for path cache keys
+	mutable map<uint64_t, vector<unsigned>> path_cache; // {start cell, goal cell} => nodes along the path; read-only during the parallel ped update
+
+	ped_nav_graph_t() : cell_sz(0.0) {}
+	bool empty() const {return nodes.empty();}
+	void clear() {nodes.clear(); adj.clear(); path_cache.clear();}
+	void build(vect_cube_t const &obstacles, cube_t const &plot_bcube, float gap, float cell_sz_);
+	uint64_t get_cache_key(point const &start, point const &goal) const;
+	bool get_cached_path(uint64_t key, vector<unsigned> &node_path) const;
+	void add_cached_path(uint64_t key, vector<unsigned> const &node_path) const; // Note: not thread safe
+};
+
+struct nav_path_cache_add_t { // a new nav graph path, added to its graph's path cache after the parallel ped update
+	ped_nav_graph_t const *graph;
+	uint64_t key;
+	unsigned order; // ped index, for adding in a deterministic order
+	vector<unsigned> node_path;
+	nav_path_cache_add_t(ped_nav_graph_t const *graph_, uint64_t key_, unsigned order_, vector<unsigned> const &node_path_) : graph(graph_), key(key_), order(order_), node_path(node_path_) {}
+	bool operator<(nav_path_cache_add_t const &a) const {return (order < a.order);}
+};
 
 class path_finder_t {
 	struct path_t : public vector<point> {
@@ -691,20 +786,29 @@ class path_finder_t {
 	point pos, dest;
 	cube_t plot_bcube;
 	path_t cur_path, best_path, partial_path;
+	vector<unsigned> node_path; // for nav graph queries
+	vector<float> g_score;
+	vector<int> came_from;
+	vector<nav_path_cache_add_t> cache_adds; // new paths to be added to nav graph path caches by the caller
+	unsigned cache_add_order;
 	bool debug;
 
 	bool add_pt_to_path(point const &p, path_t &path) const;
 	bool add_pts_around_cube_xy(path_t &path, path_t const &cur_path, path_t::const_iterator p, cube_t const &c, bool dir);
 	void find_best_path_recur(path_t const &cur_path, unsigned depth);
 	bool shorten_path(path_t &path) const;
+	void set_best_path_from_nodes(ped_nav_graph_t const &graph);
+	bool find_nav_graph_path(ped_nav_graph_t const &graph);
 public:
-	path_finder_t(bool debug_=0) : gap(0.0f), debug(debug_) {}
+	path_finder_t(bool debug_=0) : gap(0.0f), cache_add_order(0), debug(debug_) {}
 	vect_cube_t &get_avoid_vector() {return avoid;}
+	vector<nav_path_cache_add_t> &get_cache_adds() {return cache_adds;}
+	void set_cache_add_order(unsigned order) {cache_add_order = order;}
 	vector<point> const &get_best_path() const {return (found_complete_path() ? best_path : partial_path);}
 	bool found_complete_path() const {return (!best_path.empty());}
 	bool found_path() const {return (found_complete_path() || !partial_path.empty());}
 	bool find_best_path();
-	unsigned run(point const &pos_, point const &dest_, cube_t const &plot_bcube_, float gap_, point &new_dest);
+	unsigned run(point const &pos_, point const &dest_, cube_t const &plot_bcube_, float gap_, point &new_dest, ped_nav_graph_t const *nav_graph=nullptr);
 };
 
 class ped_manager_t { // pedestrians
@@ -722,6 +826,10 @@ class ped_manager_t { // pedestrians
 	vector<unsigned> by_plot;
 	vector<unsigned char> need_to_sort_city;
 	vector<car_city_vect_t> cars_by_city;
+	vector<ped_snapshot_t> ped_snap; // peds state at the beginning of the frame
+	sphere_spatial_hash_t ped_grid; // of ped_snap; Note: only valid during the ped update, since it's rebuilt each frame by the ped thread
+	vector<ped_nav_graph_t> nav_graphs; // per global plot; empty graphs use the recursive path search
+	vector<nav_path_cache_add_t> nav_cache_adds; // collected from all threads during the ped update
 	vector<point> bldg_ppl_pos;
 	rand_gen_t rgen;
 	ao_draw_state_t dstate;
@@ -734,6 +842,8 @@ class ped_manager_t { // pedestrians
 	void expand_cube_for_ped(cube_t &cube) const;
 	void remove_destroyed_peds();
 	void sort_by_city_and_plot();
+	void build_nav_graphs();
+	void get_plot_to_city_map(vector<unsigned> &plot_to_city) const;
 	road_isec_t const &get_car_isec(car_base_t const &car) const;
 	void register_ped_new_plot(pedestrian_t const &ped);
 	int get_road_ix_for_ped_crossing(pedestrian_t const &ped, bool road_dim) const;
@@ -741,7 +851,6 @@ class ped_manager_t { // pedestrians
 		bool &in_sphere_draw, bool shadow_only, bool is_dlight_shadows, bool enable_animations);
 public:
 	// for use in pedestrian_t, mostly for collisions and path finding
-	path_finder_t path_finder;
 	vect_cube_t const &get_colliders_for_plot(unsigned city_ix, unsigned plot_ix) const;
 	cube_t const &get_city_plot_bcube_for_peds(unsigned city_ix, unsigned plot_ix) const;
 	cube_t get_expanded_city_bcube_for_peds(unsigned city_ix) const;
@@ -753,7 +862,7 @@ public:
 	bool mark_crosswalk_in_use(pedestrian_t const &ped);
 	bool choose_dest_building_or_parked_car(pedestrian_t &ped);
 	unsigned get_next_plot(pedestrian_t &ped, int exclude_plot=-1) const;
-	void move_ped_to_next_plot(pedestrian_t &ped);
+	void move_ped_to_next_plot(pedestrian_t &ped) const;
 	bool has_nearby_car(pedestrian_t const &ped, bool road_dim, float delta_time, vect_cube_t *dbg_cubes=nullptr) const;
 	bool has_nearby_car_on_road(pedestrian_t const &ped, bool dim, unsigned road_ix, float delta_time, vect_cube_t *dbg_cubes) const;
 	bool has_car_at_pt(point const &pos, unsigned city, bool is_parked) const;
@@ -763,7 +872,7 @@ public:
 	void next_animation();
 	static float get_ped_radius();
 	bool empty() const {return (peds.empty() && peds_b.empty());}
-	void clear() {peds.clear(); peds_b.clear(); by_city.clear();}
+	void clear() {peds.clear(); peds_b.clear(); by_city.clear(); nav_graphs.clear();}
 	unsigned get_model_gpu_mem() const {return ped_model_loader.get_gpu_mem();}
 	void init(unsigned num_city, unsigned num_building);
 	bool proc_sphere_coll(point &pos, float radius, vector3d *cnorm) const;
@@ -771,7 +880,8 @@ public:
 	void destroy_peds_in_radius(point const &pos_in, float radius);
 	void next_frame();
 	pedestrian_t const *get_ped_at(point const &p1, point const &p2) const;
-	unsigned get_first_ped_at_plot(unsigned plot) const {assert(plot < by_plot.size()); return by_plot[plot];}
+	sphere_spatial_hash_t const &get_ped_grid() const {return ped_grid;}
+	ped_nav_graph_t const *get_nav_graph(unsigned plot) const {return ((plot < nav_graphs.size() && !nav_graphs[plot].empty()) ? &nav_graphs[plot] : nullptr);}
 	void get_peds_crossing_roads(ped_city_vect_t &pcv) const;
 	void draw(vector3d const &xlate, bool use_dlights, bool shadow_only, bool is_dlight_shadows);
 	void draw_peds_in_building(int first_ped_ix, unsigned bix, shader_t &s, vector3d const &xlate, bool dlight_shadow_only);
@@ -10,6 +10,7 @@
 #include "buildings.h"
 #include "tree_3dw.h"
 #include <cfloat> // for FLT_MAX
+#include <queue>
 
 using std::string;
 
@@ -17,6 +18,7 @@ bool const CHECK_HEIGHT_BORDER_ONLY = 1; // choose building site to minimize edg
 float const OUTSIDE_TERRAIN_HEIGHT  = 0.0;
 float const CAR_LANE_OFFSET         = 0.15; // in units of road width
 float const CITY_LIGHT_FALLOFF      = 0.2;
+unsigned const MAX_ROUTE_TABLE_ISECS = 4096; // max intersections per city for all-pairs car route tables (64MB of distances)
 
 
 float city_dlight_pcf_offset_scale(1.0);
@@ -1129,6 +1131,11 @@ class city_road_gen_t : public road_gen_base_t {
 
 	class road_network_t : public streetlights_t {
 
+		struct route_edge_t { // directed road connection from one intersection to the next within a city
+			int dest_ix; // flat isec index; -1 is none
+			float len;
+			route_edge_t() : dest_ix(-1), len(0.0) {}
+		};
 		vector<road_t> roads; // full overlapping roads with constant slope, for collisions, etc.
 		vector<road_seg_t> segs; // non-overlapping road segments, for drawing with textures
 		vector<cube_t> conn_roads; // connector road bounding cubes (contain multiple adjacent connected roads with different slopes/zvals)
@@ -1145,6 +1152,8 @@ class city_road_gen_t : public road_gen_base_t {
 		map<uint64_t, unsigned> tile_to_block_map;
 		map<unsigned, road_isec_t const *> cix_to_isec; // maps city_ix to intersection
 		vector<vect_cube_t> plot_colliders;
+		vector<route_edge_t> route_edges; // 4 per isec, indexed by flat isec index and outgoing orient
+		vector<float> route_dists; // shortest path road distances, indexed by [dest_isec*num_isecs + src_isec]; empty if not computed
 		plot_xy_t plot_xy;
 		unsigned city_id, cluster_id, plot_id_offset;
 		//string city_name; // future work
@@ -1706,6 +1715,61 @@ class city_road_gen_t : public road_gen_base_t {
 			plot_xy.gen_adj_plots(plots);
 			//cout << "tile_to_block_map: " << tile_to_block_map.size() << ", tile_blocks: " << tile_blocks.size() << endl;
 		}
+		void build_route_tables() { // Note: must be called after calc_ix_values()
+			route_edges.clear();
+			route_dists.clear();
+			unsigned const num_isecs(get_num_isecs());
+			if (num_isecs == 0 || num_isecs > MAX_ROUTE_TABLE_ISECS) return; // table would be too large, cars will use greedy routing
+			route_edges.resize(4*num_isecs);
+			vector<vector<pair<unsigned, float>>> in_edges(num_isecs); // {src_ix, len} for each dest isec
+
+			for (unsigned i = 0; i < num_isecs; ++i) { // follow each road out of each intersection to find the next intersection
+				road_isec_t const &isec(get_isec_by_ix(i));
+
+				for (unsigned orient = 0; orient < 4; ++orient) {
+					if (!(isec.conn & (1<<orient)) || isec.conn_ix[orient] < 0) continue; // not connected, or connector road to another city
+					bool const dim((orient >> 1) != 0), dir(orient & 1);
+					unsigned seg_ix(isec.conn_ix[orient]);
+					float len(0.5*isec.get_sz_dim(dim)); // start at isec center
+
+					for (unsigned n = 0; n <= segs.size(); ++n) { // bounded iteration, in case of a cycle
+						assert(seg_ix < segs.size());
+						road_seg_t const &seg(segs[seg_ix]);
+						len += seg.get_sz_dim(dim);
+						if (seg.conn_type[dir] == TYPE_RSEG) {seg_ix = seg.conn_ix[dir]; continue;} // continue along the road
+						if (!is_isect(seg.conn_type[dir])) break; // dead end
+						unsigned const dest_ix(get_isec_flat_ix((seg.conn_type[dir] - TYPE_ISEC2), seg.conn_ix[dir]));
+						route_edge_t &edge(route_edges[4*i + orient]);
+						edge.dest_ix = dest_ix;
+						edge.len     = len + 0.5*get_isec_by_ix(dest_ix).get_sz_dim(dim); // end at isec center
+						in_edges[dest_ix].emplace_back(i, edge.len);
+						break;
+					} // for n
+				} // for orient
+			} // for i
+			route_dists.resize(num_isecs*num_isecs, FLT_MAX);
+
+			// run Dijkstra's algorithm backwards from each destination so that each thread fills in one contiguous block of distances
+#pragma omp parallel for schedule(dynamic)
+			for (int d = 0; d < (int)num_isecs; ++d) {
+				float *const dists(route_dists.data() + d*num_isecs);
+				std::priority_queue<pair<float, unsigned> > open_queue; // max heap, so distances are negated
+				dists[d] = 0.0;
+				open_queue.push(make_pair(-0.0f, (unsigned)d));
+
+				while (!open_queue.empty()) {
+					float const dist(-open_queue.top().first);
+					unsigned const cur(open_queue.top().second);
+					open_queue.pop();
+					if (dist > dists[cur]) continue; // stale entry, already reached with a shorter distance
+
+					for (auto const &e : in_edges[cur]) {
+						float const new_dist(dist + e.second);
+						if (new_dist < dists[e.first]) {dists[e.first] = new_dist; open_queue.push(make_pair(-new_dist, e.first));}
+					}
+				} // end while
+			} // for d
+		}
 		void gen_parking_lots_and_place_objects(vector<car_t> &cars, bool have_cars) {
 			city_obj_placer.gen_parking_and_place_objects(plots, plot_colliders, cars, city_id, have_cars);
 			add_tile_blocks(city_obj_placer.parking_lots, tile_to_block_map, TYPE_PARK_LOT); // need to do this later, after gen_tile_blocks()
@@ -1999,6 +2063,7 @@ class city_road_gen_t : public road_gen_base_t {
 			return plot_id;
 		}
 		unsigned encode_plot_id(unsigned local_plot_id) const {return (local_plot_id + plot_id_offset);}
+		unsigned get_num_plots() const {return plots.size();}
 		cube_t      const &get_plot_from_global_id(unsigned global_plot_id) const {return plots         [decode_plot_id(global_plot_id)];}
 		vect_cube_t const &get_colliders_for_plot (unsigned global_plot_id) const {return plot_colliders[decode_plot_id(global_plot_id)];}
 
@@ -2278,28 +2343,31 @@ class city_road_gen_t : public road_gen_base_t {
 
 					// TODO: use dest_seg.car_count to estimate traffic and route around
 					if (car.dest_valid && car.cur_city != CONN_CITY_IX) { // Note: don't need to update dest logic on connector roads since there are no choices to make
-						point const dest_pos(car_rn.get_car_dest_isec_center(car, road_networks, global_rn));
-						vector3d const dest_dir(dest_pos - car.get_center());
-						bool const pri_dim(fabs(dest_dir.x) < fabs(dest_dir.y)), pri_dir(dest_dir[pri_dim] > 0), sec_dir(dest_dir[!pri_dim] > 0);
-						unsigned best_score(0);
-
-						for (unsigned tdir = 0; tdir < 3; ++tdir) { // choose best scoring of all valid turn dirs from {none/straight, left, right}
-							unsigned const orient(orients[tdir]);
-							if (!isec.is_orient_currently_valid(orient, tdir)) continue; // can't turn in this dir
-
-							if (isec.conn_to_city >= 0 && isec.conn_ix[orient] < 0) { // city connector isec
-								if (isec.conn_to_city != car.dest_city) continue; // leads to incorrect city, skip
-								car.turn_dir = tdir; // this is our destination - done
-								best_score = 1; // set to avoid assertion failure below
-								break;
-							}
-							bool const dim2((orient >> 1) != 0), dir2(orient & 1);
-							unsigned score(1); // start at lowest valid score
-							if      (dim2 == pri_dim && dir2 == pri_dir) {score = 3;} // best score
-							else if (dim2 != pri_dim && dir2 == sec_dir) {score = 2;} // second best score
-							if (score > best_score) {best_score = score; car.turn_dir = tdir;}
-						} // for d
-						assert(best_score > 0); // no dead end roads
+						if (car_rn.choose_routed_turn_dir(car, isec, orients, road_networks, global_rn)) {} // shortest path from the route table
+						else { // no route table or no valid route; choose the turn dir that heads most directly toward the destination
+							point const dest_pos(car_rn.get_car_dest_isec_center(car, road_networks, global_rn));
+							vector3d const dest_dir(dest_pos - car.get_center());
+							bool const pri_dim(fabs(dest_dir.x) < fabs(dest_dir.y)), pri_dir(dest_dir[pri_dim] > 0), sec_dir(dest_dir[!pri_dim] > 0);
+							unsigned best_score(0);
+
+							for (unsigned tdir = 0; tdir < 3; ++tdir) { // choose best scoring of all valid turn dirs from {none/straight, left, right}
+								unsigned const orient(orients[tdir]);
+								if (!isec.is_orient_currently_valid(orient, tdir)) continue; // can't turn in this dir
+
+								if (isec.conn_to_city >= 0 && isec.conn_ix[orient] < 0) { // city connector isec
+									if (isec.conn_to_city != car.dest_city) continue; // leads to incorrect city, skip
+									car.turn_dir = tdir; // this is our destination - done
+									best_score = 1; // set to avoid assertion failure below
+									break;
+								}
+								bool const dim2((orient >> 1) != 0), dir2(orient & 1);
+								unsigned score(1); // start at lowest valid score
+								if      (dim2 == pri_dim && dir2 == pri_dir) {score = 3;} // best score
+								else if (dim2 != pri_dim && dir2 == sec_dir) {score = 2;} // second best score
+								if (score > best_score) {best_score = score; car.turn_dir = tdir;}
+							} // for d
+							assert(best_score > 0); // no dead end roads
+						}
 					}
 					else { // use random turn direction
 						while (1) {
@@ -2339,9 +2407,41 @@ class city_road_gen_t : public road_gen_base_t {
 			if (it != cix_to_isec.end()) {return it->second;} // found
 			return nullptr; // not found, caller can error check
 		}
+		bool choose_routed_turn_dir(car_t &car, road_isec_t const &isec, unsigned const orients[3], vector<road_network_t> const &road_networks, road_network_t const &global_rn) const {
+			if (route_dists.empty()) return 0; // no route table, caller must choose
+			unsigned const num_isecs(get_num_isecs()), cur_ix(get_isec_flat_ix(car.get_isec_type(), car.cur_seg));
+			unsigned dest_ix(car.dest_isec);
+
+			if (car.dest_city != city_id) { // destination in another city; route to the intersection with the connector road to that city
+				assert(car.dest_city < road_networks.size());
+				road_isec_t const *const conn_isec(find_isec_to_dest_city(car, road_networks[car.dest_city], global_rn));
+				assert(conn_isec != nullptr); // path must exist, otherwise this city wouldn't have been chosen
+				dest_ix = get_isec_flat_ix(*conn_isec);
+			}
+			assert(cur_ix < num_isecs && dest_ix < num_isecs);
+			float const *const dists(route_dists.data() + dest_ix*num_isecs);
+			float best_dist(FLT_MAX);
+			bool found(0);
+
+			for (unsigned tdir = 0; tdir < 3; ++tdir) { // choose the valid turn dir with the shortest remaining distance
+				unsigned const orient(orients[tdir]);
+				if (!isec.is_orient_currently_valid(orient, tdir)) continue; // can't turn in this dir
+
+				if (isec.conn_to_city >= 0 && isec.conn_ix[orient] < 0) { // city connector isec
+					if (isec.conn_to_city != car.dest_city) continue; // leads to incorrect city, skip
+					car.turn_dir = tdir; // this is our destination - done
+					return 1;
+				}
+				route_edge_t const &edge(route_edges[4*cur_ix + orient]);
+				if (edge.dest_ix < 0) continue; // doesn't lead to another intersection in this city
+				float const dist(edge.len + dists[edge.dest_ix]);
+				if (dist < best_dist) {best_dist = dist; car.turn_dir = tdir; found = 1;} // Note: unreachable isecs have dist >= FLT_MAX
+			} // for tdir
+			return found;
+		}
 	public:
 		bool choose_new_car_dest(car_t &car, rand_gen_t &rgen) const {
-			unsigned const num_tot(isecs[0].size() + isecs[1].size() + isecs[2].size());
+			unsigned const num_tot(get_num_isecs());
 			if (num_tot == 0) return 0; // no isecs to select
 			car.dest_isec = (unsigned short)(rgen.rand() % num_tot);
 			return 1;
@@ -2349,6 +2449,19 @@ class city_road_gen_t : public road_gen_base_t {
 		bool car_at_dest(car_t const &car) const {
 			return get_isec_by_ix(car.dest_isec).contains_pt_xy(car.get_center());
 		}
+		unsigned get_num_isecs() const {return (isecs[0].size() + isecs[1].size() + isecs[2].size());}
+		unsigned get_isec_flat_ix(unsigned type, unsigned ix) const { // type is {2-way, 3-way, 4-way}; inverse of get_isec_by_ix()
+			assert(type < 3 && ix < isecs[type].size());
+			for (unsigned n = 0; n < type; ++n) {ix += isecs[n].size();}
+			return ix;
+		}
+		unsigned get_isec_flat_ix(road_isec_t const &isec) const {
+			for (unsigned n = 0; n < 3; ++n) {
+				if (!isecs[n].empty() && &isec >= isecs[n].data() && &isec < isecs[n].data() + isecs[n].size()) {return get_isec_flat_ix(n, (&isec - isecs[n].data()));}
+			}
+			assert(0); // isec not in this city
+			return 0; // never gets here
+		}
 		road_isec_t const &get_isec_by_ix(unsigned ix) const {
 			for (unsigned n = 0; n < 3; ++n) {
 				unsigned const sz(isecs[n].size());
@@ -2681,6 +2794,11 @@ public:
 		unsigned global_plot_id(0);
 		global_rn.calc_ix_values(road_networks, global_rn, global_plot_id);
 		for (auto i = road_networks.begin(); i != road_networks.end(); ++i) {i->calc_ix_values(road_networks, global_rn, global_plot_id);}
+		build_route_tables();
+	}
+	void build_route_tables() {
+		timer_t timer("Build Car Route Tables");
+		for (auto i = road_networks.begin(); i != road_networks.end(); ++i) {i->build_route_tables();} // each city is built in parallel
 	}
 	void gen_parking_lots_and_place_objects(vector<car_t> &cars, bool have_cars) {
 		for (auto i = road_networks.begin(); i != road_networks.end(); ++i) {i->gen_parking_lots_and_place_objects(cars, have_cars);}
@@ -2766,6 +2884,17 @@ public:
 		return road_network_t::gen_ped_pos(ped, rgen, road_networks);
 	}
 	cube_t const &get_plot_from_global_id(unsigned city_id, unsigned global_plot_id) const {return get_city(city_id).get_plot_from_global_id(global_plot_id);}
+
+	void get_plot_to_city_map(vector<unsigned> &plot_to_city) const { // indexed by global plot ID; unused IDs map to NO_CITY_IX
+		plot_to_city.clear();
+
+		for (unsigned city = 0; city < road_networks.size(); ++city) {
+			road_network_t const &rn(road_networks[city]);
+			unsigned const start(rn.encode_plot_id(0)), end(start + rn.get_num_plots());
+			if (end > plot_to_city.size()) {plot_to_city.resize(end, NO_CITY_IX);}
+			for (unsigned p = start; p < end; ++p) {plot_to_city[p] = city;}
+		}
+	}
 	unsigned get_next_plot(unsigned city_id, unsigned plot, unsigned dest_plot, int exclude_plot) const {return get_city(city_id).get_next_plot(plot, dest_plot, exclude_plot);}
 	bool choose_dest_building(unsigned city_id, unsigned &plot, unsigned &building, rand_gen_t &rgen) const {return get_city(city_id).choose_dest_building(plot, building, rgen);}
 	
@@ -2870,6 +2999,7 @@ void filter_dlights_to(vector<light_source> &lights, unsigned max_num, point con
 
 // Note: these ped_manager_t functions are defined here because they use road_gen
 cube_t const &ped_manager_t::get_city_plot_bcube_for_peds(unsigned city_ix, unsigned plot_ix) const {return road_gen.get_plot_from_global_id(city_ix, plot_ix);}
+void ped_manager_t::get_plot_to_city_map(vector<unsigned> &plot_to_city) const {road_gen.get_plot_to_city_map(plot_to_city);}
 road_isec_t const &ped_manager_t::get_car_isec(car_base_t const &car) const {return road_gen.get_car_isec(car);}
 
 cube_t ped_manager_t::get_expanded_city_bcube_for_peds(unsigned city_ix) const {
@@ -5,13 +5,24 @@
 #include "3DWorld.h"
 #include "cobj_bsp_tree.h"
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define USE_SSE_RAY_PACKETS
+#endif
+
 
 unsigned const MAX_LEAF_SIZE = 2;
+unsigned const RAY_PACKET_SIZE = 16; // must be a multiple of 4
+float const PACKET_MIN_DIR_DP  = 0.9; // rays with directions that differ by more than ~25 degrees are traced individually
 float const POLY_TOLER       = 1.0E-6;
 float const OVERLAP_AMT      = 0.02;
+unsigned const SAH_NUM_BINS      = 16;
+unsigned const SAH_MAX_LEAF_SIZE = 8;    // nodes with more cobjs than this are always split if possible
+unsigned const SAH_MIN_OBJS      = 1000; // smaller trees use the faster median split builder
+float const SAH_TRAV_COST        = 0.5;  // cost of a node bcube test relative to a cobj intersection test
 
 
-extern bool mt_cobj_tree_build, begin_motion;
+extern bool mt_cobj_tree_build, begin_motion, cobj_tree_sah, cobj_tree_perf_test;
 extern int display_mode, frame_counter, cobj_counter;
 extern coll_obj_group coll_objects;
 extern vector<unsigned> falling_cobjs;
@@ -419,6 +430,7 @@ void cobj_bvh_tree::add_cobjs(bool verbose) {
 void cobj_bvh_tree::build_tree_from_cixs(bool do_mt_build) {
 
 	max_depth = max_leaf_count = num_leaf_nodes = 0;
+	sah_build = (cobj_tree_sah && is_static && cixs.size() >= SAH_MIN_OBJS); // static trees only, since dynamic trees are rebuilt every frame
 	nodes.resize(get_conservative_num_nodes(cixs.size()) + 64*do_mt_build); // add 8 extra nodes for each of 8 top level splits
 	unsigned const root(0);
 	nodes[root] = tree_node(0, (unsigned)cixs.size());
@@ -428,7 +440,7 @@ void cobj_bvh_tree::build_tree_from_cixs(bool do_mt_build) {
 	}
 	else {
 		per_thread_data ptd(1, nodes.size(), 1);
-		build_tree(root, 0, 0, ptd);
+		if (sah_build) {build_tree_sah(root, 0, ptd);} else {build_tree(root, 0, 0, ptd);}
 		nodes.resize(ptd.get_next_node_ix());
 	}
 	nodes[root].next_node_id = (unsigned)nodes.size();
@@ -477,6 +489,161 @@ bool cobj_bvh_tree::check_coll_line(point const &p1, point const &p2, point &cpo
 }
 
 
+// a packet of up to RAY_PACKET_SIZE rays in SoA layout for testing against node bcubes 4 rays at a time;
+// t values are in the parametric space of each (p1, p2) ray, and tmax is reduced as closer hits are found
+struct ray_packet_t {
+	unsigned num;
+#ifdef USE_SSE_RAY_PACKETS
+	alignas(16)
+#endif
+	float ox[RAY_PACKET_SIZE], oy[RAY_PACKET_SIZE], oz[RAY_PACKET_SIZE], dix[RAY_PACKET_SIZE], diy[RAY_PACKET_SIZE], diz[RAY_PACKET_SIZE], tmax[RAY_PACKET_SIZE];
+
+	ray_packet_t(unsigned num_, point const *const p1s, point const *const p2s) : num(num_) {
+		assert(num > 0 && num <= RAY_PACKET_SIZE);
+
+		for (unsigned r = 0; r < RAY_PACKET_SIZE; ++r) {
+			if (r >= num) { // unused lanes never hit anything
+				ox[r] = oy[r] = oz[r] = dix[r] = diy[r] = diz[r] = 0.0;
+				tmax[r] = -1.0;
+				continue;
+			}
+			vector3d dinv(p2s[r] - p1s[r]);
+			dinv.invert();
+			ox [r] = p1s[r].x; oy [r] = p1s[r].y; oz [r] = p1s[r].z;
+			dix[r] = dinv.x;   diy[r] = dinv.y;   diz[r] = dinv.z;
+			tmax[r] = 1.0;
+		}
+	}
+	unsigned get_node_hit_mask(cube_t const &c) const { // returns a bit mask of the rays that intersect c
+		unsigned mask(0);
+#ifdef USE_SSE_RAY_PACKETS
+		__m128 const zero(_mm_setzero_ps());
+		__m128 const lo[3] = {_mm_set1_ps(c.d[0][0]), _mm_set1_ps(c.d[1][0]), _mm_set1_ps(c.d[2][0])};
+		__m128 const hi[3] = {_mm_set1_ps(c.d[0][1]), _mm_set1_ps(c.d[1][1]), _mm_set1_ps(c.d[2][1])};
+
+		for (unsigned g = 0; g < num; g += 4) {
+			__m128 tmin_v(zero), tmax_v(_mm_load_ps(tmax + g));
+			float const *const o[3] = {ox+g, oy+g, oz+g}, *const di[3] = {dix+g, diy+g, diz+g};
+
+			for (unsigned d = 0; d < 3; ++d) {
+				__m128 const o_v(_mm_load_ps(o[d])), di_v(_mm_load_ps(di[d]));
+				__m128 const t1(_mm_mul_ps(_mm_sub_ps(lo[d], o_v), di_v)), t2(_mm_mul_ps(_mm_sub_ps(hi[d], o_v), di_v));
+				tmin_v = _mm_max_ps(tmin_v, _mm_min_ps(t1, t2));
+				tmax_v = _mm_min_ps(tmax_v, _mm_max_ps(t1, t2));
+			}
+			mask |= (unsigned(_mm_movemask_ps(_mm_cmplt_ps(tmin_v, tmax_v))) << g);
+		}
+#else
+		for (unsigned r = 0; r < num; ++r) {
+			float tmin_r(0.0), tmax_r(tmax[r]);
+			float const o[3] = {ox[r], oy[r], oz[r]}, di[3] = {dix[r], diy[r], diz[r]};
+
+			for (unsigned d = 0; d < 3; ++d) {
+				float const t1((c.d[d][0] - o[d])*di[d]), t2((c.d[d][1] - o[d])*di[d]);
+				tmin_r = max(tmin_r, min(t1, t2));
+				tmax_r = min(tmax_r, max(t1, t2));
+			}
+			if (tmin_r < tmax_r) {mask |= (1U << r);}
+		}
+#endif
+		return mask;
+	}
+};
+
+inline unsigned count_bits(unsigned v) {
+	unsigned n(0);
+	for (; v; v &= (v - 1)) {++n;}
+	return n;
+}
+
+bool is_coherent_ray_packet(unsigned num_rays, point const *const p1s, point const *const p2s) {
+
+	vector3d avg_dir(zero_vector);
+	for (unsigned r = 0; r < num_rays; ++r) {avg_dir += (p2s[r] - p1s[r]).get_norm();}
+	if (avg_dir == zero_vector) return 0;
+	avg_dir.normalize();
+
+	for (unsigned r = 0; r < num_rays; ++r) {
+		if (dot_product((p2s[r] - p1s[r]).get_norm(), avg_dir) < PACKET_MIN_DIR_DP) return 0;
+	}
+	return 1;
+}
+
+// traces a batch of rays together, sharing node fetches and using SIMD bcube tests; equivalent to calling check_coll_line() with exact=1 for each ray;
+// cindexes[i] is set to -1 for rays that don't hit anything; falls back to single rays if the rays aren't coherent, or stop being coherent during traversal
+void cobj_bvh_tree::check_coll_line_packet(unsigned num_rays, point const *const p1s, point const *const p2s, point *cposs, vector3d *cnorms, int *cindexes,
+	int ignore_cobj, int test_alpha, bool skip_non_drawn, bool skip_init_colls, bool skip_movable) const
+{
+	for (unsigned r = 0; r < num_rays; ++r) {cindexes[r] = -1;}
+	if (nodes.empty()) return;
+
+	for (unsigned start = 0; start < num_rays; start += RAY_PACKET_SIZE) {
+		unsigned const num(min(RAY_PACKET_SIZE, (num_rays - start)));
+		point const *const p1(p1s + start), *const p2(p2s + start);
+		point *const cpos(cposs + start);
+		vector3d *const cnorm(cnorms + start);
+		int *const cindex(cindexes + start);
+		bool diverged(num == 1 || !is_coherent_ray_packet(num, p1, p2));
+
+		if (!diverged) {
+			ray_packet_t rp(num, p1, p2);
+			float max_alpha[RAY_PACKET_SIZE] = {0};
+			unsigned const num_nodes((unsigned)nodes.size());
+			unsigned num_visited(0), num_ray_hits(0);
+
+			for (unsigned nix = 0; nix < num_nodes;) {
+				tree_node const &n(nodes[nix]);
+				unsigned const hit_mask(rp.get_node_hit_mask(n));
+
+				if (hit_mask == 0) {
+					assert(n.next_node_id > nix);
+					nix = n.next_node_id; // failed the bbox test for all rays
+					continue;
+				}
+				++nix;
+				num_ray_hits += count_bits(hit_mask);
+
+				// if fewer than 1/4 of the rays are active on average, the rays have diverged, and it's faster to finish them individually
+				if (++num_visited == 64 && test_alpha != 2 && 4*num_ray_hits < num_visited*num) {diverged = 1; break;}
+
+				for (unsigned i = n.start; i < n.end; ++i) { // check leaves
+					if ((int)cixs[i] == ignore_cobj) continue;
+					coll_obj const &c(get_cobj(i));
+					if (!obj_ok(c))                                         continue;
+					if (skip_non_drawn  && !c.cp.might_be_drawn())          continue;
+					if (skip_movable    && c.is_movable())                  continue;
+					if (test_alpha == 1 && c.is_semi_trans())               continue;
+					if (test_alpha == 3 && c.cp.color.alpha < MIN_SHADOW_ALPHA) continue;
+
+					for (unsigned r = 0; r < num; ++r) {
+						if (!(hit_mask & (1U << r))) continue; // this ray doesn't intersect the node
+						if (test_alpha == 2 && c.cp.color.alpha <= max_alpha[r]) continue;
+						if (skip_init_colls && c.contains_pt(p1[r]) && c.contains_point(p1[r])) continue;
+						float t(0.0);
+						if (!c.line_int_exact(p1[r], p2[r], t, cnorm[r], 0.0, rp.tmax[r])) continue;
+						cindex[r]    = cixs[i];
+						cpos  [r]    = p1[r] + (p2[r] - p1[r])*t;
+						max_alpha[r] = c.cp.color.alpha;
+						rp.tmax  [r] = t;
+					}
+				}
+			} // for nix
+		}
+		if (!diverged) continue;
+
+		for (unsigned r = 0; r < num; ++r) { // finish with single rays, clipped to any hits found so far
+			point cpos_r;
+			vector3d cnorm_r;
+			int cindex_r(-1);
+			
+			if (check_coll_line(p1[r], ((cindex[r] >= 0) ? cpos[r] : p2[r]), cpos_r, cnorm_r, cindex_r, ignore_cobj, 1, test_alpha, skip_non_drawn, skip_init_colls, skip_movable)) {
+				cpos[r] = cpos_r; cnorm[r] = cnorm_r; cindex[r] = cindex_r;
+			}
+		}
+	} // for start
+}
+
+
 bool cobj_bvh_tree::check_point_contained(point const &p, int &cindex) const {
 
 	unsigned const num_nodes((unsigned)nodes.size());
@@ -662,7 +829,8 @@ void cobj_bvh_tree::build_tree_top_level_omp() { // single octtree level
 		unsigned const kid(cur_nixs[bix]), alloc_sz(get_conservative_num_nodes(count)), end_nix(cur_nixs[bix] + alloc_sz);
 		nodes[kid] = tree_node(curs[bix], curs[bix]+count);
 		per_thread_data ptd(cur_nixs[bix]+1, end_nix, 0);
-		build_tree(kid, ((count == num) ? 7 : 0), 1, ptd); // if all in one bin, make that bin a leaf
+		if (sah_build) {build_tree_sah(kid, 1, ptd);} // SAH will make a leaf if the cobjs can't be split
+		else {build_tree(kid, ((count == num) ? 7 : 0), 1, ptd);} // if all in one bin, make that bin a leaf
 		unsigned const next_kid(ptd.get_next_node_ix());
 		assert(next_kid <= end_nix);
 		if (next_kid < end_nix) {nodes[next_kid].next_node_id = end_nix;} // close the gap of unused nodes
@@ -730,16 +898,7 @@ void cobj_bvh_tree::build_tree(unsigned nix, unsigned skip_dims, unsigned depth,
 	for (unsigned bix = 0; bix < 3; ++bix) {
 		unsigned const count(bin_count[bix]);
 		if (count == 0) continue; // empty bin
-		unsigned const kid(ptd.get_next_node_ix());
-		ptd.increment_node_ix();
-
-		if (ptd.at_node_end()) {
-			assert(ptd.can_be_resized);
-			unsigned const old_nodes_size(nodes.size());
-			nodes.resize(5*old_nodes_size/4); // increase by 25% (will invalidate n reference)
-			cout << "Warning: Resizing cobj_bvh_tree nodes from " << old_nodes_size << " to " << nodes.size() << endl;
-			ptd.advance_end_range(nodes.size());
-		}
+		unsigned const kid(alloc_kid_node(ptd)); // will invalidate n reference
 		nodes[kid] = tree_node(cur, cur+count);
 		build_tree(kid, skip_dims, depth+1, ptd);
 		nodes[kid].next_node_id = ptd.get_next_node_ix();
@@ -750,6 +909,105 @@ void cobj_bvh_tree::build_tree(unsigned nix, unsigned skip_dims, unsigned depth,
 }
 
 
+unsigned cobj_bvh_tree::alloc_kid_node(per_thread_data &ptd) {
+
+	unsigned const kid(ptd.get_next_node_ix());
+	ptd.increment_node_ix();
+
+	if (ptd.at_node_end()) {
+		assert(ptd.can_be_resized);
+		unsigned const old_nodes_size(nodes.size());
+		nodes.resize(5*old_nodes_size/4); // increase by 25%
+		cout << "Warning: Resizing cobj_bvh_tree nodes from " << old_nodes_size << " to " << nodes.size() << endl;
+		ptd.advance_end_range(nodes.size());
+	}
+	return kid;
+}
+
+
+// binned Surface Area Heuristic BVH: each node is split in two at the bin boundary of cobj centers with the lowest estimated ray query cost;
+// slower to build than build_tree(), but creates tighter nodes with less overlap for large static scenes
+void cobj_bvh_tree::build_tree_sah(unsigned nix, unsigned depth, per_thread_data &ptd) {
+
+	assert(nix < nodes.size());
+	tree_node &n(nodes[nix]);
+	calc_node_bbox(n);
+	unsigned const start(n.start), end(n.end), num(end - start);
+	max_depth = max(max_depth, depth);
+
+	if (num <= MAX_LEAF_SIZE) { // base case
+		register_leaf(num);
+		return;
+	}
+	cube_t center_bounds(get_cobj(start).get_cube_center());
+	for (unsigned i = start+1; i < end; ++i) {center_bounds.union_with_pt(get_cobj(i).get_cube_center());}
+	struct sah_bin_t {cube_t bcube; unsigned count;} bins[SAH_NUM_BINS];
+	float right_area[SAH_NUM_BINS] = {0};
+	unsigned right_count[SAH_NUM_BINS] = {0}, best_dim(0), best_bin(0);
+	float best_cost(0.0);
+
+	for (unsigned dim = 0; dim < 3; ++dim) {
+		float const lo(center_bounds.d[dim][0]), extent(center_bounds.d[dim][1] - lo);
+		if (extent <= 0.0) continue; // all centers are the same in this dim
+		float const scale(SAH_NUM_BINS/extent);
+		for (unsigned b = 0; b < SAH_NUM_BINS; ++b) {bins[b].count = 0;}
+
+		for (unsigned i = start; i < end; ++i) {
+			coll_obj const &cobj(get_cobj(i));
+			sah_bin_t &bin(bins[min(SAH_NUM_BINS-1, unsigned((cobj.get_cube_center()[dim] - lo)*scale))]);
+			if (bin.count == 0) {bin.bcube.copy_from(cobj);} else {bin.bcube.union_with_cube(cobj);}
+			++bin.count;
+		}
+		cube_t acc;
+		unsigned count(0);
+
+		for (unsigned b = SAH_NUM_BINS-1; b > 0; --b) { // sweep from the right
+			if (bins[b].count > 0) {
+				if (count == 0) {acc = bins[b].bcube;} else {acc.union_with_cube(bins[b].bcube);}
+				count += bins[b].count;
+			}
+			right_area [b] = ((count > 0) ? acc.get_area() : 0.0);
+			right_count[b] = count;
+		}
+		count = 0;
+
+		for (unsigned b = 0; b+1 < SAH_NUM_BINS; ++b) { // sweep from the left, splitting between bin b and b+1
+			if (bins[b].count > 0) {
+				if (count == 0) {acc = bins[b].bcube;} else {acc.union_with_cube(bins[b].bcube);}
+				count += bins[b].count;
+			}
+			if (count == 0 || right_count[b+1] == 0) continue; // empty side
+			float const cost(count*acc.get_area() + right_count[b+1]*right_area[b+1]);
+			if (best_bin > 0 && cost >= best_cost) continue;
+			best_cost = cost;
+			best_dim  = dim;
+			best_bin  = b+1;
+		}
+	} // for dim
+	float const node_area(n.get_area());
+
+	if (best_bin == 0 || (num <= SAH_MAX_LEAF_SIZE && node_area > 0.0 && num <= SAH_TRAV_COST + best_cost/node_area)) { // can't split, or leaf is cheaper
+		register_leaf(num);
+		return;
+	}
+	float const lo(center_bounds.d[best_dim][0]), scale(SAH_NUM_BINS/(center_bounds.d[best_dim][1] - lo));
+	coll_obj_group const &cobjs_ref(*cobjs);
+	unsigned const *const mid(std::partition(&cixs[start], (&cixs[start] + num), [&](unsigned cix) {
+		return (min(SAH_NUM_BINS-1, unsigned((cobjs_ref[cix].get_cube_center()[best_dim] - lo)*scale)) < best_bin);}));
+	unsigned const split_pos(mid - &cixs.front());
+	assert(split_pos > start && split_pos < end);
+	unsigned const ranges[2][2] = {{start, split_pos}, {split_pos, end}};
+
+	for (unsigned k = 0; k < 2; ++k) { // create child nodes and call recursively
+		unsigned const kid(alloc_kid_node(ptd)); // will invalidate n reference
+		nodes[kid] = tree_node(ranges[k][0], ranges[k][1]);
+		build_tree_sah(kid, depth+1, ptd);
+		nodes[kid].next_node_id = ptd.get_next_node_ix();
+	}
+	nodes[nix].start = nodes[nix].end = 0; // branch node has no leaves
+}
+
+
 // is_static is_dynamic occluders_only cubes_only inc_voxel_cobjs
 cobj_bvh_tree cobj_tree_static (&coll_objects, 1, 0, 0, 0, 0); // does not include voxels
 cobj_bvh_tree cobj_tree_dynamic(&coll_objects, 0, 1, 0, 0, 0);
@@ -779,10 +1037,49 @@ void build_static_moving_cobj_tree() {
 	}
 }
 
+// builds the static cobj tree with the median split and SAH builders and compares build time and line query throughput
+void run_cobj_tree_perf_test() {
+
+	cobj_bvh_tree &tree(get_tree(0));
+	cube_t bcube;
+	if (!tree.get_root_bcube(bcube)) return; // empty tree
+	unsigned const NUM_TEST_RAYS = 1000000;
+	vector<point> p1s(NUM_TEST_RAYS), p2s(NUM_TEST_RAYS);
+	rand_gen_t rgen;
+
+	for (unsigned i = 0; i < NUM_TEST_RAYS; ++i) { // random lines through the scene
+		p1s[i] = rgen.gen_rand_cube_point(bcube);
+		p2s[i] = rgen.gen_rand_cube_point(bcube);
+	}
+	bool const prev_sah(cobj_tree_sah);
+	cout << "Cobj tree builder comparison for " << tree.get_num_objs() << " cobjs" << endl << "builder\tbuild(ms)\tnodes\trays/sec\thits" << endl;
+
+	for (unsigned sah = 0; sah < 2; ++sah) {
+		cobj_tree_sah = (sah != 0);
+		int const build_start(GET_TIME_MS());
+		tree.add_cobjs(0);
+		int const build_time(GET_TIME_MS() - build_start), query_start(GET_TIME_MS());
+		unsigned num_hits(0);
+
+#pragma omp parallel for schedule(static,1024) reduction(+:num_hits)
+		for (int i = 0; i < (int)NUM_TEST_RAYS; ++i) {
+			point cpos;
+			vector3d cnorm;
+			int cindex(-1);
+			if (tree.check_coll_line(p1s[i], p2s[i], cpos, cnorm, cindex, -1, 1, 0, 0, 0, 0)) {++num_hits;}
+		}
+		float const query_time(max(1, (GET_TIME_MS() - query_start)));
+		cout << (sah ? "SAH" : "median") << "\t" << build_time << "\t" << tree.get_num_nodes() << "\t" << unsigned(1000.0*NUM_TEST_RAYS/query_time) << "\t" << num_hits << endl;
+	}
+	cobj_tree_sah = prev_sah;
+	tree.add_cobjs(0); // rebuild with the selected builder
+}
+
 void build_cobj_tree(bool dynamic, bool verbose) {
 	
 	if (!dynamic) { // static
 		get_tree(0).add_cobjs(verbose);
+		if (cobj_tree_perf_test) {run_cobj_tree_perf_test();}
 		cobj_tree_occlude.add_cobjs(verbose);
 		//cout << "occluders: " << cobj_tree_occlude.get_num_objs() << endl;
 		//cobj_tree_triangles.add_cobjs(coll_objects, verbose);
@@ -805,6 +1102,24 @@ bool check_coll_line_exact_tree(point const &p1, point const &p2, point &cpos, v
 	return ret;
 }
 
+// packet version of check_coll_line_exact_tree() for static cobjs; used with batches of coherent rays in ray trace lighting and snow
+void check_coll_line_exact_tree_packet(unsigned num_rays, point const *const p1s, point const *const p2s, point *cposs, vector3d *cnorms, int *cindexes,
+	int ignore_cobj, int test_alpha, bool include_voxels, bool skip_init_colls, bool no_stat_moving)
+{
+	if (world_mode != WMODE_GROUND) {
+		for (unsigned r = 0; r < num_rays; ++r) {cindexes[r] = -1;}
+		return;
+	}
+	get_tree(0).check_coll_line_packet(num_rays, p1s, p2s, cposs, cnorms, cindexes, ignore_cobj, test_alpha, 0, skip_init_colls, 0);
+	if (no_stat_moving && !include_voxels) return;
+
+	for (unsigned r = 0; r < num_rays; ++r) { // static moving cobjs and voxels aren't in the static tree, so test them per ray
+		bool ret(cindexes[r] >= 0);
+		if (!no_stat_moving) {ret |= cobj_tree_static_moving.check_coll_line(p1s[r], (ret ? cposs[r] : p2s[r]), cposs[r], cnorms[r], cindexes[r], ignore_cobj, 1, test_alpha, 0, skip_init_colls, 0);}
+		if (include_voxels ) {check_voxel_coll_line(p1s[r], (ret ? cposs[r] : p2s[r]), cposs[r], cnorms[r], cindexes[r], ignore_cobj, 1);}
+	}
+}
+
 // can use with snow shadows, grass shadows, tree leaf shadows
 bool check_coll_line_tree(point const &p1, point const &p2, int &cindex, int ignore_cobj, bool dynamic,
 	int test_alpha, bool skip_non_drawn, bool include_voxels, bool skip_init_colls, bool skip_movable)
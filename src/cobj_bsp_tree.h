@@ -108,7 +108,7 @@ class cobj_bvh_tree : public cobj_tree_base {
 
 	coll_obj_group const *cobjs;
 	vector<unsigned> cixs;
-	bool is_static, is_dynamic, occluders_only, cubes_only, inc_voxel_cobjs;
+	bool is_static, is_dynamic, occluders_only, cubes_only, inc_voxel_cobjs, sah_build;
 
 	struct per_thread_data {
 		vector<unsigned> temp_bins[3];
@@ -126,8 +126,11 @@ class cobj_bvh_tree : public cobj_tree_base {
 	coll_obj const &get_cobj(unsigned ix) const {return (*cobjs)[cixs[ix]];}
 	bool create_cixs();
 	void calc_node_bbox(tree_node &n) const;
+	unsigned get_conservative_num_nodes(unsigned num) const {return (sah_build ? (2*num + 8) : cobj_tree_base::get_conservative_num_nodes(num));} // SAH can create 1 cobj leaves
+	unsigned alloc_kid_node(per_thread_data &ptd);
 	void build_tree_top_level_omp();
 	void build_tree(unsigned nix, unsigned skip_dims, unsigned depth, per_thread_data &ptd);
+	void build_tree_sah(unsigned nix, unsigned depth, per_thread_data &ptd);
 
 	bool obj_ok(coll_obj const &c) const {
 		return (((is_static && c.status == COLL_STATIC) || (is_dynamic && c.status == COLL_DYNAMIC) || (!is_static && !is_dynamic)) &&
@@ -137,15 +140,18 @@ class cobj_bvh_tree : public cobj_tree_base {
 
 public:
 	cobj_bvh_tree(coll_obj_group const *cobjs_, bool s, bool d, bool o, bool c, bool v)
-		: cobjs(cobjs_), is_static(s), is_dynamic(d), occluders_only(o), cubes_only(c), inc_voxel_cobjs(v) {assert(cobjs);}
+		: cobjs(cobjs_), is_static(s), is_dynamic(d), occluders_only(o), cubes_only(c), inc_voxel_cobjs(v), sah_build(0) {assert(cobjs);}
 
 	unsigned get_num_objs() const {return cixs.size();}
+	unsigned get_num_nodes() const {return nodes.size();}
 	void clear();
 	void add_cobj_ids(vector<unsigned> const &cids) {assert(cixs.empty() && !cids.empty()); cixs = cids;}
 	void add_cobjs(bool verbose);
 	void build_tree_from_cixs(bool do_mt_build);
 	bool check_coll_line(point const &p1, point const &p2, point &cpos, vector3d &cnorm, int &cindex, int ignore_cobj,
 		bool exact, int test_alpha, bool skip_non_drawn, bool skip_init_colls, bool skip_movable) const;
+	void check_coll_line_packet(unsigned num_rays, point const *const p1s, point const *const p2s, point *cposs, vector3d *cnorms, int *cindexes,
+		int ignore_cobj, int test_alpha, bool skip_non_drawn, bool skip_init_colls, bool skip_movable) const;
 	bool check_point_contained(point const &p, int &cindex) const;
 	void get_intersecting_cobjs(cube_t const &cube, vector<unsigned> &cobjs, int ignore_cobj, float toler, bool check_ccounter, int id_for_cobj_int) const;
 	bool is_cobj_contained(point const &viewer, point const *const pts, unsigned npts, int ignore_cobj, int &cobj) const;
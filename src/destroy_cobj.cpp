@@ -278,6 +278,19 @@ unsigned subtract_cube(vector<color_tid_vol> &cts, vector3d &cdir, csg_cube cons
 	set<unsigned> unique_cobjs, cgroups_added;
 	copy(int_cobjs.begin(), int_cobjs.end(), inserter(unique_cobjs, unique_cobjs.begin())); // unique the cobjs
 	set<unsigned> seen_cobjs(unique_cobjs);
+	cube_t edit_bcube(cube); // conservative bounds of the cobjs that may be modified, for incremental lighting updates
+	bool any_destroyable(0);
+
+	for (auto k = unique_cobjs.begin(); k != unique_cobjs.end(); ++k) {
+		coll_obj const &cobj(cobjs.get_cobj(*k));
+		if (cobj.cp.cobj_type != COBJ_TYPE_STD || cobj.destroy <= max(destroy_thresh, (min_destroy-1))) continue; // can't be modified (see below)
+		edit_bcube.union_with_cube(cobj);
+		any_destroyable = 1;
+		if (cobj.cgroup_id < 0) continue;
+		cobj_id_set_t const &group(cobj_groups.get_set(cobj.cgroup_id)); // the whole group may be destroyed
+		for (auto c = group.begin(); c != group.end(); ++c) {edit_bcube.union_with_cube(cobjs.get_cobj(*c));}
+	}
+	if (any_destroyable) {begin_incremental_lighting_edit(edit_bcube);} // must be before any cobjs are modified
 
 	while (!unique_cobjs.empty()) {
 		set<unsigned> next_cobjs;
@@ -386,6 +399,8 @@ unsigned subtract_cube(vector<color_tid_vol> &cts, vector3d &cdir, csg_cube cons
 				coll_obj &cobj(coll_objects.get_cobj(*i));
 				if (cobj.is_movable()) {register_moving_cobj(*i); continue;} // move/fall instead of destroy
 				if (cobj.destroy <= max(destroy_thresh, (min_destroy-1))) continue; // can't destroy (can't get here?)
+				// buckets with rays through the modified region were already subtracted above, so any new buckets are subtracted with unmodified geometry
+				begin_incremental_lighting_edit(cobj); // must be before this cobj is removed
 				cts.push_back(color_tid_vol(cobj, cobj.volume, cobj.calc_min_dim(), 1));
 				cobj.clear_internal_data();
 				mod_cubes.push_back(cobj);
@@ -400,6 +415,7 @@ unsigned subtract_cube(vector<color_tid_vol> &cts, vector3d &cdir, csg_cube cons
 		//PRINT_TIME("Check Anchored");
 	}
 	if (!to_remove.empty()) {cdir.normalize();}
+	end_incremental_lighting_edit(); // after the cobj tree has been rebuilt; does nothing if begin wasn't called
 	//PRINT_TIME("Subtract Cube");
 	return (unsigned)to_remove.size();
 }
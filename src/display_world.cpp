@@ -7,6 +7,7 @@
 #include "timetest.h"
 #include "physics_objects.h"
 #include "model3d.h"
+#include "profiler.h"
 #include <fstream>
 
 
@@ -711,7 +712,7 @@ void draw_sky_and_clouds(bool camera_side, bool no_update=0) {
 }
 
 void create_reflection_and_portal_textures() {
-	//timer_t timer("Create Reflection Textures"); // 340 => 250 => 230 => 195 => 184 => 112 => 103 => 98 => 92 => 82 => 72 => 63 => 54 => 47
+	PROF_ZONE("Create Reflection Textures");
 	if (enable_reflection_plane()) {create_gm_z_reflection();} // must be before draw background but after setup_object_render_data()
 	if (!enable_depth_clamp) {glEnable(GL_DEPTH_CLAMP);} // enable depth clamp if not yet enabled - useful for cube maps
 	ensure_model_reflection_cube_maps();
@@ -729,6 +730,7 @@ void flashlight_next_frame() {
 
 void display() {
 
+	PROF_ZONE("Display");
 	check_gl_error(0);
 
 	if (start_maximized) {
@@ -1157,9 +1159,9 @@ void run_tt_gameplay() {
 
 void display_inf_terrain() { // infinite terrain mode (Note: uses light params from ground mode)
 
+	PROF_ZONE("Display Inf Terrain");
 	static int init_xx(1);
 	RESET_TIME;
-	//timer_t timer("Display Inf Terrain"); // 6.9 no update / 10.6 1-thread / 8.0 2-threads / 7.6 3-threads
 
 	if (init_x || init_xx) {
 		init_xx  = 0;
@@ -73,3 +73,59 @@ public:
 	~base_file_reader() {close_file();}
 };
 
+
+class mapped_file_t { // read-only memory mapped file
+
+	char const *data;
+	size_t sz;
+#ifdef _WIN32
+	HANDLE file_handle, map_handle;
+#else
+	int fd;
+#endif
+public:
+#ifdef _WIN32
+	mapped_file_t() : data(nullptr), sz(0), file_handle(INVALID_HANDLE_VALUE), map_handle(NULL) {}
+#else
+	mapped_file_t() : data(nullptr), sz(0), fd(-1) {}
+#endif
+	~mapped_file_t() {close();}
+	bool open(std::string const &fn);
+	void close();
+	char const *get_data() const {return data;}
+	size_t size() const {return sz;}
+};
+
+
+struct hash64_t { // FNV-1a, applied to 8-byte words for speed
+	uint64_t h;
+	hash64_t() : h(14695981039346656037ULL) {}
+	void add_word(uint64_t w) {h = (h ^ w)*1099511628211ULL;}
+
+	void add(void const *const data, size_t len) {
+		unsigned char const *const p((unsigned char const *)data);
+		size_t const num_words(len/8);
+
+		for (size_t i = 0; i < num_words; ++i) {
+			uint64_t w;
+			memcpy(&w, (p + 8*i), 8);
+			add_word(w);
+		}
+		for (size_t i = 8*num_words; i < len; ++i) {add_word(p[i]);}
+		add_word(len);
+	}
+	template<typename T> void add_val(T const &val) {add(&val, sizeof(T));}
+	void add_str(std::string const &str) {add(str.data(), str.size());}
+};
+
+struct cache_file_t { // file in a model or texture cache directory
+	std::string fn;
+	uint64_t size;
+	time_t mtime;
+	bool operator<(cache_file_t const &f) const {return (mtime < f.mtime);} // oldest first
+};
+
+bool get_cache_dir_files(std::string const &dir, std::string const &ext, std::vector<cache_file_t> &files);
+void make_cache_dir(std::string const &dir);
+void touch_cache_file(std::string const &fn);
+bool get_file_size_and_mtime(std::string const &fn, uint64_t &size, time_t &mtime);
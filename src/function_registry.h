@@ -448,6 +448,8 @@ void build_static_moving_cobj_tree();
 void build_cobj_tree(bool dynamic=0, bool verbose=1);
 bool check_coll_line_exact_tree(point const &p1, point const &p2, point &cpos, vector3d &cnorm, int &cindex, int ignore_cobj,
 	bool dynamic=0, int test_alpha=0, bool skip_non_drawn=0, bool include_voxels=1, bool skip_init_colls=0, bool skip_movable=0, bool no_stat_moving=0);
+void check_coll_line_exact_tree_packet(unsigned num_rays, point const *const p1s, point const *const p2s, point *cposs, vector3d *cnorms, int *cindexes,
+	int ignore_cobj, int test_alpha=0, bool include_voxels=1, bool skip_init_colls=0, bool no_stat_moving=0);
 bool check_coll_line_tree(point const &p1, point const &p2, int &cindex, int ignore_cobj, bool dynamic=0, int test_alpha=0,
 	bool skip_non_drawn=0, bool include_voxels=1, bool skip_init_colls=0, bool skip_movable=0);
 bool cobj_contained_tree(point const &viewer, point const *const pts, unsigned npts, int ignore_cobj, int &cobj);
@@ -882,6 +884,9 @@ float get_scene_radius();
 void kill_current_raytrace_threads();
 void check_update_global_lighting(unsigned lights);
 void check_all_platform_cobj_lighting_update();
+void begin_incremental_lighting_edit(cube_t const &edit_bcube);
+void end_incremental_lighting_edit();
+void print_lighting_bake_summary(unsigned num_threads, int elapsed_ms);
 
 // function prototypes - voxels
 void gen_voxel_landscape();
@@ -0,0 +1 @@
+../dependencies/meshoptimizer/src/indexcodec.cpp
\ No newline at end of file
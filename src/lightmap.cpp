@@ -19,7 +19,7 @@ float const FLASHLIGHT_RAD   = 4.0;
 colorRGBA const flashlight_colors[2] = {colorRGBA(1.0, 0.8, 0.5, 1.0), colorRGBA(0.8, 0.8, 1.0, 1.0)}; // incandescent, LED
 
 
-bool using_lightmap(0), lm_alloc(0), has_dl_sources(0), has_spotlights(0), has_line_lights(0), use_dense_voxels(0), has_indir_lighting(0), dl_smap_enabled(0), flashlight_on(0);
+bool using_lightmap(0), lm_alloc(0), has_dl_sources(0), has_spotlights(0), has_line_lights(0), use_dense_voxels(0), sparse_lighting_volume(0), has_indir_lighting(0), dl_smap_enabled(0), flashlight_on(0);
 unsigned dl_tid(0), elem_tid(0), gb_tid(0), DL_GRID_BS(0), flashlight_color_id(0);
 float DZ_VAL2(0.0), DZ_VAL_INV2(0.0);
 float czmin0(0.0), lm_dz_adj(0.0);
@@ -203,13 +203,16 @@ void lmcell::set_outside_colors() {
 
 
 inline bool is_inside_lmap(int x, int y, int z) {return (z >= 0 && z < MESH_SIZE[2] && !point_outside_mesh(x, y));}
-bool lmap_manager_t::is_valid_cell(int x, int y, int z) const {return (is_inside_lmap(x, y, z) && vlmap[y][x] != NULL);}
+bool lmap_manager_t::is_valid_cell(int x, int y, int z) const {return (is_inside_lmap(x, y, z) && vlmap[y][x] != NULL && (unsigned)z < get_column_zsize(x, y));}
 
 // Note: only intended to work in ground mode where sizes are MESH_X_SIZE and MESH_Y_SIZE
 lmcell *lmap_manager_t::get_lmcell_round_down(point const &p) { // round down
 	int const x(get_xpos_round_down(p.x)), y(get_ypos_round_down(p.y)), z(get_zpos(p.z));
 	return (is_valid_cell(x, y, z) ? &vlmap[y][x][z] : NULL);
 }
+int lmap_manager_t::get_cell_ix_round_down(point const &p) const { // index into vldata_alloc, or -1 if invalid
+	return get_cell_ix(get_xpos_round_down(p.x), get_ypos_round_down(p.y), get_zpos(p.z));
+}
 lmcell *lmap_manager_t::get_lmcell(point const &p) { // round to center
 	int const x(get_xpos(p.x)), y(get_ypos(p.y)), z(get_zpos(p.z));
 	return (is_valid_cell(x, y, z) ? &vlmap[y][x][z] : NULL);
@@ -219,11 +222,14 @@ void lmap_manager_t::reset_all(lmcell const &init_lmcell) {
 	for (auto i = vldata_alloc.begin(); i != vldata_alloc.end(); ++i) {*i = init_lmcell;}
 }
 
-template<typename T> void lmap_manager_t::alloc(unsigned nbins, unsigned xsize, unsigned ysize, unsigned zsize, T **nonempty_bins, lmcell const &init_lmcell) {
-
+// col_zsizes is optional and gives the number of cells to allocate for each column, for sparse mode where cells above all cobjs are left unallocated
+template<typename T> void lmap_manager_t::alloc(unsigned nbins, unsigned xsize, unsigned ysize, unsigned zsize, T **nonempty_bins, lmcell const &init_lmcell,
+	vector<unsigned short> const *const col_zsizes)
+{
 	lm_xsize = xsize; lm_ysize = ysize; lm_zsize = zsize;
 	if (vlmap == NULL) {matrix_gen_2d(vlmap, lm_xsize, lm_ysize);} // create column headers once
 	vldata_alloc.resize(max(nbins, 1U), init_lmcell); // make size at least 1, even if there are no bins, so we can test on emptiness
+	if (col_zsizes) {assert(col_zsizes->size() == lm_xsize*lm_ysize); column_zsizes = *col_zsizes;} else {column_zsizes.clear();}
 	unsigned cur_v(0);
 
 	// initialize light volume
@@ -233,22 +239,24 @@ template<typename T> void lmap_manager_t::alloc(unsigned nbins, unsigned xsize,
 				vlmap[i][j] = NULL;
 				continue;
 			}
-			assert(cur_v + lm_zsize <= vldata_alloc.size());
+			unsigned const col_zsize(get_column_zsize(j, i));
+			assert(col_zsize <= lm_zsize && cur_v + col_zsize <= vldata_alloc.size());
 			vlmap[i][j] = &vldata_alloc[cur_v];
-			cur_v      += lm_zsize;
+			cur_v      += col_zsize;
 		}
 	}
 	assert(cur_v == nbins);
 }
 
-template void lmap_manager_t::alloc(unsigned nbins, unsigned xsize, unsigned ysize, unsigned zsize, unsigned char **nonempty_bins, lmcell const &init_lmcell); // explicit instantiation
+template void lmap_manager_t::alloc(unsigned nbins, unsigned xsize, unsigned ysize, unsigned zsize, unsigned char **nonempty_bins, lmcell const &init_lmcell,
+	vector<unsigned short> const *const col_zsizes); // explicit instantiation
 
 
 void lmap_manager_t::init_from(lmap_manager_t const &src) {
 
 	//assert(!is_allocated());
 	//clear_cells(); // probably unnecessary
-	alloc(src.vldata_alloc.size(), src.lm_xsize, src.lm_ysize, src.lm_zsize, src.vlmap, lmcell());
+	alloc(src.vldata_alloc.size(), src.lm_xsize, src.lm_ysize, src.lm_zsize, src.vlmap, lmcell(), (src.column_zsizes.empty() ? nullptr : &src.column_zsizes));
 	copy_data(src);
 }
 
@@ -270,8 +278,10 @@ void lmap_manager_t::copy_data(lmap_manager_t const &src, float blend_weight) {
 		for (unsigned j = 0; j < lm_xsize; ++j) {
 			if (!vlmap[i][j]) {assert(!src.vlmap[i][j]); continue;}
 			assert(src.vlmap[i][j]);
+			unsigned const col_zsize(get_column_zsize(j, i));
+			assert(src.get_column_zsize(j, i) == col_zsize);
 			
-			for (unsigned z = 0; z < lm_zsize; ++z) {
+			for (unsigned z = 0; z < col_zsize; ++z) {
 				vlmap[i][j][z].mix_lighting_with(src.vlmap[i][j][z], blend_weight);
 			}
 		}
@@ -279,6 +289,53 @@ void lmap_manager_t::copy_data(lmap_manager_t const &src, float blend_weight) {
 }
 
 
+// adds the per-thread accumulated lighting to the cells of ltype; tiles are independent, so they're merged in parallel,
+// while the threads are always added in the same order for each cell so that the result doesn't depend on scheduling
+bool lmap_manager_t::merge_thread_accums(vector<lmap_thread_accum_t const *> const &accums, int ltype) {
+
+	unsigned const num_cells(vldata_alloc.size()), tile_size(lmap_thread_accum_t::TILE_SIZE), dsz(lmcell::get_dsz(ltype));
+	int const num_tiles((num_cells + tile_size - 1)/tile_size);
+	bool any_updated(0);
+	for (auto a = accums.begin(); a != accums.end(); ++a) {any_updated |= !(*a)->empty();}
+	if (!any_updated) return 0;
+
+#pragma omp parallel for schedule(dynamic, 64)
+	for (int tix = 0; tix < num_tiles; ++tix) {
+		unsigned const start(tix*tile_size), end(min(start+tile_size, num_cells));
+
+		for (auto a = accums.begin(); a != accums.end(); ++a) {
+			float const *const vals((*a)->get_tile_vals(tix));
+			if (vals == nullptr) continue; // this thread didn't touch the tile
+
+			for (unsigned c = start; c < end; ++c) {
+				float *color(vldata_alloc[c].get_offset(ltype));
+				float const *const v(vals + 4*(c - start));
+				for (unsigned n = 0; n < dsz; ++n) {color[n] += v[n];}
+			}
+		}
+	}
+	was_updated = 1;
+	return 1;
+}
+
+unsigned lmap_manager_t::get_lighting_checksum(int ltype) const { // for checking reproducibility
+
+	unsigned const dsz(lmcell::get_dsz(ltype));
+	unsigned hash(0);
+
+	for (auto i = vldata_alloc.begin(); i != vldata_alloc.end(); ++i) {
+		float const *const v(i->get_offset(ltype));
+
+		for (unsigned n = 0; n < dsz; ++n) {
+			unsigned bits(0);
+			memcpy(&bits, (v + n), sizeof(unsigned));
+			hash = 31*hash + bits;
+		}
+	}
+	return hash;
+}
+
+
 // *this = val*lmc + (1.0 - val)*(*this)
 void lmcell::mix_lighting_with(lmcell const &lmc, float val) {
 
@@ -563,7 +620,7 @@ void calc_flow_profile(r_profile flow_prof[3], int i, int j, bool proc_cobjs, fl
 	}
 	unsigned const ncv2((unsigned)cobj_z.size());
 
-	for (int v = MESH_SIZE[2]-1; v >= 0; --v) { // top to bottom
+	for (int v = int(lmap_manager.get_column_zsize(j, i))-1; v >= 0; --v) { // top to bottom
 		float zb(czmin0 + v*zstep), zt(zb + zstep); // cell Z bounds
 		
 		if (zt < mesh_height[i][j]) { // under mesh
@@ -681,10 +738,31 @@ void build_lightmap(bool verbose) {
 		cout << "* Warning: Scene height extends beyond the specified z range. Clamping zsize of " << zsize << " to " << MESH_Z_SIZE << "." << endl;
 		zsize = MESH_Z_SIZE;
 	}
-	unsigned const nbins(nonempty*zsize);
 	MESH_SIZE[2] = zsize; // override MESH_SIZE[2]
+	unsigned nbins(nonempty*zsize);
+	vector<unsigned short> col_zsizes;
+
+	if (sparse_lighting_volume && !use_dense_voxels) {
+		// only allocate cells up to the brick containing the top of the column's cobjs; cells above that are treated as outside, the same as empty columns
+		col_zsizes.resize(MESH_X_SIZE*MESH_Y_SIZE, 0);
+		nbins = 0;
+
+		for (int i = 0; i < MESH_Y_SIZE; ++i) {
+			for (int j = 0; j < MESH_X_SIZE; ++j) {
+				if (!need_lmcell[i][j]) continue;
+				unsigned col_zsize(zsize);
+
+				if (!(need_lmcell[i][j] & 2)) { // not near a light source
+					int const ztop(get_zpos(v_collision_matrix[i][j].zmax) + 2); // one cell of padding for texture interpolation
+					col_zsize = min(zsize, LMAP_BRICK_Z*((max(ztop, 1) + LMAP_BRICK_Z - 1)/LMAP_BRICK_Z)); // round up to a multiple of the brick size
+				}
+				col_zsizes[i*MESH_X_SIZE + j] = col_zsize;
+				nbins += col_zsize;
+			}
+		}
+	}
 	float const zstep(czspan/zsize);
-	if (verbose) {cout << "Lightmap zsize= " << zsize << ", nonempty= " << nonempty << ", bins= " << nbins << ", czmin= " << czmin0 << ", czmax= " << czmax << endl;}
+	if (verbose) {cout << "Lightmap zsize= " << zsize << ", nonempty= " << nonempty << ", bins= " << nbins << " of " << nonempty*zsize << ", czmin= " << czmin0 << ", czmax= " << czmax << endl;}
 	assert(zstep > 0.0);
 	bool raytrace_lights[NUM_LIGHTING_TYPES] = {0};
 	for (unsigned i = 0; i < NUM_LIGHTING_TYPES; ++i) {raytrace_lights[i] = (read_light_files[i] || write_light_files[i]);}
@@ -695,7 +773,8 @@ void build_lightmap(bool verbose) {
 		init_lmcell.sv = init_lmcell.gv = DEF_SKY_GLOBAL_LT;
 		UNROLL_3X(init_lmcell.sc[i_] = init_lmcell.gc[i_] = 1.0;)
 	}
-	lmap_manager.alloc(nbins, MESH_X_SIZE, MESH_Y_SIZE, zsize, need_lmcell, init_lmcell);
+	lmap_manager.alloc(nbins, MESH_X_SIZE, MESH_Y_SIZE, zsize, need_lmcell, init_lmcell, (col_zsizes.empty() ? nullptr : &col_zsizes));
+	if (verbose) {cout << "Lightmap memory: " << lmap_manager.get_mem_usage()/1024 << " KB" << endl;}
 	assert(!ldynamic.empty() && lmap_manager.is_allocated());
 	using_lightmap = (nonempty > 0);
 	lm_alloc       = 1;
@@ -731,7 +810,9 @@ void build_lightmap(bool verbose) {
 					assert(lmap_manager.get_column(x, y));
 					float const xv(get_xval(x)), yv(get_yval(y));
 
-					for (int z = bnds[2][0]; z <= bnds[2][1]; ++z) {
+					int const col_zsize(lmap_manager.get_column_zsize(x, y));
+
+					for (int z = bnds[2][0]; z <= bnds[2][1] && z < col_zsize; ++z) {
 						assert(unsigned(z) < zsize);
 						point const p(xv, yv, get_zval(z));
 						point lpos(lposc); // will be updated for line lights
@@ -812,6 +893,8 @@ void update_indir_light_tex_range(lmap_manager_t const &lmap, vector<unsigned ch
 	unsigned xsize, unsigned y1, unsigned y2, unsigned zsize, float lighting_exponent, bool local_only, bool mt)
 {
 	bool const apply_sqrt(lighting_exponent > 0.49 && lighting_exponent < 0.51), apply_exp(!apply_sqrt && lighting_exponent != 1.0);
+	lmcell outside_lmc;
+	outside_lmc.set_outside_colors();
 
 #pragma omp parallel for schedule(static) if (mt)
 	for (int y = y1; y < (int)y2; ++y) {
@@ -819,12 +902,14 @@ void update_indir_light_tex_range(lmap_manager_t const &lmap, vector<unsigned ch
 			unsigned const off(zsize*(y*xsize + x));
 			lmcell const *const vlm(lmap.get_column(x, y));
 			assert(vlm != nullptr); // not supported in this flow
+			unsigned const col_zsize(lmap.get_column_zsize(x, y));
 			colorRGB color;
 
 			for (unsigned z = 0; z < zsize; ++z) {
 				unsigned const off2(4*(off + z));
-				if (local_only) {vlm[z].get_final_color_local(color);} // optimization
-				else {vlm[z].get_final_color(color, 1.0, 1.0);}
+				lmcell const &lmc((z < col_zsize) ? vlm[z] : outside_lmc); // unallocated cells above all cobjs in sparse mode are outside
+				if (local_only) {lmc.get_final_color_local(color);} // optimization
+				else {lmc.get_final_color(color, 1.0, 1.0);}
 				if      (apply_sqrt) {UNROLL_3X(color[i_] = sqrt(color[i_]););}
 				else if (apply_exp)  {UNROLL_3X(color[i_] = pow(color[i_], lighting_exponent););}
 				UNROLL_3X(tex_data[off2+i_] = (unsigned char)(255*CLIP_TO_01(color[i_]));)
@@ -837,6 +922,11 @@ void indir_light_tex_from_lmap(unsigned &tid, lmap_manager_t const &lmap, vector
 {
 	tex_data.resize(4*xsize*ysize*zsize, 0);
 	update_indir_light_tex_range(lmap, tex_data, xsize, 0, ysize, zsize, lighting_exponent, local_only, 1); // mt=1
+	upload_indir_light_tex(tid, tex_data, xsize, ysize, zsize);
+}
+
+void upload_indir_light_tex(unsigned &tid, vector<unsigned char> const &tex_data, unsigned xsize, unsigned ysize, unsigned zsize) {
+	assert(tex_data.size() == 4*xsize*ysize*zsize);
 	if (tid == 0) {tid = create_3d_texture(zsize, xsize, ysize, 4, tex_data, GL_LINEAR, GL_CLAMP_TO_EDGE);} // see update_smoke_indir_tex_range
 	else {update_3d_texture(tid, 0, 0, 0, zsize, xsize, ysize, 4, tex_data.data());} // stored {Z,X,Y}
 }
@@ -1304,7 +1394,7 @@ void get_indir_light(colorRGBA &a, point const &p) { // used for particle clouds
 	if (!point_outside_mesh(x, y) && p.z > czmin0) { // inside the mesh range and above the lowest cobj
 		float val(get_voxel_terrain_ao_lighting_val(p));
 		
-		if (using_lightmap && p.z < czmax && lmap_manager.get_column(x, y) != NULL) { // not above all collision objects and not empty cell
+		if (using_lightmap && p.z < czmax && lmap_manager.is_valid_cell(x, y, z)) { // not above all collision objects and not empty cell
 			lmap_manager.get_lmcell(x, y, z).get_final_color(cscale, 0.5, val);
 		}
 		else if (val < 1.0) {
@@ -9,6 +9,8 @@
 
 extern int MESH_X_SIZE, MESH_Y_SIZE, MESH_SIZE[3];
 
+struct binary_file_reader;
+
 #define ADD_LIGHT_CONTRIB(c, C) {C[0] += c[0]; C[1] += c[1]; C[2] += c[2];}
 
 unsigned const FLASHLIGHT_LIGHT_ID = 0;
@@ -27,6 +29,7 @@ protected:
 
 
 unsigned const lmcell_ltype_off[NUM_LIGHTING_TYPES] = {0, 4, 8, 0}; // sky, global, local, sky cobj accum, dynamic
+unsigned const LMAP_BRICK_Z = 8; // z granularity of lmap column allocation in sparse mode
 
 struct lmcell { // size = 52
 
@@ -44,9 +47,41 @@ struct lmcell { // size = 52
 };
 
 
+// per-thread sparse light accumulation buffer; lmcells are grouped into tiles that are only allocated when a ray touches them,
+// and the tiles of all threads are merged into the lmap in thread order after the threads finish, which makes the result reproducible
+class lmap_thread_accum_t {
+public:
+	static unsigned const TILE_BITS = 6, TILE_SIZE = (1U << TILE_BITS); // 64 lmcells per tile
+private:
+	struct tile_t {float v[TILE_SIZE][4];}; // RGB + weight
+	vector<unsigned> tile_ixs; // tile index + 1 for each lmap tile, 0 = unallocated
+	vector<tile_t> tiles;
+public:
+	void init(size_t num_cells) {clear(); tile_ixs.resize((num_cells + TILE_SIZE - 1) >> TILE_BITS, 0);}
+	void clear() {tile_ixs.clear(); tiles.clear();}
+	bool empty() const {return tiles.empty();}
+	bool is_inited() const {return !tile_ixs.empty();}
+	size_t get_mem_usage() const {return (tile_ixs.size()*sizeof(unsigned) + tiles.capacity()*sizeof(tile_t));}
+
+	void add(unsigned cell_ix, colorRGBA const &cw, float weight) {
+		unsigned const tix(cell_ix >> TILE_BITS);
+		assert(tix < tile_ixs.size());
+		if (tile_ixs[tix] == 0) {tiles.push_back(tile_t()); tile_ixs[tix] = tiles.size();} // value initialized to zeros
+		float *v(tiles[tile_ixs[tix]-1].v[cell_ix & (TILE_SIZE-1)]);
+		ADD_LIGHT_CONTRIB(cw, v);
+		v[3] += weight;
+	}
+	float const *get_tile_vals(unsigned tix) const { // returns TILE_SIZE*4 values, or nullptr if not allocated
+		assert(tix < tile_ixs.size());
+		return (tile_ixs[tix] ? tiles[tile_ixs[tix]-1].v[0] : nullptr);
+	}
+};
+
+
 class lmap_manager_t {
 
 	vector<lmcell> vldata_alloc;
+	vector<unsigned short> column_zsizes; // y, x; number of allocated cells per column in sparse mode, empty if all columns are lm_zsize
 	unsigned lm_xsize, lm_ysize, lm_zsize;
 	lmcell ***vlmap; // y, x, z (size is determined by {MESH_Y_SIZE, MESH_X_SIZE, MESH_Z_SIZE}
 
@@ -61,19 +96,30 @@ public:
 	void clear_cells() {vldata_alloc.clear();} // vlmap matrix headers are not cleared
 	bool is_allocated() const {return (vlmap != NULL && !vldata_alloc.empty());}
 	size_t size() const {return vldata_alloc.size();}
+	size_t get_mem_usage() const {return (vldata_alloc.capacity()*sizeof(lmcell) + column_zsizes.capacity()*sizeof(unsigned short));}
+	unsigned get_column_zsize(int x, int y) const {return (column_zsizes.empty() ? lm_zsize : column_zsizes[y*lm_xsize + x]);} // Note: no bounds checking
 	bool read_data_from_file(char const *const fn, int ltype);
+	bool read_legacy_data(binary_file_reader &reader, char const *const fn, unsigned data_size, int ltype);
+	unsigned get_layout_hash() const;
 	bool write_data_to_file(char const *const fn, int ltype) const;
+	bool write_raw_data(FILE *fp, int ltype) const;
+	bool read_raw_data(FILE *fp, int ltype);
 	void clear_lighting_values(int ltype);
 	bool is_valid_cell(int x, int y, int z) const;
 	lmcell const *get_column(int x, int y) const {return vlmap[y][x];} // Note: no bounds checking
 	lmcell *get_column(int x, int y) {return vlmap[y][x];} // Note: no bounds checking
 	lmcell &get_lmcell(int x, int y, int z) {return get_column(x, y)[z];} // Note: no bounds checking
 	lmcell *get_lmcell_round_down(point const &p);
+	int get_cell_ix_round_down(point const &p) const;
+	int get_cell_ix(int x, int y, int z) const {return (is_valid_cell(x, y, z) ? int(&vlmap[y][x][z] - vldata_alloc.data()) : -1);}
 	lmcell *get_lmcell(point const &p);
 	void reset_all(lmcell const &init_lmcell=lmcell());
-	template<typename T> void alloc(unsigned nbins, unsigned xsize, unsigned ysize, unsigned zsize, T **nonempty_bins, lmcell const &init_lmcell);
+	template<typename T> void alloc(unsigned nbins, unsigned xsize, unsigned ysize, unsigned zsize, T **nonempty_bins, lmcell const &init_lmcell,
+		vector<unsigned short> const *const col_zsizes=nullptr);
 	void init_from(lmap_manager_t const &src);
 	void copy_data(lmap_manager_t const &src, float blend_weight=1.0);
+	bool merge_thread_accums(vector<lmap_thread_accum_t const *> const &accums, int ltype);
+	unsigned get_lighting_checksum(int ltype) const;
 };
 
 
@@ -330,10 +376,11 @@ public:
 // from ray_trace.cpp
 void check_for_lighting_finished();
 void compute_ray_trace_lighting(unsigned ltype, bool verbose);
-unsigned add_path_to_lmcs(lmap_manager_t *lmgr, cube_t *bcube, point p1, point const &p2, float weight, colorRGBA const &color, int ltype, bool first_pt);
+unsigned add_path_to_lmcs(lmap_manager_t *lmgr, cube_t *bcube, point p1, point const &p2, float weight, colorRGBA const &color, int ltype, bool first_pt, lmap_thread_accum_t *lm_accum=nullptr);
 // from lightmap.cpp
 void update_indir_light_tex_range(lmap_manager_t const &lmap, vector<unsigned char> &tex_data,
 	unsigned xsize, unsigned y1, unsigned y2, unsigned zsize, float lighting_exponent=1.0, bool local_only=0, bool mt=0);
 void indir_light_tex_from_lmap(unsigned &tid, lmap_manager_t const &lmap, vector<unsigned char> &tex_data,
 	unsigned xsize, unsigned ysize, unsigned zsize, float lighting_exponent=1.0, bool local_only=0);
+void upload_indir_light_tex(unsigned &tid, vector<unsigned char> const &tex_data, unsigned xsize, unsigned ysize, unsigned zsize);
 
@@ -10,6 +10,8 @@
 #include "voxels.h" // for get_cur_model_edges_as_cubes
 #include "csg.h" // for clip_polygon_to_cube
 #include "lightmap.h" // for lmap_manager_t
+#include "file_reader.h" // for mapped_file_t
+#include "profiler.h"
 #include <fstream>
 #include <queue>
 #include "meshoptimizer.h"
@@ -19,6 +21,7 @@ bool const ENABLE_SPEC_MAPS  = 1;
 bool const ENABLE_INTER_REFLECTIONS = 1;
 unsigned const MAGIC_NUMBER  = 42987143; // arbitrary file signature
 unsigned const BLOCK_SIZE    = 32768; // in vertex indices
+unsigned const LOD_CHAIN_MIN_IXS = 3*1024; // don't generate LOD chains for small vectors
 
 bool model_calc_tan_vect(1); // slower and more memory but sometimes better quality/smoother transitions
 
@@ -26,8 +29,10 @@ extern bool group_back_face_cull, enable_model3d_tex_comp, disable_shader_effect
 extern bool two_sided_lighting, have_indir_smoke_tex, use_core_context, model3d_wn_normal, invert_model_nmap_bscale, use_z_prepass, all_model3d_ref_update;
 extern bool use_interior_cube_map_refl, enable_model3d_custom_mipmaps, enable_tt_model_indir, no_subdiv_model, auto_calc_tt_model_zvals, use_model_lod_blocks;
 extern bool flatten_tt_mesh_under_models, no_store_model_textures_in_memory, disable_model_textures, allow_model3d_quads, merge_model_objects;
-extern unsigned shadow_map_sz, reflection_tid;
-extern int display_mode;
+extern unsigned shadow_map_sz, reflection_tid, model_lod_levels;
+extern bool model3d_compress_geom;
+extern int display_mode, window_height;
+extern float model_lod_screen_error, perspective_fovy;
 extern float model3d_alpha_thresh, model3d_texture_anisotropy, model_triplanar_tc_scale, model_mat_lod_thresh, cobj_z_bias, model_hemi_lighting_scale, light_int_scale[];
 extern pos_dir_up orig_camera_pdu;
 extern bool vert_opt_flags[3];
@@ -91,7 +96,7 @@ bool texture_manager::ensure_texture_loaded(texture_t &t, int tid, bool is_bump)
 	// Note: it's incorrect to call t.has_alpha() here because that uses color, which hasn't been computed yet (t.init() is called later);
 	// but that's okay, do_gl_init() will disable custom mipmaps for textures with color.A == 1.0
 	if (use_model2d_tex_mipmaps && enable_model3d_custom_mipmaps /*&& t.has_alpha()*/) {t.use_mipmaps = 4;}
-	t.load(-1);
+	if (!t.try_load_from_cache(is_bump)) {t.load(-1);} // cached bump maps are already converted to normal maps
 		
 	if (t.alpha_tid >= 0 && t.alpha_tid != tid) { // if alpha is the same texture then the alpha channel should already be set
 		ensure_tid_loaded(t.alpha_tid, 0);
@@ -169,6 +174,287 @@ template<typename V> void read_vector(istream &in, V &v) {
 }
 
 
+// ************ model3d file format v2 ************
+
+// Layout: header, 64-byte aligned vertex/index/block blobs, then the section data (model, materials, vectors, transforms, strings),
+// then the table of contents; all offsets are absolute, and blobs can be used in place from a memory mapped file;
+// compressed files store meshoptimizer encoded vertex/index blobs with zero raw offsets, and these are decoded in parallel on load
+unsigned const MAGIC_NUMBER_V2 = 0x324D4433; // "3DM2"
+unsigned const MODEL3D_VERSION = 2;
+unsigned const MODEL3D_ALIGN   = 64; // alignment of all blobs and sections in bytes
+
+enum {M3D_SEC_MODEL=0, M3D_SEC_MATERIALS, M3D_SEC_VECTORS, M3D_SEC_TRANSFORMS, M3D_SEC_STRINGS, M3D_SEC_LOD_CHAINS, M3D_SEC_CODEC, NUM_M3D_SECS};
+unsigned const M3D_FLAG_FINALIZED = 0x01, M3D_FLAG_OPTIMIZED = 0x02, M3D_FLAG_TANGENTS = 0x04, M3D_FLAG_VERTS_ENCODED = 0x08, M3D_FLAG_IXS_ENCODED = 0x10;
+
+struct model3d_file_header_t {
+	unsigned magic, version, num_sections, align;
+	uint64_t toc_offset, file_size;
+};
+
+struct model3d_toc_entry_t {
+	unsigned type, count; // count = number of elements
+	uint64_t offset, size; // size in bytes
+};
+
+struct model3d_model_rec_t {
+	cube_t bcube;
+	unsigned unbound_ranges[2][2]; // {start, count} of {triangles, quads} in the vectors section
+};
+
+struct model3d_vect_rec_t { // one indexed_vntc_vect_t
+	unsigned vert_size, obj_id, flags, num_verts, num_indices, num_blocks, num_lod_blocks;
+	float avg_area_per_tri, amin, amax;
+	sphere_t bsphere;
+	cube_t bcube;
+	uint64_t vert_offset, index_offset, blocks_offset, lod_blocks_offset;
+	model3d_vect_rec_t() : vert_size(0), obj_id(0), flags(0), num_verts(0), num_indices(0), num_blocks(0), num_lod_blocks(0),
+		avg_area_per_tri(0.0), amin(0.0), amax(0.0), bcube(all_zeros), vert_offset(0), index_offset(0), blocks_offset(0), lod_blocks_offset(0) {}
+};
+
+struct model3d_lod_rec_t { // LOD chain of one indexed_vntc_vect_t; the LOD chains section is optional, and parallel to the vectors section
+	unsigned num_levels, num_ixs;
+	uint64_t levels_offset, ixs_offset;
+	model3d_lod_rec_t() : num_levels(0), num_ixs(0), levels_offset(0), ixs_offset(0) {}
+};
+
+struct model3d_codec_rec_t { // encoded blobs of one indexed_vntc_vect_t; the codec section is only written for compressed files, and is parallel to the vectors section
+	unsigned vert_bytes, ix_bytes;
+	uint64_t vert_offset, ix_offset;
+	model3d_codec_rec_t() : vert_bytes(0), ix_bytes(0), vert_offset(0), ix_offset(0) {}
+};
+
+struct model3d_mat_rec_t {
+	material_params_t params;
+	unsigned name_offset, name_len, fn_offset, fn_len;
+	unsigned geom_ranges[2][2], geom_tan_ranges[2][2]; // {start, count} of {triangles, quads} in the vectors section
+};
+
+struct model3d_file_writer_t {
+	ostream &out;
+	vector<model3d_vect_rec_t> vects;
+	vector<model3d_lod_rec_t> lods;
+	vector<model3d_codec_rec_t> codecs;
+	vector<model3d_mat_rec_t> mats;
+	vector<model3d_toc_entry_t> toc;
+	string strs;
+	bool compress;
+	uint64_t raw_bytes, enc_bytes; // stats for compressed blobs
+
+	model3d_file_writer_t(ostream &out_, bool compress_=0) : out(out_), compress(compress_), raw_bytes(0), enc_bytes(0) {}
+	uint64_t get_pos() {return (uint64_t)out.tellp();}
+
+	void align() {
+		static char const zeros[MODEL3D_ALIGN] = {0};
+		unsigned const rem(get_pos() % MODEL3D_ALIGN);
+		if (rem > 0) {out.write(zeros, (MODEL3D_ALIGN - rem));}
+	}
+	uint64_t write_blob(void const *const data, size_t size) { // returns file offset, or 0 if empty
+		if (size == 0) return 0;
+		align();
+		uint64_t const offset(get_pos());
+		out.write((char const *)data, size);
+		return offset;
+	}
+	template<typename V> uint64_t write_vector_blob(V const &v) {
+		return (v.empty() ? 0 : write_blob(&v.front(), v.size()*sizeof(typename V::value_type)));
+	}
+	// the encode functions return the file offset, or 0 if the data can't be encoded, in which case it should be written raw
+	uint64_t write_encoded_blob(vector<unsigned char> &buf, size_t enc_size, size_t raw_size, unsigned &nbytes) {
+		if (enc_size == 0 || enc_size >= raw_size) return 0; // encode failed or no gain
+		nbytes     = enc_size;
+		raw_bytes += raw_size;
+		enc_bytes += enc_size;
+		return write_blob(buf.data(), enc_size);
+	}
+	uint64_t write_encoded_verts(void const *const verts, unsigned num_verts, unsigned vert_size, unsigned &nbytes) {
+		if (num_verts == 0 || (vert_size & 3) != 0 || vert_size > 256) return 0; // meshoptimizer codec requirements
+		vector<unsigned char> buf(meshopt_encodeVertexBufferBound(num_verts, vert_size));
+		size_t const enc_size(meshopt_encodeVertexBuffer(buf.data(), buf.size(), verts, num_verts, vert_size));
+		return write_encoded_blob(buf, enc_size, size_t(num_verts)*vert_size, nbytes);
+	}
+	uint64_t write_encoded_indices(vector<unsigned> const &indices, unsigned num_verts, unsigned &nbytes) {
+		if (indices.empty() || (indices.size() % 3) != 0) return 0; // triangles only
+		vector<unsigned char> buf(meshopt_encodeIndexBufferBound(indices.size(), num_verts));
+		size_t const enc_size(meshopt_encodeIndexBuffer(buf.data(), buf.size(), indices.data(), indices.size()));
+		return write_encoded_blob(buf, enc_size, indices.size()*sizeof(unsigned), nbytes);
+	}
+	template<typename T> void write_section(unsigned type, T const *const data, unsigned count) {
+		model3d_toc_entry_t entry;
+		entry.type   = type;
+		entry.count  = count;
+		entry.size   = count*sizeof(T);
+		entry.offset = write_blob(data, entry.size);
+		toc.push_back(entry);
+	}
+	template<typename V> void write_section(unsigned type, V const &v) {write_section(type, (v.empty() ? nullptr : &v.front()), (unsigned)v.size());}
+
+	void add_string(string const &str, unsigned &offset, unsigned &len) {
+		offset = strs.size();
+		len    = str.size();
+		strs  += str;
+	}
+};
+
+struct model3d_file_reader_t {
+	mapped_file_t mfile;
+	model3d_file_header_t const *header;
+	model3d_toc_entry_t const *toc;
+	model3d_vect_rec_t const *vects;
+	model3d_lod_rec_t const *lods;
+	model3d_codec_rec_t const *codecs;
+	char const *strs;
+	unsigned num_vects, num_lods, num_codecs, strs_len;
+	bool corrupt; // set when a section is invalid or a required section is missing
+	vector<vector<unsigned char>> dec_verts; // decoded vertex data, indexed by vector
+	vector<vector<unsigned>> dec_ixs; // decoded indices, indexed by vector
+
+	model3d_file_reader_t() : header(nullptr), toc(nullptr), vects(nullptr), lods(nullptr), codecs(nullptr), strs(nullptr), num_vects(0), num_lods(0), num_codecs(0), strs_len(0), corrupt(0) {}
+
+	bool in_bounds(uint64_t offset, uint64_t size) const {return (offset <= mfile.size() && size <= mfile.size() - offset);}
+
+	template<typename T> T const *get_blob(uint64_t offset, unsigned count) const { // returns nullptr on error
+		if (count == 0) return nullptr;
+		if ((offset % MODEL3D_ALIGN) != 0 || !in_bounds(offset, uint64_t(count)*sizeof(T))) return nullptr;
+		return (T const *)(mfile.get_data() + offset);
+	}
+	// returns nullptr with count=0 if missing, empty, or invalid; invalid sections and missing required sections set corrupt
+	template<typename T> T const *get_section(unsigned type, unsigned &count, bool required=1) {
+		count = 0;
+
+		for (unsigned i = 0; i < header->num_sections; ++i) {
+			if (toc[i].type != type) continue;
+			if (toc[i].count == 0) return nullptr; // empty
+			T const *const data((toc[i].size == uint64_t(toc[i].count)*sizeof(T)) ? get_blob<T>(toc[i].offset, toc[i].count) : nullptr);
+			if (data == nullptr) {corrupt = 1; return nullptr;} // element size mismatch, or bad offset
+			count = toc[i].count;
+			return data;
+		}
+		if (required) {corrupt = 1;}
+		return nullptr;
+	}
+	bool get_string(unsigned offset, unsigned len, string &str) const {
+		if (uint64_t(offset) + len > strs_len) return 0;
+		str.assign((strs + offset), len);
+		return 1;
+	}
+	bool open(string const &fn) {
+		if (!mfile.open(fn) || mfile.size() < sizeof(model3d_file_header_t)) return 0;
+		header = (model3d_file_header_t const *)mfile.get_data();
+		if (header->magic != MAGIC_NUMBER_V2 || header->version != MODEL3D_VERSION || header->align != MODEL3D_ALIGN || header->file_size != mfile.size()) return 0;
+		toc = get_blob<model3d_toc_entry_t>(header->toc_offset, header->num_sections);
+		if (toc == nullptr) return 0;
+		vects  = get_section<model3d_vect_rec_t >(M3D_SEC_VECTORS,    num_vects);
+		lods   = get_section<model3d_lod_rec_t  >(M3D_SEC_LOD_CHAINS, num_lods,   0); // optional
+		codecs = get_section<model3d_codec_rec_t>(M3D_SEC_CODEC,      num_codecs, 0); // optional
+		strs   = get_section<char>(M3D_SEC_STRINGS, strs_len);
+		if (corrupt) return 0;
+		if (num_lods   != num_vects) {lods   = nullptr; num_lods   = 0;} // missing or invalid, ignore
+		if (num_codecs != num_vects) {codecs = nullptr; num_codecs = 0;} // missing or invalid; encoded vectors will fail to read
+		return 1;
+	}
+	bool decode_geometry() { // decodes all encoded vertex and index blobs in parallel; returns false on error
+		if (codecs == nullptr) return 1; // uncompressed file
+		int const start_time(GET_TIME_MS());
+		uint64_t enc_bytes(0), dec_bytes(0);
+		int num_errors(0);
+		dec_verts.resize(num_vects);
+		dec_ixs  .resize(num_vects);
+
+#pragma omp parallel for schedule(dynamic) reduction(+:enc_bytes, dec_bytes, num_errors)
+		for (int i = 0; i < (int)num_vects; ++i) {
+			PROF_ZONE("Decode Geometry");
+			model3d_vect_rec_t  const &rec (vects [i]);
+			model3d_codec_rec_t const &crec(codecs[i]);
+
+			if (rec.flags & M3D_FLAG_VERTS_ENCODED) {
+				unsigned char const *const data(get_blob<unsigned char>(crec.vert_offset, crec.vert_bytes));
+				vector<unsigned char> &verts(dec_verts[i]);
+				verts.resize(size_t(rec.num_verts)*rec.vert_size);
+				if (data == nullptr || verts.empty() || meshopt_decodeVertexBuffer(verts.data(), rec.num_verts, rec.vert_size, data, crec.vert_bytes) != 0) {verts.clear(); ++num_errors;}
+				enc_bytes += crec.vert_bytes;
+				dec_bytes += verts.size();
+			}
+			if (rec.flags & M3D_FLAG_IXS_ENCODED) {
+				unsigned char const *const data(get_blob<unsigned char>(crec.ix_offset, crec.ix_bytes));
+				vector<unsigned> &ixs(dec_ixs[i]);
+				ixs.resize(rec.num_indices);
+				if (data == nullptr || ixs.empty() || meshopt_decodeIndexBuffer(ixs.data(), rec.num_indices, sizeof(unsigned), data, crec.ix_bytes) != 0) {ixs.clear(); ++num_errors;}
+				enc_bytes += crec.ix_bytes;
+				dec_bytes += ixs.size()*sizeof(unsigned);
+			}
+		} // for i
+		int const elapsed_ms(max(1, (GET_TIME_MS() - start_time)));
+		cout << "Decoded " << (dec_bytes >> 20) << " MB from " << (enc_bytes >> 20) << " MB (ratio " << float(dec_bytes)/max(enc_bytes, uint64_t(1)) << ") in "
+			 << elapsed_ms << "ms (" << 1.0E-6*dec_bytes/elapsed_ms << " GB/s)" << endl;
+		return (num_errors == 0);
+	}
+	template<typename T> T const *get_verts(model3d_vect_rec_t const &rec) const { // returns nullptr on error
+		if (!(rec.flags & M3D_FLAG_VERTS_ENCODED)) return get_blob<T>(rec.vert_offset, rec.num_verts);
+		unsigned const vix(&rec - vects);
+		if (vix >= dec_verts.size() || dec_verts[vix].size() != size_t(rec.num_verts)*sizeof(T)) return nullptr;
+		return (T const *)dec_verts[vix].data();
+	}
+	unsigned const *get_indices(model3d_vect_rec_t const &rec) const { // returns nullptr on error
+		if (!(rec.flags & M3D_FLAG_IXS_ENCODED)) return get_blob<unsigned>(rec.index_offset, rec.num_indices);
+		unsigned const vix(&rec - vects);
+		if (vix >= dec_ixs.size() || dec_ixs[vix].size() != rec.num_indices) return nullptr;
+		return dec_ixs[vix].data();
+	}
+	bool get_range(unsigned const range[2]) const {return (uint64_t(range[0]) + range[1] <= num_vects);}
+};
+
+
+// ************ vertex welding ************
+
+float model_vertex_weld_eps(0.0); // 0.0 = exact match only
+
+float get_vertex_weld_eps() {return model_vertex_weld_eps;}
+
+template<typename T> unsigned weld_vertices_parallel(vector<T> &verts, vector<unsigned> &indices, float quant_eps) {
+
+	unsigned const num_verts(verts.size()), chunk_size(1 << 16), num_chunks((num_verts + chunk_size - 1)/chunk_size);
+	vector<vector<unsigned>> chunk_uniques(num_chunks); // per-chunk list of first occurrences of each unique vertex
+	vector<unsigned> remap(num_verts); // vertex => chunk-local unique vertex index, then => global index
+
+#pragma omp parallel for schedule(dynamic)
+	for (int c = 0; c < (int)num_chunks; ++c) { // weld within each chunk
+		unsigned const start(c*chunk_size), end(min(num_verts, start+chunk_size));
+		vertex_weld_table_t<T> table(quant_eps);
+		vector<unsigned> &uniques(chunk_uniques[c]);
+
+		for (unsigned i = start; i < end; ++i) {
+			unsigned const ix(table.find_or_insert(verts[i], uniques.size()));
+			if (ix == uniques.size()) {uniques.push_back(i);}
+			remap[i] = ix;
+		}
+	}
+	vertex_weld_table_t<T> table(quant_eps);
+	vector<T> new_verts;
+	vector<unsigned> global_ix;
+
+	for (unsigned c = 0; c < num_chunks; ++c) { // merge chunks in order so that the result matches sequential welding
+		vector<unsigned> const &uniques(chunk_uniques[c]);
+		global_ix.resize(uniques.size());
+
+		for (unsigned u = 0; u < uniques.size(); ++u) {
+			unsigned const ix(table.find_or_insert(verts[uniques[u]], new_verts.size()));
+			if (ix == new_verts.size()) {new_verts.push_back(verts[uniques[u]]);}
+			global_ix[u] = ix;
+		}
+		unsigned const start(c*chunk_size), end(min(num_verts, start+chunk_size));
+		for (unsigned i = start; i < end; ++i) {remap[i] = global_ix[remap[i]];}
+	}
+	for (auto i = indices.begin(); i != indices.end(); ++i) {assert(*i < num_verts); *i = remap[*i];}
+	if (vert_opt_flags[2]) {cout << "Weld vertices: " << num_verts << " => " << new_verts.size() << " (dedup ratio " << float(num_verts)/max(1U, (unsigned)new_verts.size()) << ")" << endl;}
+	verts.swap(new_verts);
+	return verts.size();
+}
+
+template unsigned weld_vertices_parallel(vector<vert_norm       > &verts, vector<unsigned> &indices, float quant_eps);
+template unsigned weld_vertices_parallel(vector<vert_norm_tc    > &verts, vector<unsigned> &indices, float quant_eps);
+template unsigned weld_vertices_parallel(vector<vert_norm_tc_tan> &verts, vector<unsigned> &indices, float quant_eps);
+
+
 // ************ vntc_vect_t/indexed_vntc_vect_t ************
 
 // explicit template instantiations of vert_norm case, used for voxel_model, where tc=0.0
@@ -480,16 +766,16 @@ template<typename T> void indexed_vntc_vect_t<T>::simplify(vector<unsigned> &out
 	PRINT_TIME("Simplify");
 }
 
-template<typename T> void indexed_vntc_vect_t<T>::simplify_meshoptimizer(vector<unsigned> &out, float target) const { // triangles only
+// target_error is relative to the extents of the vertex data
+template<typename T> void indexed_vntc_vect_t<T>::simplify_meshoptimizer(vector<unsigned> &out, float target, float target_error, bool verbose) const { // triangles only
 
-	timer_t timer("Meshoptimizer Simplify");
+	timer_t timer("Meshoptimizer Simplify", verbose);
 	assert(target < 1.0 && target > 0.0);
-	float const target_error = 0.01;
 	unsigned const num_verts(size()), num_ixs(indices.size()), target_num_ixs(max(3U, unsigned(target*num_ixs)));
 	if (num_ixs < 3) return; // no triangles to simplify
 	out.resize(num_ixs); // allocate space
 	size_t const num_ixs_out(meshopt_simplify(out.data(), indices.data(), num_ixs, &this->front().v.x, num_verts, sizeof(T), target_num_ixs, target_error));
-	cout << TXT(num_ixs) << TXT(target_num_ixs) << TXT(num_ixs_out) << endl;
+	if (verbose) {cout << TXT(num_ixs) << TXT(target_num_ixs) << TXT(num_ixs_out) << endl;}
 	assert(num_ixs_out > 0 && num_ixs_out <= num_ixs);
 	out.resize(num_ixs_out); // truncate to correct size
 }
@@ -499,6 +785,46 @@ template<typename T> void indexed_vntc_vect_t<T>::simplify_indices(float reduce_
 	vector<unsigned> simplified_indices;
 	simplify_meshoptimizer(simplified_indices, reduce_target);
 	indices.swap(simplified_indices);
+	clear_lod_chain(); // no longer valid
+}
+
+// each level halves the number of triangles and doubles the allowed error; levels are independent so that they can be generated in parallel;
+// returns the error bound in model space
+template<typename T> float indexed_vntc_vect_t<T>::gen_lod_level(unsigned level, vector<unsigned> &out) const { // triangles only
+
+	assert(level < 16);
+	float const target(1.0f/(2U << level)), rel_error(0.005f*(1U << level));
+	simplify_meshoptimizer(out, target, rel_error, 0); // not verbose, since this is called from multiple threads
+	return rel_error*bcube.max_len(); // the simplifier error is relative to the max extent of the vertex data
+}
+
+// takes the output of gen_lod_level() for levels [0, num_levels); returns the number of levels added
+template<typename T> unsigned indexed_vntc_vect_t<T>::set_lod_chain(vector<unsigned> const *level_ixs, float const *errors, unsigned num_levels) {
+
+	clear_lod_chain();
+	unsigned prev_num(indices.size());
+
+	for (unsigned i = 0; i < num_levels; ++i) {
+		unsigned const num(level_ixs[i].size());
+		if (num == 0 || num > 0.85*prev_num) continue; // not enough reduction from the previous level, likely limited by the error bound
+		lod_levels.emplace_back(lod_ixs.size(), num, errors[i]);
+		vector_add_to(level_ixs[i], lod_ixs);
+		prev_num = num;
+	}
+	return lod_levels.size();
+}
+
+// returns the lowest detail level with a projected error below model_lod_screen_error pixels, or nullptr for full detail
+template<typename T> typename indexed_vntc_vect_t<T>::lod_level_t const *indexed_vntc_vect_t<T>::select_lod_level() const {
+
+	if (lod_levels.empty() || model_lod_screen_error <= 0.0 || window_height <= 0) return nullptr;
+	float const dist(p2p_dist(camera_pdu.pos, bsphere.pos) - bsphere.radius);
+	if (dist <= 0.0) return nullptr; // inside the bounding sphere
+	float const max_error(model_lod_screen_error*2.0f*dist*tanf(0.5f*perspective_fovy/TO_DEG)/window_height); // in model space
+	lod_level_t const *lod(nullptr);
+
+	for (auto l = lod_levels.begin(); l != lod_levels.end() && l->error <= max_error; ++l) {lod = &(*l);}
+	return lod;
 }
 
 template<typename T> void indexed_vntc_vect_t<T>::clear() {
@@ -507,6 +833,7 @@ template<typename T> void indexed_vntc_vect_t<T>::clear() {
 	indices.clear();
 	blocks.clear();
 	lod_blocks.clear();
+	clear_lod_chain();
 	need_normalize = 0;
 }
 
@@ -555,6 +882,33 @@ template<typename T> void vntc_vect_t<T>::read(istream &in) {
 	calc_bounding_volumes();
 }
 
+template<typename T> void vntc_vect_t<T>::write_v2(model3d_file_writer_t &w, model3d_vect_rec_t &rec, model3d_codec_rec_t &crec) const {
+
+	rec.vert_size   = sizeof(T);
+	rec.obj_id      = obj_id;
+	rec.num_verts   = size();
+	if (w.compress && !empty()) {crec.vert_offset = w.write_encoded_verts(&this->front(), size(), sizeof(T), crec.vert_bytes);}
+	if (crec.vert_offset) {rec.flags |= M3D_FLAG_VERTS_ENCODED;} // raw vert_offset stays 0
+	else {rec.vert_offset = w.write_vector_blob(*this);}
+	rec.bsphere     = bsphere;
+	rec.bcube       = bcube;
+	if (has_tangents) {rec.flags |= M3D_FLAG_TANGENTS;}
+}
+
+template<typename T> bool vntc_vect_t<T>::read_v2(model3d_file_reader_t const &r, model3d_vect_rec_t const &rec) {
+
+	if (rec.vert_size != sizeof(T)) return 0; // wrong vertex type
+	T const *const verts(r.get_verts<T>(rec));
+	if (verts == nullptr && rec.num_verts > 0) return 0;
+	vector<T>::assign(verts, (verts + rec.num_verts)); // direct copy, no per-vertex processing
+	has_tangents = ((rec.flags & M3D_FLAG_TANGENTS) != 0);
+	obj_id  = rec.obj_id;
+	bsphere = rec.bsphere;
+	bcube   = rec.bcube;
+	if (bsphere.radius == 0.0 && !empty()) {calc_bounding_volumes();} // not calculated when written
+	return 1;
+}
+
 
 // Note: non-const due to VBO caching
 template<typename T> void indexed_vntc_vect_t<T>::render(shader_t &shader, bool is_shadow_pass, point const *const xlate, unsigned npts, bool no_vfc) {
@@ -579,8 +933,9 @@ template<typename T> void indexed_vntc_vect_t<T>::render(shader_t &shader, bool
 	assert(!indices.empty()); // now always using indexed drawing
 	int prim_type(GL_TRIANGLES);
 	unsigned ixn(1), ixd(1), end_ix(indices.size());
+	lod_level_t const *const lod(is_shadow_pass ? nullptr : select_lod_level());
 
-	if (!is_shadow_pass && !lod_blocks.empty()) { // block LOD
+	if (lod == nullptr && !is_shadow_pass && !lod_blocks.empty()) { // block LOD
 		float const dmin(2.0*bsphere.radius), dist(p2p_dist(camera_pdu.pos, bsphere.pos));
 
 		if (dist > dmin) { // no LOD if within the bounding sphere
@@ -602,6 +957,11 @@ template<typename T> void indexed_vntc_vect_t<T>::render(shader_t &shader, bool
 		}
 		ixn = 6; ixd = 4; // convert quads to 2 triangles
 	}
+	else if (!lod_ixs.empty() && !this->vbo) { // first use; upload LOD chain indices after the full detail indices
+		vector<unsigned> all_ixs(indices);
+		vector_add_to(lod_ixs, all_ixs);
+		this->create_and_upload(*this, all_ixs, is_shadow_pass, 0, 1); // dynamic_level=0, setup_pointers=1
+	}
 	else {
 		if (npts == 4) {prim_type = GL_QUADS;}
 		this->create_and_upload(*this, indices, is_shadow_pass, 0, 1); // dynamic_level=0, setup_pointers=1
@@ -609,7 +969,10 @@ template<typename T> void indexed_vntc_vect_t<T>::render(shader_t &shader, bool
 	this->pre_render(is_shadow_pass);
 	check_mvm_update();
 	
-	if (is_shadow_pass || blocks.empty() || no_vfc || camera_pdu.sphere_completely_visible_test(bsphere.pos, bsphere.radius)) { // draw the entire range
+	if (lod != nullptr) { // draw the selected LOD level, which is triangles only
+		glDrawRangeElements(prim_type, 0, (unsigned)size(), lod->num, GL_UNSIGNED_INT, (void *)((indices.size() + lod->start_ix)*sizeof(unsigned)));
+	}
+	else if (is_shadow_pass || blocks.empty() || no_vfc || camera_pdu.sphere_completely_visible_test(bsphere.pos, bsphere.radius)) { // draw the entire range
 		glDrawRangeElements(prim_type, 0, (unsigned)size(), (unsigned)(ixn*end_ix/ixd), GL_UNSIGNED_INT, 0);
 	}
 	else { // draw each block independently
@@ -645,16 +1008,10 @@ template<typename T> unsigned indexed_vntc_vect_t<T>::add_vertex(T const &v, ver
 
 	T v2(v);
 	if (vmap.get_average_normals()) {v2.n = zero_vector;}
-	auto it(vmap.find(v2));
-	unsigned ix;
+	unsigned const ix(vmap.find_or_insert(v2, (unsigned)size()));
 
-	if (it == vmap.end()) { // not found
-		ix = (unsigned)size();
-		this->push_back(v);
-		vmap[v2] = ix;
-	}
+	if (ix == size()) {this->push_back(v);} // not found, add it
 	else { // found
-		ix = it->second;
 		assert(ix < size());
 
 		if (vmap.get_average_normals()) {
@@ -697,8 +1054,15 @@ template<typename T> void indexed_vntc_vect_t<T>::get_polygons(get_polygon_args_
 	if (args.lod_level > 1 && !indices.empty()) {
 		indexed_vntc_vect_t<T> simplified_this;
 		simplified_this.insert(simplified_this.begin(), begin(), end()); // copy only vertex data; indices will be filled in below, and other fields are unused
-		//simplify(simplified_this.indices, 1.0/args.lod_level);
-		simplify_meshoptimizer(simplified_this.indices, 1.0/args.lod_level);
+		unsigned const target_num(indices.size()/args.lod_level);
+
+		for (auto l = lod_levels.begin(); l != lod_levels.end(); ++l) { // use the stored LOD chain if it has a level with enough reduction
+			if (l->num > target_num) continue;
+			simplified_this.indices.assign((lod_ixs.begin() + l->start_ix), (lod_ixs.begin() + l->start_ix + l->num));
+			break;
+		}
+		//if (simplified_this.indices.empty()) {simplify(simplified_this.indices, 1.0/args.lod_level);}
+		if (simplified_this.indices.empty()) {simplify_meshoptimizer(simplified_this.indices, 1.0/args.lod_level);}
 		get_polygon_args_t args2(args);
 		args2.lod_level = 0;
 		simplified_this.get_polygons(args2, npts);
@@ -773,6 +1137,71 @@ template<typename T> void indexed_vntc_vect_t<T>::read(istream &in) {
 	read_vector(in, indices);
 }
 
+template<typename T> void indexed_vntc_vect_t<T>::write_v2(model3d_file_writer_t &w, unsigned npts) const {
+
+	model3d_vect_rec_t rec;
+	model3d_codec_rec_t crec;
+	vntc_vect_t<T>::write_v2(w, rec, crec);
+	rec.num_indices       = indices.size();
+	if (w.compress && npts == 3) {crec.ix_offset = w.write_encoded_indices(indices, size(), crec.ix_bytes);} // the index codec may rotate triangles, which breaks quads
+	if (crec.ix_offset) {rec.flags |= M3D_FLAG_IXS_ENCODED;}
+	else {rec.index_offset = w.write_vector_blob(indices);}
+	rec.num_blocks        = blocks.size();
+	rec.blocks_offset     = w.write_vector_blob(blocks);
+	rec.num_lod_blocks    = lod_blocks.size();
+	rec.lod_blocks_offset = w.write_vector_blob(lod_blocks);
+	rec.avg_area_per_tri  = avg_area_per_tri;
+	rec.amin = amin;
+	rec.amax = amax;
+	if (finalized) {rec.flags |= M3D_FLAG_FINALIZED;}
+	if (optimized) {rec.flags |= M3D_FLAG_OPTIMIZED;}
+	w.vects.push_back(rec);
+	w.codecs.push_back(crec);
+	model3d_lod_rec_t lrec;
+	lrec.num_levels    = lod_levels.size();
+	lrec.levels_offset = w.write_vector_blob(lod_levels);
+	lrec.num_ixs       = lod_ixs.size();
+	lrec.ixs_offset    = w.write_vector_blob(lod_ixs);
+	w.lods.push_back(lrec);
+}
+
+// keep_blocks=0 drops the geom and LOD blocks, which is required if this vector will be merged with others
+template<typename T> bool indexed_vntc_vect_t<T>::read_v2(model3d_file_reader_t const &r, model3d_vect_rec_t const &rec, bool keep_blocks) {
+
+	if (!vntc_vect_t<T>::read_v2(r, rec)) return 0;
+	unsigned const *const ixs(r.get_indices(rec));
+	if (ixs == nullptr && rec.num_indices > 0) return 0;
+	indices.assign(ixs, (ixs + rec.num_indices));
+	blocks.clear();
+	lod_blocks.clear();
+	clear_lod_chain();
+
+	if (keep_blocks) {
+		geom_block_t const *const gb(r.get_blob<geom_block_t>(rec.blocks_offset, rec.num_blocks));
+		lod_block_t  const *const lb(r.get_blob<lod_block_t >(rec.lod_blocks_offset, rec.num_lod_blocks));
+		if ((gb == nullptr && rec.num_blocks > 0) || (lb == nullptr && rec.num_lod_blocks > 0)) return 0;
+		blocks    .assign(gb, (gb + rec.num_blocks));
+		lod_blocks.assign(lb, (lb + rec.num_lod_blocks));
+		amin = rec.amin;
+		amax = rec.amax;
+		finalized = ((rec.flags & M3D_FLAG_FINALIZED) != 0);
+		optimized = ((rec.flags & M3D_FLAG_OPTIMIZED) != 0);
+
+		if (r.lods != nullptr) { // LOD chains are indexed by vector, and are dropped if vectors are merged
+			unsigned const vix(&rec - r.vects);
+			assert(vix < r.num_lods);
+			model3d_lod_rec_t const &lrec(r.lods[vix]);
+			lod_level_t const *const ll(r.get_blob<lod_level_t>(lrec.levels_offset, lrec.num_levels));
+			unsigned    const *const li(r.get_blob<unsigned   >(lrec.ixs_offset,    lrec.num_ixs));
+			if ((ll == nullptr && lrec.num_levels > 0) || (li == nullptr && lrec.num_ixs > 0)) return 0;
+			lod_levels.assign(ll, (ll + lrec.num_levels));
+			lod_ixs   .assign(li, (li + lrec.num_ixs));
+		}
+	}
+	avg_area_per_tri = rec.avg_area_per_tri;
+	return 1;
+}
+
 
 // ************ polygon_t ************
 
@@ -918,6 +1347,8 @@ template<typename T> void vntc_vect_block_t<T>::merge_into_single_vector() {
 		vector_add_to(*i, dest); // merge verts
 		vector_add_to(i->indices, dest.indices); // merge indices
 	}
+	if (!dest.indices.empty()) {weld_vertices_parallel(dest, dest.indices);} // weld vertices shared across the merged blocks
+	dest.clear_lod_chain(); // indices have changed
 	dest.calc_bounding_volumes(); // can be optimized
 	this->resize(1); // remove all but the first block
 }
@@ -938,6 +1369,26 @@ template<typename T> bool vntc_vect_block_t<T>::read(istream &in) {
 	return 1;
 }
 
+template<typename T> void vntc_vect_block_t<T>::write_v2(model3d_file_writer_t &w, unsigned range[2], unsigned npts) const {
+
+	range[0] = w.vects.size();
+	range[1] = this->size();
+	for (auto i = begin(); i != end(); ++i) {i->write_v2(w, npts);}
+}
+
+template<typename T> bool vntc_vect_block_t<T>::read_v2(model3d_file_reader_t const &r, unsigned const range[2]) {
+
+	this->clear();
+	if (!r.get_range(range)) return 0;
+	this->resize(range[1]);
+
+	for (unsigned i = 0; i < range[1]; ++i) {
+		if (!(*this)[i].read_v2(r, r.vects[range[0] + i], !merge_model_objects)) return 0;
+	}
+	if (merge_model_objects) {merge_into_single_vector();} // model was split per object, and we don't want that; merge into a single vector
+	return 1;
+}
+
 
 // ************ geometry_t ************
 
@@ -1243,6 +1694,26 @@ bool material_t::read(istream &in) {
 }
 
 
+void material_t::write_v2(model3d_file_writer_t &w) const {
+
+	model3d_mat_rec_t rec;
+	rec.params = *this;
+	w.add_string(name,     rec.name_offset, rec.name_len);
+	w.add_string(filename, rec.fn_offset,   rec.fn_len);
+	geom    .write_v2(w, rec.geom_ranges);
+	geom_tan.write_v2(w, rec.geom_tan_ranges);
+	w.mats.push_back(rec);
+}
+
+
+bool material_t::read_v2(model3d_file_reader_t const &r, model3d_mat_rec_t const &rec) {
+
+	material_params_t::operator=(rec.params);
+	if (!r.get_string(rec.name_offset, rec.name_len, name) || !r.get_string(rec.fn_offset, rec.fn_len, filename)) return 0;
+	return (geom.read_v2(r, rec.geom_ranges) && geom_tan.read_v2(r, rec.geom_tan_ranges));
+}
+
+
 // ************ model3d ************
 
 
@@ -1557,6 +2028,54 @@ void model3d::finalize() {
 #pragma omp parallel for schedule(dynamic)
 	for (int i = 0; i < (int)materials.size(); ++i) {materials[i].finalize();}
 	unbound_geom.finalize();
+	if (model_lod_levels > 0) {gen_lod_chains(model_lod_levels);}
+}
+
+template<typename T> void add_lod_chain_vects(vntc_vect_block_t<T> &tris, vector<indexed_vntc_vect_t<T> *> &vects) {
+	for (auto i = tris.begin(); i != tris.end(); ++i) {
+		i->clear_lod_chain();
+		if (i->indices.size() >= LOD_CHAIN_MIN_IXS) {vects.push_back(&(*i));}
+	}
+}
+
+template<typename T> unsigned gen_lod_chains_for_vects(vector<indexed_vntc_vect_t<T> *> const &vects, unsigned num_levels) { // returns the number of levels added
+
+	if (vects.empty()) return 0;
+	vector<pair<unsigned, unsigned>> tasks; // {index count, task ID}; each (vector, level) is an independent task
+	tasks.reserve(vects.size()*num_levels);
+
+	for (unsigned v = 0; v < vects.size(); ++v) {
+		for (unsigned l = 0; l < num_levels; ++l) {tasks.emplace_back(vects[v]->indices.size(), (v*num_levels + l));}
+	}
+	sort(tasks.begin(), tasks.end(), greater<pair<unsigned, unsigned>>()); // largest first for better load balancing
+	vector<vector<unsigned>> level_ixs(tasks.size());
+	vector<float> errors(tasks.size(), 0.0);
+
+#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < (int)tasks.size(); ++t) {
+		PROF_ZONE("Gen LOD Level");
+		unsigned const id(tasks[t].second);
+		errors[id] = vects[id/num_levels]->gen_lod_level((id % num_levels), level_ixs[id]);
+	}
+	unsigned num_added(0);
+	for (unsigned v = 0; v < vects.size(); ++v) {num_added += vects[v]->set_lod_chain(&level_ixs[v*num_levels], &errors[v*num_levels], num_levels);}
+	return num_added;
+}
+
+// generates num_levels simplified versions of each large triangle vector, which are written to model3d files and selected per-vector by screen space error
+void model3d::gen_lod_chains(unsigned num_levels) {
+
+	timer_t timer("Gen Model LOD Chains");
+	vector<indexed_vntc_vect_t<vert_norm_tc    > *> vects;
+	vector<indexed_vntc_vect_t<vert_norm_tc_tan> *> vects_tan;
+	add_lod_chain_vects(unbound_geom.triangles, vects);
+
+	for (auto m = materials.begin(); m != materials.end(); ++m) {
+		add_lod_chain_vects(m->geom    .triangles, vects);
+		add_lod_chain_vects(m->geom_tan.triangles, vects_tan);
+	}
+	unsigned const num_added(gen_lod_chains_for_vects(vects, num_levels) + gen_lod_chains_for_vects(vects_tan, num_levels));
+	cout << "Generated " << num_added << " LOD levels for " << (vects.size() + vects_tan.size()) << " vectors" << endl;
 }
 
 
@@ -2149,8 +2668,46 @@ void model3d::show_stats() const {
 }
 
 
-bool model3d::write_to_disk(string const &fn) const { // Note: transforms not written
+bool model3d::write_to_stream(ostream &out) const { // v2 format; out must be seekable
+
+	model3d_file_writer_t w(out, model3d_compress_geom);
+	model3d_file_header_t header = {MAGIC_NUMBER_V2, MODEL3D_VERSION, 0, MODEL3D_ALIGN, 0, 0};
+	out.write((char const *)&header, sizeof(header)); // placeholder, rewritten at the end
+	model3d_model_rec_t mrec;
+	mrec.bcube = bcube;
+	unbound_geom.write_v2(w, mrec.unbound_ranges); // writes vertex and index blobs
+	for (auto m = materials.begin(); m != materials.end(); ++m) {m->write_v2(w);}
+	w.write_section(M3D_SEC_MODEL, &mrec, 1);
+	w.write_section(M3D_SEC_MATERIALS,  w.mats);
+	w.write_section(M3D_SEC_VECTORS,    w.vects);
+	w.write_section(M3D_SEC_TRANSFORMS, transforms);
+	w.write_section(M3D_SEC_STRINGS, w.strs.data(), (unsigned)w.strs.size());
+	w.write_section(M3D_SEC_LOD_CHAINS, w.lods);
+	if (w.compress) {w.write_section(M3D_SEC_CODEC, w.codecs);}
+	w.align();
+	header.toc_offset   = w.get_pos();
+	header.num_sections = w.toc.size();
+	out.write((char const *)&w.toc.front(), w.toc.size()*sizeof(model3d_toc_entry_t));
+	header.file_size    = w.get_pos();
+	out.seekp(0);
+	out.write((char const *)&header, sizeof(header));
+	if (w.enc_bytes > 0) {cout << "Encoded " << (w.raw_bytes >> 20) << " MB of geometry to " << (w.enc_bytes >> 20) << " MB (ratio " << float(w.raw_bytes)/w.enc_bytes << ")" << endl;}
+	return out.good();
+}
+
+
+bool model3d::write_to_disk(string const &fn, bool legacy_format) const { // Note: transforms are only written in the v2 format
+
+	if (!legacy_format) {
+		ofstream out(fn, ios::out | ios::binary);
 
+		if (!out.good()) {
+			cerr << "Error opening model3d file for write: " << fn << endl;
+			return 0;
+		}
+		cout << "Writing model3d file " << fn << endl;
+		return write_to_stream(out);
+	}
 	ofstream out(fn, ios::out | ios::binary);
 	
 	if (!out.good()) {
@@ -2173,7 +2730,7 @@ bool model3d::write_to_disk(string const &fn) const { // Note: transforms not wr
 }
 
 
-bool model3d::read_from_disk(string const &fn) { // Note: transforms not read
+bool model3d::read_from_disk(string const &fn) { // Note: transforms not read from legacy files
 
 	ifstream in(fn, ios::in | ios::binary);
 	
@@ -2184,6 +2741,10 @@ bool model3d::read_from_disk(string const &fn) { // Note: transforms not read
 	clear(); // ???
 	unsigned const magic_number_comp(read_uint(in));
 
+	if (magic_number_comp == MAGIC_NUMBER_V2) {
+		in.close();
+		return read_from_disk_v2(fn);
+	}
 	if (magic_number_comp != MAGIC_NUMBER) {
 		cerr << "Error reading model3d file " << fn << ": Invalid file format (magic number check failed)." << endl;
 		return 0;
@@ -2206,6 +2767,52 @@ bool model3d::read_from_disk(string const &fn) { // Note: transforms not read
 }
 
 
+bool model3d::read_from_disk_v2(string const &fn) {
+
+	model3d_file_reader_t r;
+
+	if (!r.open(fn)) {
+		cerr << "Error reading model3d file " << fn << ": Invalid or truncated v2 file." << endl;
+		return 0;
+	}
+	clear();
+	cout << "Reading model3d file " << fn << endl;
+	from_model3d_file = 1;
+	unsigned num_models(0), num_mats(0), num_xforms(0);
+	model3d_model_rec_t const *const mrec(r.get_section<model3d_model_rec_t>(M3D_SEC_MODEL, num_models));
+	model3d_mat_rec_t   const *const mats(r.get_section<model3d_mat_rec_t  >(M3D_SEC_MATERIALS, num_mats));
+	model3d_xform_t     const *const xfs (r.get_section<model3d_xform_t    >(M3D_SEC_TRANSFORMS, num_xforms));
+
+	if (r.corrupt) {
+		cerr << "Error reading model3d file " << fn << ": Missing or invalid section." << endl;
+		return 0;
+	}
+	if (mrec == nullptr || num_models != 1) {
+		cerr << "Error reading model3d file " << fn << ": Missing model section." << endl;
+		return 0;
+	}
+	if (!r.decode_geometry()) {
+		cerr << "Error reading model3d file " << fn << ": Failed to decode compressed geometry." << endl;
+		return 0;
+	}
+	bcube = mrec->bcube;
+	if (!unbound_geom.read_v2(r, mrec->unbound_ranges)) return 0;
+	materials.resize(num_mats);
+
+	for (unsigned i = 0; i < num_mats; ++i) {
+		if (!materials[i].read_v2(r, mats[i])) {
+			cerr << "Error reading material" << endl;
+			return 0;
+		}
+		mat_map[materials[i].name] = i;
+	}
+	transforms.assign(xfs, (xfs + num_xforms));
+	for (auto xf = transforms.begin(); xf != transforms.end(); ++xf) {xf->clear_bcube();} // cached, recomputed on use
+	transforms_from_file = !transforms.empty();
+	return 1;
+}
+
+
 void model3d::proc_model_normals(vector<counted_normal> &cn, int recalc_normals, float nmag_thresh) {
 
 	for (vector<counted_normal>::iterator i = cn.begin(); i != cn.end(); ++i) {
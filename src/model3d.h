@@ -14,6 +14,12 @@ using namespace std;
 
 typedef map<string, unsigned> string_map_t;
 
+struct model3d_file_writer_t; // forward declaration
+struct model3d_file_reader_t; // forward declaration
+struct model3d_vect_rec_t; // forward declaration
+struct model3d_codec_rec_t; // forward declaration
+struct model3d_mat_rec_t; // forward declaration
+
 unsigned const MAX_VMAP_SIZE     = (1 << 18); // 256K
 unsigned const BUILTIN_TID_START = (1 << 16); // 65K
 float const POLY_COPLANAR_THRESH = 0.98;
@@ -181,25 +187,116 @@ template<typename T> struct hash_by_bytes { // should work with all packed verte
 	//uint32_t operator()(T const &v) const {return jenkins_one_at_a_time_hash((const uint32_t*)&v, sizeof(T)>>2);} // faster but lower quality hash
 };
 
-//template<typename T> class vertex_map_t : public unordered_map<T, unsigned, hash_by_bytes<T>> {
-template<typename T> class vertex_map_t : public map<T, unsigned> {
+float get_vertex_weld_eps();
+
+// open addressing (linear probing) hash table for vertex deduplication; maps vertices to their indices;
+// if quant_eps > 0.0, positions are quantized to a grid of that spacing so that nearby vertices are welded together
+template<typename T> class vertex_weld_table_t {
+
+	struct entry_t {
+		unsigned gen, hash, ix; // entry is valid if gen == cur_gen
+		T key;
+	};
+	vector<entry_t> table;
+	unsigned num_entries, cur_gen;
+	float quant_eps;
+	uint64_t num_lookups, num_inserts; // stats for all lookups, including those before clear()
+
+	static uint32_t hash_key(T const &key) { // FNV-1a on 32-bit words; all vertex types are composed of 32-bit floats
+		uint32_t w[sizeof(T)/4];
+		memcpy(w, &key, sizeof(T));
+		uint32_t h(2166136261U);
+		for (unsigned i = 0; i < sizeof(T)/4; ++i) {h = (h ^ w[i])*16777619U;}
+		return (h ^ (h >> 15));
+	}
+	void grow() {
+		vector<entry_t> old_table;
+		old_table.swap(table);
+		table.resize(max(1024U, 2*(unsigned)old_table.size()));
+		for (auto i = table.begin(); i != table.end(); ++i) {i->gen = 0;}
+		unsigned const mask(table.size() - 1), prev_gen(cur_gen);
+		cur_gen = 1;
+
+		for (auto i = old_table.begin(); i != old_table.end(); ++i) {
+			if (i->gen != prev_gen) continue;
+			unsigned pos(i->hash & mask);
+			while (table[pos].gen == cur_gen) {pos = (pos + 1) & mask;}
+			table[pos] = *i;
+			table[pos].gen = cur_gen;
+		}
+	}
+public:
+	vertex_weld_table_t(float quant_eps_=0.0) : num_entries(0), cur_gen(1), quant_eps(quant_eps_), num_lookups(0), num_inserts(0) {
+		static_assert((sizeof(T) & 3) == 0, "vertex type must be composed of 32-bit values");
+	}
+	unsigned size() const {return num_entries;}
+	bool empty() const {return (num_entries == 0);}
+	uint64_t get_num_lookups() const {return num_lookups;}
+	uint64_t get_num_inserts() const {return num_inserts;}
+	float get_dedup_ratio() const {return (num_inserts ? float(num_lookups)/float(num_inserts) : 1.0f);}
+
+	void clear() { // O(1): invalidates all entries by advancing the generation
+		if (num_entries == 0) return;
+		num_entries = 0;
+		if (++cur_gen == 0) {for (auto i = table.begin(); i != table.end(); ++i) {i->gen = 0;} cur_gen = 1;} // generation wraparound
+	}
+	T make_key(T const &v) const {
+		T key(v);
+		if (quant_eps > 0.0) {UNROLL_3X(key.v[i_] = quant_eps*round(key.v[i_]/quant_eps);)}
+		float f[sizeof(T)/4];
+		memcpy(f, &key, sizeof(T));
+		for (unsigned i = 0; i < sizeof(T)/4; ++i) {f[i] += 0.0f;} // convert -0.0 to 0.0 so that bitwise compare agrees with operator==
+		memcpy(&key, f, sizeof(T));
+		return key;
+	}
+	// returns the index of an existing matching vertex, or inserts v with new_ix and returns new_ix
+	unsigned find_or_insert(T const &v, unsigned new_ix) {
+		++num_lookups;
+		if (2*(num_entries + 1) > table.size()) {grow();} // keep load factor <= 0.5
+		T const key(make_key(v));
+		unsigned const hash(hash_key(key)), mask(table.size() - 1);
+
+		for (unsigned pos = (hash & mask); ; pos = (pos + 1) & mask) {
+			entry_t &e(table[pos]);
+
+			if (e.gen != cur_gen) { // empty slot - insert
+				e.gen  = cur_gen;
+				e.hash = hash;
+				e.ix   = new_ix;
+				e.key  = key;
+				++num_entries;
+				++num_inserts;
+				return new_ix;
+			}
+			if (e.hash == hash && memcmp(&e.key, &key, sizeof(T)) == 0) return e.ix; // found
+		}
+		assert(0); // never gets here
+		return new_ix;
+	}
+};
+
+template<typename T> class vertex_map_t : public vertex_weld_table_t<T> {
 
 	int last_mat_id;
 	unsigned last_obj_id;
 	bool average_normals;
 
 public:
-	vertex_map_t(bool average_normals_=0) : last_mat_id(-1), last_obj_id(0), average_normals(average_normals_) {}
+	vertex_map_t(bool average_normals_=0) : vertex_weld_table_t<T>(get_vertex_weld_eps()), last_mat_id(-1), last_obj_id(0), average_normals(average_normals_) {}
 	bool get_average_normals() const {return average_normals;}
 	
-	void check_for_clear(int mat_id) {
-		if (mat_id != last_mat_id || this->size() >= MAX_VMAP_SIZE) {
+	void check_for_clear(int mat_id) { // Note: not cleared when large, since that would miss duplicates across the flush
+		if (mat_id != last_mat_id) {
 			last_mat_id = mat_id;
 			this->clear();
 		}
 	}
 };
 
+// welds duplicate vertices of an indexed vertex array in parallel chunks, then merges the chunks in order;
+// the result is the same as sequential welding; returns the number of unique vertices
+template<typename T> unsigned weld_vertices_parallel(vector<T> &verts, vector<unsigned> &indices, float quant_eps=0.0);
+
 typedef vertex_map_t<vert_norm_tc> vntc_map_t;
 typedef vertex_map_t<vert_norm_tc_tan> vntct_map_t;
 
@@ -248,6 +345,8 @@ public:
 	void remove_excess_cap() {if (20*vector<T>::size() < 19*vector<T>::capacity()) {vector<T>::shrink_to_fit();}}
 	void write(ostream &out) const;
 	void read(istream &in);
+	void write_v2(model3d_file_writer_t &w, model3d_vect_rec_t &rec, model3d_codec_rec_t &crec) const;
+	bool read_v2(model3d_file_reader_t const &r, model3d_vect_rec_t const &rec);
 };
 
 
@@ -277,6 +376,16 @@ private:
 	vector<lod_block_t> lod_blocks;
 	unsigned get_block_ix(float area) const;
 
+	struct lod_level_t { // simplified triangles, stored in lod_ixs
+		unsigned start_ix, num;
+		float error; // max geometric error in model space, as bounded by the simplifier
+		lod_level_t() : start_ix(0), num(0), error(0.0) {}
+		lod_level_t(unsigned s, unsigned n, float e) : start_ix(s), num(n), error(e) {}
+	};
+	vector<lod_level_t> lod_levels; // ordered from highest to lowest detail
+	vector<unsigned> lod_ixs; // uploaded to the index VBO after indices
+	lod_level_t const *select_lod_level() const;
+
 public:
 	using vntc_vect_t<T>::size;
 	using vntc_vect_t<T>::empty;
@@ -301,8 +410,11 @@ public:
 	void gen_lod_blocks(unsigned npts);
 	void finalize(unsigned npts);
 	void simplify(vector<unsigned> &out, float target) const;
-	void simplify_meshoptimizer(vector<unsigned> &out, float target) const;
+	void simplify_meshoptimizer(vector<unsigned> &out, float target, float target_error=0.01, bool verbose=1) const;
 	void simplify_indices(float reduce_target);
+	float gen_lod_level(unsigned level, vector<unsigned> &out) const;
+	unsigned set_lod_chain(vector<unsigned> const *level_ixs, float const *errors, unsigned num_levels);
+	void clear_lod_chain() {lod_levels.clear(); lod_ixs.clear();}
 	void clear();
 	unsigned num_verts() const {return unsigned(indices.empty() ? size() : indices.size());}
 	T       &get_vert(unsigned i)       {return (*this)[indices.empty() ? i : indices[i]];}
@@ -311,10 +423,12 @@ public:
 	float get_prim_area(unsigned i, unsigned npts) const;
 	float calc_area(unsigned npts);
 	void get_polygons(get_polygon_args_t &args, unsigned npts) const;
-	unsigned get_gpu_mem() const {return (vntc_vect_t<T>::get_gpu_mem() + (this->ivbo_valid() ? indices.size()*sizeof(unsigned) : 0));}
+	unsigned get_gpu_mem() const {return (vntc_vect_t<T>::get_gpu_mem() + (this->ivbo_valid() ? (indices.size() + lod_ixs.size())*sizeof(unsigned) : 0));}
 	void invert_tcy();
 	void write(ostream &out) const;
 	void read(istream &in);
+	void write_v2(model3d_file_writer_t &w, unsigned npts) const;
+	bool read_v2(model3d_file_reader_t const &r, model3d_vect_rec_t const &rec, bool keep_blocks);
 	bool indexing_enabled() const {return !indices.empty();}
 	void mark_need_normalize() {need_normalize = 1;}
 };
@@ -341,6 +455,8 @@ template<typename T> struct vntc_vect_block_t : public deque<indexed_vntc_vect_t
 	void merge_into_single_vector();
 	bool write(ostream &out) const;
 	bool read(istream &in);
+	void write_v2(model3d_file_writer_t &w, unsigned range[2], unsigned npts) const;
+	bool read_v2(model3d_file_reader_t const &r, unsigned const range[2]);
 };
 
 
@@ -367,6 +483,8 @@ template<typename T> struct geometry_t {
 	void simplify_indices(float reduce_target);
 	bool write(ostream &out) const {return (triangles.write(out) && quads.write(out));}
 	bool read(istream &in)         {return (triangles.read (in ) && quads.read (in ));}
+	void write_v2(model3d_file_writer_t &w, unsigned ranges[2][2]) const {triangles.write_v2(w, ranges[0], 3); quads.write_v2(w, ranges[1], 4);}
+	bool read_v2(model3d_file_reader_t const &r, unsigned const ranges[2][2]) {return (triangles.read_v2(r, ranges[0]) && quads.read_v2(r, ranges[1]));}
 };
 
 
@@ -446,6 +564,8 @@ struct material_t : public material_params_t {
 	colorRGBA get_avg_color(texture_manager const &tmgr, int default_tid=-1) const;
 	bool write(ostream &out) const;
 	bool read(istream &in);
+	void write_v2(model3d_file_writer_t &w) const;
+	bool read_v2(model3d_file_reader_t const &r, model3d_mat_rec_t const &rec);
 };
 
 
@@ -466,7 +586,7 @@ class model3d {
 	unsigned model_refl_tid, model_refl_tsize, model_refl_last_tsize, model_indir_tid;
 	int reflective; // reflective: 0=none, 1=planar, 2=cube map
 	int indoors; // 0=no/outdoors, 1=yes/indoors, 2=unknown
-	bool from_model3d_file, has_cobjs, needs_alpha_test, needs_bump_maps, has_spec_maps, has_gloss_maps, xform_zvals_set;
+	bool from_model3d_file, has_cobjs, needs_alpha_test, needs_bump_maps, has_spec_maps, has_gloss_maps, xform_zvals_set, transforms_from_file;
 	float metalness; // should be per-material, but not part of the material file and specified per-object instead
 
 	// materials
@@ -509,7 +629,7 @@ public:
 		: filename(filename_), recalc_normals(recalc_normals_), group_cobjs_level(group_cobjs_level_), unbound_mat(((def_tid >= 0) ? def_tid : WHITE_TEX), def_c),
 		bcube(all_zeros_cube), bcube_all_xf(all_zeros), occlusion_cube(all_zeros), model_refl_tid(0), model_refl_tsize(0), model_refl_last_tsize(0), model_indir_tid(0),
 		reflective(reflective_), indoors(2), from_model3d_file(0), has_cobjs(0), needs_alpha_test(0), needs_bump_maps(0), has_spec_maps(0), has_gloss_maps(0),
-		xform_zvals_set(0), metalness(metalness_), textures_loaded(0), sky_lighting_weight(0.0), tmgr(tmgr_)
+		xform_zvals_set(0), transforms_from_file(0), metalness(metalness_), textures_loaded(0), sky_lighting_weight(0.0), tmgr(tmgr_)
 	{UNROLL_3X(sky_lighting_sz[i_] = 0;)}
 	~model3d() {clear();}
 	size_t num_materials() const {return materials.size();}
@@ -523,7 +643,10 @@ public:
 	// creation and query
 	bool are_textures_loaded() const {return textures_loaded;}
 	void set_has_cobjs() {has_cobjs = 1;}
-	void add_transform(model3d_xform_t const &xf) {transforms.push_back(xf);}
+	void add_transform(model3d_xform_t const &xf) {
+		if (transforms_from_file) {transforms.clear(); transforms_from_file = 0;} // transforms specified in the scene replace those stored in the model3d file
+		transforms.push_back(xf);
+	}
 	unsigned add_triangles(vector<triangle> const &triangles, colorRGBA const &color, int mat_id=-1, unsigned obj_id=0);
 	unsigned add_polygon(polygon_t const &poly, vntc_map_t vmap[2], vntct_map_t vmap_tan[2], int mat_id=-1, unsigned obj_id=0);
 	void add_triangle(polygon_t const &tri, vntc_map_t &vmap, int mat_id=-1, unsigned obj_id=0);
@@ -536,6 +659,7 @@ public:
 	void mark_mat_as_used(int mat_id);
 	void set_xform_zval_from_tt_height(bool flatten_mesh);
 	void finalize();
+	void gen_lod_chains(unsigned num_levels);
 	void clear();
 	void free_context();
 	void clear_smaps(); // frees GL state
@@ -582,8 +706,10 @@ public:
 	void get_stats(model3d_stats_t &stats) const;
 	void show_stats() const;
 	void get_all_mat_lib_fns(set<std::string> &mat_lib_fns) const;
-	bool write_to_disk (string const &fn) const;
+	bool write_to_disk (string const &fn, bool legacy_format=0) const;
+	bool write_to_stream(ostream &out) const;
 	bool read_from_disk(string const &fn);
+	bool read_from_disk_v2(string const &fn);
 	static void proc_model_normals(vector<counted_normal> &cn, int recalc_normals, float nmag_thresh=0.7);
 	static void proc_model_normals(vector<weighted_normal> &wn, int recalc_normals, float nmag_thresh=0.7);
 	void write_to_cobj_file(std::ostream &out) const;
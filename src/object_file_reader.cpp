@@ -6,13 +6,35 @@
 #include "3DWorld.h"
 #include "model3d.h"
 #include "file_reader.h"
+#include "profiler.h"
 #include <stdint.h>
 #include <algorithm> // for transform()
 #include <cctype> // for tolower()
 #include "fast_atof.h"
+#include <climits> // for INT_MIN
+#include <iomanip> // for setw()
+#include <mutex>
+#include <thread>
+#ifdef _WIN32
+#include <io.h> // for _findfirst()
+#include <direct.h> // for _mkdir()
+#include <sys/utime.h>
+#include <sys/stat.h> // for _stat64()
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#endif
 
 
-extern bool use_obj_file_bump_grayscale;
+extern bool use_obj_file_bump_grayscale, parallel_obj_load, obj_load_benchmark, model_calc_tan_vect, use_model_lod_blocks, no_subdiv_model, allow_model3d_quads;
+extern bool vert_opt_flags[3];
+extern unsigned model_cache_max_mb, model_lod_levels;
+extern bool model3d_compress_geom;
+extern string model_cache_dir;
 extern float model_auto_tc_scale, model_mat_lod_thresh;
 extern model3ds all_models;
 
@@ -111,6 +133,49 @@ bool base_file_reader::read_string(char *s, unsigned max_len) {
 }
 
 
+bool mapped_file_t::open(string const &fn) { // returns 0 on failure or for empty files
+	close();
+#ifdef _WIN32
+	file_handle = CreateFileA(fn.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file_handle == INVALID_HANDLE_VALUE) return 0;
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0) {close(); return 0;}
+	map_handle = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (map_handle == NULL) {close(); return 0;}
+	data = (char const *)MapViewOfFile(map_handle, FILE_MAP_READ, 0, 0, 0);
+	if (data == nullptr) {close(); return 0;}
+	sz = (size_t)file_size.QuadPart;
+#else
+	fd = ::open(fn.c_str(), O_RDONLY);
+	if (fd < 0) return 0;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {close(); return 0;}
+	void *const ptr(mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+	if (ptr == MAP_FAILED) {close(); return 0;}
+	madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+	data = (char const *)ptr;
+	sz   = st.st_size;
+#endif
+	return 1;
+}
+
+void mapped_file_t::close() {
+#ifdef _WIN32
+	if (data) {UnmapViewOfFile(data);}
+	if (map_handle  != NULL) {CloseHandle(map_handle);}
+	if (file_handle != INVALID_HANDLE_VALUE) {CloseHandle(file_handle);}
+	file_handle = INVALID_HANDLE_VALUE;
+	map_handle  = NULL;
+#else
+	if (data) {munmap((void *)data, sz);}
+	if (fd >= 0) {::close(fd);}
+	fd = -1;
+#endif
+	data = nullptr;
+	sz   = 0;
+}
+
+
 class object_file_reader : public base_file_reader {
 
 	bool invalid_index_warned;
@@ -281,7 +346,235 @@ bool endswith(string const &value, string const &ending) {
 
 class object_file_reader_model : public object_file_reader, public model_from_file_t {
 
-	bool had_empty_mat_error;
+	static unsigned const POLY_BLOCK_SIZE = (1 << 18); // 256K
+	static size_t   const OBJ_CHUNK_SIZE  = (1 << 22); // 4MB
+
+	bool had_empty_mat_error, is_textured, had_npts_error;
+	int cur_mat_id;
+	unsigned smoothing_group, prev_smoothing_group, num_faces, num_objects, num_groups, obj_group_id, approx_line;
+	vector<point> v; // vertices
+	vector<vector3d> n; // normals
+	// weighted_normal can also be used, but doesn't work well; see face_weight_avg mode selected by recalc_normals==2
+	vector<counted_normal> vn; // vertex normals
+	vector<point2d<float> > tc; // texture coords
+	vector<colorRGB> colors; // vertex colors
+	deque<poly_data_block> pblocks;
+	set<string> loaded_mat_libs;
+
+	// per-chunk results of the parallel parser; vertex data is stored in file order, faces/state changes are stored as ops to be replayed in order
+	struct obj_chunk_t {
+		enum {OP_FACE=0, OP_OBJECT, OP_GROUP, OP_SMOOTH, OP_USEMTL, OP_MTLLIB, OP_UNDEF};
+		static int const NO_IX = INT_MIN; // index not specified
+
+		struct face_vert_t {
+			int v, t, n;
+			face_vert_t(int v_, int t_, int n_) : v(v_), t(t_), n(n_) {}
+		};
+		struct face_t {
+			unsigned start, npts, nv, nt, nn; // nv/nt/nn: number of chunk vertices/tex coords/normals before this face, used for relative indices
+			face_t(unsigned s, unsigned nv_, unsigned nt_, unsigned nn_) : start(s), npts(0), nv(nv_), nt(nt_), nn(nn_) {}
+		};
+		struct op_t {
+			unsigned char type;
+			unsigned ix, line; // ix: index into faces or strs, or smoothing group
+			op_t(unsigned char type_, unsigned ix_, unsigned line_) : type(type_), ix(ix_), line(line_) {}
+		};
+		vector<point> v;
+		vector<colorRGB> vcolors;
+		vector<unsigned char> has_color;
+		vector<point2d<float> > tc;
+		vector<vector3d> n;
+		vector<face_vert_t> fverts;
+		vector<face_t> faces;
+		vector<op_t> ops;
+		vector<string> strs;
+		string error; // name of the entry that failed to parse, if nonempty
+		unsigned num_lines, error_line;
+		char const *pos, *end;
+
+		obj_chunk_t() : num_lines(0), error_line(0), pos(nullptr), end(nullptr) {}
+
+		// these mirror the base_file_reader/object_file_reader functions, but operate on the memory mapped chunk
+		int get_char() {return ((pos < end) ? *(pos++) : EOF);}
+		void unget_char(int c) {if (c != EOF) {--pos;}} // can't unget EOF
+
+		bool read_string(char *s, unsigned max_len) {
+			unsigned ix(0);
+
+			while (1) {
+				if (ix+1 >= max_len) return 0; // buffer overrun
+				int const c(get_char());
+				if (c == EOF) {if (ix == 0) return 0; else break;} // end of chunk
+				if (fast_isspace(c)) {
+					if (ix == 0) continue; // leading whitespace
+					if (c == '\n') {unget_char(c);} // preserve the newline
+					break; // trailing whitespace
+				}
+				s[ix++] = c;
+			}
+			s[ix] = 0; // add null terminator
+			return 1;
+		}
+		bool read_int(int &val) {
+			int c(0);
+			do {c = get_char();} while (c != EOF && fast_isspace(c)); // skip leading whitespace
+			bool const is_neg(c == '-');
+			if (is_neg) {c = get_char();}
+			val = 0;
+			if (c == EOF || !fast_isdigit(c)) {unget_char(c); return is_neg;} // a lone '-' reads as 0, as in base_file_reader::fast_atoi()
+			for (; c != EOF && fast_isdigit(c); c = get_char()) {val = 10*val + unsigned(c - '0');}
+			unget_char(c); // non-integer character
+			if (is_neg) {val = -val;}
+			return 1;
+		}
+		bool read_uint(unsigned &val) {
+			int temp(-1);
+			if (!read_int(temp) || temp < 0) return 0;
+			val = temp; // cast to unsigned
+			return 1;
+		}
+		bool read_float(float &val) {
+			char buf[MAX_CHARS];
+			unsigned ix(0);
+
+			while (1) {
+				if (ix+1 >= MAX_CHARS) return 0; // buffer overrun
+				int const c(get_char());
+				if (c == EOF) {if (ix == 0) return 0; else break;} // end of chunk
+				if (fast_isspace(c)) {if (ix == 0) continue; else break;} // leading/trailing whitespace
+
+				if (ix == 0 && !fast_isdigit(c) && c != '.' && c != '-') { // not a fp number
+					unget_char(c);
+					return 0;
+				}
+				buf[ix++] = c;
+			}
+			buf[ix] = 0; // add null terminator
+			val = Assimp::fast_atof(buf);
+			return 1;
+		}
+		bool read_point(point &p, unsigned req_num=3) {
+			for (unsigned i = 0; i < 3; ++i) {
+				if (!read_float(p[i])) {return ((i >= req_num) ? 1 : 0);} // success if we read enough values
+			}
+			return 1;
+		}
+		void read_to_newline() {
+			bool prev_was_escape(0);
+
+			while (1) {
+				int const c(get_char());
+				if ((!prev_was_escape && c == '\n') || c == '\0' || c == EOF) return;
+				prev_was_escape = (c == '\\'); // handle escape character at end of line
+			}
+		}
+		void read_str_to_newline(string &str) {
+			str.resize(0);
+
+			while (1) {
+				int const c(get_char());
+				if (c == '\n' || c == '\0' || c == EOF) break; // end of file or line
+				if (!fast_isspace(c) || !str.empty()) {str.push_back(c);}
+			}
+			while (!str.empty() && fast_isspace(str.back())) {str.pop_back();}
+		}
+		void add_str_op(unsigned char type) {
+			strs.push_back(string());
+			read_str_to_newline(strs.back());
+			ops.emplace_back(type, (strs.size() - 1), num_lines);
+		}
+		bool set_error(char const *const name) {
+			error      = name;
+			error_line = num_lines;
+			return 0;
+		}
+
+		bool parse(char const *const begin, char const *const end_, geom_xform_t const &xf, int recalc_normals) {
+			pos = begin;
+			end = end_;
+			char s[MAX_CHARS];
+
+			while (read_string(s, MAX_CHARS)) {
+				++num_lines;
+
+				if (s[0] == 0) continue; // empty/unparseable line
+				else if (s[0] == '#') {read_to_newline();} // comment
+				else if (strcmp(s, "f") == 0) { // face
+					faces.emplace_back(fverts.size(), v.size(), tc.size(), n.size());
+					int vix(0), tix(0), nix(0);
+
+					while (read_int(vix)) { // read vertex index
+						face_vert_t fv(vix, NO_IX, NO_IX);
+						int const c(get_char());
+
+						if (c == '/') {
+							if (read_int(tix)) {fv.t = tix;} // read text coord index
+							int const c2(get_char());
+
+							if (c2 == '/') {
+								if (read_int(nix)) {fv.n = nix;} // read normal index
+							}
+							else {unget_char(c2);}
+						}
+						else {unget_char(c);}
+						fverts.push_back(fv);
+						++faces.back().npts;
+					} // end while vertex
+					ops.emplace_back(OP_FACE, (faces.size() - 1), num_lines);
+				}
+				else if (strcmp(s, "v") == 0) { // vertex
+					point vpos;
+					if (!read_point(vpos)) return set_error("vertex");
+					colorRGB color(WHITE);
+					float val(0.0);
+					bool const has_vcolor(read_float(val));
+
+					if (has_vcolor) {
+						color.R = val;
+						if (!read_float(color.G) || !read_float(color.B)) return set_error("vertex color");
+					}
+					xf.xform_pos(vpos);
+					v.push_back(vpos);
+					vcolors.push_back(color);
+					has_color.push_back(has_vcolor);
+				}
+				else if (strcmp(s, "vt") == 0) { // tex coord
+					point tc3d;
+					if (!read_point(tc3d, 2)) return set_error("texture coord");
+					tc.push_back(point2d<float>(tc3d.x, tc3d.y)); // discard tc3d.z
+				}
+				else if (strcmp(s, "vn") == 0) { // normal
+					vector3d normal;
+					if (!read_point(normal)) return set_error("normal");
+
+					if (!recalc_normals) {
+						xf.xform_pos_rm(normal);
+						n.push_back(normal);
+					}
+				}
+				else if (strcmp(s, "l") == 0) {read_to_newline();} // line - ignore
+				else if (strcmp(s, "o") == 0) {add_str_op(OP_OBJECT);} // object definition
+				else if (strcmp(s, "g") == 0) {add_str_op(OP_GROUP );} // group
+				else if (strcmp(s, "s") == 0) { // smoothing/shading (off/on or 0/1)
+					unsigned smoothing_group(0);
+
+					if (!read_uint(smoothing_group)) {
+						if (!read_string(s, MAX_CHARS) || strcmp(s, "off") != 0) return set_error("smoothing group");
+					}
+					ops.emplace_back(OP_SMOOTH, smoothing_group, num_lines);
+				}
+				else if (strcmp(s, "usemtl") == 0) {add_str_op(OP_USEMTL);} // use material
+				else if (strcmp(s, "mtllib") == 0) {add_str_op(OP_MTLLIB);} // material library
+				else {
+					strs.push_back(s);
+					ops.emplace_back(OP_UNDEF, (strs.size() - 1), num_lines);
+					read_to_newline(); // ignore this line
+				}
+			} // while
+			return 1;
+		}
+	}; // obj_chunk_t
+
 
 	bool read_map_name(ifstream &in, string &name, float *scale=nullptr) {
 		if (!(in >> name)) {return 0;} // no name read (EOF?)
@@ -317,7 +610,8 @@ class object_file_reader_model : public object_file_reader, public model_from_fi
 	}
 
 public:
-	object_file_reader_model(string const &fn, model3d &model_) : object_file_reader(fn), model_from_file_t(fn, model_), had_empty_mat_error(0) {}
+	object_file_reader_model(string const &fn, model3d &model_) : object_file_reader(fn), model_from_file_t(fn, model_), had_empty_mat_error(0), is_textured(0), had_npts_error(0),
+		cur_mat_id(-1), smoothing_group(0), prev_smoothing_group(0), num_faces(0), num_objects(0), num_groups(0), obj_group_id(0), approx_line(0) {}
 
 	bool load_mat_lib(string const &fn) { // Note: could cache filename, but seems to never be included more than once
 		ifstream mat_in;
@@ -482,11 +776,12 @@ public:
 		read_to_newline(mat_in); // ignore
 	}
 
-	bool load_from_model3d_file(bool verbose) {
+	bool load_from_model3d_file(bool verbose, string const &model3d_fn=string()) { // model3d_fn is used in place of filename if specified (for cached models)
 		RESET_TIME;
+		string const &fn(model3d_fn.empty() ? filename : model3d_fn);
 
-		if (!model.read_from_disk(filename)) {
-			cerr << "Error reading model3d file " << filename << endl;
+		if (!model.read_from_disk(fn)) {
+			cerr << "Error reading model3d file " << fn << endl;
 			return 0;
 		}
 		PRINT_TIME("Model3d File Load");
@@ -529,27 +824,100 @@ public:
 		return 1;
 	}
 
-	bool read(geom_xform_t const &xf, int recalc_normals, bool verbose) {
-		RESET_TIME;
+	poly_data_block &start_face() {
+		model.mark_mat_as_used(cur_mat_id);
+
+		if (pblocks.empty() || pblocks.back().pts.size() >= POLY_BLOCK_SIZE || smoothing_group != prev_smoothing_group) { // create a new block
+			if (!pblocks.empty()) {
+				remove_excess_cap(pblocks.back().polys);
+				remove_excess_cap(pblocks.back().pts);
+			}
+			pblocks.push_back(poly_data_block());
+			prev_smoothing_group = smoothing_group;
+		}
+		poly_data_block &pb(pblocks.back());
+		pb.polys.push_back(poly_header_t(cur_mat_id, obj_group_id));
+		return pb;
+	}
+	void end_face(poly_data_block &pb, unsigned pix, int recalc_normals) {
+		unsigned const npts(pb.polys.back().npts);
+
+		if (npts < 3) {
+			if (!had_npts_error) {cerr << "Error near line " << approx_line << ": face has only " << npts << " vertices." << endl; had_npts_error = 1;}
+			pb.pts.resize(pix);
+			pb.polys.pop_back(); // remove pts and polygon
+			return; // skip it
+		}
+		vector3d &normal(pb.polys.back().n);
+				
+		for (unsigned i = pix; i < pix+npts-2; ++i) { // find a nonzero normal
+			normal = cross_product((v[pb.pts[i+1].vix] - v[pb.pts[i].vix]), (v[pb.pts[i+2].vix] - v[pb.pts[i].vix])); // backwards?
+			// if we disable this normalize() we will weight normal contributions by polygon area,
+			// but we have to change the code below and it causes problems with vertex uniquing
+			normal.normalize();
+			if (normal != zero_vector) break; // got a good normal
+		}
+		if (recalc_normals) {
+			bool const face_weight_avg(recalc_normals == 2 && (npts == 3 || npts == 4)); // only works for quads and triangles
+			float face_area(0.0);
+
+			if (face_weight_avg) {
+				point face_pts[4];
+				for (unsigned i = 0; i < npts; ++i) {face_pts[i] = v[pb.pts[i+pix].vix];}
+				face_area = polygon_area(face_pts, npts);
+			}
+			for (unsigned i = pix; i < pix+npts; ++i) {
+				unsigned const vix(pb.pts[i].vix);
+				assert((unsigned)vix < vn.size());
+				bool const using_texgen(is_textured && model_auto_tc_scale > 0.0 && pb.pts[i].tix == 0);
+
+				if (vn[vix].is_valid() && (using_texgen || dot_product(normal, vn[vix].get_norm()) < 0.25)) { // normals in disagreement (or using texgen)
+					vn[vix] = zero_vector; // zero it out so that it becomes invalid later
+				}
+				else if (face_weight_avg) {vn[vix].add_normal(face_area*normal);} // face weighted average
+				else {vn[vix].add_normal(normal);} // unweighted average of normals
+			}
+		}
+	}
+	void add_vertex(point const &pos, colorRGB const *const color, int recalc_normals) { // pos has already been transformed
+		v.push_back(pos);
+		if (recalc_normals) {vn.push_back(counted_normal());} // vertex normal
+
+		if (color) {
+			if (colors.empty()) {colors.resize(v.size()-1, WHITE);} // pad colors up to this point with white
+			colors.push_back(*color);
+		}
+		else if (!colors.empty()) {colors.push_back(WHITE);} // color not specified, and in colors mode, pad with white
+	}
+	bool use_material(string const &material_name) {
+		if (material_name.empty()) {
+			if (!had_empty_mat_error) {cerr << "Error reading material from object file " << filename << " near line " << approx_line << endl;}
+			had_empty_mat_error = 1;
+			return 0;
+		}
+		cur_mat_id = model.find_material(material_name);
+				
+		if (cur_mat_id >= 0) { // material was valid
+			int const tid(model.get_material(cur_mat_id).d_tid);
+			is_textured = (tid >= 0 && model.tmgr.get_tex_avg_color(tid) != WHITE); // no texture, or all white texture
+		}
+		return 1;
+	}
+	bool use_mat_lib(string const &mat_lib) {
+		if (mat_lib.empty()) {
+			cerr << "Error reading material library from object file " << filename << " near line " << approx_line << endl;
+			return 0;
+		}
+		if (!try_load_mat_lib(mat_lib, loaded_mat_libs, approx_line)) {
+			//return 0; // nonfatal
+		}
+		return 1;
+	}
+
+	bool read_sequential(geom_xform_t const &xf, int recalc_normals) {
 		if (!open_file()) return 0;
-		cout << "Reading object file " << filename << endl;
-		unsigned const block_size = (1 << 18); // 256K
-		int cur_mat_id(-1);
-		unsigned smoothing_group(0), prev_smoothing_group(0), num_faces(0), num_objects(0), num_groups(0), obj_group_id(0);
-		vector<point> v; // vertices
-		vector<vector3d> n; // normals
-		// weighted_normal can also be used, but doesn't work well; see face_weight_avg mode selected by recalc_normals==2
-		vector<counted_normal> vn; // vertex normals
-		vector<point2d<float> > tc; // texture coords
-		vector<colorRGB> colors; // vertex colors
-		deque<poly_data_block> pblocks;
-		set<string> loaded_mat_libs;
 		char s[MAX_CHARS];
 		string material_name, mat_lib, group_name, object_name;
-		tc.push_back(point2d<float>(0.0, 0.0)); // default tex coords
-		n.push_back(zero_vector); // default normal
-		unsigned approx_line(0);
-		bool is_textured(0), had_npts_error(0);
 
 		while (read_string(s, MAX_CHARS)) {
 			++approx_line;
@@ -562,20 +930,9 @@ public:
 				read_to_newline(fp); // ignore
 			}
 			else if (strcmp(s, "f") == 0) { // face
-				model.mark_mat_as_used(cur_mat_id);
-
-				if (pblocks.empty() || pblocks.back().pts.size() >= block_size || smoothing_group != prev_smoothing_group) { // create a new block
-					if (!pblocks.empty()) {
-						remove_excess_cap(pblocks.back().polys);
-						remove_excess_cap(pblocks.back().pts);
-					}
-					pblocks.push_back(poly_data_block());
-					prev_smoothing_group = smoothing_group;
-				}
-				poly_data_block &pb(pblocks.back());
-				pb.polys.push_back(poly_header_t(cur_mat_id, obj_group_id));
+				poly_data_block &pb(start_face());
 				unsigned &npts(pb.polys.back().npts);
-				unsigned const pix((unsigned)pb.pts.size()), pts_start(pb.pts.size());
+				unsigned const pix((unsigned)pb.pts.size());
 				int vix(0), tix(0), nix(0);
 
 				while (read_int(vix)) { // read vertex index
@@ -602,60 +959,20 @@ public:
 					pb.pts.push_back(vntc_ix);
 					++npts;
 				} // end while vertex
-				if (npts < 3) {
-					if (!had_npts_error) {cerr << "Error near line " << approx_line << ": face has only " << npts << " vertices." << endl; had_npts_error = 1;}
-					pb.pts.resize(pts_start);
-					pb.polys.pop_back(); // remove pts and polygon
-					continue; // skip it
-				}
-				vector3d &normal(pb.polys.back().n);
-				
-				for (unsigned i = pix; i < pix+npts-2; ++i) { // find a nonzero normal
-					normal = cross_product((v[pb.pts[i+1].vix] - v[pb.pts[i].vix]), (v[pb.pts[i+2].vix] - v[pb.pts[i].vix])); // backwards?
-					// if we disable this normalize() we will weight normal contributions by polygon area,
-					// but we have to change the code below and it causes problems with vertex uniquing
-					normal.normalize();
-					if (normal != zero_vector) break; // got a good normal
-				}
-				if (recalc_normals) {
-					bool const face_weight_avg(recalc_normals == 2 && (npts == 3 || npts == 4)); // only works for quads and triangles
-					float face_area(0.0);
-
-					if (face_weight_avg) {
-						point face_pts[4];
-						for (unsigned i = 0; i < npts; ++i) {face_pts[i] = v[pb.pts[i+pix].vix];}
-						face_area = polygon_area(face_pts, npts);
-					}
-					for (unsigned i = pix; i < pix+npts; ++i) {
-						unsigned const vix(pb.pts[i].vix);
-						assert((unsigned)vix < vn.size());
-						bool const using_texgen(is_textured && model_auto_tc_scale > 0.0 && pb.pts[i].tix == 0);
-
-						if (vn[vix].is_valid() && (using_texgen || dot_product(normal, vn[vix].get_norm()) < 0.25)) { // normals in disagreement (or using texgen)
-							vn[vix] = zero_vector; // zero it out so that it becomes invalid later
-						}
-						else if (face_weight_avg) {vn[vix].add_normal(face_area*normal);} // face weighted average
-						else {vn[vix].add_normal(normal);} // unweighted average of normals
-					}
-				}
+				end_face(pb, pix, recalc_normals);
 			}
 			else if (strcmp(s, "v") == 0) { // vertex
-				v.push_back(point());
-				if (recalc_normals) {vn.push_back(counted_normal());} // vertex normal
+				point pos;
 			
-				if (!read_point(v.back())) {
+				if (!read_point(pos)) {
 					cerr << "Error reading vertex from object file " << filename << " near line " << approx_line << endl;
 					return 0;
 				}
 				colorRGB color;
 				int const color_ret(read_optional_color_RGB(color));
 				if (color_ret == 2) {cerr << "Error reading vertex color from object file " << filename << " near line " << approx_line << endl; return 0;}
-				else if (color_ret == 1) {
-					if (colors.empty()) {colors.resize(v.size()-1, WHITE);} // pad colors up to this point with white
-					colors.push_back(color);
-				}
-				else if (!colors.empty()) {colors.push_back(WHITE);} // color not specified, and in colors mode, pad with white
-				xf.xform_pos(v.back());
+				xf.xform_pos(pos);
+				add_vertex(pos, ((color_ret == 1) ? &color : nullptr), recalc_normals);
 			}
 			else if (strcmp(s, "vt") == 0) { // tex coord
 				point tc3d;
@@ -702,29 +1019,11 @@ public:
 			}
 			else if (strcmp(s, "usemtl") == 0) { // use material
 				read_str_to_newline(fp, material_name);
-
-				if (material_name.empty()) {
-					if (!had_empty_mat_error) {cerr << "Error reading material from object file " << filename << " near line " << approx_line << endl;}
-					had_empty_mat_error = 1;
-					return 0;
-				}
-				cur_mat_id = model.find_material(material_name);
-				
-				if (cur_mat_id >= 0) { // material was valid
-					int const tid(model.get_material(cur_mat_id).d_tid);
-					is_textured = (tid >= 0 && model.tmgr.get_tex_avg_color(tid) != WHITE); // no texture, or all white texture
-				}
+				if (!use_material(material_name)) return 0;
 			}
 			else if (strcmp(s, "mtllib") == 0) { // material library
 				read_str_to_newline(fp, mat_lib);
-
-				if (mat_lib.empty()) {
-					cerr << "Error reading material library from object file " << filename << " near line " << approx_line << endl;
-					return 0;
-				}
-				if (!try_load_mat_lib(mat_lib, loaded_mat_libs, approx_line)) {
-					//return 0; // nonfatal
-				}
+				if (!use_mat_lib(mat_lib)) return 0;
 			}
 			else {
 				cerr << "Error: Undefined entry '" << s << "' in object file " << filename << " near line " << approx_line << endl;
@@ -732,6 +1031,107 @@ public:
 				//return 0;
 			}
 		} // while
+		return 1;
+	}
+
+	// parallel parser: the file is memory mapped and split into chunks at line boundaries; chunks are parsed concurrently into per-chunk arrays
+	// and a list of face/state records, which are then replayed in file order through the same code as the sequential parser
+	bool read_parallel(geom_xform_t const &xf, int recalc_normals) {
+		mapped_file_t mfile;
+		if (!mfile.open(filename)) return read_sequential(xf, recalc_normals); // fall back to the sequential parser
+		char const *const data(mfile.get_data());
+		size_t const file_size(mfile.size());
+		vector<size_t> bounds(1, 0); // chunk start offsets
+
+		while (bounds.back() < file_size) {
+			size_t pos(min(bounds.back() + OBJ_CHUNK_SIZE, file_size));
+			while (pos < file_size && (data[pos-1] != '\n' || (pos > 1 && data[pos-2] == '\\'))) {++pos;} // move to the start of the next unescaped line
+			bounds.push_back(pos);
+		}
+		unsigned const num_chunks(bounds.size() - 1);
+		vector<obj_chunk_t> chunks(num_chunks);
+		RESET_TIME;
+
+#pragma omp parallel for schedule(dynamic)
+		for (int c = 0; c < (int)num_chunks; ++c) {
+			PROF_ZONE("Parse OBJ Chunk");
+			chunks[c].parse((data + bounds[c]), (data + bounds[c+1]), xf, recalc_normals);
+		}
+		int const parse_time(max(1, GET_DELTA_TIME));
+		unsigned line_start(0);
+
+		for (auto c = chunks.begin(); c != chunks.end(); ++c) { // stitch chunks together in order
+			unsigned const v_base(v.size()), t_base(tc.size()-1), n_base(n.size()-1); // account for tc[0] and n[0]
+			for (unsigned i = 0; i < c->v.size(); ++i) {add_vertex(c->v[i], (c->has_color[i] ? &c->vcolors[i] : nullptr), recalc_normals);}
+			tc.insert(tc.end(), c->tc.begin(), c->tc.end());
+			n .insert(n .end(), c->n .begin(), c->n .end());
+
+			for (auto op = c->ops.begin(); op != c->ops.end(); ++op) {
+				approx_line = line_start + op->line;
+
+				switch (op->type) {
+				case obj_chunk_t::OP_FACE: {
+					obj_chunk_t::face_t const &f(c->faces[op->ix]);
+					poly_data_block &pb(start_face());
+					unsigned &npts(pb.polys.back().npts);
+					unsigned const pix((unsigned)pb.pts.size());
+
+					for (unsigned i = f.start; i < f.start + f.npts; ++i) {
+						obj_chunk_t::face_vert_t const &fv(c->fverts[i]);
+						int vix(fv.v);
+						normalize_index(vix, (v_base + f.nv));
+						vntc_ix_t vntc_ix(vix, 0, 0);
+
+						if (fv.t != obj_chunk_t::NO_IX) {
+							int tix(fv.t);
+							normalize_index(tix, (t_base + f.nt));
+							vntc_ix.tix = tix+1; // account for tc[0]
+						}
+						if (fv.n != obj_chunk_t::NO_IX && !recalc_normals) {
+							int nix(fv.n);
+							normalize_index(nix, (n_base + f.nn));
+							vntc_ix.nix = nix+1; // account for n[0]
+						}
+						pb.pts.push_back(vntc_ix);
+						++npts;
+					}
+					end_face(pb, pix, recalc_normals);
+					break;
+				}
+				case obj_chunk_t::OP_OBJECT: ++num_objects; ++obj_group_id; break;
+				case obj_chunk_t::OP_GROUP:  ++num_groups;  ++obj_group_id; break;
+				case obj_chunk_t::OP_SMOOTH: smoothing_group = op->ix; break;
+				case obj_chunk_t::OP_USEMTL: if (!use_material(c->strs[op->ix])) return 0; break;
+				case obj_chunk_t::OP_MTLLIB: if (!use_mat_lib (c->strs[op->ix])) return 0; break;
+				case obj_chunk_t::OP_UNDEF:
+					cerr << "Error: Undefined entry '" << c->strs[op->ix] << "' in object file " << filename << " near line " << approx_line << endl;
+					break;
+				default: assert(0);
+				}
+			} // for op
+			if (!c->error.empty()) {
+				cerr << "Error reading " << c->error << " from object file " << filename << " near line " << (line_start + c->error_line) << endl;
+				return 0;
+			}
+			line_start += c->num_lines;
+			*c = obj_chunk_t(); // free memory
+		} // for c
+
+		if (obj_load_benchmark) {
+			float const file_mb(file_size/(1024.0*1024.0));
+			int const total_time(max(1, GET_DELTA_TIME)), stitch_time(max(1, (total_time - parse_time)));
+			cout << "Object file " << filename << ": " << file_mb << " MB in " << num_chunks << " chunks, parse " << 1000.0*file_mb/parse_time << " MB/s, stitch "
+				 << 1000.0*file_mb/stitch_time << " MB/s, total " << 1000.0*file_mb/total_time << " MB/s" << endl;
+		}
+		return 1;
+	}
+
+	bool read(geom_xform_t const &xf, int recalc_normals, bool verbose) {
+		RESET_TIME;
+		cout << "Reading object file " << filename << endl;
+		tc.push_back(point2d<float>(0.0, 0.0)); // default tex coords
+		n.push_back(zero_vector); // default normal
+		if (!(parallel_obj_load ? read_parallel(xf, recalc_normals) : read_sequential(xf, recalc_normals))) return 0;
 		remove_excess_cap(v);
 		remove_excess_cap(n);
 		remove_excess_cap(tc);
@@ -742,13 +1142,13 @@ public:
 		PRINT_TIME("Model Texture Load");
 		size_t const num_blocks(pblocks.size());
 		model3d::proc_model_normals(vn, recalc_normals); // if recalc_normals
+		vntc_map_t vmap[2]; // {triangles, quads}; shared across blocks so that vertices are welded across block boundaries
+		vntct_map_t vmap_tan[2]; // {triangles, quads}
 
 		while (!pblocks.empty()) {
 			poly_data_block const &pd(pblocks.back());
 			unsigned pix(0);
 			polygon_t poly;
-			vntc_map_t vmap[2]; // {triangles, quads}
-			vntct_map_t vmap_tan[2]; // {triangles, quads}
 
 			for (vector<poly_header_t>::const_iterator j = pd.polys.begin(); j != pd.polys.end(); ++j) {
 				poly.resize(j->npts);
@@ -791,6 +1191,13 @@ public:
 			size_t const nn(recalc_normals ? vn.size() : n.size());
 			cout << "verts: " << v.size() << ", normals: " << nn << ", tcs: " << tc.size() << ", colors: " << colors.size() << ", faces: " << num_faces
 				 << ", objects: " << num_objects << ", groups: " << num_groups << ", blocks: " << num_blocks << endl;
+			uint64_t num_lookups(0), num_unique(0);
+
+			for (unsigned d = 0; d < 2; ++d) {
+				num_lookups += vmap[d].get_num_lookups() + vmap_tan[d].get_num_lookups();
+				num_unique  += vmap[d].get_num_inserts() + vmap_tan[d].get_num_inserts();
+			}
+			cout << "vertex welding: " << num_lookups << " input verts, " << num_unique << " unique, dedup ratio " << (num_unique ? float(num_lookups)/num_unique : 1.0f) << endl;
 			model.show_stats();
 		}
 		return 1;
@@ -820,6 +1227,209 @@ bool write_model3d_file(string const &base_fn, model3d &cur_model) {
 }
 
 
+// ************ model cache ************
+
+unsigned const MODEL_CACHE_VERSION = 1; // increment when the model generation code changes in a way that invalidates cached models
+
+bool get_cache_dir_files(string const &dir, string const &ext, vector<cache_file_t> &files) { // not sorted
+#ifdef _WIN32
+	_finddata_t fd;
+	intptr_t const handle(_findfirst((dir + "/*" + ext).c_str(), &fd));
+	if (handle == -1) return 0;
+	do {files.push_back(cache_file_t({(dir + "/" + fd.name), (uint64_t)fd.size, fd.time_write}));} while (_findnext(handle, &fd) == 0);
+	_findclose(handle);
+#else
+	DIR *const d(opendir(dir.c_str()));
+	if (d == nullptr) return 0;
+
+	while (dirent const *const e = readdir(d)) {
+		string const fn(e->d_name);
+		if (!endswith(fn, ext)) continue;
+		string const path(dir + "/" + fn);
+		struct stat st;
+		if (stat(path.c_str(), &st) == 0) {files.push_back(cache_file_t({path, (uint64_t)st.st_size, st.st_mtime}));}
+	}
+	closedir(d);
+#endif
+	return 1;
+}
+
+void make_cache_dir(string const &dir) {
+#ifdef _WIN32
+	_mkdir(dir.c_str()); // may already exist
+#else
+	mkdir(dir.c_str(), 0755); // may already exist
+#endif
+}
+
+void touch_cache_file(string const &fn) { // update access time for LRU eviction
+#ifdef _WIN32
+	_utime(fn.c_str(), nullptr);
+#else
+	utime (fn.c_str(), nullptr);
+#endif
+}
+
+bool get_file_size_and_mtime(string const &fn, uint64_t &size, time_t &mtime) {
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(fn.c_str(), &st) != 0) return 0;
+#else
+	struct stat st;
+	if (stat(fn.c_str(), &st) != 0) return 0;
+#endif
+	size  = (uint64_t)st.st_size;
+	mtime = st.st_mtime;
+	return 1;
+}
+
+// caches compiled model3d files for object files, keyed by a hash of the file contents, the material libraries, and the load parameters;
+// misses are written back in a background thread, and the least recently used files are removed when the cache exceeds model_cache_max_mb
+class model_cache_t {
+	struct stats_t {
+		unsigned hits, misses, writes, write_errors, evictions;
+		uint64_t bytes_read, bytes_written;
+		stats_t() : hits(0), misses(0), writes(0), write_errors(0), evictions(0), bytes_read(0), bytes_written(0) {}
+	};
+	std::mutex mutex; // protects stats and cache directory updates
+	vector<std::thread> write_threads;
+	stats_t stats;
+	unsigned tmp_file_id;
+	bool dir_checked;
+
+	void evict(string const &dir, uint64_t max_size) { // Note: must be called with mutex locked
+		vector<cache_file_t> files;
+		if (!get_cache_dir_files(dir, ".model3d", files)) return;
+		uint64_t tot_size(0);
+		for (auto f = files.begin(); f != files.end(); ++f) {tot_size += f->size;}
+		if (tot_size <= max_size) return;
+		sort(files.begin(), files.end());
+
+		for (auto f = files.begin(); f != files.end() && tot_size > max_size; ++f) {
+			if (remove(f->fn.c_str()) != 0) continue;
+			tot_size -= f->size;
+			++stats.evictions;
+		}
+	}
+	void write_file(string const fn, string const tmp_fn, string const data, string const dir, uint64_t max_size) { // runs in a background thread
+		bool success(0);
+		{
+			ofstream out(tmp_fn, ios::out | ios::binary);
+			if (out.good()) {out.write(data.data(), data.size()); success = out.good();}
+		}
+		if (success) {
+			remove(fn.c_str()); // rename() fails on Windows if the file exists
+			success = (rename(tmp_fn.c_str(), fn.c_str()) == 0);
+		}
+		if (!success) {remove(tmp_fn.c_str());}
+		std::lock_guard<std::mutex> lock(mutex);
+		if (success) {++stats.writes; stats.bytes_written += data.size(); evict(dir, max_size);} else {++stats.write_errors;}
+	}
+public:
+	model_cache_t() : tmp_file_id(0), dir_checked(0) {}
+	~model_cache_t() {wait_for_writes();}
+	bool enabled() const {return !model_cache_dir.empty();}
+
+	void wait_for_writes() {
+		for (auto t = write_threads.begin(); t != write_threads.end(); ++t) {t->join();}
+		write_threads.clear();
+	}
+	string get_cache_filename(model_from_file_t const &reader, string const &filename, geom_xform_t const &xf, int recalc_normals) {
+		mapped_file_t mfile;
+		if (!mfile.open(filename)) return string(); // can't be cached
+		timer_t timer("Model Cache Hash");
+		hash64_t hash;
+		hash.add_val(MODEL_CACHE_VERSION);
+		char const *const data(mfile.get_data());
+		size_t const size(mfile.size());
+		hash.add(data, size);
+
+		for (size_t pos = 0; pos < size;) { // add all referenced material libraries
+			size_t end(pos);
+			while (end < size && data[end] != '\n') {++end;}
+			size_t start(pos);
+			while (start < end && (data[start] == ' ' || data[start] == '\t')) {++start;}
+
+			if (end - start > 7 && strncmp((data + start), "mtllib", 6) == 0 && isspace((unsigned char)data[start+6])) {
+				string mat_lib((data + start + 7), (data + end));
+				while (!mat_lib.empty() && isspace((unsigned char)mat_lib.front())) {mat_lib.erase(mat_lib.begin());}
+				while (!mat_lib.empty() && isspace((unsigned char)mat_lib.back ())) {mat_lib.pop_back();}
+				vector<string> names(1, mat_lib);
+				ifstream in;
+
+				if (reader.open_include_file(mat_lib, "material library", in).empty()) { // may be multiple whitespace separated names, as in try_load_mat_lib()
+					names.clear();
+					istringstream iss(mat_lib);
+					string str;
+					while (iss >> str) {names.push_back(str);}
+				}
+				for (auto n = names.begin(); n != names.end(); ++n) {
+					hash.add_str(*n);
+					in.close();
+					in.clear();
+					if (reader.open_include_file(*n, "material library", in).empty()) continue;
+					ostringstream oss;
+					oss << in.rdbuf();
+					hash.add_str(oss.str());
+				}
+			}
+			pos = end + 1;
+		}
+		// add load parameters and global state that affects the generated model
+		hash.add_val(xf.tv);
+		hash.add_val(xf.scale);
+		for (unsigned i = 0; i < 3; ++i) {hash.add_val(xf.mirror[i]); UNROLL_3X(hash.add_val(xf.swap_dim[i][i_]);)}
+		hash.add_val(recalc_normals);
+		hash.add_val(model_auto_tc_scale);
+		hash.add_val(get_vertex_weld_eps());
+		hash.add_val(model_lod_levels);
+		bool const flags[] = {model_calc_tan_vect, use_model_lod_blocks, no_subdiv_model, allow_model3d_quads, vert_opt_flags[0], vert_opt_flags[1], model3d_compress_geom};
+		hash.add(flags, sizeof(flags));
+		std::ostringstream oss;
+		oss << model_cache_dir << "/" << std::hex << std::setw(16) << std::setfill('0') << hash.h << ".model3d";
+		return oss.str();
+	}
+	bool try_load(object_file_reader_model &reader, string const &cache_fn, bool verbose) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!ifstream(cache_fn).good()) {++stats.misses; return 0;}
+		}
+		if (!reader.load_from_model3d_file(verbose, cache_fn)) {
+			cerr << "Error reading model cache file " << cache_fn << "; removing it" << endl;
+			std::lock_guard<std::mutex> lock(mutex);
+			remove(cache_fn.c_str());
+			++stats.misses;
+			return 0;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		++stats.hits;
+		mapped_file_t mfile;
+		if (mfile.open(cache_fn)) {stats.bytes_read += mfile.size();}
+		touch_cache_file(cache_fn);
+		return 1;
+	}
+	void write_async(string const &cache_fn, model3d &model) {
+		if (!dir_checked) {make_cache_dir(model_cache_dir); dir_checked = 1;}
+		model.calc_tangent_vectors(); // tangent vectors are needed for writing
+		ostringstream oss(ios::out | ios::binary);
+		if (!model.write_to_stream(oss)) {std::lock_guard<std::mutex> lock(mutex); ++stats.write_errors; return;}
+		std::ostringstream tmp_fn;
+		tmp_fn << cache_fn << ".tmp" << tmp_file_id++;
+		write_threads.push_back(std::thread(&model_cache_t::write_file, this, cache_fn, tmp_fn.str(), oss.str(), model_cache_dir, (uint64_t(model_cache_max_mb) << 20)));
+	}
+	void print_stats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		unsigned const num(stats.hits + stats.misses);
+		cout << "Model cache: " << stats.hits << " hits, " << stats.misses << " misses (" << (num ? 100.0*stats.hits/num : 0.0) << "% hit rate), "
+			 << stats.writes << " writes, " << stats.write_errors << " write errors, " << stats.evictions << " evictions, "
+			 << (stats.bytes_read >> 20) << " MB read, " << (stats.bytes_written >> 20) << " MB written" << endl;
+	}
+};
+
+model_cache_t model_cache;
+
+
+
 bool read_3ds_file_model(string const &filename, model3d &model, geom_xform_t const &xf, int use_vertex_normals, bool verbose);
 bool read_3ds_file_pts(string const &filename, vector<coll_tquad> *ppts, geom_xform_t const &xf, colorRGBA const &def_c, bool verbose);
 
@@ -845,7 +1455,15 @@ bool load_model_file(string const &filename, model3ds &models, geom_xform_t cons
 		else {
 			check_obj_file_ext(filename, ext);
 			//test_other_obj_loader(filename); // placeholder for testing other object file loaders (tinyobjloader, assimp, etc.)
-			if (!reader.read(xf, recalc_normals, verbose)) {models.pop_back(); return 0;}
+			string const cache_fn(model_cache.enabled() ? model_cache.get_cache_filename(reader, filename, xf, recalc_normals) : string());
+			bool const cache_hit(!cache_fn.empty() && model_cache.try_load(reader, cache_fn, verbose));
+
+			if (!cache_hit) {
+				if (!cache_fn.empty()) {cur_model.clear();} // in case a partial read from the cache failed
+				if (!reader.read(xf, recalc_normals, verbose)) {models.pop_back(); return 0;}
+				if (!cache_fn.empty()) {model_cache.write_async(cache_fn, cur_model);}
+			}
+			if (!cache_fn.empty()) {model_cache.print_stats();}
 			if (write_file && !write_model3d_file(filename, cur_model)) return 0; // don't need to pop the model
 		}
 	}
@@ -3,6 +3,9 @@
 // 12/6/18
 #include "city.h"
 #include "shaders.h"
+#include "profiler.h"
+#include <queue>
+#include <cfloat> // for FLT_MAX
 
 float const PED_WIDTH_SCALE  = 0.5; // ratio of collision radius to model radius (x/y)
 float const PED_HEIGHT_SCALE = 2.5; // ratio of collision radius to model height (z)
@@ -51,7 +54,7 @@ float get_sidewalk_width(cube_t const &plot_bcube) { // Note: technically should
 	return -STREETLIGHT_DIST_FROM_PLOT_EDGE*plot_sz + streetlight_ns::get_streetlight_pole_radius();
 }
 
-bool pedestrian_t::check_inside_plot(ped_manager_t &ped_mgr, point const &prev_pos, cube_t const &plot_bcube, cube_t const &next_plot_bcube) {
+bool pedestrian_t::check_inside_plot(ped_manager_t const &ped_mgr, point const &prev_pos, cube_t const &plot_bcube, cube_t const &next_plot_bcube) {
 	if (in_building) return 0; // not implemented yet
 	//if (ssn == 2516) {cout << "in_the_road: " << in_the_road << ", pos: " << pos.str() << ", plot_bcube: " << plot_bcube.str() << ", npbc: " << next_plot_bcube.str() << endl;}
 	if (plot_bcube.contains_pt_xy(pos)) {return 1;} // inside the plot
@@ -119,68 +122,42 @@ bool pedestrian_t::is_valid_pos(vect_cube_t const &colliders, bool &ped_at_dest,
 	return 1;
 }
 
-void register_ped_coll(pedestrian_t &p1, pedestrian_t &p2, unsigned pid1, unsigned pid2) {
-	p1.collided = p1.ped_coll = 1; p1.colliding_ped = pid2;
-	p2.collided = p2.ped_coll = 1; p2.colliding_ped = pid1;
-}
-
-bool pedestrian_t::check_ped_ped_coll_range(vector<pedestrian_t> &peds, unsigned pid, unsigned ped_start, unsigned target_plot, float prox_radius, vector3d &force) {
-	float const prox_radius_sq(prox_radius*prox_radius);
-
-	for (auto i = peds.begin()+ped_start; i != peds.end(); ++i) { // check every ped until we exit target_plot
-		if (i->plot != target_plot) break; // moved to a new plot, no collision, done; since plots are globally unique across cities, we don't need to check cities
-		float const dist_sq(p2p_dist_xy_sq(pos, i->pos));
-		if (dist_sq > prox_radius_sq) continue; // proximity test
-		float const r_sum(0.6f*(radius + i->radius)); // using a smaller radius to allow peds to get close to each other
-		if (dist_sq < r_sum*r_sum) {register_ped_coll(*this, *i, pid, (i - peds.begin())); return 1;} // collision
-		if (speed < TOLERANCE) continue;
-		vector3d const delta_v(vel - i->vel), delta_p((pos.x - i->pos.x), (pos.y - i->pos.y), 0.0);
-		float const dp(-dot_product_xy(delta_v, delta_p));
-		if (dp <= 0.0) continue; // diverging, no avoidance needed
-		float const dv_mag(delta_v.mag()), dist(sqrt(dist_sq)), fmag(dist/(dist - 0.9*r_sum));
-		if (dv_mag < TOLERANCE) continue;
-		vector3d const rejection(delta_p - (dp/(dv_mag*dv_mag))*delta_v); // component of velocity perpendicular to delta_p (avoid dir)
-		float const rmag(rejection.mag()), rel_vel(max(dv_mag/speed, 0.5f)); // higher when peds are converging
-		if (rmag < TOLERANCE) continue;
-		float const force_mult(dp/(dv_mag*dist)); // stronger with head-on collisions
-		force += rejection*(rel_vel*force_mult*fmag/rmag);
-		//cout << TXT(r_sum) << TXT(dist) << TXT(fmag) << ", dv: " << delta_v.str() << ", dp: " << delta_p.str() << ", rej: " << rejection.str() << ", force: " << force.str() << endl;
-	} // for i
+// checks against another ped within the proximity radius as of the beginning of the frame; only this ped is modified, so each ped can be updated independently
+bool pedestrian_t::check_ped_ped_coll_one(ped_snapshot_t const &other, unsigned other_ix, vector3d &force) {
+	float const dist_sq(p2p_dist_xy_sq(pos, other.pos));
+	float const r_sum(0.6f*(radius + other.radius)); // using a smaller radius to allow peds to get close to each other
+	if (dist_sq < r_sum*r_sum) {collided = ped_coll = 1; colliding_ped = other_ix; return 1;} // collision
+	if (speed < TOLERANCE) return 0;
+	vector3d const delta_v(vel - other.vel), delta_p((pos.x - other.pos.x), (pos.y - other.pos.y), 0.0);
+	float const dp(-dot_product_xy(delta_v, delta_p));
+	if (dp <= 0.0) return 0; // diverging, no avoidance needed
+	float const dv_mag(delta_v.mag()), dist(sqrt(dist_sq)), fmag(dist/(dist - 0.9*r_sum));
+	if (dv_mag < TOLERANCE) return 0;
+	vector3d const rejection(delta_p - (dp/(dv_mag*dv_mag))*delta_v); // component of velocity perpendicular to delta_p (avoid dir)
+	float const rmag(rejection.mag()), rel_vel(max(dv_mag/speed, 0.5f)); // higher when peds are converging
+	if (rmag < TOLERANCE) return 0;
+	float const force_mult(dp/(dv_mag*dist)); // stronger with head-on collisions
+	force += rejection*(rel_vel*force_mult*fmag/rmag);
+	//cout << TXT(r_sum) << TXT(dist) << TXT(fmag) << ", dv: " << delta_v.str() << ", dp: " << delta_p.str() << ", rej: " << rejection.str() << ", force: " << force.str() << endl;
 	return 0;
 }
 
-bool pedestrian_t::check_ped_ped_coll(ped_manager_t const &ped_mgr, vector<pedestrian_t> &peds, unsigned pid, float delta_dir) {
+bool pedestrian_t::check_ped_ped_coll(ped_manager_t const &ped_mgr, vector<ped_snapshot_t> const &snap, unsigned pid, float delta_dir) {
 	if (in_building) return 0; // no ped-ped collisions in buildings (yet)
-	assert(pid < peds.size());
+	assert(pid < snap.size());
 	float const timestep(2.0*TICKS_PER_SECOND), lookahead_dist(timestep*speed); // how far we can travel in 2s
 	float const prox_radius(1.2*radius + lookahead_dist); // assume other ped has a similar radius
 	vector3d force(zero_vector);
-	if (check_ped_ped_coll_range(peds, pid, pid+1, plot, prox_radius, force)) return 1;
-
-	if (in_the_road && next_plot != plot) {
-		// need to check for coll between two peds crossing the street from different sides, since they won't be in the same plot while in the street
-		unsigned const ped_ix(ped_mgr.get_first_ped_at_plot(next_plot));
-		assert(ped_ix <= peds.size()); // could be at the end
-		if (check_ped_ped_coll_range(peds, pid, ped_ix, next_plot, prox_radius, force)) return 1;
-	}
+	// the grid includes peds in all plots, so this also handles peds crossing the street from different sides
+	auto check_ped([&](unsigned ix) {
+		assert(ix < snap.size());
+		return (ix != pid && check_ped_ped_coll_one(snap[ix], ix, force)); // skip ourself
+	});
+	if (ped_mgr.get_ped_grid().query_radius(pos, prox_radius, check_ped)) return 1;
 	if (force != zero_vector) {set_velocity((0.1*delta_dir)*force + ((1.0 - delta_dir)/speed)*vel);} // apply ped repulsive force
 	return 0;
 }
 
-bool pedestrian_t::check_ped_ped_coll_stopped(vector<pedestrian_t> &peds, unsigned pid) {
-	if (in_building) return 0; // no ped-ped collisions in buildings (yet)
-	assert(pid < peds.size());
-
-	// Note: shouldn't have to check peds in the next plot, assuming that if we're stopped, they likely are as well, and won't be walking toward us
-	for (auto i = peds.begin()+pid+1; i != peds.end(); ++i) { // check every ped until we exit target_plot
-		if (i->plot != plot) break; // moved to a new plot, no collision, done; since plots are globally unique across cities, we don't need to check cities
-		if (!dist_xy_less_than(pos, i->pos, 0.6f*(radius + i->radius))) continue; // no collision
-		i->collided = i->ped_coll = 1; i->colliding_ped = pid;
-		return 1; // Note: could omit this return and continue processing peds
-	} // for i
-	return 0;
-}
-
 bool pedestrian_t::try_place_in_plot(cube_t const &plot_cube, vect_cube_t const &colliders, unsigned plot_id, rand_gen_t &rgen) {
 	pos    = rand_xy_pt_in_cube(plot_cube, radius, rgen);
 	pos.z += radius; // place on top of the plot
@@ -331,9 +308,131 @@ bool path_finder_t::find_best_path() {
 	return found_path();
 }
 
+void path_finder_t::set_best_path_from_nodes(ped_nav_graph_t const &graph) {
+	best_path.clear();
+	best_path.push_back(pos);
+	for (unsigned n : node_path) {best_path.push_back(point(graph.nodes[n].x, graph.nodes[n].y, pos.z));} // same zval as pos
+	best_path.push_back(dest);
+	best_path.calc_length();
+	shorten_path(best_path);
+	partial_path.clear();
+	partial_path.length = 0.0;
+}
+
+// A* search through the visibility graph; graph edges are valid for all peds, so only the edges to pos and dest need to be checked against this ped's avoid cubes
+bool path_finder_t::find_nav_graph_path(ped_nav_graph_t const &graph) {
+	unsigned const num_nodes(graph.nodes.size());
+	uint64_t const cache_key(graph.get_cache_key(pos, dest));
+
+	if (graph.get_cached_path(cache_key, node_path)) { // another ped went from near here to near there
+		assert(!node_path.empty());
+		if (!line_int_cubes_xy(pos, graph.nodes[node_path.front()], avoid) && !line_int_cubes_xy(graph.nodes[node_path.back()], dest, avoid)) {
+			set_best_path_from_nodes(graph);
+			return 1;
+		}
+	}
+	node_path.clear(); // no valid cached path, run A*
+	g_score.assign(num_nodes, FLT_MAX);
+	came_from.assign(num_nodes, -1);
+	used.assign(num_nodes, 0); // closed set
+	std::priority_queue<pair<float, unsigned> > open_queue; // max heap, so scores are negated
+
+	for (unsigned i = 0; i < num_nodes; ++i) { // connect pos to all visible nodes
+		point const &n(graph.nodes[i]);
+		if (!plot_bcube.contains_pt_xy(n) || line_int_cubes_xy(pos, n, avoid)) continue;
+		g_score[i] = p2p_dist_xy(pos, n);
+		open_queue.push(make_pair(-(g_score[i] + p2p_dist_xy(n, dest)), i));
+	}
+	float best_len(FLT_MAX);
+	int end_node(-1);
+
+	while (!open_queue.empty()) {
+		float const f_score(-open_queue.top().first);
+		unsigned const cur(open_queue.top().second);
+		open_queue.pop();
+		if (used[cur]) continue; // already closed (duplicate)
+		if (f_score >= best_len) break; // no remaining path can be shorter
+		used[cur] = 1;
+		point const &cur_pt(graph.nodes[cur]);
+
+		if (!line_int_cubes_xy(cur_pt, dest, avoid)) { // dest is visible from this node
+			float const len(g_score[cur] + p2p_dist_xy(cur_pt, dest));
+			if (len < best_len) {best_len = len; end_node = cur;}
+			continue; // going through another node can't be shorter
+		}
+		for (unsigned n : graph.adj[cur]) {
+			if (used[n]) continue;
+			float const new_g_score(g_score[cur] + p2p_dist_xy(cur_pt, graph.nodes[n]));
+			if (new_g_score >= g_score[n]) continue; // not better
+			g_score  [n] = new_g_score;
+			came_from[n] = cur;
+			open_queue.push(make_pair(-(new_g_score + p2p_dist_xy(graph.nodes[n], dest)), n));
+		}
+	} // end while
+	if (end_node < 0) return 0; // no path
+	for (int n = end_node; n >= 0; n = came_from[n]) {node_path.push_back(n);} // reconstruct path (in reverse)
+	reverse(node_path.begin(), node_path.end());
+	cache_adds.emplace_back(&graph, cache_key, cache_add_order, node_path); // the cache is read-only here, so add it later
+	set_best_path_from_nodes(graph);
+	return 1;
+}
+
+// ped_nav_graph_t
+void ped_nav_graph_t::build(vect_cube_t const &obstacles, cube_t const &plot_bcube, float gap, float cell_sz_) {
+	assert(cell_sz_ > 0.0);
+	clear();
+	bcube   = plot_bcube;
+	cell_sz = cell_sz_;
+
+	for (auto c = obstacles.begin(); c != obstacles.end(); ++c) { // add expanded corners that are inside the plot and not inside another obstacle
+		cube_t ec(*c);
+		ec.expand_by_xy(gap);
+
+		for (unsigned d = 0; d < 4; ++d) {
+			point const p(ec.d[0][d&1], ec.d[1][d>>1], plot_bcube.z1());
+			if (plot_bcube.contains_pt_xy(p) && !any_cube_contains_pt_xy(obstacles, p)) {nodes.push_back(p);}
+		}
+	}
+	adj.resize(nodes.size());
+
+	for (unsigned i = 0; i < nodes.size(); ++i) { // connect visible pairs of nodes; O(n^2) line tests, but only done once per plot
+		for (unsigned j = i+1; j < nodes.size(); ++j) {
+			if (line_int_cubes_xy(nodes[i], nodes[j], obstacles)) continue;
+			adj[i].push_back(j);
+			adj[j].push_back(i);
+		}
+	}
+}
+
+uint64_t ped_nav_graph_t::get_cache_key(point const &start, point const &goal) const { // 16 bits per cell coordinate, relative to the plot
+	uint64_t key(0);
+	point const pts[2] = {start, goal};
+
+	for (unsigned n = 0; n < 2; ++n) {
+		for (unsigned d = 0; d < 2; ++d) {
+			int const cell(round_fp((pts[n][d] - bcube.d[d][0])/cell_sz));
+			key = (key << 16) | (uint64_t)(cell & 0xFFFF);
+		}
+	}
+	return key;
+}
+
+bool ped_nav_graph_t::get_cached_path(uint64_t key, vector<unsigned> &node_path) const {
+	auto it(path_cache.find(key));
+	if (it == path_cache.end()) return 0;
+	node_path = it->second;
+	return 1;
+}
+
+void ped_nav_graph_t::add_cached_path(uint64_t key, vector<unsigned> const &node_path) const {
+	if (node_path.empty()) return; // straight paths aren't cached
+	if (path_cache.size() >= MAX_NAV_PATH_CACHE) {path_cache.clear();} // simple replacement policy
+	path_cache[key] = node_path;
+}
+
 // Note: avoid must be non-overlapping and should be non-adjacent; even better if cubes are separated enough that peds can pass between them (> 2*ped radius)
 // return values: 0=failed, 1=valid path, 2=init contained, 3=straight path (no collisions)
-unsigned path_finder_t::run(point const &pos_, point const &dest_, cube_t const &plot_bcube_, float gap_, point &new_dest) {
+unsigned path_finder_t::run(point const &pos_, point const &dest_, cube_t const &plot_bcube_, float gap_, point &new_dest, ped_nav_graph_t const *nav_graph) {
 	if (!line_int_cubes_xy(pos_, dest_, avoid)) return 3; // no work to be done, leave dest as it is
 	pos = pos_; dest = dest_; plot_bcube = plot_bcube_; gap = gap_;
 	//if (any_cube_contains_pt_xy(avoid, dest)) return 0; // invalid dest pos - ignore for now and let path finding deal with it when we get to that pos
@@ -368,7 +467,8 @@ unsigned path_finder_t::run(point const &pos_, point const &dest_, cube_t const
 			}
 		} // for i
 	}
-	if (!find_best_path()) return 0; // if we fail to find a path, leave new_dest unchanged
+	bool const found(nav_graph && find_nav_graph_path(*nav_graph)); // try the plot's visibility graph first
+	if (!found && !find_best_path()) return 0; // if we fail to find a path, leave new_dest unchanged
 	vector<point> const &path(get_best_path());
 	assert(next_pt_ix < path.size());
 	new_dest = path[next_pt_ix]; // set dest to next point on the best path
@@ -475,17 +575,16 @@ void pedestrian_t::move(ped_manager_t const &ped_mgr, cube_t const &plot_bcube,
 	anim_time += timestep*speed;
 }
 
-void pedestrian_t::next_frame(ped_manager_t &ped_mgr, vector<pedestrian_t> &peds, unsigned pid, rand_gen_t &rgen, float delta_dir) {
-	if (destroyed)    return; // destroyed
-	if (speed == 0.0) return; // not moving, no update needed
-	if (in_building)  return; // building update/movement logic handled elsewhere
+bool pedestrian_t::needs_update() const {
+	if (destroyed)    return 0; // destroyed
+	if (speed == 0.0) return 0; // not moving, no update needed
+	if (in_building)  return 0; // building update/movement logic handled elsewhere
+	return 1;
+}
 
-	// navigation with destination
-	if (at_dest) {
-		register_at_dest();
-		ped_mgr.choose_new_ped_plot_pos(*this);
-	}
-	if (at_crosswalk) {ped_mgr.mark_crosswalk_in_use(*this);}
+// Note: may be called from multiple threads; at_dest and at_crosswalk have already been handled by ped_manager_t::next_frame(), and other peds are only read through snap
+void pedestrian_t::next_frame(ped_manager_t const &ped_mgr, vector<ped_snapshot_t> const &snap, unsigned pid, path_finder_t &path_finder, rand_gen_t &rgen, float delta_dir) {
+	if (!needs_update()) return;
 	// movement logic
 	cube_t const &plot_bcube(ped_mgr.get_city_plot_bcube_for_peds(city, plot));
 	cube_t const &next_plot_bcube(ped_mgr.get_city_plot_bcube_for_peds(city, next_plot));
@@ -497,8 +596,7 @@ void pedestrian_t::next_frame(ped_manager_t &ped_mgr, vector<pedestrian_t> &peds
 			target_pos = all_zeros;
 			go(); // back up or turn so that we don't walk forward into the street? move() should attempt to rotate in place
 		}
-		else {
-			check_ped_ped_coll_stopped(peds, pid); // still need to check for other peds colliding with us; this doesn't always work
+		else { // other peds check for collisions with us
 			collided = ped_coll = 0;
 			return;
 		}
@@ -507,11 +605,10 @@ void pedestrian_t::next_frame(ped_manager_t &ped_mgr, vector<pedestrian_t> &peds
 	vect_cube_t const &colliders(ped_mgr.get_colliders_for_plot(city, plot));
 	bool outside_plot(0);
 
-	if (collided) {} // already collided with a previous ped this frame, handled below
-	else if (!check_inside_plot(ped_mgr, prev_pos, plot_bcube, next_plot_bcube)) {collided = outside_plot = 1;} // outside the plot, treat as a collision with the plot bounds
+	if (!check_inside_plot(ped_mgr, prev_pos, plot_bcube, next_plot_bcube)) {collided = outside_plot = 1;} // outside the plot, treat as a collision with the plot bounds
 	else if (!is_valid_pos(colliders, at_dest, &ped_mgr)) {collided = 1;} // collided with a static collider
 	else if (check_road_coll(ped_mgr, plot_bcube, next_plot_bcube)) {collided = 1;} // collided with something in the road (stoplight, streetlight, etc.)
-	else if (check_ped_ped_coll(ped_mgr, peds, pid, delta_dir)) {collided = 1;} // collided with another pedestrian
+	else if (check_ped_ped_coll(ped_mgr, snap, pid, delta_dir)) {collided = 1;} // collided with another pedestrian
 	else { // no collisions
 		//cout << TXT(pid) << TXT(plot) << TXT(dest_plot) << TXT(next_plot) << TXT(at_dest) << TXT(delta_dir) << TXT((unsigned)stuck_count) << TXT(collided) << endl;
 		vector3d dest_pos(get_dest_pos(plot_bcube, next_plot_bcube, ped_mgr));
@@ -526,12 +623,12 @@ void pedestrian_t::next_frame(ped_manager_t &ped_mgr, vector<pedestrian_t> &peds
 			}
 			// run only every several frames to reduce runtime; also run when at dest and when close to the current target pos or at the destination
 			if (at_dest || update_path) {
-				get_avoid_cubes(ped_mgr, colliders, dest_pos, ped_mgr.path_finder.get_avoid_vector());
+				get_avoid_cubes(ped_mgr, colliders, dest_pos, path_finder.get_avoid_vector());
 				target_pos = all_zeros;
 				cube_t union_plot_bcube(plot_bcube);
 				union_plot_bcube.union_with_cube(next_plot_bcube); // this is the area the ped is constrained to (both plots + road in between)
 				// run path finding between pos and dest_pos using avoid cubes
-				if (ped_mgr.path_finder.run(pos, dest_pos, union_plot_bcube, 0.1*radius, dest_pos)) {target_pos = dest_pos;}
+				if (path_finder.run(pos, dest_pos, union_plot_bcube, 0.1*radius, dest_pos, ped_mgr.get_nav_graph(plot))) {target_pos = dest_pos;}
 			}
 			else if (target_valid()) {dest_pos = target_pos;} // use previous frame's dest if valid
 			vector3d dest_dir((dest_pos.x - pos.x), (dest_pos.y - pos.y), 0.0); // zval=0, not normalized
@@ -561,10 +658,13 @@ void pedestrian_t::next_frame(ped_manager_t &ped_mgr, vector<pedestrian_t> &peds
 			else {pos += rgen.signed_rand_vector_spherical_xy()*(0.1*radius); } // shift randomly by 10% radius to get unstuck
 		}
 		if (ped_coll) {
-			assert(colliding_ped < peds.size());
-			vector3d const coll_dir(peds[colliding_ped].pos - pos);
+			assert(colliding_ped < snap.size());
+			vector3d const coll_dir(snap[colliding_ped].pos - pos);
 			new_dir = cross_product(vel, plus_z);
 			if (dot_product_xy(new_dir, coll_dir) > 0.0) {new_dir = -new_dir;} // orient away from the other ped
+			sphere_spatial_hash_t const &ped_grid(ped_mgr.get_ped_grid());
+			// in a crowd, if there's another ped right beside us in that dir but not on the other side, sidestep the other way instead
+			if (ped_grid.find_nearest_in_dir(pos, new_dir, 2.0*radius, radius, pid) >= 0 && ped_grid.find_nearest_in_dir(pos, -new_dir, 2.0*radius, radius, pid) < 0) {new_dir = -new_dir;}
 		}
 		else { // static object collision (should be rare if path_finder does a good job)
 			new_dir = rgen.signed_rand_vector_spherical_xy(); // try a random new direction
@@ -714,6 +814,33 @@ void ped_manager_t::sort_by_city_and_plot() {
 	need_to_sort_peds = 0; // peds are now sorted
 }
 
+void ped_manager_t::build_nav_graphs() { // Note: buildings and plot colliders are static, so this only needs to be done once
+	timer_t timer("Build Ped Nav Graphs");
+	vector<unsigned> plot_to_city; // indexed by global plot ID
+	get_plot_to_city_map(plot_to_city);
+	unsigned const num_plots(plot_to_city.size());
+	float max_radius(0.0);
+	for (auto i = peds.begin(); i != peds.end(); ++i) {max_eq(max_radius, i->radius);}
+	if (max_radius == 0.0) return; // no peds
+	float const expand(1.1*max_radius), gap(0.1*max_radius); // same values as used by pedestrian_t::get_avoid_cubes() and path finding, for the largest ped
+
+	nav_graphs.clear();
+	nav_graphs.resize(num_plots);
+
+#pragma omp parallel for schedule(dynamic)
+	for (int plot = 0; plot < (int)num_plots; ++plot) {
+		unsigned const city(plot_to_city[plot]);
+		if (city == NO_CITY_IX) continue; // plot ID gap between cities
+		cube_t const &plot_bcube(get_city_plot_bcube_for_peds(city, plot));
+		vect_cube_t obstacles;
+		get_building_bcubes(plot_bcube, obstacles);
+		vector_add_to(get_colliders_for_plot(city, plot), obstacles);
+		if (obstacles.empty() || obstacles.size() > MAX_NAV_GRAPH_OBSTACLES) continue; // nothing to avoid, or too slow to build
+		expand_cubes_by_xy(obstacles, expand);
+		nav_graphs[plot].build(obstacles, plot_bcube, gap, 4.0*max_radius);
+	}
+}
+
 bool ped_manager_t::proc_sphere_coll(point &pos, float radius, vector3d *cnorm) const { // Note: no p_last; for potential use with ped/ped collisions
 	float const rsum(get_ped_radius() + radius);
 
@@ -792,10 +919,47 @@ void ped_manager_t::register_ped_new_plot(pedestrian_t const &ped) {
 	if (!need_to_sort_city.empty()) {need_to_sort_city[ped.city] = 1;}
 	need_to_sort_peds = 1;
 }
-void ped_manager_t::move_ped_to_next_plot(pedestrian_t &ped) {
+void ped_manager_t::move_ped_to_next_plot(pedestrian_t &ped) const { // Note: the plot change is registered by next_frame() after all peds are updated
 	if (ped.next_plot == ped.plot) return; // already there (error?)
 	ped.plot = ped.next_plot; // assumes plot is adjacent; doesn't actually do any moving, only registers the move
-	register_ped_new_plot(ped);
+}
+
+void sphere_spatial_hash_t::build(float cell_sz) {
+	assert(cell_sz > 0.0);
+	inv_cell_sz = 1.0/cell_sz;
+	unsigned num_buckets(1);
+	while (num_buckets < 2*entries.size()) {num_buckets <<= 1;} // at least 2x the number of entries to keep buckets short
+	mask = num_buckets - 1;
+	bucket_start.assign((num_buckets + 1), 0);
+
+	for (auto &e : entries) { // counting sort by bucket, which keeps entries in the same cell in insertion order
+		e.cx = get_cell(e.x);
+		e.cy = get_cell(e.y);
+		++bucket_start[get_bucket(e.cx, e.cy)+1];
+	}
+	for (unsigned b = 0; b < num_buckets; ++b) {bucket_start[b+1] += bucket_start[b];}
+	insert_pos.assign(bucket_start.begin(), bucket_start.end()-1);
+	sorted.resize(entries.size(), entry_t(all_zeros, 0.0, 0));
+	for (auto const &e : entries) {sorted[insert_pos[get_bucket(e.cx, e.cy)]++] = e;}
+	entries.clear(); // ready for the next frame
+}
+
+// returns the index of the closest sphere whose center is ahead of pos along dir and within half_width (plus its radius) of the line through pos, or -1 if none
+int sphere_spatial_hash_t::find_nearest_in_dir(point const &pos, vector3d const &dir, float max_dist, float half_width, unsigned exclude_ix) const {
+	vector3d const dir_xy(vector3d(dir.x, dir.y, 0.0).get_norm());
+	float best_dist(max_dist);
+	int best_ix(-1);
+
+	auto check_entry([&](entry_t const &e) {
+		if (e.ix == exclude_ix) return 0;
+		float const dx(e.x - pos.x), dy(e.y - pos.y), along(dx*dir_xy.x + dy*dir_xy.y);
+		if (along <= 0.0 || along >= best_dist) return 0; // behind us, or not closer
+		float const perp(fabs(dx*dir_xy.y - dy*dir_xy.x)); // distance from the line
+		if (perp < half_width + e.radius) {best_dist = along; best_ix = e.ix;}
+		return 0; // keep going to find the closest
+	});
+	visit_radius(pos, max_dist, check_entry);
+	return best_ix;
 }
 
 void ped_manager_t::next_frame() {
@@ -814,8 +978,53 @@ void ped_manager_t::next_frame() {
 
 		if (first_frame) { // choose initial ped destinations (must be after building setup, etc.)
 			for (auto i = peds.begin(); i != peds.end(); ++i) {choose_dest_building_or_parked_car(*i);}
+			build_nav_graphs();
+		}
+		for (auto i = peds.begin(); i != peds.end(); ++i) { // serial pass for updates that modify rgen or shared city state, in ped order
+			if (!i->needs_update()) continue;
+
+			if (i->at_dest) { // navigation with destination
+				i->register_at_dest();
+				choose_new_ped_plot_pos(*i);
+			}
+			if (i->at_crosswalk) {mark_crosswalk_in_use(*i);}
+		}
+		// parallel pass: each ped reads other peds from a snapshot and only modifies itself, and uses its own rand gen, so results don't depend on thread count;
+		// nav graph path caches are read-only during this pass, and new paths are added afterward in ped order
+		// Note: when called from the city update thread, the nested parallel region only gets extra threads if nested parallelism is enabled (OMP_MAX_ACTIVE_LEVELS)
+		ped_snap.assign(peds.begin(), peds.end());
+		unsigned const num_plots(by_plot.empty() ? 0 : (by_plot.size() - 1));
+		float max_radius(0.0);
+
+		for (unsigned i = 0; i < ped_snap.size(); ++i) {
+			ped_grid.add(ped_snap[i].pos, ped_snap[i].radius, i);
+			max_eq(max_radius, ped_snap[i].radius);
+		}
+		ped_grid.build(2.0*max_radius); // cell size is the max ped diameter
+
+	#pragma omp parallel if (peds.size() > 1000)
+		{
+			PROF_ZONE("Ped Update Thread");
+			path_finder_t path_finder; // one per thread
+
+		#pragma omp for schedule(dynamic)
+			for (int plot = 0; plot < (int)num_plots; ++plot) { // peds are sorted by plot, so each plot is a contiguous range
+				for (unsigned pid = by_plot[plot]; pid < by_plot[plot+1]; ++pid) {
+					rand_gen_t ped_rgen;
+					ped_rgen.set_state(pid+1, frame_counter+1);
+					path_finder.set_cache_add_order(pid);
+					peds[pid].next_frame(*this, ped_snap, pid, path_finder, ped_rgen, delta_dir);
+				}
+			}
+		#pragma omp critical(merge_nav_cache_adds)
+			vector_add_to(path_finder.get_cache_adds(), nav_cache_adds);
+		} // end omp parallel
+		stable_sort(nav_cache_adds.begin(), nav_cache_adds.end()); // sort by ped so that the caches don't depend on thread scheduling
+		for (auto const &a : nav_cache_adds) {a.graph->add_cached_path(a.key, a.node_path);}
+		nav_cache_adds.clear();
+		for (unsigned i = 0; i < peds.size(); ++i) { // register plot changes
+			if (peds[i].plot != ped_snap[i].plot) {register_ped_new_plot(peds[i]);}
 		}
-		for (auto i = peds.begin(); i != peds.end(); ++i) {i->next_frame(*this, peds, (i - peds.begin()), rgen, delta_dir);}
 		if (need_to_sort_peds) {sort_by_city_and_plot();}
 		first_frame = 0;
 	}
@@ -966,7 +1175,7 @@ void pedestrian_t::debug_draw(ped_manager_t &ped_mgr) const {
 	cube_t union_plot_bcube(plot_bcube);
 	union_plot_bcube.union_with_cube(next_plot_bcube);
 	vector<point> path;
-	unsigned const ret(path_finder.run(pos, dest_pos, union_plot_bcube, 0.05*radius, dest_pos)); // 0=no path, 1=standard path, 2=init intersection path
+	unsigned const ret(path_finder.run(pos, dest_pos, union_plot_bcube, 0.05*radius, dest_pos, ped_mgr.get_nav_graph(plot))); // 0=no path, 1=standard path, 2=init intersection path
 	if (ret == 0) return; // no path found
 	bool const at_dest_plot(plot == dest_plot), complete(path_finder.found_complete_path());
 	colorRGBA line_color(at_dest_plot ? RED : YELLOW); // paths
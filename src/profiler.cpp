@@ -4,9 +4,16 @@
 
 #include "3DWorld.h"
 #include "profiler.h"
+#include <mutex>
+#include <unordered_map>
+#include <fstream>
+#include <iomanip>
+#include <cstring> // for strlen()
 
 using std::string;
 
+extern string prof_trace_fn;
+
 
 template <typename T> class timing_profiler {
 
@@ -53,6 +60,7 @@ void timing_profiler_stats() {
 	global_profiler.clear();
 	global_highres_profiler.stats();
 	global_highres_profiler.clear();
+	prof_zone_stats();
 }
 
 void highres_timer_t::end() {
@@ -62,3 +70,132 @@ void highres_timer_t::end() {
 	name.clear(); // make sure we don't double count this
 }
 
+
+// ************ hierarchical timing zones ************
+
+thread_local prof_thread_buf_t *prof_thread_buf(nullptr);
+
+class prof_thread_registry_t {
+	std::mutex lock;
+	vector<std::unique_ptr<prof_thread_buf_t>> bufs; // never freed, since the owning threads may still be running
+public:
+	prof_thread_buf_t *add() {
+		std::lock_guard<std::mutex> guard(lock);
+		bufs.emplace_back(new prof_thread_buf_t(bufs.size()));
+		return bufs.back().get();
+	}
+	// copies events recorded since the last call; events may be torn if a thread overwrites its ring while we copy, so this should be called between frames
+	void collect(vector<vector<prof_event_t>> &thread_events) {
+		std::lock_guard<std::mutex> guard(lock);
+		thread_events.resize(bufs.size());
+
+		for (unsigned t = 0; t < bufs.size(); ++t) {
+			prof_thread_buf_t &buf(*bufs[t]);
+			uint64_t const end(buf.num_events.load(std::memory_order_acquire)), start(max(buf.read_pos, ((end > PROF_RING_SIZE) ? (end - PROF_RING_SIZE) : 0)));
+			thread_events[t].clear();
+			for (uint64_t i = start; i < end; ++i) {thread_events[t].push_back(buf.events[i & (PROF_RING_SIZE-1)]);}
+			buf.read_pos = end;
+		}
+	}
+};
+
+prof_thread_registry_t prof_thread_registry;
+
+prof_thread_buf_t *register_prof_thread() {
+	prof_thread_buf = prof_thread_registry.add();
+	return prof_thread_buf;
+}
+
+void write_json_str(std::ostream &out, char const *str) {
+	out << '"';
+	for (char const *c = str; *c; ++c) {
+		if (*c == '"' || *c == '\\') {out << '\\';}
+		out << *c;
+	}
+	out << '"';
+}
+
+// writes Chrome trace_event JSON, which can be viewed in chrome://tracing or Perfetto
+bool write_prof_trace(string const &fn, vector<vector<prof_event_t>> const &thread_events, uint64_t min_time) {
+
+	std::ofstream out(fn);
+
+	if (!out.good()) {
+		std::cerr << "Error opening profiler trace file for write: " << fn << endl;
+		return 0;
+	}
+	out << "{\"traceEvents\":[" << endl << std::fixed << std::setprecision(3);
+	bool first(1);
+
+	for (unsigned t = 0; t < thread_events.size(); ++t) {
+		out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t << ",\"args\":{\"name\":\"thread " << t << "\"}}";
+		first = 0;
+
+		for (auto e = thread_events[t].begin(); e != thread_events[t].end(); ++e) {
+			out << ",\n{\"name\":";
+			write_json_str(out, e->name);
+			out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << t << ",\"ts\":" << 0.001*(e->start_ns - min_time) << ",\"dur\":" << 0.001*e->dur_ns
+				<< ",\"args\":{\"id\":" << e->id << ",\"parent\":" << e->parent_id << ",\"depth\":" << e->depth << "}}";
+		}
+	}
+	out << endl << "]}" << endl;
+	return out.good();
+}
+
+struct prof_zone_entry_t {
+	unsigned count, depth;
+	uint64_t time, tmax, self_time;
+	char const *name;
+	prof_zone_entry_t() : count(0), depth(0), time(0), tmax(0), self_time(0), name(nullptr) {}
+};
+
+// prints count, total, max, and self time in ms for each unique path of nested zone names across all threads
+void prof_zone_stats() {
+
+	vector<vector<prof_event_t>> thread_events;
+	prof_thread_registry.collect(thread_events);
+	map<string, prof_zone_entry_t> entries; // sorted by path, which gives a depth first tree order
+	uint64_t min_time(0);
+	unsigned num_events(0);
+
+	for (auto te = thread_events.begin(); te != thread_events.end(); ++te) {
+		std::unordered_map<unsigned, unsigned> id_to_ix; // zone ID => event index; parents are recorded after their children
+		vector<string> paths(te->size());
+		vector<uint64_t> child_time(te->size(), 0);
+		for (unsigned i = 0; i < te->size(); ++i) {id_to_ix[(*te)[i].id] = i;}
+
+		for (unsigned i = 0; i < te->size(); ++i) { // accumulate child times into parents
+			prof_event_t const &e((*te)[i]);
+			auto it(id_to_ix.find(e.parent_id));
+			if (e.parent_id > 0 && it != id_to_ix.end()) {child_time[it->second] += e.dur_ns;}
+			min_time = ((num_events == 0) ? e.start_ns : min(min_time, e.start_ns));
+			++num_events;
+		}
+		for (unsigned i = te->size(); i > 0; --i) { // parents come after children, so iterate backwards to build paths top-down
+			prof_event_t const &e((*te)[i-1]);
+			auto it(id_to_ix.find(e.parent_id));
+			string const parent_path((e.parent_id > 0 && it != id_to_ix.end() && it->second > i-1) ? paths[it->second] : ""); // parent missing if overwritten or still open
+			paths[i-1] = parent_path + "/" + e.name;
+			prof_zone_entry_t &entry(entries[paths[i-1]]);
+			entry.name  = e.name;
+			entry.depth = e.depth;
+			++entry.count;
+			entry.time     += e.dur_ns;
+			entry.tmax      = max(entry.tmax, e.dur_ns);
+			entry.self_time += ((e.dur_ns > child_time[i-1]) ? (e.dur_ns - child_time[i-1]) : 0);
+		}
+	} // for te
+	if (entries.empty()) return;
+	cout << "zone count total max self (ms) over " << thread_events.size() << " threads" << endl;
+	unsigned max_name(0);
+	for (auto i = entries.begin(); i != entries.end(); ++i) {max_name = max(max_name, unsigned(2*i->second.depth + strlen(i->second.name)));}
+
+	for (auto i = entries.begin(); i != entries.end(); ++i) {
+		prof_zone_entry_t const &e(i->second);
+		string const indent(2*e.depth, ' '), spaces((max_name - 2*e.depth - strlen(e.name)), ' ');
+		cout << indent << e.name << spaces << ": " << e.count << "\t" << 1.0E-6*e.time << "\t" << 1.0E-6*e.tmax << "\t" << 1.0E-6*e.self_time << endl;
+	}
+	if (!prof_trace_fn.empty() && write_prof_trace(prof_trace_fn, thread_events, min_time)) {
+		cout << "Wrote " << num_events << " zones to profiler trace file " << prof_trace_fn << endl;
+	}
+}
@@ -5,6 +5,8 @@
 
 #include <string>
 #include <chrono>
+#include <atomic>
+#include <cstdint>
 
 using namespace std::chrono;
 
@@ -14,9 +16,73 @@ class highres_timer_t {
 	high_resolution_clock::time_point timer1;
 	high_resolution_clock clock;
 public:
-	highres_timer_t(char const *const name_,  bool enabled_=1) : name(name_), timer1(clock.now()), enabled(enabled_) {}
-	highres_timer_t(std::string const &name_, bool enabled_=1) : name(name_), timer1(clock.now()), enabled(enabled_) {}
+	highres_timer_t(char const *const name_,  bool enabled_=1) : name(name_), enabled(enabled_), timer1(high_resolution_clock::now()) {}
+	highres_timer_t(std::string const &name_, bool enabled_=1) : name(name_), enabled(enabled_), timer1(high_resolution_clock::now()) {}
 	~highres_timer_t() {end();}
 	void end();
 };
 
+
+// hierarchical timing zones: each thread records completed zones into its own ring buffer without locking;
+// events are collected and consumed by timing_profiler_stats(), which prints per-path totals and optionally writes a Chrome trace
+unsigned const PROF_RING_SIZE = (1 << 16); // events per thread; must be a power of 2
+
+extern bool enable_prof_zones;
+
+inline uint64_t get_prof_time_ns() {return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();}
+
+struct prof_event_t {
+	char const *name; // must be a string literal or otherwise never freed
+	uint64_t start_ns, dur_ns;
+	unsigned id, parent_id, depth; // per-thread zone IDs; parent_id=0 for top level zones
+};
+
+struct prof_thread_buf_t {
+	prof_event_t events[PROF_RING_SIZE];
+	std::atomic<uint64_t> num_events; // written only by the owning thread
+	uint64_t read_pos; // written only by the collecting thread
+	unsigned thread_id, next_id, cur_id, depth;
+
+	prof_thread_buf_t(unsigned thread_id_) : num_events(0), read_pos(0), thread_id(thread_id_), next_id(0), cur_id(0), depth(0) {}
+
+	void add(prof_event_t const &e) { // older events are overwritten if the collector falls behind
+		uint64_t const n(num_events.load(std::memory_order_relaxed));
+		events[n & (PROF_RING_SIZE-1)] = e;
+		num_events.store(n+1, std::memory_order_release);
+	}
+};
+
+prof_thread_buf_t *register_prof_thread();
+extern thread_local prof_thread_buf_t *prof_thread_buf;
+
+class prof_zone_t {
+	char const *name;
+	prof_thread_buf_t *buf; // nullptr if disabled
+	uint64_t start_ns;
+	unsigned id, parent_id, depth;
+public:
+	prof_zone_t(char const *const name_) : name(name_), buf(nullptr), start_ns(0), id(0), parent_id(0), depth(0) {
+		if (!enable_prof_zones) return;
+		buf = prof_thread_buf;
+		if (buf == nullptr) {buf = register_prof_thread();} // first zone on this thread
+		id        = ++buf->next_id;
+		parent_id = buf->cur_id;
+		depth     = buf->depth++;
+		buf->cur_id = id;
+		start_ns  = get_prof_time_ns();
+	}
+	~prof_zone_t() {
+		if (buf == nullptr) return;
+		prof_event_t const e = {name, start_ns, (get_prof_time_ns() - start_ns), id, parent_id, depth};
+		buf->add(e);
+		buf->cur_id = parent_id;
+		--buf->depth;
+	}
+};
+
+#define PROF_ZONE_CAT2(a, b) a##b
+#define PROF_ZONE_CAT(a, b) PROF_ZONE_CAT2(a, b)
+#define PROF_ZONE(name) prof_zone_t const PROF_ZONE_CAT(prof_zone_, __LINE__)(name)
+
+void prof_zone_stats();
+
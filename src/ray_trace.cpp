@@ -21,12 +21,13 @@ float const ICE_ALBEDO    = 0.8;
 bool keep_beams(0); // debugging mode
 bool kill_raytrace(0);
 bool no_stat_moving(0); // generally not thread safe for dynamic lighting update, since BVH is rebuilt per-frame; also, wrong to cache lighting for moving cobjs
-unsigned NPTS(50000), NRAYS(40000), LOCAL_RAYS(1000000), GLOBAL_RAYS(1000000), DYNAMIC_RAYS(1000000), NUM_THREADS(1), MAX_RAY_BOUNCES(20);
+unsigned NPTS(50000), NRAYS(40000), LOCAL_RAYS(1000000), GLOBAL_RAYS(1000000), DYNAMIC_RAYS(1000000), NUM_THREADS(1), MAX_RAY_BOUNCES(20), LIGHTING_PASSES(1);
 std::atomic<unsigned long long> tot_rays(0), num_hits(0), cells_touched(0);
 unsigned const NUM_RAY_SPLITS [NUM_LIGHTING_TYPES] = {1, 1, 1, 1, 1}; // sky, global, local, cobj_accum, dynamic
 unsigned const INIT_RAY_SPLITS[NUM_LIGHTING_TYPES] = {1, 4, 1, 1, 1}; // sky, global, local, cobj_accum, dynamic
+unsigned const GLOBAL_RAY_BATCH_SIZE = 64; // number of randomized global rays traced together as ray packets
 
-extern bool has_snow, combined_gu, global_lighting_update, lighting_update_offline, store_cobj_accum_lighting_as_blocked;
+extern bool has_snow, combined_gu, global_lighting_update, lighting_update_offline, store_cobj_accum_lighting_as_blocked, lighting_scaling_test, lighting_dda_walk, lighting_ray_packets, incremental_lighting, lighting_file_half_float;
 extern int read_light_files[], write_light_files[], display_mode, DISABLE_WATER;
 extern float water_plane_z, temperature, snow_depth, ray_step_size_mult, first_ray_weight[];
 extern char *lighting_file[];
@@ -189,6 +190,8 @@ struct cobj_ray_accum_map_t : public map<unsigned, cobj_ray_accum_t> {
 };
 
 cobj_ray_accum_map_t merged_accum_map;
+unsigned lighting_pass_ix(0), lighting_num_passes(1); // for progressive sky lighting
+vector<rand_gen_t> sky_pass_rgens; // per-thread rgen state at the end of the previous pass
 
 
 float get_scene_radius() {return sqrt(2.0f*(X_SCENE_SIZE*X_SCENE_SIZE + Y_SCENE_SIZE*Y_SCENE_SIZE + Z_SCENE_SIZE*Z_SCENE_SIZE));}
@@ -214,7 +217,164 @@ light_volume_local &get_local_light_volume(int ltype) {
 }
 
 
-unsigned add_path_to_lmcs(lmap_manager_t *lmgr, cube_t *bcube, point p1, point const &p2, float weight, colorRGBA const &color, int ltype, bool first_pt) {
+// Amanatides-Woo 3D DDA: calls func(x, y, z, seg_len) once for each grid cell crossed by the line (p1, p2), in order from p1 to p2
+template<typename F> unsigned walk_grid_cells(point const &p1, point const &p2, float const origin[3], float const cell_sz[3], F func) {
+
+	vector3d const delta(p2 - p1);
+	float const len(delta.mag());
+	int pos[3], step[3];
+	float t_max[3], t_delta[3]; // in parametric units of (p1, p2)
+
+	for (unsigned d = 0; d < 3; ++d) {
+		float const g((p1[d] - origin[d])/cell_sz[d]); // position in grid units
+		pos[d] = int(floor(g));
+
+		if (delta[d] == 0.0) {
+			step[d] = 0;
+			t_max[d] = t_delta[d] = 2.0; // never crosses a boundary in this dim (t <= 1.0)
+		}
+		else {
+			step   [d] = ((delta[d] > 0.0) ? 1 : -1);
+			t_delta[d] = fabs(cell_sz[d]/delta[d]);
+			t_max  [d] = ((delta[d] > 0.0) ? ((pos[d] + 1) - g) : (g - pos[d]))*t_delta[d];
+		}
+	}
+	float t(0.0);
+	unsigned num(0);
+
+	while (1) {
+		unsigned const d((t_max[0] < t_max[1]) ? ((t_max[0] < t_max[2]) ? 0 : 2) : ((t_max[1] < t_max[2]) ? 1 : 2)); // dim of next cell boundary
+		float const t_next(min(t_max[d], 1.0f));
+		func(pos[0], pos[1], pos[2], (t_next - t)*len);
+		++num;
+		if (t_max[d] >= 1.0) break; // reached p2
+		t = t_max[d];
+		pos  [d] += step[d];
+		t_max[d] += t_delta[d];
+	}
+	return num;
+}
+
+template<typename F> unsigned walk_lmap_grid_cells(point const &p1, point const &p2, F func) {
+	float const cell_sz[3] = {DX_VAL, DY_VAL, DZ_VAL2}, origin[3] = {-X_SCENE_SIZE, -Y_SCENE_SIZE, czmin};
+	return walk_grid_cells(p1, p2, origin, cell_sz, func);
+}
+
+point get_lmap_cell_center(int x, int y, int z) {return point(get_xval(x)+0.5*DX_VAL, get_yval(y)+0.5*DY_VAL, get_zval(z)+0.5*DZ_VAL2);}
+
+
+// incremental sky lighting: sky rays are grouped into buckets by target tile; each bucket is traced with its own rgen seeds so that it can be
+// exactly retraced later; we record the coarse scene regions crossed by each bucket's ray paths so that a cobj edit only needs to retrace the
+// buckets whose rays passed through the edited region, subtracting their old contribution and adding the new one
+unsigned const INC_SKY_TILES  = 16; // target tiles in each of x and y = number of buckets is 256
+unsigned const INC_REGIONS_XY = 32, INC_REGIONS_Z = 8;
+
+class lighting_bucket_tracker_t {
+
+	float origin[3], cell_sz[3];
+	vector<vector<unsigned>> bucket_regions; // sorted list of regions crossed by each bucket
+	vector<vector<unsigned>> region_buckets; // inverse of the above, sorted list of buckets crossing each region
+	vector<point> sky_pts; // shared by all buckets
+	bool inited;
+
+	unsigned get_region_ix(int x, int y, int z) const {
+		x = max(0, min(x, int(INC_REGIONS_XY)-1));
+		y = max(0, min(y, int(INC_REGIONS_XY)-1));
+		z = max(0, min(z, int(INC_REGIONS_Z )-1));
+		return (z*INC_REGIONS_XY + y)*INC_REGIONS_XY + x;
+	}
+public:
+	vector<unsigned> pending; // buckets whose contribution has been subtracted but not yet re-added
+	vector<unsigned> job_buckets; // buckets to retrace in the current update job
+
+	lighting_bucket_tracker_t() : inited(0) {}
+	bool is_inited() const {return inited;}
+	unsigned num_buckets() const {return INC_SKY_TILES*INC_SKY_TILES;}
+	unsigned num_regions() const {return INC_REGIONS_XY*INC_REGIONS_XY*INC_REGIONS_Z;}
+	vector<point> const &get_sky_pts() const {return sky_pts;}
+
+	void init(unsigned npts, float scene_radius) {
+		if (inited && sky_pts.size() == npts) return; // already inited
+		cube_t const bounds(get_scene_bounds_bcube());
+		unsigned const nregions[3] = {INC_REGIONS_XY, INC_REGIONS_XY, INC_REGIONS_Z};
+
+		for (unsigned d = 0; d < 3; ++d) {
+			origin [d] = bounds.d[d][0];
+			cell_sz[d] = max(bounds.get_sz_dim(d), TOLERANCE)/nregions[d];
+		}
+		rand_gen_t rgen; // fixed seed, independent of the number of threads
+		sky_pts.resize(npts);
+
+		for (auto i = sky_pts.begin(); i != sky_pts.end(); ++i) {
+			do {
+				*i = rgen.signed_rand_vector_spherical(1.0).get_norm()*scene_radius; // start the ray here
+			} while (i->z < zbottom); // force above zbottom
+		}
+		sort(sky_pts.begin(), sky_pts.end());
+		bucket_regions.clear();
+		bucket_regions.resize(num_buckets());
+		region_buckets.clear();
+		pending.clear();
+		inited = 1;
+	}
+	cube_t get_bucket_target_tile(unsigned bucket) const {
+		assert(bucket < num_buckets());
+		float const dx(2.0*X_SCENE_SIZE/INC_SKY_TILES), dy(2.0*Y_SCENE_SIZE/INC_SKY_TILES);
+		float const x1(-X_SCENE_SIZE + (bucket%INC_SKY_TILES)*dx), y1(-Y_SCENE_SIZE + (bucket/INC_SKY_TILES)*dy);
+		return cube_t(x1, x1+dx, y1, y1+dy, czmin, czmax);
+	}
+	void mark_segment(point p1, point p2, vector<unsigned char> &region_mask) const { // thread safe
+		assert(region_mask.size() == num_regions());
+		float const bounds[3][2] = {{origin[0], origin[0]+INC_REGIONS_XY*cell_sz[0]}, {origin[1], origin[1]+INC_REGIONS_XY*cell_sz[1]}, {origin[2], origin[2]+INC_REGIONS_Z*cell_sz[2]}};
+		if (!do_line_clip(p1, p2, bounds)) return;
+		walk_grid_cells(p1, p2, origin, cell_sz, [&](int x, int y, int z, float seg_len) {region_mask[get_region_ix(x, y, z)] = 1;});
+	}
+	void set_bucket_regions(unsigned bucket, vector<unsigned char> const &region_mask) { // thread safe as long as each bucket is owned by one thread
+		assert(bucket < bucket_regions.size());
+		vector<unsigned> &regions(bucket_regions[bucket]);
+		regions.clear();
+		for (unsigned r = 0; r < region_mask.size(); ++r) {if (region_mask[r]) {regions.push_back(r);}}
+	}
+	void build_region_index() {
+		region_buckets.clear();
+		region_buckets.resize(num_regions());
+
+		for (unsigned b = 0; b < bucket_regions.size(); ++b) {
+			for (auto r = bucket_regions[b].begin(); r != bucket_regions[b].end(); ++r) {region_buckets[*r].push_back(b);}
+		}
+	}
+	void find_buckets_for_cube(cube_t const &c, vector<unsigned> &buckets) const { // returns buckets not already pending
+		buckets.clear();
+		if (region_buckets.empty()) return; // no index
+		int lo[3], hi[3];
+
+		for (unsigned d = 0; d < 3; ++d) {
+			lo[d] = int(floor((c.d[d][0] - origin[d])/cell_sz[d]));
+			hi[d] = int(floor((c.d[d][1] - origin[d])/cell_sz[d]));
+		}
+		for (int z = lo[2]; z <= hi[2]; ++z) {
+			if (z < 0 || z >= int(INC_REGIONS_Z)) continue;
+			for (int y = lo[1]; y <= hi[1]; ++y) {
+				if (y < 0 || y >= int(INC_REGIONS_XY)) continue;
+				for (int x = lo[0]; x <= hi[0]; ++x) {
+					if (x < 0 || x >= int(INC_REGIONS_XY)) continue;
+					vector<unsigned> const &rb(region_buckets[get_region_ix(x, y, z)]);
+					buckets.insert(buckets.end(), rb.begin(), rb.end());
+				}
+			}
+		}
+		sort(buckets.begin(), buckets.end());
+		buckets.erase(unique(buckets.begin(), buckets.end()), buckets.end());
+		vector<unsigned> new_buckets;
+		set_difference(buckets.begin(), buckets.end(), pending.begin(), pending.end(), back_inserter(new_buckets)); // pending is sorted
+		buckets.swap(new_buckets);
+	}
+};
+
+lighting_bucket_tracker_t sky_lighting_buckets;
+
+
+unsigned add_path_to_lmcs(lmap_manager_t *lmgr, cube_t *bcube, point p1, point const &p2, float weight, colorRGBA const &color, int ltype, bool first_pt, lmap_thread_accum_t *lm_accum) {
 
 	bool const dynamic(is_ltype_dynamic(ltype));
 	if (first_pt && dynamic) return 0; // since dynamic lights already have a direct lighting component, we skip the first ray here to avoid double counting it
@@ -222,11 +382,42 @@ unsigned add_path_to_lmcs(lmap_manager_t *lmgr, cube_t *bcube, point p1, point c
 	if (fabs(weight) < TOLERANCE) return 0;
 	weight *= ray_step_size_mult;
 	colorRGBA const cw(color*weight);
+
+	if (lighting_dda_walk) { // visit each cell once, weighted by the length of the path within the cell
+		float const len_scale(1.0/get_step_size()); // normalize so that the contribution per unit length matches the fixed step case
+		unsigned nsteps(0);
+
+		if (dynamic) { // it's a local lighting volume
+			light_volume_local &lvol(get_local_light_volume(ltype));
+			nsteps = walk_lmap_grid_cells(p1, p2, [&](int x, int y, int z, float seg_len) {
+				lvol.add_color(get_lmap_cell_center(x, y, z), cw*(seg_len*len_scale));});
+		}
+		else { // use the lmgr
+			assert(lmgr != nullptr && lmgr->is_allocated());
+			nsteps = walk_lmap_grid_cells(p1, p2, [&](int x, int y, int z, float seg_len) {
+				int const cix(lmgr->get_cell_ix(x, y, z));
+				if (cix < 0) return; // outside the lightmap
+				float const seg_weight(seg_len*len_scale);
+				
+				if (lm_accum) {lm_accum->add(cix, cw*seg_weight, weight*seg_weight);} // weight is ignored for local lighting
+				else { // Note: not thread safe; multiple threads should use lm_accum
+					float *color(lmgr->get_lmcell(x, y, z).get_offset(ltype));
+					ADD_LIGHT_CONTRIB((cw*seg_weight), color);
+					if (ltype != LIGHTING_LOCAL) {color[3] += weight*seg_weight;}
+				}
+			});
+			if (bcube) {
+				bcube->assign_or_union_with_pt(p1);
+				bcube->union_with_pt(p2);
+			}
+			if (!lm_accum) {lmgr->was_updated = 1;}
+		}
+		return nsteps;
+	}
 	unsigned const nsteps(1 + unsigned(p2p_dist(p1, p2)/get_step_size())); // round up (dist can be 0)
 	vector3d const step((p2 - p1)/nsteps); // at least two points
 	if (!first_pt) {p1 += step;} // move past the first step so we don't double count
 
-	// FIXME: probably better time vs. quality tradeoff using a proper line drawing algorithm that chooses step size by distance to closest grid boundary and multiplies weight by segment length
 	if (dynamic) { // it's a local lighting volume
 		light_volume_local &lvol(get_local_light_volume(ltype));
 
@@ -238,28 +429,94 @@ unsigned add_path_to_lmcs(lmap_manager_t *lmgr, cube_t *bcube, point p1, point c
 	else { // use the lmgr
 		assert(lmgr != nullptr && lmgr->is_allocated());
 
-		for (unsigned s = 0; s < nsteps; ++s) {
-			lmcell *lmc(lmgr->get_lmcell_round_down(p1));
+		if (lm_accum) { // accumulate into this thread's private buffer, to be merged later
+			for (unsigned s = 0; s < nsteps; ++s) {
+				int const cix(lmgr->get_cell_ix_round_down(p1));
+				if (cix >= 0) {lm_accum->add(cix, cw, weight);} // weight is ignored for local lighting
+				p1 += step;
+			}
+		}
+		else {
+			for (unsigned s = 0; s < nsteps; ++s) {
+				lmcell *lmc(lmgr->get_lmcell_round_down(p1));
 		
-			if (lmc != NULL) { // could use a mutex here, but it seems too slow
-				float *color(lmc->get_offset(ltype));
-				ADD_LIGHT_CONTRIB(cw, color);
-				if (ltype != LIGHTING_LOCAL) {color[3] += weight;}
+				if (lmc != NULL) { // Note: not thread safe; multiple threads should use lm_accum
+					float *color(lmc->get_offset(ltype));
+					ADD_LIGHT_CONTRIB(cw, color);
+					if (ltype != LIGHTING_LOCAL) {color[3] += weight;}
+				}
+				p1 += step;
 			}
-			p1 += step;
+			lmgr->was_updated = 1;
 		}
 		if (bcube) {
 			bcube->assign_or_union_with_pt(p1);
 			bcube->union_with_pt(p2);
 		}
-		lmgr->was_updated = 1;
 	}
 	return nsteps;
 }
 
 
+struct rt_init_coll_t { // first cobj intersection of a primary ray, precomputed with a ray packet
+	point cpos;
+	vector3d cnorm;
+	int cindex;
+};
+
+// batches primary rays so that their first cobj intersections can be found with packet traversal of the static cobj BVH;
+// only rays that are clipped by the scene bounds are batched, since unclipped rays use skip_init_colls in cast_light_ray()
+class light_ray_batch_t {
+	vector<point> p1s, p2s, cp1s, cp2s, cposs;
+	vector<vector3d> cnorms;
+	vector<int> cindexes;
+	vector<unsigned> batch_ixs;
+	vector<rt_init_coll_t> init_colls;
+	vector<unsigned char> valid;
+
+public:
+	void clear() {p1s.clear(); p2s.clear();}
+	bool empty() const {return p1s.empty();}
+	unsigned size() const {return (unsigned)p1s.size();}
+	point const &get_p1(unsigned i) const {assert(i < size()); return p1s[i];}
+	point const &get_p2(unsigned i) const {assert(i < size()); return p2s[i];}
+	void add(point const &p1, point const &p2) {p1s.push_back(p1); p2s.push_back(p2);}
+	rt_init_coll_t const *get_init_coll(unsigned i) const {assert(i < valid.size()); return (valid[i] ? &init_colls[i] : nullptr);}
+
+	void find_init_colls() {
+		unsigned const num(size());
+		cp1s.clear(); cp2s.clear(); batch_ixs.clear();
+		init_colls.resize(num);
+		valid.resize(num);
+
+		for (unsigned i = 0; i < num; ++i) { // same clipping as in cast_light_ray()
+			point p1(p1s[i]), p2(p2s[i]);
+			valid[i] = (do_line_clip_scene(p1, p2, min(zbottom, czmin), max(ztop, czmax)) && p1 != p1s[i]);
+			if (!valid[i]) continue;
+			cp1s.push_back(p1);
+			cp2s.push_back(p2);
+			batch_ixs.push_back(i);
+		}
+		if (batch_ixs.empty()) return;
+		unsigned const bnum((unsigned)batch_ixs.size());
+		cposs.resize(bnum);
+		cnorms.resize(bnum);
+		cindexes.resize(bnum);
+		check_coll_line_exact_tree_packet(bnum, &cp1s.front(), &cp2s.front(), &cposs.front(), &cnorms.front(), &cindexes.front(), -1, 0, 1, 0, no_stat_moving);
+
+		for (unsigned i = 0; i < bnum; ++i) {
+			rt_init_coll_t &ic(init_colls[batch_ixs[i]]);
+			ic.cindex = cindexes[i];
+			ic.cpos   = ((ic.cindex >= 0) ? cposs[i] : cp2s[i]);
+			ic.cnorm  = cnorms[i];
+		}
+	}
+};
+
+
 void cast_light_ray(lmap_manager_t *lmgr, point p1, point p2, float weight, float weight0, colorRGBA color, float line_length,
-	int ignore_cobj, int ltype, unsigned depth, rand_gen_t &rgen, cobj_ray_accum_map_t *accum_map, cube_t *bcube=nullptr)
+	int ignore_cobj, int ltype, unsigned depth, rand_gen_t &rgen, cobj_ray_accum_map_t *accum_map, cube_t *bcube=nullptr, lmap_thread_accum_t *lm_accum=nullptr,
+	rt_init_coll_t const *init_coll=nullptr, vector<unsigned char> *region_mask=nullptr)
 {
 	if (depth > MAX_RAY_BOUNCES) return;
 	if (ltype == LIGHTING_DYNAMIC && depth > 4) return; // use a sensible default since this is running during rendering
@@ -276,7 +533,18 @@ void cast_light_ray(lmap_manager_t *lmgr, point p1, point p2, float weight, floa
 	float t(0.0), zval(0.0);
 	bool snow_coll(0), ice_coll(0), water_coll(0), mesh_coll(0);
 	vector3d const dir((p2 - p1).get_norm());
-	bool coll(check_coll_line_exact(p1, p2, cpos, cnorm, cindex, 0.0, ignore_cobj, 1, 0, 1, 1, (p1 == orig_p1), no_stat_moving)); // fast=1, exclude voxels, maybe skip init colls
+	bool coll(0);
+
+	if (init_coll) { // first hit was already found with a ray packet
+		assert(depth == 0 && ignore_cobj < 0);
+		cpos  = init_coll->cpos;
+		cnorm = init_coll->cnorm;
+		cindex= init_coll->cindex;
+		coll  = (cindex >= 0);
+	}
+	else {
+		coll = check_coll_line_exact(p1, p2, cpos, cnorm, cindex, 0.0, ignore_cobj, 1, 0, 1, 1, (p1 == orig_p1), no_stat_moving); // fast=1, exclude voxels, maybe skip init colls
+	}
 	assert(coll ? (cindex >= 0 && cindex < (int)coll_objects.size()) : (cindex == -1));
 
 	// find the intersection point with the model3ds
@@ -333,10 +601,11 @@ void cast_light_ray(lmap_manager_t *lmgr, point p1, point p2, float weight, floa
 	point p_end(p2);
 	if ( coll) {p2 = cpos;}
 	if (keep_beams && p1 != p2) {beams.push_back(beam3d(!coll, 1, p1, p2, color, 0.1*weight));} // testing
+	if (region_mask) {sky_lighting_buckets.mark_segment(p1, p2, *region_mask);} // record before the early return, since a missed ray can be blocked by an added cobj
 	if (!coll) return; // more efficient to do this up here and let a reverse ray from the sky light this path
 
 	// walk from p1 to p2, adding light to all lightmap cells encountered
-	cells_touched += add_path_to_lmcs(lmgr, bcube, p1, p2, weight, color, ltype, (depth == 0));
+	cells_touched += add_path_to_lmcs(lmgr, bcube, p1, p2, weight, color, ltype, (depth == 0), lm_accum);
 	++num_hits;
 	//if (!coll)    return;
 	if (p1 == p2) return; // line must have started inside a cobj - this is bad, but what can we do?
@@ -442,7 +711,8 @@ void cast_light_ray(lmap_manager_t *lmgr, point p1, point p2, float weight, floa
 							point const p_int(p_end + (p2 - p_end)*t);
 
 							if (!dist_less_than(p2, p_int, get_step_size())) {	
-								cells_touched += add_path_to_lmcs(lmgr, bcube, p2, p_int, weight, color, ltype, (depth == 0));
+								cells_touched += add_path_to_lmcs(lmgr, bcube, p2, p_int, weight, color, ltype, (depth == 0), lm_accum);
+								if (region_mask) {sky_lighting_buckets.mark_segment(p2, p_int, *region_mask);}
 								++num_hits;
 							}
 							if (calc_refraction_angle(v_refract, v_refract2, -cnorm2, cobj.cp.refract_ix, 1.0)) {
@@ -460,7 +730,7 @@ void cast_light_ray(lmap_manager_t *lmgr, point p1, point p2, float weight, floa
 						no_transmit = 1; // total internal reflection (could process an internal reflection)
 					}
 				}
-				if (!no_transmit) {cast_light_ray(lmgr, p2, p_end, tweight, weight0, color, line_length, cindex, ltype, depth+1, rgen, accum_map, bcube);} // transmitted
+				if (!no_transmit) {cast_light_ray(lmgr, p2, p_end, tweight, weight0, color, line_length, cindex, ltype, depth+1, rgen, accum_map, bcube, lm_accum, nullptr, region_mask);} // transmitted
 			}
 			weight *= rweight; // reflected weight
 		}
@@ -489,7 +759,7 @@ void cast_light_ray(lmap_manager_t *lmgr, point p1, point p2, float weight, floa
 			//assert(dot_product(v_new, cnorm) >= 0.0); // too strong - may fail due to FP rounding
 		}
 		p2 = p1 + v_new*line_length; // ending point: effectively at infinity
-		cast_light_ray(lmgr, cpos, p2, weight/num_splits, weight0, color, line_length, cindex, ltype, depth+1, rgen, accum_map, bcube);
+		cast_light_ray(lmgr, cpos, p2, weight/num_splits, weight0, color, line_length, cindex, ltype, depth+1, rgen, accum_map, bcube, lm_accum, nullptr, region_mask);
 	}
 }
 
@@ -501,6 +771,7 @@ struct rt_data {
 	cube_t update_bcube;
 	lmap_manager_t *lmgr;
 	cobj_ray_accum_map_t accum_map;
+	lmap_thread_accum_t lm_accum; // only used with multiple threads
 
 	rt_data(unsigned i=0, unsigned n=0, int s=1, bool t=0, bool v=0, bool r=0, int lt=0, unsigned jid=0)
 		: ix(i), num(n), job_id(jid), checksum(0), rseed(s), ltype(lt), is_thread(t), verbose(v), randomized(r), is_running(0), lmgr(nullptr) {update_bcube.set_to_zeros();}
@@ -516,6 +787,7 @@ struct rt_data {
 		assert(is_running); // can this fail due to race conditions? too strong? remove?
 		is_running = 0;
 	}
+	lmap_thread_accum_t *get_lm_accum() {return (lm_accum.is_inited() ? &lm_accum : nullptr);}
 };
 
 
@@ -568,6 +840,23 @@ void kill_current_raytrace_threads() {
 }
 
 
+void merge_thread_lmap_accums() {
+
+	vector<lmap_thread_accum_t const *> accums;
+	lmap_manager_t *lmgr(nullptr);
+	int ltype(0);
+
+	for (auto i = thread_manager.data.begin(); i != thread_manager.data.end(); ++i) { // in thread order
+		if (!i->lm_accum.is_inited()) continue;
+		assert(lmgr == nullptr || i->lmgr == lmgr); // all threads must share the same lmap
+		accums.push_back(&i->lm_accum);
+		lmgr  = i->lmgr;
+		ltype = i->ltype;
+	}
+	if (lmgr) {lmgr->merge_thread_accums(accums, ltype);}
+}
+
+
 void update_lmap_from_temp_copy() {
 
 	if (!thread_temp_lmap.was_updated) return; // no updates
@@ -582,11 +871,15 @@ void check_for_lighting_finished() { // to be called about once per frame
 
 	if (!thread_manager.is_active()) return; // inactive
 	if (thread_manager.any_threads_running()) return; // still running
-	thread_manager.join_and_clear(); // clear() or join_and_clear()?
+	thread_manager.join();
+	merge_thread_lmap_accums();
+	thread_manager.clear();
 	update_lmap_from_temp_copy();
 }
 
 
+void trace_ray_block_sky_bucket_update(rt_data *data);
+
 // see https://computing.llnl.gov/tutorials/pthreads/ (for old pthread implementation - now using std::thread)
 void launch_threaded_job(unsigned num_threads, void (*start_func)(rt_data *), bool verbose, bool blocking, bool use_temp_lmap, bool randomized, int ltype, unsigned job_id=0) {
 
@@ -600,9 +893,10 @@ void launch_threaded_job(unsigned num_threads, void (*start_func)(rt_data *), bo
 	if (use_temp_lmap) {thread_temp_lmap.init_from(lmap_manager);}
 
 	for (unsigned t = 0; t < data.size(); ++t) {
-		// create a custom lmap_manager_t for each thread then merge them together?
 		data[t] = rt_data(t, num_threads, 234323*(t+1), !single_thread, (verbose && t == 0), randomized, ltype, job_id);
 		data[t].lmgr = (use_temp_lmap ? &thread_temp_lmap : &lmap_manager);
+		// each thread accumulates into its own sparse buffer, which are merged in thread order when done; this avoids races and gives reproducible results
+		if (!single_thread && !is_ltype_dynamic(ltype) && data[t].lmgr->is_allocated()) {data[t].lm_accum.init(data[t].lmgr->size());}
 	}
 	if (single_thread && blocking) { // threads disabled
 		start_func((rt_data *)(&data[0]));
@@ -612,12 +906,15 @@ void launch_threaded_job(unsigned num_threads, void (*start_func)(rt_data *), bo
 		if (blocking) {thread_manager.join();}
 	}
 	if (blocking) {
-		if (enable_platform_lights(ltype)) {
-			merged_accum_map.clear();
+		bool const inc_update(start_func == trace_ray_block_sky_bucket_update); // partial retrace, must not replace the platform accum map
+		merge_thread_lmap_accums();
+
+		if (enable_platform_lights(ltype) && !inc_update) {
+			if (job_id == 0) {merged_accum_map.clear();} // progressive passes after the first add to the map
 			for (auto i = data.begin(); i != data.end(); ++i) {merged_accum_map.merge(i->accum_map);}
 			if (!merged_accum_map.empty()) {merged_accum_map.stats();}
 		}
-		if (ltype == LIGHTING_COBJ_ACCUM) {
+		if (ltype == LIGHTING_COBJ_ACCUM || inc_update) {
 			for (auto i = data.begin(); i != data.end(); ++i) {
 				lmap_manager.update_bcube.assign_or_union_with_cube(i->update_bcube); // merge update bounding cubes
 			}
@@ -640,21 +937,34 @@ bool cube_light_src_vect::ray_intersects_any(point const &start_pt, point const
 }
 
 
-void trace_one_global_ray(lmap_manager_t *lmgr, point const &pos, point const &pt, colorRGBA const &color, float ray_wt,
-	int ltype, bool is_scene_cube, rand_gen_t &rgen, cobj_ray_accum_map_t *accum_map, float line_length)
-{
+void add_one_global_ray(light_ray_batch_t &batch, point const &pos, point const &pt, bool is_scene_cube, float line_length) {
+
 	point const end_pt(pt + (pt - pos).get_norm()*line_length);
 	if (is_scene_cube && global_cube_lights.ray_intersects_any(pt, end_pt)) return; // don't double count
-	cast_light_ray(lmgr, pos, end_pt, ray_wt, ray_wt, color, line_length, -1, ltype, 0, rgen, accum_map);
+	batch.add(pos, end_pt);
+}
+
+void trace_global_ray_batch(light_ray_batch_t &batch, lmap_manager_t *lmgr, colorRGBA const &color, float ray_wt,
+	int ltype, rand_gen_t &rgen, cobj_ray_accum_map_t *accum_map, float line_length, lmap_thread_accum_t *lm_accum)
+{
+	if (lighting_ray_packets) {batch.find_init_colls();}
+
+	for (unsigned r = 0; r < batch.size() && !kill_raytrace; ++r) {
+		cast_light_ray(lmgr, batch.get_p1(r), batch.get_p2(r), ray_wt, ray_wt, color, line_length, -1, ltype, 0, rgen, accum_map, nullptr, lm_accum,
+			(lighting_ray_packets ? batch.get_init_coll(r) : nullptr));
+	}
+	batch.clear();
 }
 
 
 void trace_ray_block_global_cube(lmap_manager_t *lmgr, cube_t const &bnds, point const &pos, colorRGBA const &color, float ray_wt,
-	unsigned nrays, int ltype, unsigned disabled_edges, bool is_scene_cube, bool verbose, bool randomized, rand_gen_t &rgen, cobj_ray_accum_map_t *accum_map)
+	unsigned nrays, int ltype, unsigned disabled_edges, bool is_scene_cube, bool verbose, bool randomized, rand_gen_t &rgen, cobj_ray_accum_map_t *accum_map,
+	lmap_thread_accum_t *lm_accum)
 {
 	float const line_length(2.0*get_scene_radius());
 	vector3d const ldir((bnds.get_cube_center() - pos).get_norm());
 	float proj_area[3] = {0}, tot_area(0.0);
+	light_ray_batch_t batch;
 
 	for (unsigned i = 0; i < 3; ++i) { // adjust the number or weight of rays based on sun/moon position, or simply modify color scale?
 		if (disabled_edges & EFLAGS[i][ldir[i] < 0.0]) continue; // should this be here, or should we just skip them later?
@@ -680,8 +990,10 @@ void trace_ray_block_global_cube(lmap_manager_t *lmgr, cube_t const &bnds, point
 				if (verbose && ((s%1000) == 0)) {increment_printed_number(s/1000);}
 				pt[d0] = rgen.rand_uniform(bnds.d[d0][0], bnds.d[d0][1]);
 				pt[d1] = rgen.rand_uniform(bnds.d[d1][0], bnds.d[d1][1]);
-				trace_one_global_ray(lmgr, pos, pt, color, ray_wt, ltype, is_scene_cube, rgen, accum_map, line_length);
+				add_one_global_ray(batch, pos, pt, is_scene_cube, line_length);
+				if (batch.size() >= GLOBAL_RAY_BATCH_SIZE) {trace_global_ray_batch(batch, lmgr, color, ray_wt, ltype, rgen, accum_map, line_length, lm_accum);}
 			}
+			trace_global_ray_batch(batch, lmgr, color, ray_wt, ltype, rgen, accum_map, line_length, lm_accum);
 		}
 		else {
 			float const len0(bnds.d[d0][1] - bnds.d[d0][0]), len1(bnds.d[d1][1] - bnds.d[d1][0]);
@@ -697,8 +1009,9 @@ void trace_ray_block_global_cube(lmap_manager_t *lmgr, cube_t const &bnds, point
 					if (kill_raytrace) break;
 					if (verbose && ((num%1000) == 0)) increment_printed_number(num/1000);
 					pt[d1] = bnds.d[d1][0] + (s1 + rgen.rand_uniform(0.0, 1.0))*len1/n1;
-					trace_one_global_ray(lmgr, pos, pt, color, ray_wt, ltype, is_scene_cube, rgen, accum_map, line_length);
+					add_one_global_ray(batch, pos, pt, is_scene_cube, line_length);
 				}
+				trace_global_ray_batch(batch, lmgr, color, ray_wt, ltype, rgen, accum_map, line_length, lm_accum); // one batch per row of rays
 			}
 		}
 		if (verbose) {cout << endl;}
@@ -718,14 +1031,14 @@ void trace_ray_block_global_light(rt_data *data, point const &pos, colorRGBA con
 		float const ray_wt(RAY_WEIGHT*weight*color.alpha/GLOBAL_RAYS);
 		assert(ray_wt > 0.0);
 		cube_t const bnds(get_scene_bounds());
-		trace_ray_block_global_cube(data->lmgr, bnds, pos, color, ray_wt, max(1U, GLOBAL_RAYS/data->num), LIGHTING_GLOBAL, 0, 1, data->verbose, data->randomized, rgen, &data->accum_map);
+		trace_ray_block_global_cube(data->lmgr, bnds, pos, color, ray_wt, max(1U, GLOBAL_RAYS/data->num), LIGHTING_GLOBAL, 0, 1, data->verbose, data->randomized, rgen, &data->accum_map, data->get_lm_accum());
 	}
 	for (cube_light_src_vect::const_iterator i = global_cube_lights.begin(); i != global_cube_lights.end(); ++i) {
 		if (data->num == 0 || i->num_rays == 0) continue; // disabled
 		if (data->verbose) {cout << "Cube volume light source " << (i - global_cube_lights.begin()) << " of " << global_cube_lights.size() << endl;}
 		unsigned const num_rays(i->num_rays/data->num);
 		float const cube_weight(RAY_WEIGHT*weight*i->intensity/i->num_rays);
-		trace_ray_block_global_cube(data->lmgr, i->bounds, pos, color, cube_weight, num_rays, LIGHTING_GLOBAL, i->disabled_edges, 0, data->verbose, data->randomized, rgen, &data->accum_map);
+		trace_ray_block_global_cube(data->lmgr, i->bounds, pos, color, cube_weight, num_rays, LIGHTING_GLOBAL, i->disabled_edges, 0, data->verbose, data->randomized, rgen, &data->accum_map, data->get_lm_accum());
 		cube_start_rays += num_rays;
 	}
 	if (data->verbose) {
@@ -747,7 +1060,96 @@ void trace_ray_block_global(rt_data *data) {
 }
 
 
-float get_sky_light_ray_weight() {return RAY_WEIGHT/(((float)NPTS)*NRAYS);}
+unsigned get_inc_sky_rays_per_point() {return max(1U, NRAYS/sky_lighting_buckets.num_buckets());}
+float get_sky_light_ray_weight() {return RAY_WEIGHT/(((float)NPTS)*(incremental_lighting ? get_inc_sky_rays_per_point()*sky_lighting_buckets.num_buckets() : NRAYS));}
+
+// traces one incremental lighting bucket: rays from every sky point to random targets within the bucket's target tile; returns the number of start rays
+unsigned trace_sky_bucket(rt_data *data, unsigned bucket, float ray_wt, cobj_ray_accum_map_t *accum_map, cube_t *bcube, vector<unsigned char> *region_mask) {
+
+	vector<point> const &pts(sky_lighting_buckets.get_sky_pts());
+	cube_t const tile(sky_lighting_buckets.get_bucket_target_tile(bucket));
+	float const line_length(2.0*get_scene_radius()), weight0(fabs(ray_wt)); // weight0 must be positive for the thresholds when subtracting with a negative weight
+	vector<vector3d> dirs(get_inc_sky_rays_per_point());
+	light_ray_batch_t batch;
+	rand_gen_t rgen;
+	unsigned num_rays(0);
+
+	for (unsigned p = 0; p < pts.size(); ++p) {
+		if (kill_raytrace) break;
+		point const &pt(pts[p]);
+		unsigned const key[2] = {p, bucket};
+		rgen.set_state((jenkins_one_at_a_time_hash(key, 2) & 0x3FFFFFFF) + 1, p+1); // unique per point and bucket, so that this bucket can be retraced exactly
+		rgen.rand_mix();
+
+		for (unsigned r = 0; r < dirs.size(); ++r) {dirs[r] = (rgen.gen_rand_cube_point(tile) - pt).get_norm();}
+		sort(dirs.begin(), dirs.end());
+
+		for (unsigned r = 0; r < dirs.size(); ++r) {
+			if (dot_product(dirs[r], pt) >= 0.0) continue; // can get here when (-Z_SCENE_SIZE, Z_SCENE_SIZE) does not contain (czmin, czmax)
+			point const end_pt(pt + dirs[r]*line_length);
+			if (sky_cube_lights.ray_intersects_any(pt, end_pt)) continue; // don't double count
+			batch.add(pt, end_pt);
+		}
+		if (lighting_ray_packets) {batch.find_init_colls();} // rays from the same point toward the same tile are very coherent
+
+		for (unsigned r = 0; r < batch.size(); ++r) {
+			if (kill_raytrace) break;
+			cast_light_ray(data->lmgr, pt, batch.get_p2(r), ray_wt, weight0, WHITE, line_length, -1, LIGHTING_SKY, 0, rgen, accum_map, bcube, data->get_lm_accum(),
+				(lighting_ray_packets ? batch.get_init_coll(r) : nullptr), region_mask);
+			++num_rays;
+		}
+		batch.clear();
+	}
+	return num_rays;
+}
+
+// initial trace of all buckets assigned to this thread, recording the regions crossed by each bucket
+unsigned trace_ray_block_sky_buckets(rt_data *data) {
+
+	unsigned const num_buckets(sky_lighting_buckets.num_buckets());
+	float const ray_wt(get_sky_light_ray_weight());
+	vector<unsigned char> region_mask;
+	unsigned num_rays(0);
+	if (data->verbose) {cout << "Sky light bucket progress (of " << num_buckets << "): 0";}
+
+	for (unsigned b = data->ix; b < num_buckets; b += data->num) {
+		if (kill_raytrace) break;
+		if (data->verbose) {increment_printed_number(b);}
+		region_mask.clear();
+		region_mask.resize(sky_lighting_buckets.num_regions(), 0);
+		num_rays += trace_sky_bucket(data, b, ray_wt, &data->accum_map, nullptr, &region_mask);
+		sky_lighting_buckets.set_bucket_regions(b, region_mask);
+	}
+	if (data->verbose) {cout << endl;}
+	return num_rays;
+}
+
+// retrace of pending buckets after an edit: job_id 0 subtracts their contribution on the old scene, job_id 1 adds it back on the new scene
+void trace_ray_block_sky_bucket_update(rt_data *data) {
+
+	assert(data);
+	rand_gen_t rgen;
+	data->pre_run(rgen); // rgen is unused; each bucket seeds its own
+	data->update_bcube.set_to_zeros();
+	bool const add_pass(data->job_id != 0);
+	float const ray_wt((add_pass ? 1.0 : -1.0)*get_sky_light_ray_weight());
+	vector<unsigned> const &buckets(sky_lighting_buckets.job_buckets);
+	vector<unsigned char> region_mask;
+
+	for (unsigned i = data->ix; i < buckets.size(); i += data->num) {
+		if (kill_raytrace) break;
+		cobj_ray_accum_map_t accum_map; // discarded; only passed so that rays terminate at light update platforms the same way as in the initial trace
+
+		if (add_pass) {
+			region_mask.clear();
+			region_mask.resize(sky_lighting_buckets.num_regions(), 0);
+		}
+		trace_sky_bucket(data, buckets[i], ray_wt, &accum_map, &data->update_bcube, (add_pass ? &region_mask : nullptr));
+		if (add_pass) {sky_lighting_buckets.set_bucket_regions(buckets[i], region_mask);}
+	}
+	data->post_run();
+}
+
 
 void trace_ray_block_sky(rt_data *data) {
 
@@ -757,11 +1159,15 @@ void trace_ray_block_sky(rt_data *data) {
 	float const scene_radius(get_scene_radius()), line_length(2.0*scene_radius);
 	unsigned long long start_rays(0), cube_start_rays(0);
 
-	if (NPTS > 0 && NRAYS > 0) {
+	if (incremental_lighting && NPTS > 0 && NRAYS > 0) {
+		start_rays = trace_ray_block_sky_buckets(data);
+	}
+	else if (NPTS > 0 && NRAYS > 0) {
 		float const ray_wt(get_sky_light_ray_weight());
 		unsigned const block_npts(max(1U, NPTS/data->num));
 		vector<point> pts(block_npts);
 		vector<vector3d> dirs(NRAYS);
+		light_ray_batch_t batch;
 
 		for (unsigned p = 0; p < block_npts; ++p) {
 			do {
@@ -769,9 +1175,11 @@ void trace_ray_block_sky(rt_data *data) {
 			} while (pts[p].z < zbottom); // force above zbottom
 		}
 		sort(pts.begin(), pts.end());
-		if (data->verbose) {cout << "Sky light source progress (of " << block_npts << "): 0";}
+		unsigned const p_start(lighting_pass_ix*block_npts/lighting_num_passes), p_end((lighting_pass_ix+1)*block_npts/lighting_num_passes);
+		if (lighting_pass_ix > 0) {rgen = sky_pass_rgens[data->ix];} // continue the random sequence from the end of the previous pass
+		if (data->verbose) {cout << "Sky light source progress (of " << block_npts << "): " << p_start;}
 
-		for (unsigned p = 0; p < block_npts; ++p) {
+		for (unsigned p = p_start; p < p_end; ++p) {
 			if (kill_raytrace) break;
 			if (data->verbose) {increment_printed_number(p);}
 			point const &pt(pts[p]);
@@ -784,18 +1192,25 @@ void trace_ray_block_sky(rt_data *data) {
 			sort(dirs.begin(), dirs.end());
 
 			for (unsigned r = 0; r < NRAYS; ++r) {
-				if (kill_raytrace) break;
 				if (dot_product(dirs[r], pt) >= 0.0) continue; // can get here when (-Z_SCENE_SIZE, Z_SCENE_SIZE) does not contain (czmin, czmax)
 				point const end_pt(pt + dirs[r]*line_length);
 				if (sky_cube_lights.ray_intersects_any(pt, end_pt)) continue; // don't double count
-				cast_light_ray(data->lmgr, pt, end_pt, ray_wt, ray_wt, WHITE, line_length, -1, LIGHTING_SKY, 0, rgen, &data->accum_map);
+				batch.add(pt, end_pt);
+			}
+			if (lighting_ray_packets) {batch.find_init_colls();} // rays from the same point with sorted dirs are coherent
+
+			for (unsigned r = 0; r < batch.size(); ++r) {
+				if (kill_raytrace) break;
+				cast_light_ray(data->lmgr, pt, batch.get_p2(r), ray_wt, ray_wt, WHITE, line_length, -1, LIGHTING_SKY, 0, rgen, &data->accum_map, nullptr, data->get_lm_accum(),
+					(lighting_ray_packets ? batch.get_init_coll(r) : nullptr));
 				++start_rays;
 			}
+			batch.clear();
 		}
 		if (data->verbose) {cout << endl;}
 	}
 	for (cube_light_src_vect::const_iterator i = sky_cube_lights.begin(); i != sky_cube_lights.end(); ++i) {
-		if (kill_raytrace) break;
+		if (kill_raytrace || lighting_pass_ix+1 < lighting_num_passes) break; // cube lights are traced in the last pass
 		if (data->num == 0 || i->num_rays == 0) continue; // disabled
 		unsigned const num_rays(i->num_rays/data->num);
 		float const cube_weight(RAY_WEIGHT*i->intensity/i->num_rays);
@@ -809,7 +1224,7 @@ void trace_ray_block_sky(rt_data *data) {
 			vector3d dir(rgen.signed_rand_vector_spherical().get_norm()); // need high quality distribution
 			dir.z = -fabs(dir.z); // make sure z is negative since this is supposed to be light from the sky
 			point const end_pt(pt + dir*line_length);
-			cast_light_ray(data->lmgr, pt, end_pt, cube_weight, cube_weight, i->color, line_length, -1, LIGHTING_SKY, 0, rgen, &data->accum_map);
+			cast_light_ray(data->lmgr, pt, end_pt, cube_weight, cube_weight, i->color, line_length, -1, LIGHTING_SKY, 0, rgen, &data->accum_map, nullptr, data->get_lm_accum());
 		}
 		if (data->verbose) {cout << endl;}
 	}
@@ -817,6 +1232,7 @@ void trace_ray_block_sky(rt_data *data) {
 		cout << "start rays: " << start_rays << ", cube start rays: " << cube_start_rays << ", total rays: " << tot_rays
 			 << ", hits: " << num_hits << ", cells touched: " << cells_touched << endl;
 	}
+	if (lighting_num_passes > 1) {sky_pass_rgens[data->ix] = rgen;}
 	data->checksum = rgen.rand();
 	data->post_run();
 }
@@ -856,7 +1272,7 @@ void trace_ray_block_cobj_accum(rt_data *data) {
 			if (kill_raytrace) break; // not needed?
 			assert(r->weight > 0.0);
 			float const weight0(ray_wt ? ray_wt : r->weight);
-			cast_light_ray(data->lmgr, r->pos, r->get_p2(line_length), r->weight, weight0, r->get_color(), line_length, -1, LIGHTING_COBJ_ACCUM, 0, rgen, nullptr, nullptr);
+			cast_light_ray(data->lmgr, r->pos, r->get_p2(line_length), r->weight, weight0, r->get_color(), line_length, -1, LIGHTING_COBJ_ACCUM, 0, rgen, nullptr, nullptr, data->get_lm_accum());
 		}
 	}
 	data->post_run();
@@ -891,13 +1307,15 @@ void trace_ray_block_cobj_accum_single_update(rt_data *data) {
 		if (cur_hit == prev_hit) continue; // no change in hit status
 		float const weight(r->weight*(cur_hit ? -1.0 : 1.0)); // if ray is newly blocked, subtract its contribution by negating its weight
 		// Note: cobj is ignored here because it can't be in both the prev and cur position at the same time, and temporarily moving it isn't thread safe
-		cast_light_ray(data->lmgr, r->pos, end_pt, weight, (ray_wt ? ray_wt : r->weight), r->get_color(), line_length, cid, LIGHTING_COBJ_ACCUM, 0, rgen, nullptr, &data->update_bcube);
+		cast_light_ray(data->lmgr, r->pos, end_pt, weight, (ray_wt ? ray_wt : r->weight), r->get_color(), line_length, cid, LIGHTING_COBJ_ACCUM, 0, rgen, nullptr, &data->update_bcube, data->get_lm_accum());
 	}
 	data->post_run();
 }
 
 
-void ray_trace_local_light_source(lmap_manager_t *lmgr, light_source const &ls, float line_length, unsigned num_rays, rand_gen_t &rgen, int ltype, unsigned N_RAYS) {
+void ray_trace_local_light_source(lmap_manager_t *lmgr, light_source const &ls, float line_length, unsigned num_rays, rand_gen_t &rgen, int ltype, unsigned N_RAYS,
+	lmap_thread_accum_t *lm_accum=nullptr)
+{
 
 	colorRGBA lcolor(ls.get_color());
 	if (N_RAYS == 0 || lcolor.alpha == 0.0) return; // nothing to do
@@ -944,7 +1362,7 @@ void ray_trace_local_light_source(lmap_manager_t *lmgr, light_source const &ls,
 					start_pt[d1] = rgen.rand_uniform(cube.d[d1][0], cube.d[d1][1]);
 					start_pt[d2] = rgen.rand_uniform(cube.d[d2][0], cube.d[d2][1]);
 					point const end_pt(start_pt + dir*line_length);
-					cast_light_ray(lmgr, start_pt, end_pt, ray_wt, ray_wt, lcolor, line_length, -1, ltype, 0, rgen, nullptr); // init_cobj not used here
+					cast_light_ray(lmgr, start_pt, end_pt, ray_wt, ray_wt, lcolor, line_length, -1, ltype, 0, rgen, nullptr, nullptr, lm_accum); // init_cobj not used here
 				} // for n
 			} // for dir
 		} // for dim
@@ -990,7 +1408,7 @@ void ray_trace_local_light_source(lmap_manager_t *lmgr, light_source const &ls,
 			if (line_light) {start_pt += n*delta;} // fixed spacing along the length of the line
 		}
 		point const end_pt(start_pt + dir*line_length);
-		cast_light_ray(lmgr, start_pt, end_pt, weight, weight, lcolor, line_length, init_cobj, ltype, 0, rgen, nullptr);
+		cast_light_ray(lmgr, start_pt, end_pt, weight, weight, lcolor, line_length, init_cobj, ltype, 0, rgen, nullptr, nullptr, lm_accum);
 	} // for n
 }
 
@@ -1010,7 +1428,7 @@ void trace_ray_block_local(rt_data *data) {
 	for (unsigned i = 0; i < light_sources_a.size(); ++i) {
 		if (data->verbose) {increment_printed_number(i);}
 		unsigned const light_nrays(light_sources_a[i].get_num_rays()), NRAYS(light_nrays ? light_nrays : LOCAL_RAYS), num_rays(max(1U, NRAYS/data->num));
-		ray_trace_local_light_source(data->lmgr, light_sources_a[i], line_length, num_rays, rgen, data->ltype, NRAYS);
+		ray_trace_local_light_source(data->lmgr, light_sources_a[i], line_length, num_rays, rgen, data->ltype, NRAYS, data->get_lm_accum());
 	}
 	if (data->verbose) {cout << endl;}
 	data->post_run();
@@ -1044,6 +1462,165 @@ typedef void (*ray_trace_func)(rt_data *);
 ray_trace_func const rt_funcs[NUM_LIGHTING_TYPES] = {trace_ray_block_sky, trace_ray_block_global, trace_ray_block_local, trace_ray_block_cobj_accum, trace_ray_block_dynamic};
 
 
+// traces ltype on 1, 2, 4, ... 64 threads and prints the time and lighting checksum for each;
+// the checksum should be the same across runs that use the same number of threads;
+// then compares the rays/sec of fixed step vs. grid traversal (DDA) lightmap deposition, and of single rays vs. ray packets
+void run_lighting_perf_tests(int ltype) {
+
+	if (ltype != LIGHTING_SKY && ltype != LIGHTING_GLOBAL && ltype != LIGHTING_LOCAL) return; // not supported
+	cout << "Lighting thread scaling test for ltype " << ltype << endl << "threads\ttime(ms)\tspeedup\tchecksum" << endl;
+	int base_time(0);
+
+	for (unsigned num_threads = 1; num_threads <= 64; num_threads *= 2) {
+		lmap_manager.clear_lighting_values(ltype);
+		int const start_time(GET_TIME_MS());
+		launch_threaded_job(num_threads, rt_funcs[ltype], 0, 1, 0, 0, ltype); // blocking
+		int const elapsed(max(1, (GET_TIME_MS() - start_time)));
+		if (num_threads == 1) {base_time = elapsed;}
+		cout << num_threads << "\t" << elapsed << "\t" << float(base_time)/elapsed << "\t" << std::hex << lmap_manager.get_lighting_checksum(ltype) << std::dec << endl;
+	}
+	bool const prev_dda_walk(lighting_dda_walk);
+	cout << "Lightmap deposition comparison on " << NUM_THREADS << " threads" << endl << "mode\ttime(ms)\trays/sec\tcells/ray" << endl;
+
+	for (unsigned dda = 0; dda < 2; ++dda) {
+		lighting_dda_walk = (dda != 0);
+		lmap_manager.clear_lighting_values(ltype);
+		tot_rays = num_hits = cells_touched = 0;
+		int const start_time(GET_TIME_MS());
+		launch_threaded_job(NUM_THREADS, rt_funcs[ltype], 0, 1, 0, 0, ltype); // blocking
+		float const elapsed(max(1, (GET_TIME_MS() - start_time)));
+		cout << (dda ? "DDA" : "step") << "\t" << elapsed << "\t" << unsigned(1000.0*tot_rays/elapsed) << "\t" << float(cells_touched)/max(1ULL, (unsigned long long)num_hits) << endl;
+	}
+	lighting_dda_walk = prev_dda_walk;
+	bool const prev_ray_packets(lighting_ray_packets);
+	cout << "Ray packet comparison on " << NUM_THREADS << " threads" << endl << "mode\ttime(ms)\trays/sec\tchecksum" << endl;
+
+	for (unsigned packets = 0; packets < 2; ++packets) {
+		lighting_ray_packets = (packets != 0);
+		lmap_manager.clear_lighting_values(ltype);
+		tot_rays = 0;
+		int const start_time(GET_TIME_MS());
+		launch_threaded_job(NUM_THREADS, rt_funcs[ltype], 0, 1, 0, 0, ltype); // blocking
+		float const elapsed(max(1, (GET_TIME_MS() - start_time)));
+		cout << (packets ? "packet" : "single") << "\t" << elapsed << "\t" << unsigned(1000.0*tot_rays/elapsed) << "\t" << std::hex << lmap_manager.get_lighting_checksum(ltype) << std::dec << endl;
+	}
+	lighting_ray_packets = prev_ray_packets;
+	tot_rays = num_hits = cells_touched = 0;
+	lmap_manager.clear_lighting_values(ltype);
+}
+
+
+// progressive sky lighting: the sky points of each thread are split across passes, with a checkpoint written after each pass
+// so that an interrupted bake can be resumed; rgen states are carried across passes, so a resumed bake gives the same result
+// as an uninterrupted bake with the same number of passes and threads
+unsigned const LIGHTING_CKPT_VERSION = 1;
+char const LIGHTING_CKPT_MAGIC[4] = {'3', 'D', 'W', 'C'};
+
+struct lighting_checkpoint_header_t {
+	char magic[4];
+	unsigned version, num_threads, num_passes, next_pass, npts, nrays, num_cells, layout_hash, lmap_checksum;
+};
+
+string get_lighting_checkpoint_fn() {
+	char const *const fn(lighting_file[LIGHTING_SKY]);
+	return (string((fn && fn[0]) ? fn : "lighting_sky") + ".ckpt");
+}
+
+bool write_lighting_checkpoint(string const &fn, unsigned next_pass) {
+
+	string const tmp_fn(fn + ".tmp"); // write to a temp file and rename so that a crash while writing doesn't corrupt the previous checkpoint
+	FILE *fp(fopen(tmp_fn.c_str(), "wb"));
+	if (fp == nullptr) {cerr << "Error: Failed to open lighting checkpoint file " << tmp_fn << " for writing" << endl; return 0;}
+	lighting_checkpoint_header_t header;
+	memcpy(header.magic, LIGHTING_CKPT_MAGIC, 4);
+	header.version       = LIGHTING_CKPT_VERSION;
+	header.num_threads   = (unsigned)sky_pass_rgens.size();
+	header.num_passes    = lighting_num_passes;
+	header.next_pass     = next_pass;
+	header.npts          = NPTS;
+	header.nrays         = NRAYS;
+	header.num_cells     = (unsigned)lmap_manager.size();
+	header.layout_hash   = lmap_manager.get_layout_hash();
+	header.lmap_checksum = lmap_manager.get_lighting_checksum(LIGHTING_SKY);
+	bool success(fwrite(&header, sizeof(header), 1, fp) == 1);
+
+	for (auto i = sky_pass_rgens.begin(); i != sky_pass_rgens.end() && success; ++i) {
+		int const seeds[2] = {int(i->rseed1), int(i->rseed2)};
+		success = (fwrite(seeds, sizeof(int), 2, fp) == 2);
+	}
+	success = (success && lmap_manager.write_raw_data(fp, LIGHTING_SKY) && merged_accum_map.write(fp));
+	checked_fclose(fp);
+
+	if (!success) {
+		cerr << "Error writing lighting checkpoint file " << tmp_fn << endl;
+		remove(tmp_fn.c_str());
+		return 0;
+	}
+	remove(fn.c_str()); // rename() fails on Windows if the file exists
+	
+	if (rename(tmp_fn.c_str(), fn.c_str()) != 0) {
+		cerr << "Error: Failed to rename lighting checkpoint file " << tmp_fn << " to " << fn << endl;
+		return 0;
+	}
+	cout << "Wrote lighting checkpoint " << fn << " after pass " << next_pass << " of " << lighting_num_passes << endl;
+	return 1;
+}
+
+unsigned read_lighting_checkpoint(string const &fn) { // returns the pass to resume from, 0 if there is no valid checkpoint
+
+	FILE *fp(fopen(fn.c_str(), "rb"));
+	if (fp == nullptr) return 0; // no checkpoint
+	lighting_checkpoint_header_t header;
+	bool success(fread(&header, sizeof(header), 1, fp) == 1);
+
+	if (success && (memcmp(header.magic, LIGHTING_CKPT_MAGIC, 4) != 0 || header.version != LIGHTING_CKPT_VERSION || header.num_threads != sky_pass_rgens.size() ||
+		header.num_passes != lighting_num_passes || header.next_pass == 0 || header.next_pass >= lighting_num_passes || header.npts != NPTS || header.nrays != NRAYS ||
+		header.num_cells != lmap_manager.size() || header.layout_hash != lmap_manager.get_layout_hash()))
+	{
+		cerr << "Lighting checkpoint file " << fn << " does not match the current settings (threads, passes, rays, or lightmap size). Ignoring file." << endl;
+		checked_fclose(fp);
+		return 0;
+	}
+	for (auto i = sky_pass_rgens.begin(); i != sky_pass_rgens.end() && success; ++i) {
+		int seeds[2] = {0, 0};
+		success = (fread(seeds, sizeof(int), 2, fp) == 2);
+		i->set_state(seeds[0], seeds[1]);
+	}
+	success = (success && lmap_manager.read_raw_data(fp, LIGHTING_SKY) && merged_accum_map.read(fp));
+	checked_fclose(fp);
+	success = (success && lmap_manager.get_lighting_checksum(LIGHTING_SKY) == header.lmap_checksum);
+
+	if (!success) {
+		cerr << "Error reading lighting checkpoint file " << fn << ". Ignoring file." << endl;
+		lmap_manager.clear_lighting_values(LIGHTING_SKY); // may have been partially filled
+		merged_accum_map.clear();
+		return 0;
+	}
+	cout << "Resuming sky lighting from checkpoint " << fn << " at pass " << header.next_pass << " of " << lighting_num_passes << endl;
+	return header.next_pass;
+}
+
+void compute_sky_lighting_progressive(bool verbose) {
+
+	string const fn(get_lighting_checkpoint_fn());
+	lighting_num_passes = LIGHTING_PASSES;
+	sky_pass_rgens.clear();
+	sky_pass_rgens.resize(NUM_THREADS);
+	unsigned const start_pass(read_lighting_checkpoint(fn));
+
+	for (unsigned pass = start_pass; pass < lighting_num_passes; ++pass) {
+		if (verbose) {cout << "Sky lighting pass " << (pass + 1) << " of " << lighting_num_passes << endl;}
+		lighting_pass_ix = pass;
+		launch_threaded_job(NUM_THREADS, trace_ray_block_sky, verbose, 1, 0, 0, LIGHTING_SKY, pass); // job_id=pass; the platform accum map is only cleared on the first pass
+		if (pass+1 < lighting_num_passes) {write_lighting_checkpoint(fn, pass+1);}
+	}
+	remove(fn.c_str()); // finished, checkpoint is no longer needed
+	lighting_pass_ix    = 0;
+	lighting_num_passes = 1;
+	sky_pass_rgens.clear();
+}
+
+
 void compute_ray_trace_lighting(unsigned ltype, bool verbose) {
 
 	bool const dynamic(is_ltype_dynamic(ltype));
@@ -1065,8 +1642,12 @@ void compute_ray_trace_lighting(unsigned ltype, bool verbose) {
 	else {
 		if (c_ltype != LIGHTING_LOCAL && !dynamic) {cout << X_SCENE_SIZE << " " << Y_SCENE_SIZE << " " << Z_SCENE_SIZE << " " << czmin << " " << czmax << endl;}
 		all_models.build_cobj_trees(1);
+		if (incremental_lighting && c_ltype == LIGHTING_SKY) {sky_lighting_buckets.init(NPTS, get_scene_radius());}
+		if (lighting_scaling_test) {run_lighting_perf_tests(ltype);}
 		if (enable_platform_lights(ltype)) {pre_rt_bvh_build_hook();}
-		launch_threaded_job(NUM_THREADS, rt_funcs[c_ltype], verbose, 1, 0, 0, ltype);
+		if (c_ltype == LIGHTING_SKY && LIGHTING_PASSES > 1 && !incremental_lighting) {compute_sky_lighting_progressive(verbose);}
+		else {launch_threaded_job(NUM_THREADS, rt_funcs[c_ltype], verbose, 1, 0, 0, ltype);}
+		if (incremental_lighting && c_ltype == LIGHTING_SKY) {sky_lighting_buckets.build_region_index();}
 		if (enable_platform_lights(ltype)) {post_rt_bvh_build_hook();}
 	}
 	if (!dynamic && write_light_files[c_ltype]) {
@@ -1083,6 +1664,16 @@ void compute_ray_trace_lighting(unsigned ltype, bool verbose) {
 }
 
 
+void print_lighting_bake_summary(unsigned num_threads, int elapsed_ms) {
+
+	float const secs(max(elapsed_ms, 1)/1000.0f);
+	cout << "Lighting bake finished in " << secs << "s on " << num_threads << " threads" << endl;
+	cout << "total rays: " << tot_rays << ", hits: " << num_hits << ", cells touched: " << cells_touched
+		 << ", rays/sec: " << unsigned(tot_rays/secs) << endl;
+	timing_profiler_stats(); // in case the profiler was enabled
+}
+
+
 bool pre_lighting_update() {
 	if (!lmap_manager.is_allocated()) return 0; // too early
 	tot_rays = num_hits = cells_touched = 0;
@@ -1102,13 +1693,26 @@ void check_update_global_lighting(unsigned lights) {
 	launch_threaded_job(max(1U, NUM_THREADS-1), rt_funcs[LIGHTING_GLOBAL], 0, 0, lighting_update_offline, 0, LIGHTING_GLOBAL); // reserve a thread for rendering
 }
 
+void update_smoke_indir_tex_for_update_bcube() {
+
+	cube_t &lm_bc(lmap_manager.update_bcube);
+
+	if (lmap_manager.was_updated && !lm_bc.is_zero_area()) {
+		lmap_manager.was_updated = 0; // unset to enable multi-threaded updates (though it doesn't seem to matter much)
+		int const x1(max(get_xpos_round_down(lm_bc.d[0][0]), 0)), x2(min(get_ypos_round_down(lm_bc.d[0][1])+1, MESH_X_SIZE));
+		int const y1(max(get_xpos_round_down(lm_bc.d[1][0]), 0)), y2(min(get_ypos_round_down(lm_bc.d[1][1])+1, MESH_Y_SIZE));
+		int const z1(max(get_zpos(lm_bc.d[2][0]), 0)), z2(min(get_zpos(lm_bc.d[2][1])+1, MESH_SIZE[2]));
+		if (x1 < x2 && y1 < y2 && z1 < z2) {update_smoke_indir_tex_range(x1, x2, y1, y2, z1, z2);}
+		lm_bc.set_to_zeros(); // clear
+	}
+}
+
 void check_all_platform_cobj_lighting_update() {
 
 	if (merged_accum_map.empty()) return; // updates not enabled
 	if (!pre_lighting_update())   return; // lmap is not yet allocated
 	bool const prev_was_updated(lmap_manager.was_updated);
 	lmap_manager.was_updated = 0; // clear and check if it gets set again
-	cube_t &lm_bc(lmap_manager.update_bcube);
 
 	for (cobj_id_set_t::const_iterator i = coll_objects.platform_ids.begin(); i != coll_objects.platform_ids.end(); ++i) {
 		coll_obj &cobj(coll_objects.get_cobj(*i));
@@ -1116,29 +1720,162 @@ void check_all_platform_cobj_lighting_update() {
 		if (!cobj.is_update_light_platform()) continue; // no updates
 		launch_threaded_job(NUM_THREADS, trace_ray_block_cobj_accum_single_update, 0, 1, 0, 0, LIGHTING_COBJ_ACCUM, *i); // blocking, on all threads, using cobj_id as job_id
 	}
-	if (lmap_manager.was_updated && !lm_bc.is_zero_area()) {
-		lmap_manager.was_updated = 0; // unset to enable multi-threaded updates (though it doesn't seem to matter much)
-		int const x1(max(get_xpos_round_down(lm_bc.d[0][0]), 0)), x2(min(get_ypos_round_down(lm_bc.d[0][1])+1, MESH_X_SIZE));
-		int const y1(max(get_xpos_round_down(lm_bc.d[1][0]), 0)), y2(min(get_ypos_round_down(lm_bc.d[1][1])+1, MESH_Y_SIZE));
-		int const z1(max(get_zpos(lm_bc.d[2][0]), 0)), z2(min(get_zpos(lm_bc.d[2][1])+1, MESH_SIZE[2]));
-		if (x1 < x2 && y1 < y2 && z1 < z2) {update_smoke_indir_tex_range(x1, x2, y1, y2, z1, z2);}
-		lm_bc.set_to_zeros(); // clear
-	}
+	update_smoke_indir_tex_for_update_bcube();
 	lmap_manager.was_updated = prev_was_updated; // restore previous value
 }
 
+// incremental sky lighting update for a cobj edit within edit_bcube:
+// call begin before the cobjs are modified (removes the old light of the affected buckets),
+// then end after the cobjs have been modified and the cobj tree has been rebuilt (adds the new light of the same buckets);
+// multiple edits can be batched between begin and end;
+// only called for destroyed cobjs in subtract_cube(); cobjs that move, fall, or are added by other means still need a full lighting update
+void begin_incremental_lighting_edit(cube_t const &edit_bcube) {
+
+	if (!incremental_lighting || !sky_lighting_buckets.is_inited()) return; // not enabled, or sky lighting was read from a file
+	if (!pre_lighting_update()) return; // lmap is not yet allocated
+	vector<unsigned> &buckets(sky_lighting_buckets.job_buckets);
+	sky_lighting_buckets.find_buckets_for_cube(edit_bcube, buckets);
+	if (buckets.empty()) return; // no rays through this region, or all affected buckets were already subtracted
+	launch_threaded_job(NUM_THREADS, trace_ray_block_sky_bucket_update, 0, 1, 0, 0, LIGHTING_SKY, 0); // blocking, on all threads, job_id=0 to subtract
+	vector<unsigned> &pending(sky_lighting_buckets.pending);
+	pending.insert(pending.end(), buckets.begin(), buckets.end());
+	sort(pending.begin(), pending.end());
+	buckets.clear();
+}
+
+void end_incremental_lighting_edit() {
+
+	if (sky_lighting_buckets.pending.empty()) return; // nothing to do
+	if (!pre_lighting_update()) return; // lmap is not yet allocated
+	timer_t timer("Incremental Lighting Update");
+	bool const prev_was_updated(lmap_manager.was_updated);
+	unsigned const num_buckets(sky_lighting_buckets.pending.size());
+	sky_lighting_buckets.job_buckets.swap(sky_lighting_buckets.pending);
+	launch_threaded_job(NUM_THREADS, trace_ray_block_sky_bucket_update, 0, 1, 0, 0, LIGHTING_SKY, 1); // blocking, on all threads, job_id=1 to add
+	sky_lighting_buckets.job_buckets.clear();
+	sky_lighting_buckets.build_region_index();
+	lmap_manager.was_updated = 1; // the subtract pass updated the lmap as well
+	update_smoke_indir_tex_for_update_bcube();
+	lmap_manager.was_updated = prev_was_updated; // restore previous value
+	cout << "Incremental lighting update retraced " << num_buckets << " of " << sky_lighting_buckets.num_buckets() << " buckets" << endl;
+}
+
 
 // lmap_manager_t
 
 
+// lighting file format (version 2): a header followed by one planar section per lighting type in ltype_mask, in ltype order;
+// each section stores one plane of num_cells values per component (R, G, B[, weight]), which is written and read with a single call;
+// files ending in .gz are compressed through binary_file_io; files without the magic number are read as the older per-cell float format
+unsigned const LIGHTING_FILE_VERSION = 2;
+char const LIGHTING_FILE_MAGIC[4] = {'3', 'D', 'W', 'L'};
+enum {LMAP_FILE_ENC_FLOAT32=0, LMAP_FILE_ENC_FLOAT16};
+
+struct lighting_file_header_t {
+	char magic[4];
+	unsigned version, xsize, ysize, zsize, num_cells, ltype_mask, encoding, layout_hash, checksum; // checksum is the adler32 of all section data
+};
+
+// IEEE half float conversion with round to nearest even; denormals are flushed to zero and large values are clamped, which is sufficient for lighting values
+uint16_t float_to_half(float v) {
+	uint32_t bits(0);
+	memcpy(&bits, &v, sizeof(float));
+	uint16_t const sign((bits >> 16) & 0x8000);
+	int const exp(int((bits >> 23) & 0xFF) - 127 + 15);
+	if (exp <= 0)  return sign; // zero or too small
+	if (exp >= 31) return (sign | 0x7BFF); // clamp to max half value
+	uint32_t const round_bits(bits & 0x1FFF); // mantissa bits that are dropped
+	uint32_t val((exp << 10) | ((bits >> 13) & 0x03FF));
+	if (round_bits > 0x1000 || (round_bits == 0x1000 && (val & 1))) {++val;} // round up; may carry into the exponent, which is still correct
+	return (sign | min(val, 0x7BFFU)); // clamp to max half value if rounding overflowed
+}
+float half_to_float(uint16_t h) {
+	unsigned const exp((h >> 10) & 0x1F);
+	uint32_t const bits((uint32_t(h & 0x8000) << 16) | (exp ? (((exp - 15 + 127) << 23) | (uint32_t(h & 0x03FF) << 13)) : 0));
+	float v(0.0);
+	memcpy(&v, &bits, sizeof(float));
+	return v;
+}
+
+unsigned lmap_manager_t::get_layout_hash() const { // identifies the sparse column layout; 0 for dense
+	if (column_zsizes.empty()) return 0;
+	return adler32(1, (Bytef const *)column_zsizes.data(), unsigned(column_zsizes.size()*sizeof(unsigned short)));
+}
+
 bool lmap_manager_t::read_data_from_file(char const *const fn, int ltype) {
 
 	assert(fn != nullptr);
 	binary_file_reader reader;
 	if (!reader.open(fn)) return 0;
 	cout << "Reading lighting file from " << fn << endl;
-	unsigned data_size(0);
-	if (!reader.read(&data_size, sizeof(unsigned), 1)) return 0;
+	lighting_file_header_t header;
+	if (!reader.read(header.magic, sizeof(char), 4)) return 0;
+
+	if (memcmp(header.magic, LIGHTING_FILE_MAGIC, 4) != 0) { // older format: cell count followed by per-cell values
+		unsigned data_size(0);
+		memcpy(&data_size, header.magic, sizeof(unsigned));
+		return read_legacy_data(reader, fn, data_size, ltype);
+	}
+	if (!reader.read(&header.version, (sizeof(header) - sizeof(header.magic)), 1)) {
+		cerr << "Error reading header of lighting file " << fn << endl;
+		return 0;
+	}
+	if (header.version != LIGHTING_FILE_VERSION) {
+		cerr << "Error: Lighting file " << fn << " has version " << header.version << " but expected version " << LIGHTING_FILE_VERSION << ". Ignoring file." << endl;
+		return 0;
+	}
+	if (header.xsize != lm_xsize || header.ysize != lm_ysize || header.zsize != lm_zsize || header.num_cells != vldata_alloc.size() || header.layout_hash != get_layout_hash()) {
+		cerr << "Error: Lighting file " << fn << " size of " << header.xsize << "x" << header.ysize << "x" << header.zsize << " with " << header.num_cells
+			 << " cells does not match the expected size of " << lm_xsize << "x" << lm_ysize << "x" << lm_zsize << " with " << vldata_alloc.size() << " cells. Ignoring file." << endl;
+		return 0;
+	}
+	if (!(header.ltype_mask & (1U << ltype))) {
+		cerr << "Error: Lighting file " << fn << " does not contain lighting type " << ltype << ". Ignoring file." << endl;
+		return 0;
+	}
+	if (header.encoding != LMAP_FILE_ENC_FLOAT32 && header.encoding != LMAP_FILE_ENC_FLOAT16) {
+		cerr << "Error: Lighting file " << fn << " has unknown encoding " << header.encoding << ". Ignoring file." << endl;
+		return 0;
+	}
+	bool const half(header.encoding == LMAP_FILE_ENC_FLOAT16);
+	size_t const num(vldata_alloc.size()), val_sz(half ? sizeof(uint16_t) : sizeof(float));
+	vector<unsigned char> data;
+	unsigned checksum(1); // adler32 initial value
+
+	for (int lt = 0; lt < NUM_LIGHTING_TYPES; ++lt) { // read all sections in order for the checksum, but only keep the one for ltype
+		if (!(header.ltype_mask & (1U << lt))) continue;
+		unsigned const sz(lmcell::get_dsz(lt));
+		data.resize(num*sz*val_sz);
+
+		if (!reader.read(data.data(), val_sz, num*sz)) {
+			cerr << "Error reading data from lighting file " << fn << endl;
+			return 0;
+		}
+		checksum = adler32(checksum, data.data(), unsigned(data.size()));
+		if (lt != ltype) continue;
+
+		for (unsigned n = 0; n < sz; ++n) { // scatter planes into cells
+			unsigned char const *plane(data.data() + n*num*val_sz);
+
+			if (half) {
+				uint16_t const *vals((uint16_t const *)plane);
+				for (size_t i = 0; i < num; ++i) {vldata_alloc[i].get_offset(ltype)[n] = half_to_float(vals[i]);}
+			}
+			else {
+				float const *vals((float const *)plane);
+				for (size_t i = 0; i < num; ++i) {vldata_alloc[i].get_offset(ltype)[n] = vals[i];}
+			}
+		}
+	}
+	if (checksum != header.checksum) {
+		cerr << "Error: Lighting file " << fn << " checksum mismatch; file may be corrupted. Ignoring file." << endl;
+		clear_lighting_values(ltype); // may have been partially filled
+		return 0;
+	}
+	return 1;
+}
+
+bool lmap_manager_t::read_legacy_data(binary_file_reader &reader, char const *const fn, unsigned data_size, int ltype) {
 
 	if (data_size != vldata_alloc.size()) {
 		cerr << "Error: Lighting file " << fn << " data size of " << data_size
@@ -1168,16 +1905,60 @@ bool lmap_manager_t::write_data_to_file(char const *const fn, int ltype) const {
 	binary_file_writer writer;
 	if (!writer.open(fn)) return 0;
 	cout << "Writing lighting file to " << fn << endl;
-	unsigned const data_size((unsigned)vldata_alloc.size()); // should be size_t?
-	if (!writer.write(&data_size, sizeof(unsigned), 1)) return 0;
+	size_t const num(vldata_alloc.size());
 	unsigned const sz(lmcell::get_dsz(ltype));
-
-	for (vector<lmcell>::const_iterator i = vldata_alloc.begin(); i != vldata_alloc.end(); ++i) { // const_iterator?
-		if (!writer.write(i->get_offset(ltype), sizeof(float), sz)) {
-			cerr << "Error writing data to ligthing file " << fn << endl;
-			return 0;
+	bool const half(lighting_file_half_float);
+	vector<float> data(half ? 0 : num*sz);
+	vector<uint16_t> hdata(half ? num*sz : 0);
+
+	for (unsigned n = 0; n < sz; ++n) { // gather cells into planes
+		for (size_t i = 0; i < num; ++i) {
+			float const val(vldata_alloc[i].get_offset(ltype)[n]);
+			if (half) {hdata[n*num + i] = float_to_half(val);} else {data[n*num + i] = val;}
 		}
 	}
+	void const *const ptr(half ? (void const *)hdata.data() : (void const *)data.data());
+	size_t const val_sz(half ? sizeof(uint16_t) : sizeof(float));
+	lighting_file_header_t header;
+	memcpy(header.magic, LIGHTING_FILE_MAGIC, 4);
+	header.version     = LIGHTING_FILE_VERSION;
+	header.xsize       = lm_xsize;
+	header.ysize       = lm_ysize;
+	header.zsize       = lm_zsize;
+	header.num_cells   = (unsigned)num;
+	header.ltype_mask  = (1U << ltype);
+	header.encoding    = (half ? LMAP_FILE_ENC_FLOAT16 : LMAP_FILE_ENC_FLOAT32);
+	header.layout_hash = get_layout_hash();
+	header.checksum    = adler32(1, (Bytef const *)ptr, unsigned(num*sz*val_sz));
+
+	if (!writer.write(&header, sizeof(header), 1) || !writer.write(ptr, val_sz, num*sz)) {
+		cerr << "Error writing data to ligthing file " << fn << endl;
+		return 0;
+	}
+	return 1;
+}
+
+
+bool lmap_manager_t::write_raw_data(FILE *fp, int ltype) const { // exact values for checkpoints; not portable across architectures
+
+	unsigned const sz(lmcell::get_dsz(ltype));
+	vector<float> data(vldata_alloc.size()*sz);
+
+	for (size_t i = 0; i < vldata_alloc.size(); ++i) {
+		for (unsigned n = 0; n < sz; ++n) {data[i*sz + n] = vldata_alloc[i].get_offset(ltype)[n];}
+	}
+	return (fwrite(data.data(), sizeof(float), data.size(), fp) == data.size());
+}
+
+bool lmap_manager_t::read_raw_data(FILE *fp, int ltype) {
+
+	unsigned const sz(lmcell::get_dsz(ltype));
+	vector<float> data(vldata_alloc.size()*sz);
+	if (fread(data.data(), sizeof(float), data.size(), fp) != data.size()) return 0;
+
+	for (size_t i = 0; i < vldata_alloc.size(); ++i) {
+		for (unsigned n = 0; n < sz; ++n) {vldata_alloc[i].get_offset(ltype)[n] = data[i*sz + n];}
+	}
 	return 1;
 }
 
@@ -142,7 +142,7 @@ void add_smoke(point const &pos, float val) {
 void diffuse_smoke_xy(int x, int y, int z, lmcell &adj, float rate, int dim, int dir) {
 
 	float delta(0.0); // Note: not using fticks due to instability
-	lmcell *vldata(point_outside_mesh(x, y) ? nullptr : lmap_manager.get_column(x, y));
+	lmcell *vldata(lmap_manager.is_valid_cell(x, y, z) ? lmap_manager.get_column(x, y) : nullptr);
 
 	if (vldata) {
 		lmcell &lmc(vldata[z]);
@@ -164,7 +164,7 @@ void diffuse_smoke_z(int x, int y, int z, lmcell &adj, lmcell *vldata, float pos
 
 	float delta(0.0); // Note: not using fticks due to instability
 
-	if (z >= 0 && z < MESH_SIZE[2]) {
+	if (z >= 0 && z < (int)lmap_manager.get_column_zsize(x, y)) {
 		lmcell &lmc(vldata[z]);
 		unsigned char const flow(dir ? adj.pflow[dim] : lmc.pflow[dim]);
 		if (flow == 0) return;
@@ -254,8 +254,8 @@ float get_smoke_at_pos(point const &pos) {
 	if (pos.z <= czmin0 || pos.z >= czmax) return 0.0;
 	int const x(get_xpos(pos.x)), y(get_ypos(pos.y)), z(get_zpos(pos.z));
 	if (point_outside_mesh(x, y) || z < 0 || z >= MESH_SIZE[2]) return 0.0;
-	lmcell const *const vldata(lmap_manager.get_column(x, y));
-	return ((vldata == NULL) ? 0.0 : vldata[z].smoke);
+	if (!lmap_manager.is_valid_cell(x, y, z)) return 0.0; // empty column, or above all cobjs in sparse mode
+	return lmap_manager.get_column(x, y)[z].smoke;
 }
 
 
@@ -274,7 +274,7 @@ void update_smoke_row(vector<unsigned char> &data, vector<unsigned> const &llvol
 	default_lmc.get_final_color(default_color, 1.0);
 
 	for (unsigned x = x_start; x < x_end; ++x) {
-		lmcell const *const vlm(lmap_manager.get_column(x, y));
+		lmcell const *vlm(lmap_manager.get_column(x, y));
 		if (vlm == NULL && !update_lighting) continue; // x/y pairs that get into here should also be constant
 		unsigned const off(zsize*(y*MESH_X_SIZE + x));
 		bool const check_z_thresh((display_mode & 0x01) && !is_mesh_disabled(x, y));
@@ -298,8 +298,11 @@ void update_smoke_row(vector<unsigned char> &data, vector<unsigned> const &llvol
 			z_start = zrange.zmin;
 			z_end   = zrange.zmax;
 		}
+		unsigned const col_zsize(lmap_manager.get_column_zsize(x, y));
+
 		for (unsigned z = z_start; z < z_end; ++z) {
 			unsigned const off2(ncomp*(off + z));
+			if (z >= col_zsize) {vlm = NULL;} // unallocated cells above all cobjs in sparse mode; z only increases, so the rest of the column is unallocated
 			if (vlm == NULL || vlm[z].smoke == 0.0) {data[off2+3] = 0;}
 			else {data[off2+3] = (unsigned char)(255*CLIP_TO_01(smoke_scale*vlm[z].smoke));} // alpha: smoke
 			if (!do_lighting) continue; // lighting not needed
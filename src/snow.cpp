@@ -11,6 +11,7 @@
 unsigned const VOXELS_PER_DIV = 8; // 1024 for 128 vertex mesh
 unsigned const MAX_STRIP_LEN  = 200; // larger = faster, less overhead; smaller = smaller edge strips, better culling
 int      const Z_CHECK_RANGE  = 1; // larger = smoother and fewer strips, but longer preprocessing
+unsigned const SNOW_RAY_BLOCK_SIZE = 16; // number of snowflake rays traced together as a ray packet
 bool const ENABLE_SNOW_DLIGHTS= 1; // looks nice, but slow
 
 
@@ -476,11 +477,12 @@ vector3d get_rand_snow_vect(rand_gen_t &rgen, float amount=1.0) {
 }
 
 
-bool check_snow_line_coll(point const &pos1, point const &pos2, point &cpos, vector3d &cnorm) {
+// if cobj_cindex is non-null, the cobj intersection was already computed (with a ray packet) and is passed in through cpos, cnorm, and cobj_cindex
+bool check_snow_line_coll(point const &pos1, point const &pos2, point &cpos, vector3d &cnorm, int const *const cobj_cindex=nullptr) {
 
 	int cindex(-1);
 	colorRGBA model_color; // unused
-	bool const cobj_coll(check_coll_line_exact(pos1, pos2, cpos, cnorm, cindex, 0.0, -1, 0, 0, 1));
+	bool const cobj_coll(cobj_cindex ? (*cobj_cindex >= 0) : check_coll_line_exact(pos1, pos2, cpos, cnorm, cindex, 0.0, -1, 0, 0, 1));
 	bool const model_coll(all_models.check_coll_line(pos1, (cobj_coll ? cpos : pos2), cpos, cnorm, model_color, 1));
 	return (cobj_coll || model_coll);
 }
@@ -500,47 +502,63 @@ void create_snow_map(voxel_map &vmap) {
 		if (omp_get_thread_num_3dw() == 0) {increment_printed_number(y);} // progress for thread 0
 		rand_gen_t rgen;
 		rgen.set_state(123, y);
-
-		for (int x = 0; x < num_per_dim; ++x) {
-			point pos1(-X_SCENE_SIZE + x*xscale, -Y_SCENE_SIZE + y*yscale, zval);
-			// add slightly more randomness for numerical precision reasons
-			for (unsigned d = 0; d < 2; ++d) {pos1[d] += SMALL_NUMBER*rgen.signed_rand_float();}
-			point pos2;
-			if (!get_mesh_ice_pt(pos1, pos2)) continue; // invalid point
-			assert(pos2.z < pos1.z);
-			pos1 += get_rand_snow_vect(rgen, 1.0); // add some gaussian randomness for better distribution
-			point cpos;
-			vector3d cnorm;
-			bool invalid(0);
-			unsigned iter(0);
-			
-			while (check_snow_line_coll(pos1, pos2, cpos, cnorm)) {
-				if (cnorm.z > 0.0) { // collision with a surface that points up - we're done
-					pos2 = cpos;
-					break;
-				}
-				if (snow_random == 0.0 || iter > 100) { // something odd happened
-					invalid = 1;
-					break;
-				}
-				// collision with vertical or bottom surface
-				float const val(CLIP_TO_01((pos1.z - zbottom)*zv_scale));
-				vector3d const delta(get_rand_snow_vect(rgen, 0.1*val));
-				pos1 = cpos - (pos2 - pos1).get_norm()*SMALL_NUMBER; // push a small amount back from the object
-				pos2 = pos1 + ((dot_product(delta, cnorm) < 0.0) ? -delta : delta);
+		// the initial vertical rays for a block of x values are nearly parallel, so their first cobj hits are found together with a ray packet
+		point p1s[SNOW_RAY_BLOCK_SIZE], p2s[SNOW_RAY_BLOCK_SIZE], cposs[SNOW_RAY_BLOCK_SIZE];
+		vector3d cnorms[SNOW_RAY_BLOCK_SIZE];
+		int cindexes[SNOW_RAY_BLOCK_SIZE];
+
+		for (int xb = 0; xb < num_per_dim; xb += SNOW_RAY_BLOCK_SIZE) {
+			unsigned num(0);
+
+			for (int x = xb; x < min(num_per_dim, xb+(int)SNOW_RAY_BLOCK_SIZE); ++x) {
+				point pos1(-X_SCENE_SIZE + x*xscale, -Y_SCENE_SIZE + y*yscale, zval);
+				// add slightly more randomness for numerical precision reasons
+				for (unsigned d = 0; d < 2; ++d) {pos1[d] += SMALL_NUMBER*rgen.signed_rand_float();}
+				point pos2;
+				if (!get_mesh_ice_pt(pos1, pos2)) continue; // invalid point
+				assert(pos2.z < pos1.z);
+				p1s[num] = pos1 + get_rand_snow_vect(rgen, 1.0); // add some gaussian randomness for better distribution
+				p2s[num] = pos2;
+				++num;
+			}
+			if (num == 0) continue;
+			check_coll_line_exact_tree_packet(num, p1s, p2s, cposs, cnorms, cindexes, -1);
+
+			for (unsigned r = 0; r < num; ++r) {
+				bool const cobj_coll(cindexes[r] >= 0);
+				point pos1(p1s[r]), pos2(p2s[r]), cpos(cobj_coll ? cposs[r] : pos2);
+				vector3d cnorm(cobj_coll ? cnorms[r] : plus_z);
+				bool invalid(0);
+				unsigned iter(0);
 				
-				if (!get_mesh_ice_pt(pos2, pos2)) { // invalid point
-					invalid = 1;
-					break;
-				}
-				++iter;
-			} // end while
-			if (!invalid) {
-				voxel_t const voxel(pos2);
+				while (check_snow_line_coll(pos1, pos2, cpos, cnorm, ((iter == 0) ? &cindexes[r] : nullptr))) {
+					if (cnorm.z > 0.0) { // collision with a surface that points up - we're done
+						pos2 = cpos;
+						break;
+					}
+					if (snow_random == 0.0 || iter > 100) { // something odd happened
+						invalid = 1;
+						break;
+					}
+					// collision with vertical or bottom surface
+					float const val(CLIP_TO_01((pos1.z - zbottom)*zv_scale));
+					vector3d const delta(get_rand_snow_vect(rgen, 0.1*val));
+					pos1 = cpos - (pos2 - pos1).get_norm()*SMALL_NUMBER; // push a small amount back from the object
+					pos2 = pos1 + ((dot_product(delta, cnorm) < 0.0) ? -delta : delta);
+					
+					if (!get_mesh_ice_pt(pos2, pos2)) { // invalid point
+						invalid = 1;
+						break;
+					}
+					++iter;
+				} // end while
+				if (!invalid) {
+					voxel_t const voxel(pos2);
 #pragma omp critical(snow_map_update)
-				vmap[voxel].update(pos2.z);
-			}
-		} // for x
+					vmap[voxel].update(pos2.z);
+				}
+			} // for r
+		} // for xb
 	} // for y
 	cout << endl;
 }
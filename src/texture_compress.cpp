@@ -0,0 +1,482 @@
+// 3D World - CPU Texture Block Compression (BC1/BC3/BC4/BC5/BC7)
+// by Frank Gennari
+// 10/16/26
+#include "3DWorld.h"
+#include "texture_compress.h"
+#include <stdint.h>
+#include <climits> // for UINT_MAX
+#include <cstring> // for memcpy()
+
+// Endpoints are chosen along the principal axis of each 4x4 block and refined with a least squares fit of the selected indices.
+// BC7 only uses mode 6 (single subset, RGBA, 4-bit indices), which handles both opaque and alpha blocks; quality is the number of refinement iterations.
+
+unsigned const BC7_WEIGHTS4[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+
+unsigned get_bcn_block_size(int format) {
+	assert(format > BCN_NONE && format < NUM_BCN_FORMATS);
+	return ((format == BCN_BC1 || format == BCN_BC4) ? 8 : 16);
+}
+
+unsigned get_bcn_image_size(int format, unsigned width, unsigned height) {
+	return get_bcn_block_size(format)*((width+3)/4)*((height+3)/4);
+}
+
+GLenum get_bcn_gl_format(int format) {
+	switch (format) {
+	case BCN_BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	case BCN_BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	case BCN_BC4: return GL_COMPRESSED_RED_RGTC1;
+	case BCN_BC5: return GL_COMPRESSED_RG_RGTC2;
+	case BCN_BC7: return GL_COMPRESSED_RGBA_BPTC_UNORM;
+	default: assert(0);
+	}
+	return 0; // never gets here
+}
+
+char const *get_bcn_format_name(int format) {
+	char const *const names[NUM_BCN_FORMATS] = {"none", "BC1", "BC3", "BC4", "BC5", "BC7"};
+	assert(format >= 0 && format < NUM_BCN_FORMATS);
+	return names[format];
+}
+
+
+struct rgba_block_t {
+	unsigned char c[16][4];
+
+	void load(unsigned char const *data, unsigned width, unsigned height, unsigned ncolors, unsigned bx, unsigned by) {
+		for (unsigned y = 0; y < 4; ++y) {
+			unsigned const yy(min(4*by+y, height-1)); // clamp to the edge for partial blocks
+
+			for (unsigned x = 0; x < 4; ++x) {
+				unsigned const xx(min(4*bx+x, width-1));
+				unsigned char const *const p(data + ncolors*(yy*width + xx));
+				unsigned char *const d(c[4*y+x]);
+				if      (ncolors == 1) {d[0] = d[1] = d[2] = p[0]; d[3] = 255;}
+				else if (ncolors == 2) {d[0] = p[0]; d[1] = p[1]; d[2] = 0; d[3] = 255;}
+				else {UNROLL_3X(d[i_] = p[i_];) d[3] = ((ncolors == 4) ? p[3] : 255);}
+			}
+		}
+	}
+	void store(unsigned char *rgba, unsigned width, unsigned height, unsigned bx, unsigned by) const {
+		for (unsigned y = 0; y < 4 && 4*by+y < height; ++y) {
+			for (unsigned x = 0; x < 4 && 4*bx+x < width; ++x) {
+				memcpy((rgba + 4*((4*by+y)*width + 4*bx+x)), c[4*y+x], 4);
+			}
+		}
+	}
+};
+
+
+// finds the extremes of the block's colors projected onto the principal axis of the first nchan channels
+void get_pca_endpoints(rgba_block_t const &b, unsigned nchan, float e0[4], float e1[4]) {
+
+	float mean[4] = {0.0}, cov[4][4] = {0.0}, axis[4] = {0.0};
+
+	for (unsigned i = 0; i < 16; ++i) {
+		for (unsigned n = 0; n < nchan; ++n) {mean[n] += b.c[i][n];}
+	}
+	for (unsigned n = 0; n < nchan; ++n) {mean[n] /= 16.0;}
+
+	for (unsigned i = 0; i < 16; ++i) {
+		float d[4];
+		for (unsigned n = 0; n < nchan; ++n) {d[n] = b.c[i][n] - mean[n];}
+		for (unsigned n = 0; n < nchan; ++n) {
+			for (unsigned m = 0; m < nchan; ++m) {cov[n][m] += d[n]*d[m];}
+		}
+	}
+	for (unsigned n = 0; n < nchan; ++n) {axis[n] = sqrt(cov[n][n]);} // initial guess
+
+	for (unsigned iter = 0; iter < 8; ++iter) { // power iteration
+		float v[4] = {0.0}, vmax(0.0);
+
+		for (unsigned n = 0; n < nchan; ++n) {
+			for (unsigned m = 0; m < nchan; ++m) {v[n] += cov[n][m]*axis[m];}
+			vmax = max(vmax, fabs(v[n]));
+		}
+		if (vmax < 1.0E-6) break; // converged to zero
+		for (unsigned n = 0; n < nchan; ++n) {axis[n] = v[n]/vmax;}
+	}
+	float alen_sq(0.0);
+	for (unsigned n = 0; n < nchan; ++n) {alen_sq += axis[n]*axis[n];}
+
+	if (alen_sq < 1.0E-6) { // solid color block
+		for (unsigned n = 0; n < 4; ++n) {e0[n] = e1[n] = ((n < nchan) ? mean[n] : 255.0f);}
+		return;
+	}
+	float tmin(0.0), tmax(0.0);
+
+	for (unsigned i = 0; i < 16; ++i) {
+		float t(0.0);
+		for (unsigned n = 0; n < nchan; ++n) {t += (b.c[i][n] - mean[n])*axis[n];}
+		tmin = min(tmin, t);
+		tmax = max(tmax, t);
+	}
+	for (unsigned n = 0; n < 4; ++n) {
+		e0[n] = ((n < nchan) ? max(0.0f, min(255.0f, (mean[n] + tmax*axis[n]/alen_sq))) : 255.0f);
+		e1[n] = ((n < nchan) ? max(0.0f, min(255.0f, (mean[n] + tmin*axis[n]/alen_sq))) : 255.0f);
+	}
+}
+
+// least squares fit of endpoints to the block given the interpolation weight of each pixel; returns false if the system is singular
+bool fit_endpoints(rgba_block_t const &b, unsigned nchan, float const w[16], float e0[4], float e1[4]) {
+
+	float a(0.0), bb(0.0), c(0.0), r0[4] = {0.0}, r1[4] = {0.0};
+
+	for (unsigned i = 0; i < 16; ++i) {
+		float const w1(w[i]), w0(1.0f - w1);
+		a  += w0*w0;
+		bb += w0*w1;
+		c  += w1*w1;
+		for (unsigned n = 0; n < nchan; ++n) {r0[n] += w0*b.c[i][n]; r1[n] += w1*b.c[i][n];}
+	}
+	float const det(a*c - bb*bb);
+	if (fabs(det) < 1.0E-6) return 0;
+	float const det_inv(1.0f/det);
+
+	for (unsigned n = 0; n < nchan; ++n) {
+		e0[n] = max(0.0f, min(255.0f, (c*r0[n] - bb*r1[n])*det_inv));
+		e1[n] = max(0.0f, min(255.0f, (a*r1[n] - bb*r0[n])*det_inv));
+	}
+	return 1;
+}
+
+
+// ************ BC1 ************
+
+unsigned short pack_565(float const c[3]) {
+	unsigned const r(unsigned(c[0]*31.0f/255.0f + 0.5f)), g(unsigned(c[1]*63.0f/255.0f + 0.5f)), b(unsigned(c[2]*31.0f/255.0f + 0.5f));
+	return (unsigned short)((min(r, 31U) << 11) | (min(g, 63U) << 5) | min(b, 31U));
+}
+
+void unpack_565(unsigned short v, int c[3]) {
+	int const r((v >> 11) & 31), g((v >> 5) & 63), b(v & 31);
+	c[0] = (r << 3) | (r >> 2);
+	c[1] = (g << 2) | (g >> 4);
+	c[2] = (b << 3) | (b >> 2);
+}
+
+void get_bc1_palette(unsigned short c0, unsigned short c1, bool four_color, int pal[4][3]) {
+
+	unpack_565(c0, pal[0]);
+	unpack_565(c1, pal[1]);
+
+	for (unsigned n = 0; n < 3; ++n) {
+		if (four_color) {
+			pal[2][n] = (2*pal[0][n] + pal[1][n])/3;
+			pal[3][n] = (pal[0][n] + 2*pal[1][n])/3;
+		}
+		else {
+			pal[2][n] = (pal[0][n] + pal[1][n])/2;
+			pal[3][n] = 0; // black
+		}
+	}
+}
+
+// uses the 4-color palette for the endpoints in either order; returns the total squared error
+unsigned calc_bc1_indices(rgba_block_t const &b, unsigned short c0, unsigned short c1, unsigned ixs[16]) {
+
+	int pal[4][3];
+	get_bc1_palette(c0, c1, 1, pal);
+	unsigned tot_err(0);
+
+	for (unsigned i = 0; i < 16; ++i) {
+		unsigned best_err(UINT_MAX);
+
+		for (unsigned p = 0; p < 4; ++p) {
+			unsigned err(0);
+			UNROLL_3X(int const d(int(b.c[i][i_]) - pal[p][i_]); err += d*d;)
+			if (err < best_err) {best_err = err; ixs[i] = p;}
+		}
+		tot_err += best_err;
+	}
+	return tot_err;
+}
+
+void encode_bc1_block(rgba_block_t const &b, unsigned char *out) {
+
+	float e[2][4];
+	get_pca_endpoints(b, 3, e[0], e[1]);
+	unsigned short c[2] = {pack_565(e[0]), pack_565(e[1])};
+	unsigned ixs[16];
+	unsigned err(calc_bc1_indices(b, c[0], c[1], ixs));
+
+	if (err > 0 && c[0] != c[1]) { // refine once
+		float const ix_weights[4] = {0.0f, 1.0f, 1.0f/3.0f, 2.0f/3.0f};
+		float w[16];
+		for (unsigned i = 0; i < 16; ++i) {w[i] = ix_weights[ixs[i]];}
+
+		if (fit_endpoints(b, 3, w, e[0], e[1])) {
+			unsigned short const c2[2] = {pack_565(e[0]), pack_565(e[1])};
+			unsigned ixs2[16];
+			unsigned const err2(calc_bc1_indices(b, c2[0], c2[1], ixs2));
+			if (err2 < err) {err = err2; c[0] = c2[0]; c[1] = c2[1]; memcpy(ixs, ixs2, sizeof(ixs));}
+		}
+	}
+	if (c[0] < c[1]) { // swap so that c0 > c1 selects the 4-color mode
+		swap(c[0], c[1]);
+		unsigned const remap[4] = {1, 0, 3, 2};
+		for (unsigned i = 0; i < 16; ++i) {ixs[i] = remap[ixs[i]];}
+	}
+	else if (c[0] == c[1]) { // solid color
+		for (unsigned i = 0; i < 16; ++i) {ixs[i] = 0;}
+	}
+	unsigned bits(0);
+	for (unsigned i = 0; i < 16; ++i) {bits |= (ixs[i] << (2*i));}
+	out[0] = (unsigned char)(c[0] & 0xFF); out[1] = (unsigned char)(c[0] >> 8);
+	out[2] = (unsigned char)(c[1] & 0xFF); out[3] = (unsigned char)(c[1] >> 8);
+	for (unsigned i = 0; i < 4; ++i) {out[4+i] = (unsigned char)(bits >> (8*i));}
+}
+
+void decode_bc1_block(unsigned char const *in, rgba_block_t &b, bool allow_three_color) {
+
+	unsigned short const c0(in[0] | (in[1] << 8)), c1(in[2] | (in[3] << 8));
+	bool const four_color(!allow_three_color || c0 > c1);
+	int pal[4][3];
+	get_bc1_palette(c0, c1, four_color, pal);
+	unsigned const bits(in[4] | (in[5] << 8) | (in[6] << 16) | (unsigned(in[7]) << 24));
+
+	for (unsigned i = 0; i < 16; ++i) {
+		unsigned const ix((bits >> (2*i)) & 3);
+		UNROLL_3X(b.c[i][i_] = (unsigned char)pal[ix][i_];)
+		b.c[i][3] = ((!four_color && ix == 3) ? 0 : 255); // transparent black in 3-color mode
+	}
+}
+
+
+// ************ BC4 (also used for the BC3 alpha block and both channels of BC5) ************
+
+void encode_bc4_block(rgba_block_t const &b, unsigned chan, unsigned char *out) {
+
+	unsigned vmin(255), vmax(0);
+
+	for (unsigned i = 0; i < 16; ++i) {
+		vmin = min(vmin, (unsigned)b.c[i][chan]);
+		vmax = max(vmax, (unsigned)b.c[i][chan]);
+	}
+	out[0] = (unsigned char)vmax; // vmax > vmin selects the 8 value mode
+	out[1] = (unsigned char)vmin;
+	uint64_t bits(0);
+
+	if (vmax > vmin) { // else all indices are 0
+		unsigned const range(vmax - vmin);
+
+		for (unsigned i = 0; i < 16; ++i) {
+			unsigned const p((7*(vmax - b.c[i][chan]) + range/2)/range); // 0 = vmax, 7 = vmin
+			uint64_t const ix((p == 0) ? 0 : ((p == 7) ? 1 : p+1));
+			bits |= (ix << (3*i));
+		}
+	}
+	for (unsigned i = 0; i < 6; ++i) {out[2+i] = (unsigned char)(bits >> (8*i));}
+}
+
+void decode_bc4_block(unsigned char const *in, rgba_block_t &b, unsigned chan) {
+
+	unsigned const a0(in[0]), a1(in[1]);
+	unsigned char pal[8] = {(unsigned char)a0, (unsigned char)a1};
+
+	if (a0 > a1) {
+		for (unsigned i = 1; i < 7; ++i) {pal[i+1] = (unsigned char)(((7-i)*a0 + i*a1 + 3)/7);}
+	}
+	else {
+		for (unsigned i = 1; i < 5; ++i) {pal[i+1] = (unsigned char)(((5-i)*a0 + i*a1 + 2)/5);}
+		pal[6] = 0;
+		pal[7] = 255;
+	}
+	uint64_t bits(0);
+	for (unsigned i = 0; i < 6; ++i) {bits |= (uint64_t(in[2+i]) << (8*i));}
+	for (unsigned i = 0; i < 16; ++i) {b.c[i][chan] = pal[(bits >> (3*i)) & 7];}
+}
+
+
+// ************ BC7 (mode 6) ************
+
+class bit_writer_t {
+	unsigned char *out;
+	unsigned pos;
+public:
+	bit_writer_t(unsigned char *out_, unsigned num_bytes) : out(out_), pos(0) {memset(out, 0, num_bytes);}
+	void write(unsigned val, unsigned nbits) {
+		for (unsigned i = 0; i < nbits; ++i, ++pos) {
+			if ((val >> i) & 1) {out[pos >> 3] |= (1 << (pos & 7));}
+		}
+	}
+};
+
+class bit_reader_t {
+	unsigned char const *in;
+	unsigned pos;
+public:
+	bit_reader_t(unsigned char const *in_) : in(in_), pos(0) {}
+	unsigned read(unsigned nbits) {
+		unsigned val(0);
+		for (unsigned i = 0; i < nbits; ++i, ++pos) {val |= (((in[pos >> 3] >> (pos & 7)) & 1) << i);}
+		return val;
+	}
+};
+
+struct bc7_endpoint_t {
+	unsigned c7[4], p; // 7-bit channels + shared p-bit
+
+	void quantize(float const e[4]) { // choose the p-bit with the lower error
+		float best_err(0.0);
+
+		for (unsigned pbit = 0; pbit < 2; ++pbit) {
+			unsigned q[4];
+			float err(0.0);
+
+			for (unsigned n = 0; n < 4; ++n) {
+				int const v(int((e[n] - pbit)/2.0f + 0.5f));
+				q[n] = max(0, min(127, v));
+				float const d(float((q[n] << 1) | pbit) - e[n]);
+				err += d*d;
+			}
+			if (pbit == 0 || err < best_err) {best_err = err; p = pbit; UNROLL_4X(c7[i_] = q[i_];)}
+		}
+	}
+	int get_val(unsigned n) const {return ((c7[n] << 1) | p);}
+};
+
+unsigned calc_bc7_indices(rgba_block_t const &b, bc7_endpoint_t const &e0, bc7_endpoint_t const &e1, unsigned ixs[16]) {
+
+	int pal[16][4];
+
+	for (unsigned i = 0; i < 16; ++i) {
+		unsigned const w(BC7_WEIGHTS4[i]);
+		for (unsigned n = 0; n < 4; ++n) {pal[i][n] = ((64 - w)*e0.get_val(n) + w*e1.get_val(n) + 32) >> 6;}
+	}
+	unsigned tot_err(0);
+
+	for (unsigned i = 0; i < 16; ++i) {
+		unsigned best_err(UINT_MAX);
+
+		for (unsigned p = 0; p < 16; ++p) {
+			unsigned err(0);
+			UNROLL_4X(int const d(int(b.c[i][i_]) - pal[p][i_]); err += d*d;)
+			if (err < best_err) {best_err = err; ixs[i] = p;}
+		}
+		tot_err += best_err;
+	}
+	return tot_err;
+}
+
+void encode_bc7_block(rgba_block_t const &b, unsigned quality, unsigned char *out) {
+
+	float e[2][4];
+	get_pca_endpoints(b, 4, e[0], e[1]);
+	bc7_endpoint_t ep[2];
+	ep[0].quantize(e[0]);
+	ep[1].quantize(e[1]);
+	unsigned ixs[16];
+	unsigned err(calc_bc7_indices(b, ep[0], ep[1], ixs));
+
+	for (unsigned iter = 0; iter < quality && err > 0; ++iter) { // least squares refinement
+		float w[16];
+		for (unsigned i = 0; i < 16; ++i) {w[i] = BC7_WEIGHTS4[ixs[i]]/64.0f;}
+		if (!fit_endpoints(b, 4, w, e[0], e[1])) break;
+		bc7_endpoint_t ep2[2];
+		ep2[0].quantize(e[0]);
+		ep2[1].quantize(e[1]);
+		unsigned ixs2[16];
+		unsigned const err2(calc_bc7_indices(b, ep2[0], ep2[1], ixs2));
+		if (err2 >= err) break; // no improvement
+		err = err2;
+		ep[0] = ep2[0];
+		ep[1] = ep2[1];
+		memcpy(ixs, ixs2, sizeof(ixs));
+	}
+	if (ixs[0] & 8) { // the MSB of the anchor index is implicitly 0, so swap the endpoints and invert the indices
+		swap(ep[0], ep[1]);
+		for (unsigned i = 0; i < 16; ++i) {ixs[i] = 15 - ixs[i];}
+	}
+	bit_writer_t bw(out, 16);
+	bw.write((1 << 6), 7); // mode 6
+
+	for (unsigned n = 0; n < 4; ++n) {
+		bw.write(ep[0].c7[n], 7);
+		bw.write(ep[1].c7[n], 7);
+	}
+	bw.write(ep[0].p, 1);
+	bw.write(ep[1].p, 1);
+	bw.write(ixs[0], 3);
+	for (unsigned i = 1; i < 16; ++i) {bw.write(ixs[i], 4);}
+}
+
+void decode_bc7_block(unsigned char const *in, rgba_block_t &b) {
+
+	bit_reader_t br(in);
+	unsigned mode(0);
+	while (mode < 8 && br.read(1) == 0) {++mode;}
+
+	if (mode != 6) { // unsupported mode - fill with magenta
+		for (unsigned i = 0; i < 16; ++i) {b.c[i][0] = 255; b.c[i][1] = 0; b.c[i][2] = 255; b.c[i][3] = 255;}
+		return;
+	}
+	bc7_endpoint_t ep[2];
+
+	for (unsigned n = 0; n < 4; ++n) {
+		ep[0].c7[n] = br.read(7);
+		ep[1].c7[n] = br.read(7);
+	}
+	ep[0].p = br.read(1);
+	ep[1].p = br.read(1);
+
+	for (unsigned i = 0; i < 16; ++i) {
+		unsigned const w(BC7_WEIGHTS4[br.read((i == 0) ? 3 : 4)]);
+		for (unsigned n = 0; n < 4; ++n) {b.c[i][n] = (unsigned char)(((64 - w)*ep[0].get_val(n) + w*ep[1].get_val(n) + 32) >> 6);}
+	}
+}
+
+
+// ************ images ************
+
+void bcn_compress_image(unsigned char const *data, unsigned width, unsigned height, unsigned ncolors, int format, unsigned quality, unsigned char *comp) {
+
+	assert(data != nullptr && comp != nullptr);
+	assert(width > 0 && height > 0 && ncolors >= 1 && ncolors <= 4);
+	assert(format != BCN_BC5 || ncolors >= 2);
+	unsigned const bw((width+3)/4), bh((height+3)/4), block_size(get_bcn_block_size(format));
+
+#pragma omp parallel for schedule(dynamic) if (bh > 4)
+	for (int by = 0; by < (int)bh; ++by) { // each row of blocks
+		for (unsigned bx = 0; bx < bw; ++bx) {
+			rgba_block_t block;
+			block.load(data, width, height, ncolors, bx, by);
+			unsigned char *const out(comp + block_size*(by*bw + bx));
+
+			switch (format) {
+			case BCN_BC1: encode_bc1_block(block, out); break;
+			case BCN_BC3: encode_bc4_block(block, 3, out); encode_bc1_block(block, out+8); break; // alpha block, then color block
+			case BCN_BC4: encode_bc4_block(block, 0, out); break;
+			case BCN_BC5: encode_bc4_block(block, 0, out); encode_bc4_block(block, 1, out+8); break;
+			case BCN_BC7: encode_bc7_block(block, quality, out); break;
+			default: assert(0);
+			}
+		} // for bx
+	} // for by
+}
+
+void bcn_decompress_image(unsigned char const *comp, unsigned width, unsigned height, int format, unsigned char *rgba) {
+
+	assert(comp != nullptr && rgba != nullptr);
+	unsigned const bw((width+3)/4), bh((height+3)/4), block_size(get_bcn_block_size(format));
+
+#pragma omp parallel for schedule(dynamic) if (bh > 4)
+	for (int by = 0; by < (int)bh; ++by) {
+		for (unsigned bx = 0; bx < bw; ++bx) {
+			unsigned char const *const in(comp + block_size*(by*bw + bx));
+			rgba_block_t block;
+			for (unsigned i = 0; i < 16; ++i) {block.c[i][0] = block.c[i][1] = block.c[i][2] = 0; block.c[i][3] = 255;}
+
+			switch (format) {
+			case BCN_BC1: decode_bc1_block(in, block, 1); break;
+			case BCN_BC3: decode_bc1_block(in+8, block, 0); decode_bc4_block(in, block, 3); break;
+			case BCN_BC4: decode_bc4_block(in, block, 0); break;
+			case BCN_BC5: decode_bc4_block(in, block, 0); decode_bc4_block(in+8, block, 1); break;
+			case BCN_BC7: decode_bc7_block(in, block); break;
+			default: assert(0);
+			}
+			block.store(rgba, width, height, bx, by);
+		} // for bx
+	} // for by
+}
@@ -0,0 +1,14 @@
+// 3D World - CPU Texture Block Compression (BC1/BC3/BC4/BC5/BC7)
+// by Frank Gennari
+// 10/16/26
+#pragma once
+
+enum {BCN_NONE=0, BCN_BC1, BCN_BC3, BCN_BC4, BCN_BC5, BCN_BC7, NUM_BCN_FORMATS};
+
+unsigned get_bcn_block_size(int format); // bytes per 4x4 block
+unsigned get_bcn_image_size(int format, unsigned width, unsigned height);
+GLenum get_bcn_gl_format(int format);
+char const *get_bcn_format_name(int format);
+// data is width*height*ncolors bytes; BC4 uses the first channel, and BC5 uses the first two channels; quality only applies to BC7
+void bcn_compress_image(unsigned char const *data, unsigned width, unsigned height, unsigned ncolors, int format, unsigned quality, unsigned char *comp);
+void bcn_decompress_image(unsigned char const *comp, unsigned width, unsigned height, int format, unsigned char *rgba); // for testing; only BC7 mode 6 is supported